@@ -120,6 +120,18 @@ void qemu_aio_flush(void)
     } while (qemu_bh_poll() || ret > 0);
 }
 
+int qemu_aio_pending(void)
+{
+    AioHandler *node;
+
+    QLIST_FOREACH(node, &aio_handlers, node) {
+        if (node->io_flush && node->io_flush(node->opaque)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
 int qemu_aio_process_queue(void)
 {
     AioHandler *node;
@@ -41,6 +41,17 @@
 #include "net.h"
 #include "gdbstub.h"
 #include "hw/smbios.h"
+#include "block.h"
+#include "migration-compress.h"
+
+#ifdef CONFIG_USERFAULTFD
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#endif
 
 #ifdef TARGET_SPARC
 int graphic_width = 1024;
@@ -91,6 +102,7 @@ const uint32_t arch_type = QEMU_ARCH;
 #define RAM_SAVE_FLAG_PAGE     0x08
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
+#define RAM_SAVE_FLAG_ZBATCH   0x40 /* since version 5 */
 
 static int is_dup_page(uint8_t *page, uint8_t ch)
 {
@@ -107,15 +119,399 @@ static int is_dup_page(uint8_t *page, uint8_t ch)
     return 1;
 }
 
+/* Page index written after the VM state of a snapshot, so that RAM can be
+   restored lazily.  One entry per target page, holding either the position
+   of the page contents in the stream or its fill byte.  */
+#define RAM_INDEX_MAGIC 0x514c5a49 /* "QLZI" */
+#define RAM_INDEX_PAGE  (1ULL << 63)
+#define RAM_INDEX_FILL  (1ULL << 62)
+#define RAM_INDEX_MASK  (RAM_INDEX_FILL - 1)
+#define RAM_INDEX_PACKED (RAM_INDEX_PAGE | RAM_INDEX_FILL) /* compressed */
+#define RAM_INDEX_MAX_HOT 4096
+
+static uint64_t *ram_index;
+static int64_t *ram_parts;
+static int nb_ram_parts;
+static ram_addr_t *ram_hot_pages;
+static int nb_ram_hot_pages;
+
+/* Set while saving the device state of a RAM template: the pages are in
+   the template files and are left out of the VM state.  */
+static int ram_template;
+
+/* Incremental snapshots only save the pages dirtied since their parent.
+   While they are enabled, ram_baseline is set when the migration dirty
+   bits track exactly the pages written since RAM last matched a snapshot;
+   ram_delta is set while such a snapshot is being saved.  */
+static int ram_incremental;
+static int ram_baseline;
+static int ram_delta;
+
+static uint64_t bytes_transferred;
+
+/* Compressed RAM stream.  Pages are gathered in batches from a single RAM
+   block, which worker threads deflate while the next batches are filled;
+   batches go to the stream in order.  A page that was already sent in the
+   same stream and is still in the page cache is sent as the XOR with its
+   previous contents, which deflates to almost nothing when only a few
+   bytes changed.  The receiving side inflates batches in parallel too, and
+   copies them to RAM in stream order.  */
+#define RAM_ZBATCH_SIZE  (256 * 1024)
+#define RAM_ZBATCH_PAGES (RAM_ZBATCH_SIZE / TARGET_PAGE_SIZE)
+#define RAM_ZPAGE_DELTA  0x1
+#define RAM_ZPAGE_FILL   0x2
+
+typedef struct RamZBatch {
+    CompressJob job;
+    int busy;
+    RAMBlock *block;
+    int nb_pages;
+    uint64_t pages[RAM_ZBATCH_PAGES];
+    uint8_t *data;
+    unsigned long data_len;
+    uint8_t *zdata;
+    unsigned long zdata_size;
+} RamZBatch;
+
+typedef struct RamZStream {
+    int nb_batches;
+    RamZBatch *batches;
+    int cur;
+} RamZStream;
+
+static RamZStream *ram_zsend;
+static RamZStream *ram_zrecv;
+
+static ram_addr_t *ram_zcache_tags;
+static uint8_t *ram_zcache;
+static ram_addr_t ram_zcache_slots;
+
+static RamZStream *ram_zstream_new(int threads)
+{
+    RamZStream *s;
+    int i;
+
+    s = qemu_mallocz(sizeof(*s));
+    s->nb_batches = 2 * compress_pool_start(threads);
+    s->batches = qemu_mallocz(s->nb_batches * sizeof(RamZBatch));
+    for (i = 0; i < s->nb_batches; i++) {
+        s->batches[i].data = qemu_malloc(RAM_ZBATCH_SIZE);
+        s->batches[i].zdata_size = compress_bound(RAM_ZBATCH_SIZE);
+        s->batches[i].zdata = qemu_malloc(s->batches[i].zdata_size);
+    }
+    return s;
+}
+
+static void ram_zstream_free(RamZStream *s)
+{
+    int i;
+
+    for (i = 0; i < s->nb_batches; i++) {
+        if (s->batches[i].busy) {
+            compress_job_wait(&s->batches[i].job);
+        }
+        qemu_free(s->batches[i].data);
+        qemu_free(s->batches[i].zdata);
+    }
+    qemu_free(s->batches);
+    qemu_free(s);
+}
+
+static void ram_zsend_start(void)
+{
+    ram_addr_t i;
+
+    ram_zsend = ram_zstream_new(migrate_compress_threads());
+
+    ram_zcache_slots = migrate_compress_cache_size() / TARGET_PAGE_SIZE;
+    if (ram_zcache_slots) {
+        ram_zcache_tags = qemu_malloc(ram_zcache_slots * sizeof(ram_addr_t));
+        for (i = 0; i < ram_zcache_slots; i++) {
+            ram_zcache_tags[i] = -1;
+        }
+        ram_zcache = qemu_vmalloc(ram_zcache_slots * TARGET_PAGE_SIZE);
+    }
+}
+
+static void ram_zsend_stop(void)
+{
+    if (ram_zsend) {
+        ram_zstream_free(ram_zsend);
+        ram_zsend = NULL;
+    }
+    if (ram_zcache_slots) {
+        qemu_free(ram_zcache_tags);
+        qemu_vfree(ram_zcache);
+        ram_zcache_slots = 0;
+    }
+}
+
+static void ram_zbatch_write(QEMUFile *f, RamZBatch *b)
+{
+    int i;
+
+    b->busy = 0;
+    if (compress_job_wait(&b->job) < 0) {
+        qemu_file_set_error(f);
+        return;
+    }
+    qemu_put_be64(f, RAM_SAVE_FLAG_ZBATCH);
+    qemu_put_byte(f, strlen(b->block->idstr));
+    qemu_put_buffer(f, (uint8_t *)b->block->idstr, strlen(b->block->idstr));
+    qemu_put_be32(f, b->nb_pages);
+    for (i = 0; i < b->nb_pages; i++) {
+        qemu_put_be64(f, b->pages[i]);
+    }
+    qemu_put_be32(f, b->data_len);
+    qemu_put_be32(f, b->job.out_len);
+    qemu_put_buffer(f, b->zdata, b->job.out_len);
+    bytes_transferred += b->nb_pages * 8 + b->job.out_len;
+    b->nb_pages = 0;
+    b->data_len = 0;
+}
+
+/* Hand the batch being filled to the workers, and write the oldest batch
+   out if that one is needed for the next pages */
+static void ram_zbatch_submit(QEMUFile *f)
+{
+    RamZStream *s = ram_zsend;
+    RamZBatch *b = &s->batches[s->cur];
+
+    if (!b->nb_pages) {
+        return;
+    }
+    b->job.decompress = 0;
+    b->job.in = b->data;
+    b->job.in_len = b->data_len;
+    b->job.out = b->zdata;
+    b->job.out_len = b->zdata_size;
+    compress_job_submit(&b->job);
+    b->busy = 1;
+
+    s->cur = (s->cur + 1) % s->nb_batches;
+    if (s->batches[s->cur].busy) {
+        ram_zbatch_write(f, &s->batches[s->cur]);
+    }
+}
+
+static void ram_zsend_flush(QEMUFile *f)
+{
+    RamZStream *s = ram_zsend;
+    int i;
+
+    ram_zbatch_submit(f);
+    for (i = 0; i < s->nb_batches; i++) {
+        if (s->batches[(s->cur + i) % s->nb_batches].busy) {
+            ram_zbatch_write(f, &s->batches[(s->cur + i) % s->nb_batches]);
+        }
+    }
+}
+
+static void ram_zbatch_add(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
+{
+    RamZStream *s = ram_zsend;
+    RamZBatch *b = &s->batches[s->cur];
+    ram_addr_t addr = block->offset + offset;
+    ram_addr_t slot = 0;
+    uint8_t *p = block->host + offset;
+    unsigned long *out, *cached, tmp;
+    uint64_t kind = 0;
+    int i;
+
+    if (b->nb_pages &&
+        (b->block != block || b->nb_pages == RAM_ZBATCH_PAGES)) {
+        ram_zbatch_submit(f);
+        b = &s->batches[s->cur];
+    }
+    b->block = block;
+
+    if (ram_zcache_slots) {
+        slot = (addr >> TARGET_PAGE_BITS) % ram_zcache_slots;
+    }
+    if (is_dup_page(p, *p)) {
+        kind = RAM_ZPAGE_FILL;
+        b->data[b->data_len++] = *p;
+        if (ram_zcache_slots && ram_zcache_tags[slot] == addr) {
+            ram_zcache_tags[slot] = -1;
+        }
+        if (ram_index) {
+            ram_index[addr >> TARGET_PAGE_BITS] = RAM_INDEX_FILL | *p;
+        }
+    } else {
+        /* work on a copy, the guest may still be writing to the page */
+        out = (unsigned long *)(b->data + b->data_len);
+        memcpy(out, p, TARGET_PAGE_SIZE);
+        if (ram_zcache_slots) {
+            cached = (unsigned long *)(ram_zcache + slot * TARGET_PAGE_SIZE);
+            if (ram_zcache_tags[slot] == addr) {
+                kind = RAM_ZPAGE_DELTA;
+                for (i = 0; i < TARGET_PAGE_SIZE / sizeof(long); i++) {
+                    tmp = out[i];
+                    out[i] ^= cached[i];
+                    cached[i] = tmp;
+                }
+            } else {
+                ram_zcache_tags[slot] = addr;
+                memcpy(cached, out, TARGET_PAGE_SIZE);
+            }
+        }
+        b->data_len += TARGET_PAGE_SIZE;
+        if (ram_index) {
+            ram_index[addr >> TARGET_PAGE_BITS] = RAM_INDEX_PACKED;
+        }
+    }
+    b->pages[b->nb_pages++] = offset | kind;
+}
+
+static int ram_zbatch_apply(RamZBatch *b)
+{
+    unsigned long pos = 0;
+    uint64_t kind;
+    uint8_t *host;
+    int i, j;
+
+    b->busy = 0;
+    if (compress_job_wait(&b->job) < 0) {
+        return -EIO;
+    }
+    for (i = 0; i < b->nb_pages; i++) {
+        host = b->block->host + (b->pages[i] & TARGET_PAGE_MASK);
+        kind = b->pages[i] & ~TARGET_PAGE_MASK;
+        if (kind & RAM_ZPAGE_FILL) {
+            if (pos + 1 > b->job.out_len) {
+                return -EINVAL;
+            }
+            memset(host, b->data[pos], TARGET_PAGE_SIZE);
+            pos++;
+        } else {
+            if (pos + TARGET_PAGE_SIZE > b->job.out_len) {
+                return -EINVAL;
+            }
+            if (kind & RAM_ZPAGE_DELTA) {
+                for (j = 0; j < TARGET_PAGE_SIZE; j++) {
+                    host[j] ^= b->data[pos + j];
+                }
+            } else {
+                memcpy(host, b->data + pos, TARGET_PAGE_SIZE);
+            }
+            pos += TARGET_PAGE_SIZE;
+        }
+    }
+    return 0;
+}
+
+/* Drop the batches that a failed stream left behind */
+static void ram_zrecv_discard(void)
+{
+    int i;
+
+    for (i = 0; ram_zrecv && i < ram_zrecv->nb_batches; i++) {
+        if (ram_zrecv->batches[i].busy) {
+            compress_job_wait(&ram_zrecv->batches[i].job);
+            ram_zrecv->batches[i].busy = 0;
+        }
+    }
+}
+
+/* Copy all the batches still being inflated to RAM */
+static int ram_zrecv_flush(void)
+{
+    RamZStream *s = ram_zrecv;
+    RamZBatch *b;
+    int i, ret = 0;
+
+    if (!s) {
+        return 0;
+    }
+    for (i = 0; i < s->nb_batches; i++) {
+        b = &s->batches[(s->cur + i) % s->nb_batches];
+        if (b->busy) {
+            int err = ram_zbatch_apply(b);
+            if (!ret) {
+                ret = err;
+            }
+        }
+    }
+    return ret;
+}
+
+static int ram_zbatch_load(QEMUFile *f)
+{
+    RamZStream *s;
+    RamZBatch *b;
+    RAMBlock *block;
+    unsigned long zlen;
+    char id[256];
+    uint8_t len;
+    int i, ret;
+
+    if (!ram_zrecv) {
+        ram_zrecv = ram_zstream_new(migrate_compress_threads());
+    }
+    s = ram_zrecv;
+    b = &s->batches[s->cur];
+    if (b->busy) {
+        ret = ram_zbatch_apply(b);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(id, block->idstr, sizeof(id))) {
+            break;
+        }
+    }
+    if (!block) {
+        fprintf(stderr, "Can't find block %s!\n", id);
+        return -EINVAL;
+    }
+    b->block = block;
+
+    b->nb_pages = qemu_get_be32(f);
+    if (b->nb_pages < 0 || b->nb_pages > RAM_ZBATCH_PAGES) {
+        return -EINVAL;
+    }
+    for (i = 0; i < b->nb_pages; i++) {
+        b->pages[i] = qemu_get_be64(f);
+        if ((b->pages[i] & TARGET_PAGE_MASK) >= block->length) {
+            return -EINVAL;
+        }
+    }
+    b->data_len = qemu_get_be32(f);
+    zlen = qemu_get_be32(f);
+    if (b->data_len > RAM_ZBATCH_SIZE || zlen > b->zdata_size) {
+        return -EINVAL;
+    }
+    qemu_get_buffer(f, b->zdata, zlen);
+    if (qemu_file_has_error(f)) {
+        return -EIO;
+    }
+
+    b->job.decompress = 1;
+    b->job.in = b->zdata;
+    b->job.in_len = zlen;
+    b->job.out = b->data;
+    b->job.out_len = RAM_ZBATCH_SIZE;
+    compress_job_submit(&b->job);
+    b->busy = 1;
+    s->cur = (s->cur + 1) % s->nb_batches;
+    return 0;
+}
+
 static RAMBlock *last_block;
 static ram_addr_t last_offset;
 
+/* Send the next dirty page, returns 0 if there is none */
 static int ram_save_block(QEMUFile *f)
 {
     RAMBlock *block = last_block;
     ram_addr_t offset = last_offset;
     ram_addr_t current_addr;
-    int bytes_sent = 0;
+    int found = 0;
 
     if (!block)
         block = QLIST_FIRST(&ram_list.blocks);
@@ -132,8 +528,11 @@ static int ram_save_block(QEMUFile *f)
                                             MIGRATION_DIRTY_FLAG);
 
             p = block->host + offset;
+            found = 1;
 
-            if (is_dup_page(p, *p)) {
+            if (ram_zsend) {
+                ram_zbatch_add(f, block, offset);
+            } else if (is_dup_page(p, *p)) {
                 qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_COMPRESS);
                 if (!cont) {
                     qemu_put_byte(f, strlen(block->idstr));
@@ -141,7 +540,11 @@ static int ram_save_block(QEMUFile *f)
                                     strlen(block->idstr));
                 }
                 qemu_put_byte(f, *p);
-                bytes_sent = 1;
+                if (ram_index) {
+                    ram_index[current_addr >> TARGET_PAGE_BITS] =
+                        RAM_INDEX_FILL | *p;
+                }
+                bytes_transferred += 1;
             } else {
                 qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_PAGE);
                 if (!cont) {
@@ -149,8 +552,12 @@ static int ram_save_block(QEMUFile *f)
                     qemu_put_buffer(f, (uint8_t *)block->idstr,
                                     strlen(block->idstr));
                 }
+                if (ram_index) {
+                    ram_index[current_addr >> TARGET_PAGE_BITS] =
+                        RAM_INDEX_PAGE | qemu_ftell(f);
+                }
                 qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-                bytes_sent = TARGET_PAGE_SIZE;
+                bytes_transferred += TARGET_PAGE_SIZE;
             }
 
             break;
@@ -171,11 +578,9 @@ static int ram_save_block(QEMUFile *f)
     last_block = block;
     last_offset = offset;
 
-    return bytes_sent;
+    return found;
 }
 
-static uint64_t bytes_transferred;
-
 static ram_addr_t ram_save_remaining(void)
 {
     RAMBlock *block;
@@ -248,6 +653,13 @@ static void sort_ram_list(void)
     qemu_free(blocks);
 }
 
+/* Only a compressed stream needs version 5; anything else stays loadable
+   by builds that know version 4 at most */
+void ram_set_params(int blk_enable, int shared, void *opaque)
+{
+    savevm_set_save_version("ram", opaque, migrate_compress_threads() ? 5 : 4);
+}
+
 int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
 {
     ram_addr_t addr;
@@ -256,6 +668,7 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
     uint64_t expected_time = 0;
 
     if (stage < 0) {
+        ram_zsend_stop();
         cpu_physical_memory_set_dirty_tracking(0);
         return 0;
     }
@@ -265,6 +678,12 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
         return 0;
     }
 
+    if (ram_index) {
+        ram_parts = qemu_realloc(ram_parts,
+                                 (nb_ram_parts + 1) * 2 * sizeof(int64_t));
+        ram_parts[nb_ram_parts * 2] = qemu_ftell(f);
+    }
+
     if (stage == 1) {
         RAMBlock *block;
         bytes_transferred = 0;
@@ -272,13 +691,18 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
         last_offset = 0;
         sort_ram_list();
 
-        /* Make sure all dirty bits are set */
-        QLIST_FOREACH(block, &ram_list.blocks, next) {
-            for (addr = block->offset; addr < block->offset + block->length;
-                 addr += TARGET_PAGE_SIZE) {
-                if (!cpu_physical_memory_get_dirty(addr,
-                                                   MIGRATION_DIRTY_FLAG)) {
-                    cpu_physical_memory_set_dirty(addr);
+        /* Make sure all dirty bits are set, unless only the pages dirtied
+           since the parent snapshot are saved */
+        if (!ram_delta) {
+            ram_baseline = 0;
+            QLIST_FOREACH(block, &ram_list.blocks, next) {
+                for (addr = block->offset;
+                     addr < block->offset + block->length;
+                     addr += TARGET_PAGE_SIZE) {
+                    if (!cpu_physical_memory_get_dirty(addr,
+                                                       MIGRATION_DIRTY_FLAG)) {
+                        cpu_physical_memory_set_dirty(addr);
+                    }
                 }
             }
         }
@@ -295,18 +719,32 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
         }
     }
 
+    if (ram_template) {
+        if (stage == 3) {
+            cpu_physical_memory_set_dirty_tracking(0);
+        }
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        return 1;
+    }
+
+    if (stage == 1) {
+        ram_zsend_stop();
+        if (migrate_compress_threads()) {
+            ram_zsend_start();
+        }
+    }
+
     bytes_transferred_last = bytes_transferred;
     bwidth = qemu_get_clock_ns(rt_clock);
 
     while (!qemu_file_rate_limit(f)) {
-        int bytes_sent;
-
-        bytes_sent = ram_save_block(f);
-        bytes_transferred += bytes_sent;
-        if (bytes_sent == 0) { /* no more blocks */
+        if (ram_save_block(f) == 0) { /* no more blocks */
             break;
         }
     }
+    if (ram_zsend) {
+        ram_zsend_flush(f);
+    }
 
     bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
     bwidth = (bytes_transferred - bytes_transferred_last) / bwidth;
@@ -319,22 +757,236 @@ int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
 
     /* try transferring iterative blocks of memory */
     if (stage == 3) {
-        int bytes_sent;
-
         /* flush all remaining blocks regardless of rate limiting */
-        while ((bytes_sent = ram_save_block(f)) != 0) {
-            bytes_transferred += bytes_sent;
+        while (ram_save_block(f) != 0) {
+        }
+        if (ram_zsend) {
+            ram_zsend_flush(f);
+            ram_zsend_stop();
         }
         cpu_physical_memory_set_dirty_tracking(0);
     }
 
     qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
 
+    if (ram_index) {
+        ram_parts[nb_ram_parts * 2 + 1] = qemu_ftell(f);
+        nb_ram_parts++;
+    }
+
     expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
 
     return (stage == 2) && (expected_time <= migrate_max_downtime());
 }
 
+/* Write every RAM block to its own file in 'dir', for new VMs to map
+   copy-on-write with -mem-template.  Until ram_template_done() is called,
+   ram_save_live() then only saves the list of RAM blocks.  */
+int ram_template_save(const char *dir)
+{
+    RAMBlock *block;
+    char *filename;
+    int fd, ret;
+
+#ifdef _WIN32
+    ret = mkdir(dir);
+#else
+    ret = mkdir(dir, 0777);
+#endif
+    if (ret < 0 && errno != EEXIST) {
+        return -errno;
+    }
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        filename = qemu_ram_template_file(dir, block->idstr);
+        /* VMs running from an older template keep their mapping of it */
+        unlink(filename);
+        fd = qemu_open(filename, O_WRONLY | O_CREAT | O_EXCL | O_BINARY, 0644);
+        qemu_free(filename);
+        if (fd < 0) {
+            return -errno;
+        }
+        ret = 0;
+        if (qemu_write_full(fd, block->host, block->length) != block->length) {
+            ret = -errno;
+        }
+        close(fd);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    ram_template = 1;
+    return 0;
+}
+
+void ram_template_done(void)
+{
+    ram_template = 0;
+}
+
+/* Dirty logging slows down every RAM write, so it is only kept on between
+   snapshots while incremental snapshots are enabled */
+void ram_set_incremental(int enable)
+{
+    if (!enable && ram_baseline) {
+        cpu_physical_memory_set_dirty_tracking(0);
+        ram_baseline = 0;
+    }
+    ram_incremental = enable;
+}
+
+/* Only save the pages dirtied since the last ram_snapshot_baseline() */
+void ram_save_set_delta(int enable)
+{
+    ram_delta = enable;
+}
+
+/* Called when RAM matches a snapshot, after savevm or loadvm: from now on
+   the migration dirty bits track what the next incremental snapshot must
+   save.  */
+void ram_snapshot_baseline(void)
+{
+    RAMBlock *block;
+
+    if (!ram_incremental) {
+        return;
+    }
+    cpu_physical_memory_set_dirty_tracking(1);
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        cpu_physical_memory_reset_dirty(block->offset,
+                                        block->offset + block->length,
+                                        MIGRATION_DIRTY_FLAG);
+    }
+    ram_baseline = 1;
+}
+
+int ram_snapshot_has_baseline(void)
+{
+    return ram_baseline;
+}
+
+/* Start recording the page index of a snapshot.  The pages currently
+   mapped by the TLBs are saved as the ones to restore first.  */
+void ram_index_start(void)
+{
+    RAMBlock *block;
+    ram_addr_t end = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        end = MAX(end, block->offset + block->length);
+    }
+    qemu_free(ram_index);
+    ram_index = qemu_mallocz((end >> TARGET_PAGE_BITS) * sizeof(uint64_t));
+    nb_ram_parts = 0;
+
+    if (!ram_hot_pages) {
+        ram_hot_pages = qemu_malloc(RAM_INDEX_MAX_HOT * sizeof(ram_addr_t));
+    }
+    nb_ram_hot_pages = tlb_get_ram_pages(ram_hot_pages, RAM_INDEX_MAX_HOT);
+}
+
+/* Append the page index to the VM state and stop recording.  Pages are
+   numbered in RAM block order, the order used by the index itself.  The
+   index also names the parent of an incremental snapshot.  */
+void ram_index_save(QEMUFile *f, const char *parent)
+{
+    RAMBlock *block;
+    int64_t index_start;
+    ram_addr_t addr;
+    uint64_t page;
+    int i, n;
+
+    if (!ram_index) {
+        return;
+    }
+
+    index_start = qemu_ftell(f);
+    qemu_put_be32(f, RAM_INDEX_MAGIC);
+    qemu_put_byte(f, strlen(parent));
+    qemu_put_buffer(f, (const uint8_t *)parent, strlen(parent));
+    n = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        n++;
+    }
+    qemu_put_be32(f, n);
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, block->length);
+        for (addr = block->offset; addr < block->offset + block->length;
+             addr += TARGET_PAGE_SIZE) {
+            qemu_put_be64(f, ram_index[addr >> TARGET_PAGE_BITS]);
+        }
+    }
+
+    qemu_put_be32(f, nb_ram_parts);
+    for (i = 0; i < nb_ram_parts * 2; i++) {
+        qemu_put_be64(f, ram_parts[i]);
+    }
+
+    qemu_put_be32(f, nb_ram_hot_pages);
+    for (i = 0; i < nb_ram_hot_pages; i++) {
+        page = 0;
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            if (ram_hot_pages[i] - block->offset < block->length) {
+                page += (ram_hot_pages[i] - block->offset) >> TARGET_PAGE_BITS;
+                break;
+            }
+            page += block->length >> TARGET_PAGE_BITS;
+        }
+        qemu_put_be64(f, page);
+    }
+
+    qemu_put_be64(f, index_start);
+    qemu_put_be32(f, RAM_INDEX_MAGIC);
+
+    qemu_free(ram_index);
+    ram_index = NULL;
+    qemu_free(ram_parts);
+    ram_parts = NULL;
+    nb_ram_parts = 0;
+}
+
+/* Position 'f' after the header of the page index of a snapshot, and
+   read the name of its parent into 'parent' (256 bytes) */
+static int ram_index_open(QEMUFile *f, int64_t vm_state_size, char *parent)
+{
+    int64_t index_start;
+    uint8_t len;
+
+    if (vm_state_size < 12) {
+        return -ENOENT;
+    }
+    qemu_fseek(f, vm_state_size - 12, SEEK_SET);
+    index_start = qemu_get_be64(f);
+    if (qemu_get_be32(f) != RAM_INDEX_MAGIC ||
+        index_start < 0 || index_start >= vm_state_size - 12) {
+        return -ENOENT;
+    }
+    qemu_fseek(f, index_start, SEEK_SET);
+    if (qemu_get_be32(f) != RAM_INDEX_MAGIC) {
+        return -ENOENT;
+    }
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)parent, len);
+    parent[len] = 0;
+    return qemu_file_has_error(f) ? -EIO : 0;
+}
+
+/* Get the ID of the parent of the snapshot whose VM state is read from
+   'f', or an empty string for a full snapshot.  'f' is left at the start
+   of the VM state.  */
+int ram_index_get_parent(QEMUFile *f, int64_t vm_state_size, char *parent)
+{
+    int ret;
+
+    ret = ram_index_open(f, vm_state_size, parent);
+    if (ret < 0) {
+        parent[0] = 0;
+    }
+    qemu_fseek(f, 0, SEEK_SET);
+    return ret == -ENOENT ? 0 : ret;
+}
+
 static inline void *host_from_stream_offset(QEMUFile *f,
                                             ram_addr_t offset,
                                             int flags)
@@ -365,15 +1017,35 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     return NULL;
 }
 
+static int64_t *lazy_parts;
+static int nb_lazy_parts;
+
 int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     ram_addr_t addr;
     int flags;
+    int i;
 
-    if (version_id < 3 || version_id > 4) {
+    if (version_id < 3 || version_id > 5) {
         return -EINVAL;
     }
 
+    ram_zrecv_discard();
+
+    /* the dirty bits no longer tell what changed since a snapshot */
+    if (ram_baseline) {
+        cpu_physical_memory_set_dirty_tracking(0);
+        ram_baseline = 0;
+    }
+
+    /* RAM that is restored lazily is skipped in the stream */
+    for (i = 0; i < nb_lazy_parts; i++) {
+        if (qemu_ftell(f) == lazy_parts[i * 2]) {
+            qemu_fseek(f, lazy_parts[i * 2 + 1], SEEK_SET);
+            return 0;
+        }
+    }
+
     do {
         addr = qemu_get_be64(f);
 
@@ -448,15 +1120,516 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
                 host = host_from_stream_offset(f, addr, flags);
 
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+        } else if (flags & RAM_SAVE_FLAG_ZBATCH) {
+            int ret;
+
+            if (version_id < 5) {
+                return -EINVAL;
+            }
+            ret = ram_zbatch_load(f);
+            if (ret < 0) {
+                return ret;
+            }
         }
         if (qemu_file_has_error(f)) {
             return -EIO;
         }
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
+    return ram_zrecv_flush();
+}
+
+/* Called once the VM state stream has been read */
+void ram_lazy_stream_end(void)
+{
+    qemu_free(lazy_parts);
+    lazy_parts = NULL;
+    nb_lazy_parts = 0;
+}
+
+#ifdef CONFIG_USERFAULTFD
+
+/* Lazy restore of the RAM of a snapshot.  Guest RAM is registered with
+   userfaultfd and emptied; a helper thread then copies in the pages the
+   guest touches as it faults on them, and in the background the pages
+   that were in the TLBs at save time followed by all the others.  Page
+   contents are read straight from the image file, using the page index
+   saved after the VM state.  The unit of transfer is the host page, which
+   may contain several target pages.  */
+
+typedef struct LazyBlock {
+    RAMBlock *block;
+    uint64_t *index;        /* one entry per target page */
+    uint8_t *fetched;       /* one entry per host page */
+    ram_addr_t lazy_length; /* registered part of the block */
+} LazyBlock;
+
+typedef struct RamLazyState {
+    int uffd;
+    int fd;
+    ram_addr_t unit;
+    int nb_blocks;
+    LazyBlock *blocks;
+    uint64_t *map;
+    uint64_t *hot;
+    int nb_hot;
+    int hot_pos;
+    int cur_block;
+    ram_addr_t cur_offset;
+    uint64_t nb_left;
+    pthread_t thread;
+} RamLazyState;
+
+static RamLazyState *ram_lazy;
+
+/* Assemble 'size' bytes of RAM at 'offset' in 'buf'.  Page contents are
+   read through the block layer if 'bs' is not NULL, else from the image
+   file.  Returns 1 if the result is all zeroes.  */
+static int ram_lazy_read(RamLazyState *s, BlockDriverState *bs,
+                         LazyBlock *lb, ram_addr_t offset, ram_addr_t size,
+                         uint8_t *buf)
+{
+    uint64_t entry;
+    ram_addr_t i;
+    int ret, zero = 1;
+
+    for (i = 0; i < size; i += TARGET_PAGE_SIZE) {
+        entry = lb->index[(offset + i) >> TARGET_PAGE_BITS];
+        if (entry & RAM_INDEX_PAGE) {
+            if (bs) {
+                ret = bdrv_load_vmstate(bs, buf + i, entry & RAM_INDEX_MASK,
+                                        TARGET_PAGE_SIZE);
+            } else {
+                ret = pread(s->fd, buf + i, TARGET_PAGE_SIZE,
+                            entry & RAM_INDEX_MASK);
+            }
+            if (ret != TARGET_PAGE_SIZE) {
+                return -EIO;
+            }
+            zero = 0;
+        } else {
+            memset(buf + i, entry & 0xff, TARGET_PAGE_SIZE);
+            if (entry & 0xff) {
+                zero = 0;
+            }
+        }
+    }
+    return zero;
+}
+
+static void ram_lazy_place(RamLazyState *s, uint8_t *host, uint8_t *buf,
+                           int zero)
+{
+    struct uffdio_zeropage zeropage;
+    struct uffdio_copy copy;
+    struct uffdio_range range;
+    int ret;
+
+    if (zero) {
+        zeropage.range.start = (uintptr_t)host;
+        zeropage.range.len = s->unit;
+        zeropage.mode = 0;
+        ret = ioctl(s->uffd, UFFDIO_ZEROPAGE, &zeropage);
+    } else {
+        copy.dst = (uintptr_t)host;
+        copy.src = (uintptr_t)buf;
+        copy.len = s->unit;
+        copy.mode = 0;
+        ret = ioctl(s->uffd, UFFDIO_COPY, &copy);
+    }
+    if (ret < 0 && errno == EEXIST) {
+        /* somebody may still be waiting for it */
+        range.start = (uintptr_t)host;
+        range.len = s->unit;
+        ret = ioctl(s->uffd, UFFDIO_WAKE, &range);
+    }
+    if (ret < 0) {
+        fprintf(stderr, "lazy loadvm: cannot map page: %s\n",
+                strerror(errno));
+        abort();
+    }
+}
+
+static void ram_lazy_fetch(RamLazyState *s, LazyBlock *lb, ram_addr_t offset,
+                           uint8_t *buf)
+{
+    int ret;
+
+    ret = ram_lazy_read(s, NULL, lb, offset, s->unit, buf);
+    if (ret < 0) {
+        fprintf(stderr, "lazy loadvm: cannot read page: %s\n",
+                strerror(-ret));
+        abort();
+    }
+    ram_lazy_place(s, lb->block->host + offset, buf, ret);
+    lb->fetched[offset / s->unit] = 1;
+    s->nb_left--;
+}
+
+static void ram_lazy_fault(RamLazyState *s, uint64_t address, uint8_t *buf)
+{
+    LazyBlock *lb;
+    ram_addr_t offset;
+    int i;
+
+    for (i = 0; i < s->nb_blocks; i++) {
+        lb = &s->blocks[i];
+        offset = address - (uintptr_t)lb->block->host;
+        if (offset < lb->lazy_length) {
+            offset &= ~(s->unit - 1);
+            if (lb->fetched[offset / s->unit]) {
+                /* discarded again since, e.g. by the balloon */
+                ram_lazy_place(s, lb->block->host + offset, buf, 1);
+            } else {
+                ram_lazy_fetch(s, lb, offset, buf);
+            }
+            return;
+        }
+    }
+}
+
+static void ram_lazy_prefetch(RamLazyState *s, uint8_t *buf)
+{
+    LazyBlock *lb;
+    ram_addr_t offset;
+    uint64_t page;
+    int i;
+
+    while (s->hot_pos < s->nb_hot) {
+        page = s->hot[s->hot_pos++];
+        for (i = 0; i < s->nb_blocks; i++) {
+            lb = &s->blocks[i];
+            if (page < lb->block->length >> TARGET_PAGE_BITS) {
+                offset = (page << TARGET_PAGE_BITS) & ~(s->unit - 1);
+                if (offset < lb->lazy_length &&
+                    !lb->fetched[offset / s->unit]) {
+                    ram_lazy_fetch(s, lb, offset, buf);
+                    return;
+                }
+                break;
+            }
+            page -= lb->block->length >> TARGET_PAGE_BITS;
+        }
+    }
+
+    while (s->cur_block < s->nb_blocks) {
+        lb = &s->blocks[s->cur_block];
+        if (s->cur_offset >= lb->lazy_length) {
+            s->cur_block++;
+            s->cur_offset = 0;
+            continue;
+        }
+        offset = s->cur_offset;
+        s->cur_offset += s->unit;
+        if (!lb->fetched[offset / s->unit]) {
+            ram_lazy_fetch(s, lb, offset, buf);
+            return;
+        }
+    }
+}
+
+static void ram_lazy_unregister(RamLazyState *s)
+{
+    struct uffdio_range range;
+    int i;
+
+    for (i = 0; i < s->nb_blocks; i++) {
+        if (s->blocks[i].lazy_length) {
+            range.start = (uintptr_t)s->blocks[i].block->host;
+            range.len = s->blocks[i].lazy_length;
+            ioctl(s->uffd, UFFDIO_UNREGISTER, &range);
+            s->blocks[i].lazy_length = 0;
+        }
+    }
+}
+
+static void *ram_lazy_thread(void *opaque)
+{
+    RamLazyState *s = opaque;
+    struct uffd_msg msg;
+    uint8_t *buf;
+    ssize_t len;
+
+    buf = qemu_memalign(s->unit, s->unit);
+    while (s->nb_left) {
+        len = read(s->uffd, &msg, sizeof(msg));
+        if (len == sizeof(msg)) {
+            if (msg.event == UFFD_EVENT_PAGEFAULT) {
+                ram_lazy_fault(s, msg.arg.pagefault.address, buf);
+            }
+        } else if (len < 0 && errno != EAGAIN && errno != EINTR) {
+            fprintf(stderr, "lazy loadvm: userfaultfd read failed: %s\n",
+                    strerror(errno));
+            abort();
+        } else {
+            ram_lazy_prefetch(s, buf);
+        }
+    }
+    qemu_vfree(buf);
+    ram_lazy_unregister(s);
+    return NULL;
+}
+
+static void ram_lazy_free(RamLazyState *s)
+{
+    int i;
+
+    ram_lazy_unregister(s);
+    if (s->uffd >= 0) {
+        close(s->uffd);
+    }
+    if (s->fd >= 0) {
+        close(s->fd);
+    }
+    for (i = 0; i < s->nb_blocks; i++) {
+        qemu_free(s->blocks[i].index);
+        qemu_free(s->blocks[i].fetched);
+    }
+    qemu_free(s->blocks);
+    qemu_free(s->map);
+    qemu_free(s->hot);
+    qemu_free(s);
+}
+
+/* Find the pages of one host page in the image file, and rewrite their
+   index entries to file offsets.  */
+static int ram_lazy_map(RamLazyState *s, BlockDriverState *bs, LazyBlock *lb,
+                        ram_addr_t offset)
+{
+    uint64_t *entry = &lb->index[offset >> TARGET_PAGE_BITS];
+    const char *filename;
+    int64_t file_offset;
+    int i, n = s->unit >> TARGET_PAGE_BITS;
+
+    for (i = 0; i < n; i++) {
+        s->map[i] = entry[i];
+        if (!(entry[i] & RAM_INDEX_PAGE)) {
+            continue;
+        }
+        if (bdrv_map_vmstate(bs, entry[i] & RAM_INDEX_MASK, TARGET_PAGE_SIZE,
+                             &filename, &file_offset) < 0) {
+            return -1;
+        }
+        if (s->fd < 0) {
+            s->fd = qemu_open(filename, O_RDONLY);
+            if (s->fd < 0) {
+                return -1;
+            }
+        }
+        s->map[i] = RAM_INDEX_PAGE | file_offset;
+    }
+    memcpy(entry, s->map, n * sizeof(uint64_t));
     return 0;
 }
 
+static int ram_lazy_load_index(RamLazyState *s, QEMUFile *f,
+                               int64_t vm_state_size)
+{
+    RAMBlock *block;
+    LazyBlock *lb;
+    ram_addr_t length, i;
+    char id[256];
+    uint8_t len;
+    int n, ret;
+
+    ret = ram_index_open(f, vm_state_size, id);
+    if (ret < 0) {
+        return ret;
+    }
+    if (id[0]) {
+        /* incremental snapshot, its index only covers part of RAM */
+        return -ENOTSUP;
+    }
+
+    n = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        n++;
+    }
+    if (qemu_get_be32(f) != n) {
+        return -EINVAL;
+    }
+    s->blocks = qemu_mallocz(n * sizeof(LazyBlock));
+    for (s->nb_blocks = 0; s->nb_blocks < n; s->nb_blocks++) {
+        lb = &s->blocks[s->nb_blocks];
+        len = qemu_get_byte(f);
+        qemu_get_buffer(f, (uint8_t *)id, len);
+        id[len] = 0;
+        length = qemu_get_be64(f);
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            if (!strncmp(id, block->idstr, sizeof(id))) {
+                break;
+            }
+        }
+        if (!block || block->length != length) {
+            return -EINVAL;
+        }
+        lb->block = block;
+        lb->index = qemu_malloc((length >> TARGET_PAGE_BITS) *
+                                sizeof(uint64_t));
+        for (i = 0; i < length >> TARGET_PAGE_BITS; i++) {
+            lb->index[i] = qemu_get_be64(f);
+            if ((lb->index[i] & RAM_INDEX_PACKED) == RAM_INDEX_PACKED) {
+                /* compressed pages cannot be read in place */
+                return -ENOTSUP;
+            }
+        }
+        if (qemu_file_has_error(f)) {
+            return -EIO;
+        }
+    }
+
+    nb_lazy_parts = qemu_get_be32(f);
+    if (nb_lazy_parts < 0 || nb_lazy_parts > 65536) {
+        nb_lazy_parts = 0;
+        return -EINVAL;
+    }
+    lazy_parts = qemu_malloc(nb_lazy_parts * 2 * sizeof(int64_t));
+    for (n = 0; n < nb_lazy_parts * 2; n++) {
+        lazy_parts[n] = qemu_get_be64(f);
+    }
+
+    s->nb_hot = qemu_get_be32(f);
+    if (s->nb_hot > RAM_INDEX_MAX_HOT) {
+        return -EINVAL;
+    }
+    s->hot = qemu_malloc(s->nb_hot * sizeof(uint64_t));
+    for (n = 0; n < s->nb_hot; n++) {
+        s->hot[n] = qemu_get_be64(f);
+    }
+
+    return qemu_file_has_error(f) ? -EIO : 0;
+}
+
+/* Prepare the lazy restore of RAM from the snapshot whose VM state is read
+   from 'f', before the state is loaded.  On failure the whole state must
+   be loaded as usual.  */
+int ram_lazy_start(QEMUFile *f, BlockDriverState *bs, int64_t vm_state_size)
+{
+    RamLazyState *s;
+    LazyBlock *lb;
+    struct uffdio_api api;
+    struct uffdio_register reg;
+    sigset_t set, oldset;
+    ram_addr_t offset, length;
+    uint8_t *buf = NULL;
+    int i, ret;
+
+    ram_lazy_wait();
+    if (kvm_enabled()) {
+        return -ENOTSUP;
+    }
+
+    s = qemu_mallocz(sizeof(*s));
+    s->uffd = -1;
+    s->fd = -1;
+    s->unit = MAX(qemu_real_host_page_size, TARGET_PAGE_SIZE);
+    s->map = qemu_malloc((s->unit >> TARGET_PAGE_BITS) * sizeof(uint64_t));
+
+    ret = ram_lazy_load_index(s, f, vm_state_size);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (s->uffd < 0) {
+        ret = -errno;
+        goto fail;
+    }
+    memset(&api, 0, sizeof(api));
+    api.api = UFFD_API;
+    if (ioctl(s->uffd, UFFDIO_API, &api) < 0) {
+        ret = -errno;
+        goto fail;
+    }
+
+    buf = qemu_memalign(s->unit, s->unit);
+    for (i = 0; i < s->nb_blocks; i++) {
+        lb = &s->blocks[i];
+        length = lb->block->length & ~(s->unit - 1);
+        if (length && !((uintptr_t)lb->block->host & (s->unit - 1))) {
+            memset(&reg, 0, sizeof(reg));
+            reg.range.start = (uintptr_t)lb->block->host;
+            reg.range.len = length;
+            reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+            if (ioctl(s->uffd, UFFDIO_REGISTER, &reg) == 0) {
+                lb->lazy_length = length;
+                qemu_madvise(lb->block->host, length, QEMU_MADV_DONTNEED);
+            }
+        }
+        lb->fetched = qemu_mallocz(lb->lazy_length / s->unit + 1);
+
+        /* Pages that cannot be read from the image file directly, and
+           whatever could not be registered, are restored right away */
+        for (offset = 0; offset < lb->lazy_length; offset += s->unit) {
+            if (ram_lazy_map(s, bs, lb, offset) == 0) {
+                s->nb_left++;
+                continue;
+            }
+            ret = ram_lazy_read(s, bs, lb, offset, s->unit, buf);
+            if (ret < 0) {
+                goto fail;
+            }
+            ram_lazy_place(s, lb->block->host + offset, buf, ret);
+            lb->fetched[offset / s->unit] = 1;
+        }
+        if (lb->lazy_length < lb->block->length) {
+            ret = ram_lazy_read(s, bs, lb, lb->lazy_length,
+                                lb->block->length - lb->lazy_length,
+                                lb->block->host + lb->lazy_length);
+            if (ret < 0) {
+                goto fail;
+            }
+        }
+    }
+    qemu_vfree(buf);
+    buf = NULL;
+
+    /* all the signals keep going to the other threads */
+    sigfillset(&set);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    ret = pthread_create(&s->thread, NULL, ram_lazy_thread, s);
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    if (ret) {
+        ret = -ret;
+        goto fail;
+    }
+
+    ram_lazy = s;
+    qemu_fseek(f, 0, SEEK_SET);
+    return 0;
+
+fail:
+    qemu_vfree(buf);
+    ram_lazy_free(s);
+    ram_lazy_stream_end();
+    qemu_fseek(f, 0, SEEK_SET);
+    return ret;
+}
+
+/* Wait until all the RAM of a lazily restored snapshot is in place */
+void ram_lazy_wait(void)
+{
+    if (!ram_lazy) {
+        return;
+    }
+    pthread_join(ram_lazy->thread, NULL);
+    ram_lazy_free(ram_lazy);
+    ram_lazy = NULL;
+}
+
+#else
+
+int ram_lazy_start(QEMUFile *f, BlockDriverState *bs, int64_t vm_state_size)
+{
+    return -ENOTSUP;
+}
+
+void ram_lazy_wait(void)
+{
+}
+
+#endif /* CONFIG_USERFAULTFD */
+
 void qemu_service_io(void)
 {
     qemu_notify_event();
@@ -143,6 +143,49 @@
 #undef IN_T
 #undef SHIFT
 
+#ifdef FLOAT_MIXENG
+#define SIMD(f) f
+#else
+#include "mixeng_simd.h"
+
+/*
+ * Host endian signed 16 and 32 bit samples go through the vector kernels,
+ * which leave the last few samples to the generic code.
+ */
+#define SIMD(f) glue (simd_, f)
+
+#define SIMD_CONV(f, kernel, in_t, channels)                            \
+static void SIMD (f) (struct st_sample *dst, const void *src, int samples) \
+{                                                                       \
+    int n = kernel (dst, src, samples);                                 \
+    f (dst + n, (const in_t *) src + n * channels, samples - n);        \
+}
+
+#define SIMD_CLIP(f, kernel, in_t, channels)                            \
+static void SIMD (f) (void *dst, const struct st_sample *src, int samples) \
+{                                                                       \
+    int n = kernel (dst, src, samples);                                 \
+    f ((in_t *) dst + n * channels, src + n, samples - n);              \
+}
+
+SIMD_CONV (conv_natural_int16_t_to_stereo, mixeng_conv_s16_to_stereo,
+           int16_t, 2)
+SIMD_CONV (conv_natural_int16_t_to_mono, mixeng_conv_s16_to_mono,
+           int16_t, 1)
+SIMD_CONV (conv_natural_int32_t_to_stereo, mixeng_conv_s32_to_stereo,
+           int32_t, 2)
+SIMD_CONV (conv_natural_int32_t_to_mono, mixeng_conv_s32_to_mono,
+           int32_t, 1)
+SIMD_CLIP (clip_natural_int16_t_from_stereo, mixeng_clip_s16_from_stereo,
+           int16_t, 2)
+SIMD_CLIP (clip_natural_int16_t_from_mono, mixeng_clip_s16_from_mono,
+           int16_t, 1)
+SIMD_CLIP (clip_natural_int32_t_from_stereo, mixeng_clip_s32_from_stereo,
+           int32_t, 2)
+SIMD_CLIP (clip_natural_int32_t_from_mono, mixeng_clip_s32_from_mono,
+           int32_t, 1)
+#endif
+
 t_sample *mixeng_conv[2][2][2][3] = {
     {
         {
@@ -160,8 +203,8 @@ t_sample *mixeng_conv[2][2][2][3] = {
         {
             {
                 conv_natural_int8_t_to_mono,
-                conv_natural_int16_t_to_mono,
-                conv_natural_int32_t_to_mono
+                SIMD (conv_natural_int16_t_to_mono),
+                SIMD (conv_natural_int32_t_to_mono)
             },
             {
                 conv_natural_int8_t_to_mono,
@@ -186,8 +229,8 @@ t_sample *mixeng_conv[2][2][2][3] = {
         {
             {
                 conv_natural_int8_t_to_stereo,
-                conv_natural_int16_t_to_stereo,
-                conv_natural_int32_t_to_stereo
+                SIMD (conv_natural_int16_t_to_stereo),
+                SIMD (conv_natural_int32_t_to_stereo)
             },
             {
                 conv_natural_int8_t_to_stereo,
@@ -215,8 +258,8 @@ f_sample *mixeng_clip[2][2][2][3] = {
         {
             {
                 clip_natural_int8_t_from_mono,
-                clip_natural_int16_t_from_mono,
-                clip_natural_int32_t_from_mono
+                SIMD (clip_natural_int16_t_from_mono),
+                SIMD (clip_natural_int32_t_from_mono)
             },
             {
                 clip_natural_int8_t_from_mono,
@@ -241,8 +284,8 @@ f_sample *mixeng_clip[2][2][2][3] = {
         {
             {
                 clip_natural_int8_t_from_stereo,
-                clip_natural_int16_t_from_stereo,
-                clip_natural_int32_t_from_stereo
+                SIMD (clip_natural_int16_t_from_stereo),
+                SIMD (clip_natural_int32_t_from_stereo)
             },
             {
                 clip_natural_int8_t_from_stereo,
@@ -318,10 +361,14 @@ void *st_rate_start (int inrate, int outrate)
 
 #define NAME st_rate_flow_mix
 #define OP(a, b) a += b
+#ifndef FLOAT_MIXENG
+#define BLOCK_OP(dst, src, n) mixeng_mix (dst, src, n)
+#endif
 #include "rate_template.h"
 
 #define NAME st_rate_flow
 #define OP(a, b) a = b
+#define BLOCK_OP(dst, src, n) memcpy (dst, src, (n) * sizeof (struct st_sample))
 #include "rate_template.h"
 
 void st_rate_stop (void *opaque)
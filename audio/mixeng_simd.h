@@ -0,0 +1,262 @@
+/*
+ * QEMU Mixing engine: vector kernels
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIXENG_SIMD_H
+#define QEMU_MIXENG_SIMD_H
+
+#include <stdint.h>
+#include "mixeng.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * Conversion and clipping of host endian signed 16 and 32 bit samples
+ * to and from the fixed point mixing format, several samples at a time.
+ * They give exactly what the generic code in mixeng_template.h gives,
+ * but only do whole vectors: the return value is the number of samples
+ * done, the caller passes the rest to the generic code.
+ */
+
+#if defined(__SSE2__)
+static inline void mixeng_store_s32(struct st_sample *dst, __m128i v)
+{
+    __m128i sign = _mm_srai_epi32(v, 31);
+
+    _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi32(v, sign));
+    _mm_storeu_si128((__m128i *)(dst + 1), _mm_unpackhi_epi32(v, sign));
+}
+
+static inline void mixeng_store_s32_mono(struct st_sample *dst, __m128i v)
+{
+    __m128i sign = _mm_srai_epi32(v, 31);
+    __m128i lo = _mm_unpacklo_epi32(v, sign);
+    __m128i hi = _mm_unpackhi_epi32(v, sign);
+
+    _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi64(lo, lo));
+    _mm_storeu_si128((__m128i *)(dst + 1), _mm_unpackhi_epi64(lo, lo));
+    _mm_storeu_si128((__m128i *)(dst + 2), _mm_unpacklo_epi64(hi, hi));
+    _mm_storeu_si128((__m128i *)(dst + 3), _mm_unpackhi_epi64(hi, hi));
+}
+
+/*
+ * Clip the four 64 bit values in a and b to 32 bits, the way the generic
+ * clip does: anything from 0x7f000000 up becomes INT32_MAX.  SSE2 has no
+ * 64 bit compares, so look at the two halves instead: the value fits in
+ * 32 bits if the high half is the sign of the low half.
+ */
+static inline __m128i mixeng_clip_s32x4(__m128i a, __m128i b)
+{
+    __m128i lo = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a),
+                                                 _mm_castsi128_ps(b),
+                                                 _MM_SHUFFLE(2, 0, 2, 0)));
+    __m128i hi = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(a),
+                                                 _mm_castsi128_ps(b),
+                                                 _MM_SHUFFLE(3, 1, 3, 1)));
+    __m128i max = _mm_set1_epi32(INT32_MAX);
+    __m128i fits = _mm_cmpeq_epi32(hi, _mm_srai_epi32(lo, 31));
+    __m128i big = _mm_cmpgt_epi32(lo, _mm_set1_epi32(0x7effffff));
+    __m128i sat = _mm_xor_si128(max, _mm_srai_epi32(hi, 31));
+    __m128i in = _mm_or_si128(_mm_andnot_si128(big, lo),
+                              _mm_and_si128(big, max));
+
+    return _mm_or_si128(_mm_and_si128(fits, in), _mm_andnot_si128(fits, sat));
+}
+
+/* l + r of two samples */
+static inline __m128i mixeng_load_mono(const struct st_sample *src)
+{
+    __m128i a = _mm_loadu_si128((const __m128i *)src);
+    __m128i b = _mm_loadu_si128((const __m128i *)(src + 1));
+
+    return _mm_add_epi64(_mm_unpacklo_epi64(a, b), _mm_unpackhi_epi64(a, b));
+}
+
+static inline __m128i mixeng_load(const struct st_sample *src)
+{
+    return _mm_loadu_si128((const __m128i *)src);
+}
+#endif
+
+static inline int mixeng_conv_s16_to_stereo(struct st_sample *dst,
+                                            const void *src, int samples)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    const int16_t *in = src;
+    __m128i zero = _mm_setzero_si128();
+
+    for (; i + 4 <= samples; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i * 2));
+
+        /* a 16 bit sample in the high half is the sample << 16 */
+        mixeng_store_s32(dst + i, _mm_unpacklo_epi16(zero, v));
+        mixeng_store_s32(dst + i + 2, _mm_unpackhi_epi16(zero, v));
+    }
+#endif
+    return i;
+}
+
+static inline int mixeng_conv_s16_to_mono(struct st_sample *dst,
+                                          const void *src, int samples)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    const int16_t *in = src;
+    __m128i zero = _mm_setzero_si128();
+
+    for (; i + 8 <= samples; i += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + i));
+
+        mixeng_store_s32_mono(dst + i, _mm_unpacklo_epi16(zero, v));
+        mixeng_store_s32_mono(dst + i + 4, _mm_unpackhi_epi16(zero, v));
+    }
+#endif
+    return i;
+}
+
+static inline int mixeng_conv_s32_to_stereo(struct st_sample *dst,
+                                            const void *src, int samples)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    const int32_t *in = src;
+
+    for (; i + 2 <= samples; i += 2) {
+        mixeng_store_s32(dst + i,
+                         _mm_loadu_si128((const __m128i *)(in + i * 2)));
+    }
+#endif
+    return i;
+}
+
+static inline int mixeng_conv_s32_to_mono(struct st_sample *dst,
+                                          const void *src, int samples)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    const int32_t *in = src;
+
+    for (; i + 4 <= samples; i += 4) {
+        mixeng_store_s32_mono(dst + i,
+                              _mm_loadu_si128((const __m128i *)(in + i)));
+    }
+#endif
+    return i;
+}
+
+static inline int mixeng_clip_s16_from_stereo(void *dst,
+                                              const struct st_sample *src,
+                                              int samples)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    int16_t *out = dst;
+
+    for (; i + 4 <= samples; i += 4) {
+        __m128i a = mixeng_clip_s32x4(mixeng_load(src + i),
+                                      mixeng_load(src + i + 1));
+        __m128i b = mixeng_clip_s32x4(mixeng_load(src + i + 2),
+                                      mixeng_load(src + i + 3));
+
+        _mm_storeu_si128((__m128i *)(out + i * 2),
+                         _mm_packs_epi32(_mm_srai_epi32(a, 16),
+                                         _mm_srai_epi32(b, 16)));
+    }
+#endif
+    return i;
+}
+
+static inline int mixeng_clip_s16_from_mono(void *dst,
+                                            const struct st_sample *src,
+                                            int samples)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    int16_t *out = dst;
+
+    for (; i + 8 <= samples; i += 8) {
+        __m128i a = mixeng_clip_s32x4(mixeng_load_mono(src + i),
+                                      mixeng_load_mono(src + i + 2));
+        __m128i b = mixeng_clip_s32x4(mixeng_load_mono(src + i + 4),
+                                      mixeng_load_mono(src + i + 6));
+
+        _mm_storeu_si128((__m128i *)(out + i),
+                         _mm_packs_epi32(_mm_srai_epi32(a, 16),
+                                         _mm_srai_epi32(b, 16)));
+    }
+#endif
+    return i;
+}
+
+static inline int mixeng_clip_s32_from_stereo(void *dst,
+                                              const struct st_sample *src,
+                                              int samples)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    int32_t *out = dst;
+
+    for (; i + 2 <= samples; i += 2) {
+        _mm_storeu_si128((__m128i *)(out + i * 2),
+                         mixeng_clip_s32x4(mixeng_load(src + i),
+                                           mixeng_load(src + i + 1)));
+    }
+#endif
+    return i;
+}
+
+static inline int mixeng_clip_s32_from_mono(void *dst,
+                                            const struct st_sample *src,
+                                            int samples)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    int32_t *out = dst;
+
+    for (; i + 4 <= samples; i += 4) {
+        _mm_storeu_si128((__m128i *)(out + i),
+                         mixeng_clip_s32x4(mixeng_load_mono(src + i),
+                                           mixeng_load_mono(src + i + 2)));
+    }
+#endif
+    return i;
+}
+
+/* Mix samples of src into dst */
+static inline void mixeng_mix(struct st_sample *dst,
+                              const struct st_sample *src, int samples)
+{
+    int i = 0;
+
+#if defined(__SSE2__)
+    for (; i + 2 <= samples; i += 2) {
+        __m128i a = _mm_add_epi64(mixeng_load(dst + i), mixeng_load(src + i));
+        __m128i b = _mm_add_epi64(mixeng_load(dst + i + 1),
+                                  mixeng_load(src + i + 1));
+
+        _mm_storeu_si128((__m128i *)(dst + i), a);
+        _mm_storeu_si128((__m128i *)(dst + i + 1), b);
+    }
+#endif
+    for (; i < samples; i++) {
+        dst[i].l += src[i].l;
+        dst[i].r += src[i].r;
+    }
+}
+
+#endif /* QEMU_MIXENG_SIMD_H */
@@ -31,81 +31,100 @@ void NAME (void *opaque, struct st_sample *ibuf, struct st_sample *obuf,
            int *isamp, int *osamp)
 {
     struct rate *rate = opaque;
-    struct st_sample *istart, *iend;
     struct st_sample *ostart, *oend;
-    struct st_sample ilast, icur, out;
+    struct st_sample iprev, icur, out;
+    const struct st_sample *ilast;
+    uint64_t opos, opos_inc, pos;
+    uint64_t n = *isamp;
+    uint32_t ipos;
 #ifdef FLOAT_MIXENG
     mixeng_real t;
 #else
-    int64_t t;
+    uint64_t t;
 #endif
 
-    ilast = rate->ilast;
-
-    istart = ibuf;
-    iend = ibuf + *isamp;
-
     ostart = obuf;
     oend = obuf + *osamp;
 
     if (rate->opos_inc == (1ULL + UINT_MAX)) {
-        int i, n = *isamp > *osamp ? *osamp : *isamp;
+        int n = *isamp > *osamp ? *osamp : *isamp;
+#ifdef BLOCK_OP
+        BLOCK_OP (obuf, ibuf, n);
+#else
+        int i;
         for (i = 0; i < n; i++) {
             OP (obuf[i].l, ibuf[i].l);
             OP (obuf[i].r, ibuf[i].r);
         }
+#endif
         *isamp = n;
         *osamp = n;
         return;
     }
 
+    /*
+     * Input sample ipos + pos comes right after output position opos, so
+     * the pair to interpolate between is ibuf[pos - 1] and ibuf[pos],
+     * where ibuf[-1] is the last sample of the previous call.  Working
+     * it out rather than stepping through the input one sample at a time
+     * leaves no hard to predict branches in the loop, and keeping the
+     * positions in locals spares reloading them after each store to obuf.
+     */
+    opos = rate->opos;
+    opos_inc = rate->opos_inc;
+    ipos = rate->ipos;
+    iprev = rate->ilast;
+    pos = 0;
+
     while (obuf < oend) {
+        pos = (opos >> 32) + 1 - ipos;
 
-        /* Safety catch to make sure we have input samples.  */
-        if (ibuf >= iend) {
+        /* See if we finished the input buffer yet */
+        if (pos >= n) {
+            pos = n;
             break;
         }
 
-        /* read as many input samples so that ipos > opos */
-
-        while (rate->ipos <= (rate->opos >> 32)) {
-            ilast = *ibuf++;
-            rate->ipos++;
-            /* See if we finished the input buffer yet */
-            if (ibuf >= iend) {
-                goto the_end;
-            }
-        }
-
-        icur = *ibuf;
+        ilast = pos ? &ibuf[pos - 1] : &iprev;
+        icur = ibuf[pos];
 
         /* interpolate */
 #ifdef FLOAT_MIXENG
 #ifdef RECIPROCAL
-        t = (rate->opos & UINT_MAX) * (1.f / UINT_MAX);
+        t = (opos & UINT_MAX) * (1.f / UINT_MAX);
 #else
-        t = (rate->opos & UINT_MAX) / (mixeng_real) UINT_MAX;
+        t = (opos & UINT_MAX) / (mixeng_real) UINT_MAX;
 #endif
-        out.l = (ilast.l * (1.0 - t)) + icur.l * t;
-        out.r = (ilast.r * (1.0 - t)) + icur.r * t;
+        out.l = (ilast->l * (1.0 - t)) + icur.l * t;
+        out.r = (ilast->r * (1.0 - t)) + icur.r * t;
 #else
-        t = rate->opos & 0xffffffff;
-        out.l = (ilast.l * ((int64_t) UINT_MAX - t) + icur.l * t) >> 32;
-        out.r = (ilast.r * ((int64_t) UINT_MAX - t) + icur.r * t) >> 32;
+        /*
+         * ilast * (UINT_MAX - t) + icur * t with one multiplication:
+         * (ilast << 32) - ilast + (icur - ilast) * t
+         */
+        t = opos & 0xffffffff;
+        out.l = (int64_t) (((uint64_t) ilast->l << 32) - ilast->l +
+                           (uint64_t) (icur.l - ilast->l) * t) >> 32;
+        out.r = (int64_t) (((uint64_t) ilast->r << 32) - ilast->r +
+                           (uint64_t) (icur.r - ilast->r) * t) >> 32;
 #endif
 
         /* output sample & increment position */
         OP (obuf->l, out.l);
         OP (obuf->r, out.r);
         obuf += 1;
-        rate->opos += rate->opos_inc;
+        opos += opos_inc;
     }
 
-the_end:
-    *isamp = ibuf - istart;
+    *isamp = pos;
     *osamp = obuf - ostart;
-    rate->ilast = ilast;
+    rate->opos = opos;
+    rate->ipos = ipos + pos;
+    if (pos) {
+        rate->ilast = ibuf[pos - 1];
+    }
 }
 
 #undef NAME
 #undef OP
+#undef BLOCK_OP
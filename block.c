@@ -28,6 +28,8 @@
 #include "block_int.h"
 #include "module.h"
 #include "qemu-objects.h"
+#include "qemu-timer.h"
+#include "host-utils.h"
 
 #ifdef CONFIG_BSD
 #include <sys/types.h>
@@ -919,18 +921,90 @@ static int bdrv_check_request(BlockDriverState *bs, int64_t sector_num,
                                    nb_sectors * BDRV_SECTOR_SIZE);
 }
 
+/*
+ * Latency accounting.  Each request is accounted once per
+ * BlockDriverState, by the path that really performs it: the synchronous
+ * functions skip drivers that emulate them on top of AIO and the AIO
+ * functions skip drivers that emulate AIO on top of synchronous I/O.
+ */
+static void bdrv_acct_done(BlockDriverState *bs, int type, int64_t start)
+{
+    int64_t ns = get_clock() - start;
+    uint64_t us;
+    int bucket = 0;
+
+    if (ns < 0) {
+        ns = 0;
+    }
+    us = ns / 1000;
+    if (us) {
+        bucket = MIN(64 - clz64(us), BDRV_LATENCY_BUCKETS - 1);
+    }
+    bs->total_time_ns[type] += ns;
+    bs->latency[type][bucket]++;
+}
+
+typedef struct BlockAcctData {
+    BlockDriverCompletionFunc *cb;
+    void *opaque;
+    BlockDriverState *bs;
+    int type;
+    int64_t start;
+    int cancelled;
+} BlockAcctData;
+
+static void block_acct_cb(void *opaque, int ret)
+{
+    BlockAcctData *d = opaque;
+
+    if (d->cancelled) {
+        /* bdrv_aio_cancel() frees it */
+        return;
+    }
+    bdrv_acct_done(d->bs, d->type, d->start);
+    d->cb(d->opaque, ret);
+    qemu_free(d);
+}
+
+static BlockAcctData *block_acct_alloc(BlockDriverState *bs, int type,
+                                       BlockDriverCompletionFunc *cb,
+                                       void *opaque)
+{
+    BlockAcctData *d = qemu_malloc(sizeof(BlockAcctData));
+
+    d->cb = cb;
+    d->opaque = opaque;
+    d->bs = bs;
+    d->type = type;
+    d->start = get_clock();
+    d->cancelled = 0;
+    return d;
+}
+
 /* return < 0 if error. See bdrv_write() for the return codes */
 int bdrv_read(BlockDriverState *bs, int64_t sector_num,
               uint8_t *buf, int nb_sectors)
 {
     BlockDriver *drv = bs->drv;
+    int64_t start;
+    int ret;
 
     if (!drv)
         return -ENOMEDIUM;
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return -EIO;
 
-    return drv->bdrv_read(bs, sector_num, buf, nb_sectors);
+    if (drv->bdrv_read == bdrv_read_em) {
+        /* accounted by bdrv_aio_readv() */
+        return drv->bdrv_read(bs, sector_num, buf, nb_sectors);
+    }
+
+    start = get_clock();
+    ret = drv->bdrv_read(bs, sector_num, buf, nb_sectors);
+    bs->rd_bytes += (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
+    bs->rd_ops++;
+    bdrv_acct_done(bs, BDRV_ACCT_READ, start);
+    return ret;
 }
 
 static void set_dirty_bitmap(BlockDriverState *bs, int64_t sector_num,
@@ -971,6 +1045,9 @@ int bdrv_write(BlockDriverState *bs, int64_t sector_num,
                const uint8_t *buf, int nb_sectors)
 {
     BlockDriver *drv = bs->drv;
+    int64_t start;
+    int ret;
+
     if (!bs->drv)
         return -ENOMEDIUM;
     if (bs->read_only)
@@ -986,7 +1063,17 @@ int bdrv_write(BlockDriverState *bs, int64_t sector_num,
         bs->wr_highest_sector = sector_num + nb_sectors - 1;
     }
 
-    return drv->bdrv_write(bs, sector_num, buf, nb_sectors);
+    if (drv->bdrv_write == bdrv_write_em) {
+        /* accounted by bdrv_aio_writev() */
+        return drv->bdrv_write(bs, sector_num, buf, nb_sectors);
+    }
+
+    start = get_clock();
+    ret = drv->bdrv_write(bs, sector_num, buf, nb_sectors);
+    bs->wr_bytes += (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
+    bs->wr_ops++;
+    bdrv_acct_done(bs, BDRV_ACCT_WRITE, start);
+    return ret;
 }
 
 int bdrv_pread(BlockDriverState *bs, int64_t offset,
@@ -1433,6 +1520,13 @@ int bdrv_get_translation_hint(BlockDriverState *bs)
     return bs->translation;
 }
 
+/* Memory budget for the metadata caches of formats like qcow2, takes
+   effect when the image is opened */
+void bdrv_set_metadata_cache_size(BlockDriverState *bs, int64_t size)
+{
+    bs->metadata_cache_size = size;
+}
+
 void bdrv_set_on_error(BlockDriverState *bs, BlockErrorAction on_read_error,
                        BlockErrorAction on_write_error)
 {
@@ -1586,7 +1680,12 @@ int bdrv_flush(BlockDriverState *bs)
     }
 
     if (bs->drv && bs->drv->bdrv_flush) {
-        return bs->drv->bdrv_flush(bs);
+        int64_t start = get_clock();
+        int ret = bs->drv->bdrv_flush(bs);
+
+        bs->flush_ops++;
+        bdrv_acct_done(bs, BDRV_ACCT_FLUSH, start);
+        return ret;
     }
 
     /*
@@ -1797,11 +1896,29 @@ static void bdrv_stats_iter(QObject *data, void *opaque)
                         " wr_bytes=%" PRId64
                         " rd_operations=%" PRId64
                         " wr_operations=%" PRId64
-                        "\n",
+                        " flush_operations=%" PRId64
+                        " rd_total_time_ns=%" PRId64
+                        " wr_total_time_ns=%" PRId64
+                        " flush_total_time_ns=%" PRId64,
                         qdict_get_int(qdict, "rd_bytes"),
                         qdict_get_int(qdict, "wr_bytes"),
                         qdict_get_int(qdict, "rd_operations"),
-                        qdict_get_int(qdict, "wr_operations"));
+                        qdict_get_int(qdict, "wr_operations"),
+                        qdict_get_int(qdict, "flush_operations"),
+                        qdict_get_int(qdict, "rd_total_time_ns"),
+                        qdict_get_int(qdict, "wr_total_time_ns"),
+                        qdict_get_int(qdict, "flush_total_time_ns"));
+    if (qdict_haskey(qdict, "metadata_cache_hits")) {
+        monitor_printf(mon, " metadata_cache_hits=%" PRId64
+                            " metadata_cache_misses=%" PRId64
+                            " metadata_cache_readahead=%" PRId64
+                            " metadata_cache_bytes=%" PRId64,
+                            qdict_get_int(qdict, "metadata_cache_hits"),
+                            qdict_get_int(qdict, "metadata_cache_misses"),
+                            qdict_get_int(qdict, "metadata_cache_readahead"),
+                            qdict_get_int(qdict, "metadata_cache_bytes"));
+    }
+    monitor_printf(mon, "\n");
 }
 
 void bdrv_stats_print(Monitor *mon, const QObject *data)
@@ -1809,6 +1926,96 @@ void bdrv_stats_print(Monitor *mon, const QObject *data)
     qlist_iter(qobject_to_qlist(data), bdrv_stats_iter, mon);
 }
 
+static const char * const bdrv_acct_names[BDRV_MAX_IOTYPE] = {
+    [BDRV_ACCT_READ] = "rd",
+    [BDRV_ACCT_WRITE] = "wr",
+    [BDRV_ACCT_FLUSH] = "flush",
+};
+
+static void bdrv_latency_print_one(Monitor *mon, QDict *stats, int type)
+{
+    const char *name = bdrv_acct_names[type];
+    char key[32];
+    QList *hist;
+    QListEntry *entry;
+    int64_t ops, total_ns;
+    int i = 0;
+
+    snprintf(key, sizeof(key), "%s_operations", name);
+    ops = qdict_get_int(stats, key);
+    snprintf(key, sizeof(key), "%s_total_time_ns", name);
+    total_ns = qdict_get_int(stats, key);
+    snprintf(key, sizeof(key), "%s_latency", name);
+    hist = qdict_get_qlist(stats, key);
+
+    monitor_printf(mon, "  %-5s ops=%" PRId64 " avg=%" PRId64 "us\n", name,
+                   ops, ops ? total_ns / ops / 1000 : 0);
+    QLIST_FOREACH_ENTRY(hist, entry) {
+        int64_t count = qint_get_int(qobject_to_qint(qlist_entry_obj(entry)));
+
+        if (count) {
+            if (i == 0) {
+                monitor_printf(mon, "        %10s < 1us", "");
+            } else if (i == BDRV_LATENCY_BUCKETS - 1) {
+                monitor_printf(mon, "        %10" PRIu64 "us and up",
+                               (uint64_t)1 << (i - 1));
+            } else {
+                monitor_printf(mon, "        %10" PRIu64 "us .. %" PRIu64 "us",
+                               (uint64_t)1 << (i - 1), (uint64_t)1 << i);
+            }
+            monitor_printf(mon, ": %" PRId64 "\n", count);
+        }
+        i++;
+    }
+}
+
+static void bdrv_latency_iter(QObject *data, void *opaque)
+{
+    QDict *qdict = qobject_to_qdict(data);
+    Monitor *mon = opaque;
+    QDict *stats;
+    int type;
+
+    if (!qdict_haskey(qdict, "device")) {
+        return;
+    }
+    monitor_printf(mon, "%s:\n", qdict_get_str(qdict, "device"));
+    stats = qobject_to_qdict(qdict_get(qdict, "stats"));
+    for (type = 0; type < BDRV_MAX_IOTYPE; type++) {
+        bdrv_latency_print_one(mon, stats, type);
+    }
+}
+
+void bdrv_latency_print(Monitor *mon, const QObject *data)
+{
+    qlist_iter(qobject_to_qlist(data), bdrv_latency_iter, mon);
+}
+
+static void bdrv_info_stats_latency(BlockDriverState *bs, QDict *stats)
+{
+    char key[32];
+    QList *hist;
+    int type, i, n;
+
+    for (type = 0; type < BDRV_MAX_IOTYPE; type++) {
+        snprintf(key, sizeof(key), "%s_total_time_ns", bdrv_acct_names[type]);
+        qdict_put(stats, key, qint_from_int(bs->total_time_ns[type]));
+
+        /* leave out the empty buckets at the slow end */
+        for (n = BDRV_LATENCY_BUCKETS; n > 0; n--) {
+            if (bs->latency[type][n - 1]) {
+                break;
+            }
+        }
+        hist = qlist_new();
+        for (i = 0; i < n; i++) {
+            qlist_append(hist, qint_from_int(bs->latency[type][i]));
+        }
+        snprintf(key, sizeof(key), "%s_latency", bdrv_acct_names[type]);
+        qdict_put(stats, key, hist);
+    }
+}
+
 static QObject* bdrv_info_stats_bs(BlockDriverState *bs)
 {
     QObject *res;
@@ -1819,13 +2026,28 @@ static QObject* bdrv_info_stats_bs(BlockDriverState *bs)
                              "'wr_bytes': %" PRId64 ","
                              "'rd_operations': %" PRId64 ","
                              "'wr_operations': %" PRId64 ","
+                             "'flush_operations': %" PRId64 ","
                              "'wr_highest_offset': %" PRId64
                              "} }",
                              bs->rd_bytes, bs->wr_bytes,
-                             bs->rd_ops, bs->wr_ops,
+                             bs->rd_ops, bs->wr_ops, bs->flush_ops,
                              bs->wr_highest_sector *
                              (uint64_t)BDRV_SECTOR_SIZE);
     dict  = qobject_to_qdict(res);
+    bdrv_info_stats_latency(bs, qobject_to_qdict(qdict_get(dict, "stats")));
+
+    if (bs->metadata_cache_max) {
+        QDict *stats = qobject_to_qdict(qdict_get(dict, "stats"));
+
+        qdict_put(stats, "metadata_cache_hits",
+                  qint_from_int(bs->metadata_cache_hits));
+        qdict_put(stats, "metadata_cache_misses",
+                  qint_from_int(bs->metadata_cache_misses));
+        qdict_put(stats, "metadata_cache_readahead",
+                  qint_from_int(bs->metadata_cache_readahead));
+        qdict_put(stats, "metadata_cache_bytes",
+                  qint_from_int(bs->metadata_cache_bytes));
+    }
 
     if (*bs->device_name) {
         qdict_put(dict, "device", qstring_from_str(bs->device_name));
@@ -1893,6 +2115,29 @@ int bdrv_write_compressed(BlockDriverState *bs, int64_t sector_num,
     return drv->bdrv_write_compressed(bs, sector_num, buf, nb_sectors);
 }
 
+/* Write a cluster that the caller compressed itself, e.g. in a worker
+   thread.  zbuf holds the headerless deflate stream of buf, or zlen is 0 if
+   the data did not compress; in that case buf is written uncompressed.  */
+int bdrv_write_deflated(BlockDriverState *bs, int64_t sector_num,
+                        const uint8_t *buf, int nb_sectors,
+                        const uint8_t *zbuf, int zlen)
+{
+    BlockDriver *drv = bs->drv;
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_write_deflated)
+        return -ENOTSUP;
+    if (bdrv_check_request(bs, sector_num, nb_sectors))
+        return -EIO;
+
+    if (bs->dirty_bitmap) {
+        set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
+    }
+
+    return drv->bdrv_write_deflated(bs, sector_num, buf, nb_sectors,
+                                    zbuf, zlen);
+}
+
 int bdrv_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BlockDriver *drv = bs->drv;
@@ -1930,6 +2175,28 @@ int bdrv_load_vmstate(BlockDriverState *bs, uint8_t *buf,
     return -ENOTSUP;
 }
 
+/* Find where 'size' bytes of VM state at 'pos' are stored, as an offset in
+   the host file *filename, so that they can be read without the block
+   layer.  Returns -ENOTSUP if the format or protocol does not allow it
+   and -ERANGE if only this range is not stored contiguously.  */
+int bdrv_map_vmstate(BlockDriverState *bs, int64_t pos, int size,
+                     const char **filename, int64_t *file_offset)
+{
+    BlockDriver *drv = bs->drv;
+    int ret;
+
+    if (!drv)
+        return -ENOMEDIUM;
+    if (!drv->bdrv_map_vmstate || !bs->file ||
+        strcmp(bs->file->drv->format_name, "file"))
+        return -ENOTSUP;
+    ret = drv->bdrv_map_vmstate(bs, pos, size, file_offset);
+    if (ret < 0)
+        return ret;
+    *filename = bs->file->filename;
+    return 0;
+}
+
 void bdrv_debug_event(BlockDriverState *bs, BlkDebugEvent event)
 {
     BlockDriver *drv = bs->drv;
@@ -2148,6 +2415,7 @@ BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
 {
     BlockDriver *drv = bs->drv;
     BlockDriverAIOCB *ret;
+    BlockAcctData *acct;
 
     trace_bdrv_aio_readv(bs, sector_num, nb_sectors, opaque);
 
@@ -2156,13 +2424,22 @@ BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return NULL;
 
+    if (drv->bdrv_aio_readv == bdrv_aio_readv_em) {
+        /* accounted by bdrv_read() */
+        return drv->bdrv_aio_readv(bs, sector_num, qiov, nb_sectors,
+                                   cb, opaque);
+    }
+
+    acct = block_acct_alloc(bs, BDRV_ACCT_READ, cb, opaque);
     ret = drv->bdrv_aio_readv(bs, sector_num, qiov, nb_sectors,
-                              cb, opaque);
+                              block_acct_cb, acct);
 
     if (ret) {
 	/* Update stats even though technically transfer has not happened. */
 	bs->rd_bytes += (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
 	bs->rd_ops ++;
+    } else {
+        qemu_free(acct);
     }
 
     return ret;
@@ -2211,6 +2488,7 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
     BlockDriver *drv = bs->drv;
     BlockDriverAIOCB *ret;
     BlockCompleteData *blk_cb_data;
+    BlockAcctData *acct;
 
     trace_bdrv_aio_writev(bs, sector_num, nb_sectors, opaque);
 
@@ -2228,8 +2506,15 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
         opaque = blk_cb_data;
     }
 
+    if (drv->bdrv_aio_writev == bdrv_aio_writev_em) {
+        /* accounted by bdrv_write() */
+        return drv->bdrv_aio_writev(bs, sector_num, qiov, nb_sectors,
+                                    cb, opaque);
+    }
+
+    acct = block_acct_alloc(bs, BDRV_ACCT_WRITE, cb, opaque);
     ret = drv->bdrv_aio_writev(bs, sector_num, qiov, nb_sectors,
-                               cb, opaque);
+                               block_acct_cb, acct);
 
     if (ret) {
         /* Update stats even though technically transfer has not happened. */
@@ -2238,6 +2523,8 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
         if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
             bs->wr_highest_sector = sector_num + nb_sectors - 1;
         }
+    } else {
+        qemu_free(acct);
     }
 
     return ret;
@@ -2481,10 +2768,57 @@ fail:
     return -1;
 }
 
+/*
+ * Between bdrv_io_plug() and bdrv_io_unplug(), AIO requests may be queued
+ * by the host backend instead of being submitted one at a time; unplug
+ * submits them together.  Calls nest and must be balanced.  Callers use
+ * this around a burst of requests, e.g. everything a device found in its
+ * queue at once.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        return;
+    }
+    if (drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+        return;
+    }
+    if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+    if (bs->backing_hd) {
+        bdrv_io_plug(bs->backing_hd);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (!drv) {
+        return;
+    }
+    if (drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+        return;
+    }
+    if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+    if (bs->backing_hd) {
+        bdrv_io_unplug(bs->backing_hd);
+    }
+}
+
 BlockDriverAIOCB *bdrv_aio_flush(BlockDriverState *bs,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
     BlockDriver *drv = bs->drv;
+    BlockDriverAIOCB *ret;
+    BlockAcctData *acct;
 
     trace_bdrv_aio_flush(bs, opaque);
 
@@ -2494,12 +2828,33 @@ BlockDriverAIOCB *bdrv_aio_flush(BlockDriverState *bs,
 
     if (!drv)
         return NULL;
-    return drv->bdrv_aio_flush(bs, cb, opaque);
+    if (drv->bdrv_aio_flush == bdrv_aio_flush_em) {
+        /* accounted by bdrv_flush() */
+        return drv->bdrv_aio_flush(bs, cb, opaque);
+    }
+
+    acct = block_acct_alloc(bs, BDRV_ACCT_FLUSH, cb, opaque);
+    ret = drv->bdrv_aio_flush(bs, block_acct_cb, acct);
+    if (ret) {
+        bs->flush_ops++;
+    } else {
+        qemu_free(acct);
+    }
+    return ret;
 }
 
 void bdrv_aio_cancel(BlockDriverAIOCB *acb)
 {
+    BlockAcctData *acct = NULL;
+
+    /* A cancelled request never completes, so its accounting data is
+       freed here rather than by block_acct_cb */
+    if (acb->cb == block_acct_cb) {
+        acct = acb->opaque;
+        acct->cancelled = 1;
+    }
     acb->pool->cancel(acb);
+    qemu_free(acct);
 }
 
 
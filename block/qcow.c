@@ -859,6 +859,30 @@ static int qcow_make_empty(BlockDriverState *bs)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
+static int qcow_write_deflated(BlockDriverState *bs, int64_t sector_num,
+                               const uint8_t *buf, int nb_sectors,
+                               const uint8_t *zbuf, int zlen)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+
+    if (nb_sectors != s->cluster_sectors)
+        return -EINVAL;
+
+    if (zlen <= 0 || zlen >= s->cluster_size) {
+        /* could not compress: write normal cluster */
+        return bdrv_write(bs, sector_num, buf, s->cluster_sectors);
+    }
+
+    cluster_offset = get_cluster_offset(bs, sector_num << 9, 2,
+                                        zlen, 0, 0);
+    cluster_offset &= s->cluster_offset_mask;
+    if (bdrv_pwrite(bs->file, cluster_offset, zbuf, zlen) != zlen) {
+        return -1;
+    }
+    return 0;
+}
+
 static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors)
 {
@@ -866,7 +890,6 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
     z_stream strm;
     int ret, out_len;
     uint8_t *out_buf;
-    uint64_t cluster_offset;
 
     if (nb_sectors != s->cluster_sectors)
         return -EINVAL;
@@ -900,21 +923,13 @@ static int qcow_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     deflateEnd(&strm);
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
-        /* could not compress: write normal cluster */
-        bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-    } else {
-        cluster_offset = get_cluster_offset(bs, sector_num << 9, 2,
-                                            out_len, 0, 0);
-        cluster_offset &= s->cluster_offset_mask;
-        if (bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len) != out_len) {
-            qemu_free(out_buf);
-            return -1;
-        }
+    if (ret != Z_STREAM_END) {
+        out_len = 0;
     }
-
+    ret = qcow_write_deflated(bs, sector_num, buf, nb_sectors,
+                              out_buf, out_len);
     qemu_free(out_buf);
-    return 0;
+    return ret;
 }
 
 static int qcow_flush(BlockDriverState *bs)
@@ -970,6 +985,7 @@ static BlockDriver bdrv_qcow = {
     .bdrv_aio_writev	= qcow_aio_writev,
     .bdrv_aio_flush	= qcow_aio_flush,
     .bdrv_write_compressed = qcow_write_compressed,
+    .bdrv_write_deflated = qcow_write_deflated,
     .bdrv_get_info	= qcow_get_info,
 
     .create_options = qcow_create_options,
@@ -26,56 +26,158 @@
 #include "qemu-common.h"
 #include "qcow2.h"
 
+/*
+ * The cache starts empty and grows by one table on each miss until it holds
+ * max_size tables; only then are tables evicted, using the CLOCK algorithm.
+ * The memory for all max_size tables is reserved in one block when the
+ * cache is created, but it is only touched as the cache grows.  Tables are
+ * found by offset through a hash table, and by address through their index
+ * in the block.
+ */
+
 typedef struct Qcow2CachedTable {
     void*   table;
     int64_t offset;
     bool    dirty;
-    int     cache_hits;
+    bool    referenced;
+    bool    loading;
     int     ref;
+    int     hash_next;
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable*       entries;
     struct Qcow2Cache*      depends;
+    uint8_t*                tables;
+    int*                    hash;
+    int                     hash_mask;
     int                     size;
+    int                     max_size;
+    int                     clock_hand;
+    int                     cluster_bits;
     bool                    depends_on_flush;
     bool                    writethrough;
 };
 
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+typedef struct Qcow2CacheReadahead {
+    Qcow2Cache*             cache;
+    int                     index;
+    struct iovec            iov;
+    QEMUIOVector            qiov;
+} Qcow2CacheReadahead;
+
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int max_tables,
     bool writethrough)
 {
     BDRVQcowState *s = bs->opaque;
     Qcow2Cache *c;
-    int i;
+    int i, hash_size;
 
     c = qemu_mallocz(sizeof(*c));
-    c->size = num_tables;
-    c->entries = qemu_mallocz(sizeof(*c->entries) * num_tables);
+    c->max_size = max_tables;
+    c->cluster_bits = s->cluster_bits;
+    c->entries = qemu_mallocz(sizeof(*c->entries) * max_tables);
+    c->tables = qemu_blockalign(bs, (size_t)max_tables * s->cluster_size);
     c->writethrough = writethrough;
 
-    for (i = 0; i < c->size; i++) {
-        c->entries[i].table = qemu_blockalign(bs, s->cluster_size);
+    for (hash_size = 1; hash_size < max_tables; hash_size <<= 1) {
+        /* nothing */
+    }
+    c->hash_mask = hash_size - 1;
+    c->hash = qemu_malloc(sizeof(*c->hash) * hash_size);
+    for (i = 0; i < hash_size; i++) {
+        c->hash[i] = -1;
+    }
+
+    for (i = 0; i < max_tables; i++) {
+        c->entries[i].table = c->tables + (size_t)i * s->cluster_size;
+        c->entries[i].hash_next = -1;
     }
 
+    bs->metadata_cache_max += (uint64_t)max_tables * s->cluster_size;
+
     return c;
 }
 
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c)
 {
+    BDRVQcowState *s = bs->opaque;
     int i;
 
     for (i = 0; i < c->size; i++) {
+        while (c->entries[i].loading) {
+            qemu_aio_wait();
+        }
         assert(c->entries[i].ref == 0);
-        qemu_vfree(c->entries[i].table);
     }
 
+    bs->metadata_cache_bytes -= (uint64_t)c->size * s->cluster_size;
+    bs->metadata_cache_max -= (uint64_t)c->max_size * s->cluster_size;
+
+    qemu_vfree(c->tables);
+    qemu_free(c->hash);
     qemu_free(c->entries);
     qemu_free(c);
 
     return 0;
 }
 
+/*
+ * Tables are cluster aligned, so hash the cluster index.  Consecutive
+ * tables are common, the multiplication spreads them over the buckets.
+ */
+static int qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    uint64_t cluster = offset >> c->cluster_bits;
+
+    return ((cluster * 0x9e3779b97f4a7c15ULL) >> 32) & c->hash_mask;
+}
+
+static int qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    int i;
+
+    for (i = c->hash[qcow2_cache_hash(c, offset)]; i >= 0;
+         i = c->entries[i].hash_next) {
+        if (c->entries[i].offset == offset) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Change the offset of entry i, keeping the hash table up to date */
+static void qcow2_cache_set_offset(Qcow2Cache *c, int i, uint64_t offset)
+{
+    int *p;
+
+    if (c->entries[i].offset) {
+        p = &c->hash[qcow2_cache_hash(c, c->entries[i].offset)];
+        while (*p != i) {
+            p = &c->entries[*p].hash_next;
+        }
+        *p = c->entries[i].hash_next;
+        c->entries[i].hash_next = -1;
+    }
+
+    c->entries[i].offset = offset;
+    if (offset) {
+        p = &c->hash[qcow2_cache_hash(c, offset)];
+        c->entries[i].hash_next = *p;
+        *p = i;
+    }
+}
+
+static int qcow2_cache_find_table(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t i = ((uint8_t *) table - c->tables) >> c->cluster_bits;
+
+    if (i < 0 || i >= c->size || c->entries[i].table != table) {
+        return -1;
+    }
+    return i;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
     int ret;
@@ -181,34 +283,35 @@ void qcow2_cache_depends_on_flush(Qcow2Cache *c)
     c->depends_on_flush = true;
 }
 
-static int qcow2_cache_find_entry_to_replace(Qcow2Cache *c)
+static int qcow2_cache_find_entry_to_replace(BlockDriverState *bs,
+    Qcow2Cache *c)
 {
-    int i;
-    int min_count = INT_MAX;
-    int min_index = -1;
+    BDRVQcowState *s = bs->opaque;
+    int i, n;
 
+    /* Use a new table as long as the cache may grow */
+    if (c->size < c->max_size) {
+        bs->metadata_cache_bytes += s->cluster_size;
+        return c->size++;
+    }
+
+    /* Two rounds of the clock hand: the first may only clear the
+     * referenced bits */
+    for (n = 0; n < 2 * c->size; n++) {
+        i = c->clock_hand;
+        c->clock_hand = (i + 1) % c->size;
 
-    for (i = 0; i < c->size; i++) {
         if (c->entries[i].ref) {
             continue;
         }
-
-        if (c->entries[i].cache_hits < min_count) {
-            min_index = i;
-            min_count = c->entries[i].cache_hits;
+        if (c->entries[i].referenced) {
+            c->entries[i].referenced = false;
+            continue;
         }
-
-        /* Give newer hits priority */
-        /* TODO Check how to optimize the replacement strategy */
-        c->entries[i].cache_hits /= 2;
+        return i;
     }
 
-    if (min_index == -1) {
-        /* This can't happen in current synchronous code, but leave the check
-         * here as a reminder for whoever starts using AIO with the cache */
-        abort();
-    }
-    return min_index;
+    return -1;
 }
 
 static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
@@ -218,17 +321,27 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     int i;
     int ret;
 
-    /* Check if the table is already cached */
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].offset == offset) {
-            goto found;
+    /* Check if the table is already cached, maybe by readahead */
+    for (;;) {
+        i = qcow2_cache_lookup(c, offset);
+        if (i < 0 || !c->entries[i].loading) {
+            break;
         }
+        qemu_aio_wait();
+    }
+    if (i >= 0) {
+        if (read_from_disk) {
+            bs->metadata_cache_hits++;
+        }
+        goto found;
     }
 
     /* If not, write a table back and replace it */
-    i = qcow2_cache_find_entry_to_replace(c);
+    i = qcow2_cache_find_entry_to_replace(bs, c);
     if (i < 0) {
-        return i;
+        /* This can't happen in current synchronous code, but leave the check
+         * here as a reminder for whoever starts using AIO with the cache */
+        abort();
     }
 
     ret = qcow2_cache_entry_flush(bs, c, i);
@@ -236,26 +349,27 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
         return ret;
     }
 
-    c->entries[i].offset = 0;
+    qcow2_cache_set_offset(c, i, 0);
     if (read_from_disk) {
         if (c == s->l2_table_cache) {
             BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
         }
+        bs->metadata_cache_misses++;
 
+        /* don't let a nested request pick the same entry */
+        c->entries[i].ref++;
         ret = bdrv_pread(bs->file, offset, c->entries[i].table, s->cluster_size);
+        c->entries[i].ref--;
         if (ret < 0) {
             return ret;
         }
     }
 
-    /* Give the table some hits for the start so that it won't be replaced
-     * immediately. The number 32 is completely arbitrary. */
-    c->entries[i].cache_hits = 32;
-    c->entries[i].offset = offset;
+    qcow2_cache_set_offset(c, i, offset);
 
     /* And return the right table */
 found:
-    c->entries[i].cache_hits++;
+    c->entries[i].referenced = true;
     c->entries[i].ref++;
     *table = c->entries[i].table;
     return 0;
@@ -273,18 +387,71 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     return qcow2_cache_do_get(bs, c, offset, table, false);
 }
 
+static void qcow2_cache_readahead_cb(void *opaque, int ret)
+{
+    Qcow2CacheReadahead *ra = opaque;
+    Qcow2CachedTable *entry = &ra->cache->entries[ra->index];
+
+    if (ret < 0) {
+        qcow2_cache_set_offset(ra->cache, ra->index, 0);
+    }
+    entry->loading = false;
+    entry->ref--;
+    qemu_free(ra);
+}
+
+/*
+ * Start reading the table at offset into the cache in the background, so
+ * that a later qcow2_cache_get finds it there.  This is only a hint: it
+ * does nothing if the table is cached already or if making room for it
+ * would mean writing back a dirty table.
+ */
+void qcow2_cache_readahead(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CacheReadahead *ra;
+    BlockDriverAIOCB *acb;
+    int i;
+
+    if (qcow2_cache_lookup(c, offset) >= 0) {
+        return;
+    }
+
+    i = qcow2_cache_find_entry_to_replace(bs, c);
+    if (i < 0 || c->entries[i].dirty) {
+        return;
+    }
+
+    qcow2_cache_set_offset(c, i, offset);
+    c->entries[i].referenced = true;
+    c->entries[i].loading = true;
+    c->entries[i].ref++;
+
+    ra = qemu_malloc(sizeof(*ra));
+    ra->cache = c;
+    ra->index = i;
+    ra->iov.iov_base = c->entries[i].table;
+    ra->iov.iov_len = s->cluster_size;
+    qemu_iovec_init_external(&ra->qiov, &ra->iov, 1);
+
+    bs->metadata_cache_readahead++;
+    acb = bdrv_aio_readv(bs->file, offset >> 9, &ra->qiov,
+                         s->cluster_sectors, qcow2_cache_readahead_cb, ra);
+    if (!acb) {
+        qcow2_cache_readahead_cb(ra, -EIO);
+    }
+}
+
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
     int i;
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == *table) {
-            goto found;
-        }
+    i = qcow2_cache_find_table(c, *table);
+    if (i < 0) {
+        return -ENOENT;
     }
-    return -ENOENT;
 
-found:
     c->entries[i].ref--;
     *table = NULL;
 
@@ -301,14 +468,10 @@ void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table)
 {
     int i;
 
-    for (i = 0; i < c->size; i++) {
-        if (c->entries[i].table == table) {
-            goto found;
-        }
+    i = qcow2_cache_find_table(c, table);
+    if (i < 0) {
+        abort();
     }
-    abort();
-
-found:
     c->entries[i].dirty = true;
 }
 
@@ -110,17 +110,32 @@ int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size)
  *
  * Returns a pointer to the L2 table on success, or NULL if the read from
  * the image file failed.
+ *
+ * When the guest moves from one L2 table to the next, it is likely to
+ * stream through the image, so the table after that is read ahead.
  */
 
-static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
-    uint64_t **l2_table)
+static int l2_load(BlockDriverState *bs, unsigned int l1_index,
+    uint64_t l2_offset, uint64_t **l2_table)
 {
     BDRVQcowState *s = bs->opaque;
+    uint64_t next_offset;
     int ret;
 
     ret = qcow2_cache_get(bs, s->l2_table_cache, l2_offset, (void**) l2_table);
+    if (ret < 0) {
+        return ret;
+    }
 
-    return ret;
+    if (l1_index == s->l2_last_index + 1 && l1_index + 1 < s->l1_size) {
+        next_offset = s->l1_table[l1_index + 1] & ~QCOW_OFLAG_COPIED;
+        if (next_offset) {
+            qcow2_cache_readahead(bs, s->l2_table_cache, next_offset);
+        }
+    }
+    s->l2_last_index = l1_index;
+
+    return 0;
 }
 
 /*
@@ -439,7 +454,7 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     /* load the l2 table in memory */
 
     l2_offset &= ~QCOW_OFLAG_COPIED;
-    ret = l2_load(bs, l2_offset, &l2_table);
+    ret = l2_load(bs, l1_index, l2_offset, &l2_table);
     if (ret < 0) {
         return ret;
     }
@@ -510,7 +525,7 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
     if (l2_offset & QCOW_OFLAG_COPIED) {
         /* load the l2 table in memory */
         l2_offset &= ~QCOW_OFLAG_COPIED;
-        ret = l2_load(bs, l2_offset, &l2_table);
+        ret = l2_load(bs, l1_index, l2_offset, &l2_table);
         if (ret < 0) {
             return ret;
         }
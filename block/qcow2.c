@@ -145,6 +145,8 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     QCowHeader header;
     uint64_t ext_end;
     bool writethrough;
+    int64_t cache_size;
+    int l2_cache_tables, refcount_cache_tables;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -228,11 +230,21 @@ static int qcow2_open(BlockDriverState *bs, int flags)
         }
     }
 
-    /* alloc L2 table/refcount block cache */
+    /* alloc L2 table/refcount block cache; the L2 cache doesn't need more
+     * tables than the L1 table has entries */
     writethrough = ((flags & BDRV_O_CACHE_MASK) == 0);
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE, writethrough);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE,
+    cache_size = bs->metadata_cache_size;
+    if (cache_size <= 0) {
+        cache_size = DEFAULT_METADATA_CACHE_SIZE;
+    }
+    l2_cache_tables = MIN((cache_size / 4 * 3) >> s->cluster_bits, s->l1_size);
+    l2_cache_tables = MAX(l2_cache_tables, L2_CACHE_SIZE);
+    refcount_cache_tables = MAX((cache_size / 4) >> s->cluster_bits,
+                                REFCOUNT_CACHE_SIZE);
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_tables, writethrough);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_tables,
         writethrough);
+    s->l2_last_index = -1;
 
     s->cluster_cache = qemu_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
@@ -288,6 +300,9 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     if (s->l2_table_cache) {
         qcow2_cache_destroy(bs, s->l2_table_cache);
     }
+    if (s->refcount_block_cache) {
+        qcow2_cache_destroy(bs, s->refcount_block_cache);
+    }
     qemu_free(s->cluster_cache);
     qemu_free(s->cluster_data);
     return ret;
@@ -1143,6 +1158,33 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
 
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
+static int qcow2_write_deflated(BlockDriverState *bs, int64_t sector_num,
+                                const uint8_t *buf, int nb_sectors,
+                                const uint8_t *zbuf, int zlen)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+
+    if (nb_sectors != s->cluster_sectors)
+        return -EINVAL;
+
+    if (zlen <= 0 || zlen >= s->cluster_size) {
+        /* could not compress: write normal cluster */
+        return bdrv_write(bs, sector_num, buf, s->cluster_sectors);
+    }
+
+    cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+        sector_num << 9, zlen);
+    if (!cluster_offset)
+        return -1;
+    cluster_offset &= s->cluster_offset_mask;
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    if (bdrv_pwrite(bs->file, cluster_offset, zbuf, zlen) != zlen) {
+        return -1;
+    }
+    return 0;
+}
+
 static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                   const uint8_t *buf, int nb_sectors)
 {
@@ -1191,24 +1233,13 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
 
     deflateEnd(&strm);
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
-        /* could not compress: write normal cluster */
-        bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-    } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset)
-            return -1;
-        cluster_offset &= s->cluster_offset_mask;
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        if (bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len) != out_len) {
-            qemu_free(out_buf);
-            return -1;
-        }
+    if (ret != Z_STREAM_END) {
+        out_len = 0;
     }
-
+    ret = qcow2_write_deflated(bs, sector_num, buf, nb_sectors,
+                               out_buf, out_len);
     qemu_free(out_buf);
-    return 0;
+    return ret;
 }
 
 static int qcow2_flush(BlockDriverState *bs)
@@ -1319,6 +1350,30 @@ static int qcow2_load_vmstate(BlockDriverState *bs, uint8_t *buf,
     return ret;
 }
 
+static int qcow2_map_vmstate(BlockDriverState *bs, int64_t pos, int size,
+                             int64_t *file_offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t offset = qcow2_vm_state_offset(s) + pos;
+    uint64_t cluster_offset;
+    int n, ret;
+
+    if (s->crypt_method) {
+        return -ENOTSUP;
+    }
+    n = ((offset & 511) + size + 511) >> 9;
+    ret = qcow2_get_cluster_offset(bs, offset, &n, &cluster_offset);
+    if (ret < 0) {
+        return ret;
+    }
+    if (!cluster_offset || (cluster_offset & QCOW_OFLAG_COMPRESSED) ||
+        (n << 9) < (offset & 511) + size) {
+        return -ERANGE;
+    }
+    *file_offset = cluster_offset + (offset & (s->cluster_size - 1));
+    return 0;
+}
+
 static QEMUOptionParameter qcow2_create_options[] = {
     {
         .name = BLOCK_OPT_SIZE,
@@ -1372,6 +1427,7 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_discard           = qcow2_discard,
     .bdrv_truncate          = qcow2_truncate,
     .bdrv_write_compressed  = qcow2_write_compressed,
+    .bdrv_write_deflated    = qcow2_write_deflated,
 
     .bdrv_snapshot_create   = qcow2_snapshot_create,
     .bdrv_snapshot_goto     = qcow2_snapshot_goto,
@@ -1382,6 +1438,7 @@ static BlockDriver bdrv_qcow2 = {
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
+    .bdrv_map_vmstate     = qcow2_map_vmstate,
 
     .bdrv_change_backing_file   = qcow2_change_backing_file,
 
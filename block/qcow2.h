@@ -49,11 +49,16 @@
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
+/* Minimum number of tables in the L2 cache */
 #define L2_CACHE_SIZE 16
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
 
+/* Default memory budget for both metadata caches, unless the drive sets
+ * metadata-cache-size.  A quarter of the budget goes to refcount blocks. */
+#define DEFAULT_METADATA_CACHE_SIZE (8 * 1024 * 1024)
+
 typedef struct QCowHeader {
     uint32_t magic;
     uint32_t version;
@@ -100,6 +105,7 @@ typedef struct BDRVQcowState {
 
     Qcow2Cache* l2_table_cache;
     Qcow2Cache* refcount_block_cache;
+    unsigned int l2_last_index;
 
     uint8_t *cluster_cache;
     uint8_t *cluster_data;
@@ -223,7 +229,7 @@ void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
 /* qcow2-cache.c functions */
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int max_tables,
     bool writethrough);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
 
@@ -238,5 +244,7 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+void qcow2_cache_readahead(BlockDriverState *bs, Qcow2Cache *c,
+    uint64_t offset);
 
 #endif
@@ -40,6 +40,18 @@
 #define BLOCK_OPT_TABLE_SIZE    "table_size"
 #define BLOCK_OPT_PREALLOC      "preallocation"
 
+/* Request types for latency accounting */
+enum {
+    BDRV_ACCT_READ,
+    BDRV_ACCT_WRITE,
+    BDRV_ACCT_FLUSH,
+    BDRV_MAX_IOTYPE,
+};
+
+/* Latency histogram: bucket 0 counts requests that took less than 1us,
+   bucket i those that took [2^(i-1), 2^i) us, the last one is open ended */
+#define BDRV_LATENCY_BUCKETS 32
+
 typedef struct AIOPool {
     void (*cancel)(BlockDriverAIOCB *acb);
     int aiocb_size;
@@ -73,6 +85,9 @@ struct BlockDriver {
         BlockDriverCompletionFunc *cb, void *opaque);
     BlockDriverAIOCB *(*bdrv_aio_flush)(BlockDriverState *bs,
         BlockDriverCompletionFunc *cb, void *opaque);
+    /* batch AIO submission, see bdrv_io_plug() */
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
     int (*bdrv_discard)(BlockDriverState *bs, int64_t sector_num,
                         int nb_sectors);
 
@@ -87,6 +102,11 @@ struct BlockDriver {
     int64_t (*bdrv_getlength)(BlockDriverState *bs);
     int (*bdrv_write_compressed)(BlockDriverState *bs, int64_t sector_num,
                                  const uint8_t *buf, int nb_sectors);
+    /* like bdrv_write_compressed, but the caller has already deflated buf
+       into zbuf (no zlib header, 4k window); zlen is 0 if it didn't fit */
+    int (*bdrv_write_deflated)(BlockDriverState *bs, int64_t sector_num,
+                               const uint8_t *buf, int nb_sectors,
+                               const uint8_t *zbuf, int zlen);
 
     int (*bdrv_snapshot_create)(BlockDriverState *bs,
                                 QEMUSnapshotInfo *sn_info);
@@ -103,6 +123,8 @@ struct BlockDriver {
                              int64_t pos, int size);
     int (*bdrv_load_vmstate)(BlockDriverState *bs, uint8_t *buf,
                              int64_t pos, int size);
+    int (*bdrv_map_vmstate)(BlockDriverState *bs, int64_t pos, int size,
+                            int64_t *file_offset);
 
     int (*bdrv_change_backing_file)(BlockDriverState *bs,
         const char *backing_file, const char *backing_fmt);
@@ -180,7 +202,20 @@ struct BlockDriverState {
     uint64_t wr_bytes;
     uint64_t rd_ops;
     uint64_t wr_ops;
+    uint64_t flush_ops;
     uint64_t wr_highest_sector;
+    uint64_t total_time_ns[BDRV_MAX_IOTYPE];
+    uint64_t latency[BDRV_MAX_IOTYPE][BDRV_LATENCY_BUCKETS];
+
+    /* Format metadata cache (qcow2).  metadata_cache_size is the memory
+       budget requested with -drive, 0 for the driver's default; the
+       statistics are only shown if metadata_cache_max is non-zero. */
+    int64_t metadata_cache_size;
+    uint64_t metadata_cache_max;
+    uint64_t metadata_cache_bytes;
+    uint64_t metadata_cache_hits;
+    uint64_t metadata_cache_misses;
+    uint64_t metadata_cache_readahead;
 
     /* Whether the disk can expand beyond total_sectors */
     int growable;
@@ -16,6 +16,8 @@
 #include "sysemu.h"
 #include "hw/qdev.h"
 #include "block_int.h"
+#include "qemu-timer.h"
+#include "qjson.h"
 
 static QTAILQ_HEAD(drivelist, DriveInfo) drives = QTAILQ_HEAD_INITIALIZER(drives);
 
@@ -237,6 +239,7 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     const char *devaddr;
     DriveInfo *dinfo;
     int snapshot = 0;
+    int64_t metadata_cache_size;
     int ret;
 
     translation = BIOS_ATA_TRANSLATION_AUTO;
@@ -353,6 +356,8 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     }
 #endif
 
+    metadata_cache_size = qemu_opt_get_size(opts, "metadata-cache-size", 0);
+
     if ((buf = qemu_opt_get(opts, "format")) != NULL) {
        if (strcmp(buf, "?") == 0) {
            error_printf("Supported formats:");
@@ -473,6 +478,7 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi)
     QTAILQ_INSERT_TAIL(&drives, dinfo, next);
 
     bdrv_set_on_error(dinfo->bdrv, on_read_error, on_write_error);
+    bdrv_set_metadata_cache_size(dinfo->bdrv, metadata_cache_size);
 
     switch(type) {
     case IF_IDE:
@@ -805,3 +811,47 @@ int do_block_resize(Monitor *mon, const QDict *qdict, QObject **ret_data)
 
     return 0;
 }
+
+/* Periodic dump of the block statistics, see -blockstats-log */
+static FILE *blockstats_log;
+static QEMUTimer *blockstats_log_timer;
+static int64_t blockstats_log_interval;
+
+static void blockstats_log_tick(void *opaque)
+{
+    QObject *data;
+    QString *json;
+
+    bdrv_info_stats(NULL, &data);
+    json = qobject_to_json(data);
+    fprintf(blockstats_log, "{\"host_ms\": %" PRId64 ", \"vm_ns\": %" PRId64
+            ", \"devices\": %s}\n", qemu_get_clock_ms(rt_clock),
+            qemu_get_clock_ns(vm_clock), qstring_get_str(json));
+    fflush(blockstats_log);
+    QDECREF(json);
+    qobject_decref(data);
+
+    qemu_mod_timer(blockstats_log_timer,
+                   qemu_get_clock_ms(rt_clock) + blockstats_log_interval);
+}
+
+/* Append the output of query-blockstats to filename as one JSON line
+   every interval_ms milliseconds of host time */
+int blockstats_log_start(const char *filename, int64_t interval_ms)
+{
+    if (blockstats_log) {
+        fclose(blockstats_log);
+    }
+    blockstats_log = fopen(filename, "a");
+    if (!blockstats_log) {
+        return -errno;
+    }
+    blockstats_log_interval = interval_ms;
+    if (!blockstats_log_timer) {
+        blockstats_log_timer = qemu_new_timer_ms(rt_clock,
+                                                 blockstats_log_tick, NULL);
+    }
+    qemu_mod_timer(blockstats_log_timer,
+                   qemu_get_clock_ms(rt_clock) + blockstats_log_interval);
+    return 0;
+}
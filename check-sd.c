@@ -0,0 +1,346 @@
+/*
+ * SD card block transfer tests
+ *
+ * Runs the same single and multiple block reads and writes (CMD17, CMD18,
+ * CMD24 and CMD25) on two cards with identical images, one through
+ * sd_read_data/sd_write_data a byte at a time and the other through
+ * sd_read_blocks/sd_write_blocks, and checks that the data, the card
+ * status and the images come out the same.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "qemu-common.h"
+#include "block.h"
+#include "hw/irq.h"
+#include "hw/sd.h"
+#include "sysemu.h"
+
+#define IMAGE_SIZE      (4 << 20)
+#define GUEST_RAM_SIZE  (256 << 10)
+#define MAX_BLOCKS      (GUEST_RAM_SIZE / 512)
+
+typedef struct {
+    char filename[32];
+    BlockDriverState *bs;
+    SDState *sd;
+} Card;
+
+static Card byte_card, block_card;
+static uint8_t guest_ram[GUEST_RAM_SIZE];
+static uint8_t byte_buf[GUEST_RAM_SIZE];
+static uint8_t block_buf[512];
+static int failed;
+
+static VMChangeStateHandler *state_cb[2];
+static void *state_opaque[2];
+static int nb_state_cbs;
+
+/* The sd code and the DMA helpers only see guest memory through these */
+void *cpu_physical_memory_map(target_phys_addr_t addr,
+                              target_phys_addr_t *plen,
+                              int is_write)
+{
+    if (addr >= GUEST_RAM_SIZE) {
+        return NULL;
+    }
+    if (*plen > GUEST_RAM_SIZE - addr) {
+        *plen = GUEST_RAM_SIZE - addr;
+    }
+    return guest_ram + addr;
+}
+
+void cpu_physical_memory_unmap(void *buffer, target_phys_addr_t len,
+                               int is_write, target_phys_addr_t access_len)
+{
+}
+
+void *cpu_register_map_client(void *opaque, void (*callback)(void *opaque))
+{
+    return NULL;
+}
+
+void qemu_set_irq(qemu_irq irq, int level)
+{
+}
+
+VMChangeStateEntry *qemu_add_vm_change_state_handler(VMChangeStateHandler *cb,
+                                                     void *opaque)
+{
+    state_cb[nb_state_cbs] = cb;
+    state_opaque[nb_state_cbs] = opaque;
+    nb_state_cbs++;
+    return NULL;
+}
+
+void qemu_add_exit_notifier(Notifier *notify)
+{
+}
+
+static void check(int cond, const char *what)
+{
+    if (!cond) {
+        fprintf(stderr, "check-sd: %s\n", what);
+        failed = 1;
+    }
+}
+
+static int command(Card *c, int cmd, uint32_t arg, uint8_t *response)
+{
+    SDRequest req;
+    uint8_t buf[16];
+
+    req.cmd = cmd;
+    req.arg = arg;
+    req.crc = 0;
+    return sd_do_command(c->sd, &req, response ? response : buf);
+}
+
+/* Both cards take the command; their responses must match */
+static void command_both(int cmd, uint32_t arg)
+{
+    uint8_t a[16], b[16];
+    int alen, blen;
+
+    alen = command(&byte_card, cmd, arg, a);
+    blen = command(&block_card, cmd, arg, b);
+    check(alen == blen && !memcmp(a, b, alen), "responses differ");
+}
+
+static void card_open(Card *c)
+{
+    uint8_t *buf = qemu_malloc(IMAGE_SIZE);
+    uint8_t response[16];
+    int fd, i;
+
+    strcpy(c->filename, "/tmp/check-sd.XXXXXX");
+    fd = mkstemp(c->filename);
+    if (fd < 0) {
+        perror("check-sd: mkstemp");
+        exit(1);
+    }
+    srand(1);
+    for (i = 0; i < IMAGE_SIZE; i++) {
+        buf[i] = rand();
+    }
+    if (write(fd, buf, IMAGE_SIZE) != IMAGE_SIZE) {
+        perror("check-sd: write");
+        exit(1);
+    }
+    close(fd);
+    qemu_free(buf);
+
+    c->bs = bdrv_new("");
+    if (bdrv_open(c->bs, c->filename, BDRV_O_RDWR, bdrv_find_format("raw"))) {
+        fprintf(stderr, "check-sd: could not open %s\n", c->filename);
+        exit(1);
+    }
+    c->sd = sd_init(c->bs, 0);
+
+    /* Identify and select the card, then use 512 byte blocks */
+    command(c, 0, 0, NULL);
+    command(c, 55, 0, NULL);
+    command(c, 41, 0x00ff8000, NULL);
+    command(c, 2, 0, NULL);
+    command(c, 3, 0, response);
+    command(c, 7, (response[0] << 24) | (response[1] << 16), NULL);
+    command(c, 16, 512, NULL);
+}
+
+static void card_close(Card *c)
+{
+    bdrv_delete(c->bs);
+    unlink(c->filename);
+}
+
+static void transfer_done(void *opaque, int ret)
+{
+    *(int *)opaque = ret < 0 ? ret : 1;
+}
+
+/* Move nblocks through the block interface, split over a few sg entries */
+static int transfer_blocks(int is_write, int nblocks)
+{
+    QEMUSGList sg;
+    int done = 0, ret, len = nblocks * 512;
+
+    qemu_sglist_init(&sg, 3);
+    if (len > 1536) {
+        qemu_sglist_add(&sg, 0, 1000);
+        qemu_sglist_add(&sg, 1000, 536);
+        qemu_sglist_add(&sg, 1536, len - 1536);
+    } else {
+        qemu_sglist_add(&sg, 0, len);
+    }
+    if (is_write) {
+        ret = sd_write_blocks(block_card.sd, &sg, transfer_done, &done);
+    } else {
+        ret = sd_read_blocks(block_card.sd, &sg, transfer_done, &done);
+    }
+    while (ret == 0 && !done) {
+        qemu_aio_wait();
+    }
+    qemu_sglist_destroy(&sg);
+    return ret < 0 ? ret : (done < 0 ? done : 0);
+}
+
+static void read_bytes(Card *c, uint8_t *buf, int nblocks)
+{
+    int i;
+
+    for (i = 0; i < nblocks * 512; i++) {
+        buf[i] = sd_read_data(c->sd);
+    }
+}
+
+static void write_bytes(Card *c, const uint8_t *buf, int nblocks)
+{
+    int i;
+
+    for (i = 0; i < nblocks * 512; i++) {
+        sd_write_data(c->sd, buf[i]);
+    }
+}
+
+static void fill(uint8_t *buf, int nblocks, int seed)
+{
+    int i;
+
+    for (i = 0; i < nblocks * 512; i++) {
+        buf[i] = seed + i * 7 + (i >> 9);
+    }
+}
+
+static void test_read(int cmd, uint32_t addr, int nblocks)
+{
+    command_both(cmd, addr);
+    memset(guest_ram, 0, sizeof(guest_ram));
+    check(transfer_blocks(0, nblocks) == 0, "sd_read_blocks failed");
+    read_bytes(&byte_card, byte_buf, nblocks);
+    check(!memcmp(guest_ram, byte_buf, nblocks * 512), "read data differs");
+    if (cmd == 18) {
+        /* Carry on through the byte interface from where the blocks
+           left the card */
+        check(sd_data_ready(block_card.sd), "card not ready after read");
+        read_bytes(&byte_card, byte_buf, 1);
+        read_bytes(&block_card, block_buf, 1);
+        check(!memcmp(block_buf, byte_buf, 512), "read data differs");
+        command_both(12, 0);
+    }
+    command_both(13, 0);
+}
+
+static void test_write(int cmd, uint32_t addr, int nblocks, int seed)
+{
+    command_both(cmd, addr);
+    fill(guest_ram, nblocks, seed);
+    write_bytes(&byte_card, guest_ram, nblocks);
+    check(transfer_blocks(1, nblocks) == 0, "sd_write_blocks failed");
+    if (cmd == 25) {
+        /* One more block through the byte interface on both cards */
+        fill(block_buf, 1, seed + 1);
+        write_bytes(&byte_card, block_buf, 1);
+        write_bytes(&block_card, block_buf, 1);
+        command_both(12, 0);
+    }
+    command_both(13, 0);
+}
+
+static void test_fallback(void)
+{
+    QEMUSGList sg;
+    int done = 0;
+
+    /* Not a whole number of blocks: the controller has to use the bytes */
+    command_both(17, 0);
+    qemu_sglist_init(&sg, 1);
+    qemu_sglist_add(&sg, 0, 100);
+    check(sd_read_blocks(block_card.sd, &sg, transfer_done, &done) < 0,
+          "sd_read_blocks took a partial block");
+    qemu_sglist_destroy(&sg);
+    check(transfer_blocks(0, 2) < 0, "sd_read_blocks took two blocks "
+          "for CMD17");
+    check(transfer_blocks(1, 1) < 0, "sd_write_blocks took a read command");
+    read_bytes(&byte_card, byte_buf, 1);
+    read_bytes(&block_card, block_buf, 1);
+    check(!memcmp(block_buf, byte_buf, 512), "read data differs");
+    command_both(13, 0);
+}
+
+/* Blocks gathered from the byte interface must be on the image once the
+   VM stops, even in the middle of a CMD25 */
+static void test_stop(uint32_t addr, int nblocks, int seed)
+{
+    uint8_t buf[512];
+    int i;
+
+    command_both(25, addr);
+    fill(byte_buf, nblocks, seed);
+    write_bytes(&byte_card, byte_buf, nblocks);
+    write_bytes(&block_card, byte_buf, nblocks);
+    for (i = 0; i < nb_state_cbs; i++) {
+        state_cb[i](state_opaque[i], 0, 0);
+    }
+    for (i = 0; i < nblocks; i++) {
+        if (bdrv_read(byte_card.bs, (addr >> 9) + i, buf, 1) < 0 ||
+            memcmp(buf, byte_buf + i * 512, 512)) {
+            check(0, "gathered blocks not written on stop");
+            break;
+        }
+    }
+    command_both(12, 0);
+    command_both(13, 0);
+}
+
+static void compare_images(void)
+{
+    uint8_t a[4096], b[4096];
+    int64_t sector;
+
+    for (sector = 0; sector < IMAGE_SIZE / 512; sector += 8) {
+        if (bdrv_read(byte_card.bs, sector, a, 8) < 0 ||
+            bdrv_read(block_card.bs, sector, b, 8) < 0) {
+            check(0, "image read failed");
+            return;
+        }
+        if (memcmp(a, b, sizeof(a))) {
+            check(0, "images differ");
+            return;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    bdrv_init();
+    card_open(&byte_card);
+    card_open(&block_card);
+
+    test_read(17, 0, 1);
+    test_read(17, 0x3e00, 1);
+    test_read(18, 0x1000, 8);
+    test_read(18, 0x20000, MAX_BLOCKS);
+    test_write(24, 0x800, 1, 1);
+    test_write(25, 0x10000, 5, 2);
+    test_write(25, 0x100000, MAX_BLOCKS, 3);
+    test_read(18, 0x10000, 6);
+    test_write(24, IMAGE_SIZE - 512, 1, 4);
+    test_read(17, IMAGE_SIZE - 512, 1);
+    test_read(18, IMAGE_SIZE - 1024, 1);
+    test_stop(0x30000, 3, 5);
+    test_fallback();
+    compare_images();
+
+    card_close(&byte_card);
+    card_close(&block_card);
+    if (failed) {
+        return 1;
+    }
+    printf("check-sd: ok\n");
+    return 0;
+}
@@ -177,8 +177,16 @@ static int nb_consoles = 0;
 
 void vga_hw_update(void)
 {
-    if (active_console && active_console->hw_update)
+    DisplayState *ds;
+
+    if (active_console && active_console->hw_update) {
         active_console->hw_update(active_console->hw);
+        ds = active_console->ds;
+        if (ds->frame_updated) {
+            ds->frame_updated = 0;
+            ds->frames++;
+        }
+    }
 }
 
 void vga_hw_invalidate(void)
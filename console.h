@@ -187,6 +187,9 @@ struct DisplayState {
     void (*mouse_set)(int x, int y, int on);
     void (*cursor_define)(QEMUCursor *cursor);
 
+    uint64_t frames; /* refreshes that found the screen changed */
+    int frame_updated;
+
     struct DisplayState *next;
 };
 
@@ -236,9 +239,22 @@ static inline void register_displaychangelistener(DisplayState *ds, DisplayChang
     ds->listeners = dcl;
 }
 
+static inline void unregister_displaychangelistener(DisplayState *ds, DisplayChangeListener *dcl)
+{
+    DisplayChangeListener **p;
+
+    for (p = &ds->listeners; *p; p = &(*p)->next) {
+        if (*p == dcl) {
+            *p = dcl->next;
+            break;
+        }
+    }
+}
+
 static inline void dpy_update(DisplayState *s, int x, int y, int w, int h)
 {
     struct DisplayChangeListener *dcl = s->listeners;
+    s->frame_updated = 1;
     while (dcl != NULL) {
         dcl->dpy_update(s, x, y, w, h);
         dcl = dcl->next;
@@ -394,6 +410,13 @@ void sdl_display_init(DisplayState *ds, int full_screen, int no_frame);
 /* cocoa.m */
 void cocoa_display_init(DisplayState *ds, int full_screen);
 
+/* record.c */
+int record_start(DisplayState *ds, const char *filename, const char *format,
+                 int fps);
+void record_stop(void);
+void do_info_record_print(Monitor *mon, const QObject *data);
+void do_info_record(Monitor *mon, QObject **ret_data);
+
 /* vnc.c */
 void vnc_display_init(DisplayState *ds);
 void vnc_display_close(DisplayState *ds);
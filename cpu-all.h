@@ -886,6 +886,9 @@ extern RAMList ram_list;
 
 extern const char *mem_path;
 extern int mem_prealloc;
+extern const char *mem_template;
+
+char *qemu_ram_template_file(const char *dir, const char *idstr);
 
 /* physical memory access */
 
@@ -970,6 +973,11 @@ int cpu_physical_log_stop(target_phys_addr_t start_addr,
                           ram_addr_t size);
 
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf);
+void dump_tb_profile(FILE *f, fprintf_function cpu_fprintf);
+#if !defined(CONFIG_USER_ONLY)
+void dump_tlb_stats(FILE *f, fprintf_function cpu_fprintf);
+int tlb_get_ram_pages(ram_addr_t *addrs, int max);
+#endif
 #endif /* !CONFIG_USER_ONLY */
 
 int cpu_memory_rw_debug(CPUState *env, target_ulong addr,
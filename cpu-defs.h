@@ -110,16 +110,44 @@ typedef struct CPUTLBEntry {
 
 extern int CPUTLBEntry_wrong_size[sizeof(CPUTLBEntry) == (1 << CPU_TLB_ENTRY_BITS) ? 1 : -1];
 
+/* The direct mapped TLB size is baked into the generated code, so the
+   per-CPU adaptive part is a fully associative victim TLB that catches
+   entries evicted by conflicts.  Its active size moves between
+   CPU_VTLB_MIN_SIZE and CPU_VTLB_SIZE according to the miss rate.  */
+#define CPU_VTLB_SIZE 64
+#define CPU_VTLB_MIN_SIZE 8
+
+typedef struct CPUTLBStats {
+    uint64_t lookups;      /* direct mapped TLB misses (slow path) */
+    uint64_t victim_hits;  /* slow path lookups served by the victim TLB */
+    uint64_t fills;        /* lookups that needed tlb_fill() */
+    uint64_t flushes;      /* full TLB flushes */
+    uint64_t page_flushes; /* single page flushes */
+    uint64_t resizes;      /* victim TLB size changes */
+    /* current sampling window */
+    uint32_t window_lookups;
+    uint32_t window_fills;
+    uint32_t window_upper_hits;
+} CPUTLBStats;
+
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
     target_phys_addr_t iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
     target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;
+    target_ulong tlb_flush_mask;                                        \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    target_phys_addr_t iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];            \
+    unsigned int vtlb_index; /* next victim slot to replace */
+
+#define CPU_COMMON_TLB_STATE \
+    unsigned int vtlb_size; /* active victim TLB entries */            \
+    CPUTLBStats tlb_stats;
 
 #else
 
 #define CPU_COMMON_TLB
+#define CPU_COMMON_TLB_STATE
 
 #endif
 
@@ -191,6 +219,13 @@ typedef struct CPUWatchpoint {
     CPUWatchpoint *watchpoint_hit;                                      \
                                                                         \
     struct GDBRegisterState *gdb_regs;                                  \
+    int gdb_stopped; /* stopped on its own in gdb non-stop mode */      \
+    int gdb_stop_pending; /* stop not yet reported to gdb */            \
+    int gdb_stop_request; /* vCont;t waiting for it to leave its TB */  \
+    int gdb_stop_signal;                                                \
+    uint64_t tb_dispatches; /* TBs entered from the cpu_exec loop */    \
+                                                                        \
+    CPU_COMMON_TLB_STATE                                                \
                                                                         \
     /* Core interrupt code */                                           \
     jmp_buf jmp_env;                                                    \
@@ -196,6 +196,36 @@ static inline TranslationBlock *tb_find_fast(void)
     return tb;
 }
 
+/* Called from generated code at the end of a TB whose successor is only
+   known at run time (indirect branches).  Returns the host code of the
+   next TB if it is in the jump cache, or NULL to go back to the main loop
+   which also handles the cases that need translation or an interrupt.  */
+void *tb_find_indirect(void)
+{
+    TranslationBlock *tb;
+    target_ulong cs_base, pc;
+    int flags;
+
+    cpu_get_tb_cpu_state(env, &pc, &cs_base, &flags);
+    tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
+    if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
+                 tb->flags != flags)) {
+        return NULL;
+    }
+    /* Make the TB current before looking at the exit conditions, so that
+       cpu_exit() either unlinks it or we see its request.  */
+    env->current_tb = tb;
+    barrier();
+    if (unlikely(env->exit_request || env->interrupt_request)) {
+        return NULL;
+    }
+#ifdef CONFIG_DEBUG_EXEC
+    qemu_log_mask(CPU_LOG_EXEC, "Trace 0x%08lx [" TARGET_FMT_lx "] %s\n",
+                  (long)tb->tc_ptr, tb->pc, lookup_symbol(tb->pc));
+#endif
+    return tb->tc_ptr;
+}
+
 static CPUDebugExcpHandler *debug_excp_handler;
 
 CPUDebugExcpHandler *cpu_set_debug_excp_handler(CPUDebugExcpHandler *handler)
@@ -586,6 +616,7 @@ int cpu_exec(CPUState *env1)
 #endif /* DEBUG_DISAS || CONFIG_DEBUG_EXEC */
                 spin_lock(&tb_lock);
                 tb = tb_find_fast();
+                env->tb_dispatches++;
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
                 if (tb_invalidated_flag) {
@@ -649,6 +680,14 @@ int cpu_exec(CPUState *env1)
                             next_tb = 0;
                             cpu_loop_exit();
                         }
+                    } else if ((next_tb & 3) == 3) {
+                        /* TB became hot before executing anything.  */
+                        tb = (TranslationBlock *)(long)(next_tb & ~3);
+                        cpu_pc_from_tb(env, tb);
+                        spin_lock(&tb_lock);
+                        tb_gen_hot(env, tb);
+                        spin_unlock(&tb_lock);
+                        next_tb = 0;
                     }
                 }
                 env->current_tb = NULL;
@@ -134,7 +134,7 @@ static int cpu_can_run(CPUState *env)
     if (env->stop) {
         return 0;
     }
-    if (env->stopped || !vm_running) {
+    if (env->stopped || env->gdb_stopped || !vm_running) {
         return 0;
     }
     return 1;
@@ -142,10 +142,10 @@ static int cpu_can_run(CPUState *env)
 
 static bool cpu_thread_is_idle(CPUState *env)
 {
-    if (env->stop || env->queued_work_first) {
+    if (env->stop || env->queued_work_first || env->gdb_stop_request) {
         return false;
     }
-    if (env->stopped || !vm_running) {
+    if (env->stopped || env->gdb_stopped || !vm_running) {
         return true;
     }
     if (!env->halted || qemu_cpu_has_work(env) ||
@@ -155,7 +155,7 @@ static bool cpu_thread_is_idle(CPUState *env)
     return true;
 }
 
-static bool all_cpu_threads_idle(void)
+bool all_cpu_threads_idle(void)
 {
     CPUState *env;
 
@@ -169,6 +169,10 @@ static bool all_cpu_threads_idle(void)
 
 static void cpu_handle_guest_debug(CPUState *env)
 {
+    if (gdb_stop_cpu(env)) {
+        /* gdb non-stop mode, the other CPUs keep going */
+        return;
+    }
     gdb_set_stop_cpu(env);
     qemu_system_debug_request();
 #ifdef CONFIG_IOTHREAD
@@ -800,6 +804,8 @@ static void *qemu_kvm_cpu_thread_fn(void *arg)
             r = kvm_cpu_exec(env);
             if (r == EXCP_DEBUG) {
                 cpu_handle_guest_debug(env);
+            } else if (env->gdb_stop_request) {
+                gdb_stop_request_done(env);
             }
         }
         qemu_kvm_wait_io_event(env);
@@ -1095,6 +1101,9 @@ bool cpu_exec_all(void)
                 cpu_handle_guest_debug(env);
                 break;
             }
+            if (env->gdb_stop_request) {
+                gdb_stop_request_done(env);
+            }
         } else if (env->stop || env->stopped) {
             break;
         }
@@ -333,6 +333,94 @@ const char *lookup_symbol(target_ulong orig_addr)
     return symbol;
 }
 
+/* Symbols read from an nm style text file by load_symbol_file().  */
+struct text_sym {
+    target_ulong addr;
+    char *name;
+};
+
+struct text_syminfo {
+    struct syminfo info;
+    struct text_sym *syms;
+    int nb_syms;
+};
+
+static int text_sym_cmp(const void *a, const void *b)
+{
+    const struct text_sym *sa = a, *sb = b;
+
+    if (sa->addr < sb->addr) {
+        return -1;
+    }
+    return sa->addr > sb->addr;
+}
+
+#if defined(CONFIG_USER_ONLY)
+static const char *lookup_text_symbol(struct syminfo *s, target_ulong orig_addr)
+#else
+static const char *lookup_text_symbol(struct syminfo *s,
+                                      target_phys_addr_t orig_addr)
+#endif
+{
+    struct text_syminfo *ts = container_of(s, struct text_syminfo, info);
+    int lo = 0, hi = ts->nb_syms - 1, mid;
+
+    if (hi < 0 || orig_addr < ts->syms[0].addr) {
+        return "";
+    }
+    /* the closest symbol at or below orig_addr */
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (ts->syms[mid].addr <= orig_addr) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return ts->syms[lo].name;
+}
+
+/* Load guest symbols from a text file with "address [type] name" lines, as
+   printed by nm.  Symbols without a size are assumed to extend up to the
+   next one.  Returns the number of symbols or -1 on error.  */
+int load_symbol_file(const char *filename)
+{
+    struct text_syminfo *ts;
+    char line[1024], *tok[3], *p;
+    int n, nb_alloc = 0;
+    FILE *f;
+
+    f = fopen(filename, "r");
+    if (!f) {
+        return -1;
+    }
+    ts = qemu_mallocz(sizeof(*ts));
+    while (fgets(line, sizeof(line), f)) {
+        n = 0;
+        for (p = strtok(line, " \t\r\n"); p && n < 3;
+             p = strtok(NULL, " \t\r\n")) {
+            tok[n++] = p;
+        }
+        if (n < 2) {
+            continue;
+        }
+        if (ts->nb_syms == nb_alloc) {
+            nb_alloc = nb_alloc ? nb_alloc * 2 : 256;
+            ts->syms = qemu_realloc(ts->syms, nb_alloc * sizeof(*ts->syms));
+        }
+        ts->syms[ts->nb_syms].addr = strtoull(tok[0], NULL, 16);
+        ts->syms[ts->nb_syms].name = qemu_strdup(tok[n - 1]);
+        ts->nb_syms++;
+    }
+    fclose(f);
+
+    qsort(ts->syms, ts->nb_syms, sizeof(*ts->syms), text_sym_cmp);
+    ts->info.lookup_symbol = lookup_text_symbol;
+    ts->info.next = syminfos;
+    syminfos = &ts->info;
+    return ts->nb_syms;
+}
+
 #if !defined(CONFIG_USER_ONLY)
 
 #include "monitor.h"
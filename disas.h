@@ -15,6 +15,9 @@ void monitor_disas(Monitor *mon, CPUState *env,
 const char *lookup_symbol(target_ulong orig_addr);
 #endif
 
+/* Load guest symbols from an nm style text file.  */
+int load_symbol_file(const char *filename);
+
 struct syminfo;
 struct elf32_sym;
 struct elf64_sym;
@@ -33,6 +33,7 @@
 #include "osdep.h"
 #include "kvm.h"
 #include "qemu-timer.h"
+#include "disas.h"
 #if defined(CONFIG_USER_ONLY)
 #include <qemu.h>
 #include <signal.h>
@@ -75,7 +76,6 @@
 static TranslationBlock *tbs;
 static int code_gen_max_blocks;
 TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
-static int nb_tbs;
 /* any access to the tbs or the page table must use this lock */
 spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
 
@@ -98,9 +98,31 @@ spinlock_t tb_lock = SPIN_LOCK_UNLOCKED;
 uint8_t code_gen_prologue[1024] code_gen_section;
 static uint8_t *code_gen_buffer;
 static unsigned long code_gen_buffer_size;
-/* threshold to flush the translated code buffer */
-static unsigned long code_gen_buffer_max_size;
-static uint8_t *code_gen_ptr;
+
+/* The code buffer and tbs[] are split into regions which are filled in
+   turn.  When the current region is full, the next one (the oldest) is
+   emptied by invalidating only its TBs, instead of flushing everything.
+   With hot TB detection on, the last region is the survivor region: it
+   holds the superblocks of hot TBs and is only emptied when it fills up
+   itself.  Small buffers use a single region, which is flushed as a
+   whole.  */
+#define CODE_GEN_MAX_REGIONS 8
+
+typedef struct CodeGenRegion {
+    uint8_t *buffer;
+    uint8_t *ptr;               /* next free byte of the region */
+    TranslationBlock *tbs;
+    int nb_tbs;
+} CodeGenRegion;
+
+static CodeGenRegion code_gen_regions[CODE_GEN_MAX_REGIONS];
+static int nb_code_gen_regions;
+static int code_gen_survivor;   /* 1 if the last region is the survivor */
+static int code_gen_cur_region;
+static unsigned long code_gen_region_size;
+/* threshold to move on to the next region */
+static unsigned long code_gen_region_max_size;
+static int code_gen_region_max_blocks;
 
 #if !defined(CONFIG_USER_ONLY)
 int phys_ram_fd;
@@ -217,8 +239,17 @@ static int log_append = 0;
 /* statistics */
 #if !defined(CONFIG_USER_ONLY)
 static int tlb_flush_count;
+static int tb_hot_count;
+/* number of executions after which a TB is retranslated as a superblock,
+   0 to disable */
+int tb_hot_threshold;
+/* count executions of new TBs for the TB profile */
+int tb_profiling;
+/* perf map of the generated code, see tb_perf_map_open() */
+static FILE *perf_map_file;
 #endif
 static int tb_flush_count;
+static int tb_region_evict_count;
 static int tb_phys_invalidate_count;
 
 #ifdef _WIN32
@@ -457,6 +488,36 @@ static uint8_t static_code_gen_buffer[DEFAULT_CODE_GEN_BUFFER_SIZE]
                __attribute__((aligned (CODE_GEN_ALIGN)));
 #endif
 
+static void code_gen_regions_init(void)
+{
+    unsigned long max_block_size = TCG_MAX_OP_SIZE * OPC_MAX_SIZE;
+    CodeGenRegion *r;
+    int i;
+
+    /* a region must hold many blocks, and the ring needs at least two
+       regions besides the survivor region, if any */
+    code_gen_survivor = tb_hot_threshold > 0;
+    nb_code_gen_regions = code_gen_buffer_size / (8 * max_block_size);
+    if (nb_code_gen_regions > CODE_GEN_MAX_REGIONS) {
+        nb_code_gen_regions = CODE_GEN_MAX_REGIONS;
+    } else if (nb_code_gen_regions < 2 + code_gen_survivor) {
+        nb_code_gen_regions = 1;
+        code_gen_survivor = 0;
+    }
+    code_gen_region_size = (code_gen_buffer_size / nb_code_gen_regions) &
+        ~(CODE_GEN_ALIGN - 1);
+    code_gen_region_max_size = code_gen_region_size - max_block_size;
+    code_gen_region_max_blocks = code_gen_max_blocks / nb_code_gen_regions;
+    for (i = 0; i < nb_code_gen_regions; i++) {
+        r = &code_gen_regions[i];
+        r->buffer = code_gen_buffer + i * code_gen_region_size;
+        r->ptr = r->buffer;
+        r->tbs = tbs + i * code_gen_region_max_blocks;
+        r->nb_tbs = 0;
+    }
+    code_gen_cur_region = 0;
+}
+
 static void code_gen_alloc(unsigned long tb_size)
 {
 #ifdef USE_STATIC_CODE_GEN_BUFFER
@@ -553,10 +614,9 @@ static void code_gen_alloc(unsigned long tb_size)
 #endif
 #endif /* !USE_STATIC_CODE_GEN_BUFFER */
     map_exec(code_gen_prologue, sizeof(code_gen_prologue));
-    code_gen_buffer_max_size = code_gen_buffer_size - 
-        (TCG_MAX_OP_SIZE * OPC_MAX_SIZE);
     code_gen_max_blocks = code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
     tbs = qemu_malloc(code_gen_max_blocks * sizeof(TranslationBlock));
+    code_gen_regions_init();
 }
 
 /* Must be called before using the QEMU cpus. 'tb_size' is the size
@@ -566,7 +626,6 @@ void cpu_exec_init_all(unsigned long tb_size)
 {
     cpu_gen_init();
     code_gen_alloc(tb_size);
-    code_gen_ptr = code_gen_buffer;
     page_init();
 #if !defined(CONFIG_USER_ONLY)
     io_mem_init();
@@ -652,29 +711,42 @@ void cpu_exec_init(CPUState *env)
 #endif
 }
 
-/* Allocate a new translation block. Flush the translation buffer if
-   too many translation blocks or too much generated code. */
-static TranslationBlock *tb_alloc(target_ulong pc)
+/* Return the region new code with these cflags is generated into. */
+static inline CodeGenRegion *tb_region(int cflags)
+{
+    if ((cflags & CF_HOT) && code_gen_survivor) {
+        return &code_gen_regions[nb_code_gen_regions - 1];
+    }
+    return &code_gen_regions[code_gen_cur_region];
+}
+
+/* Allocate a new translation block in region 'r'. Return NULL if the
+   region has too many translation blocks or too much generated code. */
+static TranslationBlock *tb_alloc(CodeGenRegion *r, target_ulong pc)
 {
     TranslationBlock *tb;
 
-    if (nb_tbs >= code_gen_max_blocks ||
-        (code_gen_ptr - code_gen_buffer) >= code_gen_buffer_max_size)
+    if (r->nb_tbs >= code_gen_region_max_blocks ||
+        (r->ptr - r->buffer) >= code_gen_region_max_size)
         return NULL;
-    tb = &tbs[nb_tbs++];
+    tb = &r->tbs[r->nb_tbs++];
     tb->pc = pc;
     tb->cflags = 0;
+    tb->exec_count = 0;
     return tb;
 }
 
 void tb_free(TranslationBlock *tb)
 {
+    CodeGenRegion *r;
+
     /* In practice this is mostly used for single use temporary TB
        Ignore the hard cases and just back up if this TB happens to
        be the last one generated.  */
-    if (nb_tbs > 0 && tb == &tbs[nb_tbs - 1]) {
-        code_gen_ptr = tb->tc_ptr;
-        nb_tbs--;
+    r = &code_gen_regions[(tb - tbs) / code_gen_region_max_blocks];
+    if (r->nb_tbs > 0 && tb == &r->tbs[r->nb_tbs - 1]) {
+        r->ptr = tb->tc_ptr;
+        r->nb_tbs--;
     }
 }
 
@@ -723,16 +795,24 @@ static void page_flush_tb(void)
 void tb_flush(CPUState *env1)
 {
     CPUState *env;
+    CodeGenRegion *r;
+    int i;
+
+    for (i = 0; i < nb_code_gen_regions; i++) {
+        r = &code_gen_regions[i];
 #if defined(DEBUG_FLUSH)
-    printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
-           (unsigned long)(code_gen_ptr - code_gen_buffer),
-           nb_tbs, nb_tbs > 0 ?
-           ((unsigned long)(code_gen_ptr - code_gen_buffer)) / nb_tbs : 0);
+        printf("qemu: flush region=%d code_size=%ld nb_tbs=%d "
+               "avg_tb_size=%ld\n",
+               i, (unsigned long)(r->ptr - r->buffer),
+               r->nb_tbs, r->nb_tbs > 0 ?
+               ((unsigned long)(r->ptr - r->buffer)) / r->nb_tbs : 0);
 #endif
-    if ((unsigned long)(code_gen_ptr - code_gen_buffer) > code_gen_buffer_size)
-        cpu_abort(env1, "Internal error: code buffer overflow\n");
-
-    nb_tbs = 0;
+        if ((unsigned long)(r->ptr - r->buffer) > code_gen_region_size)
+            cpu_abort(env1, "Internal error: code buffer overflow\n");
+        r->nb_tbs = 0;
+        r->ptr = r->buffer;
+    }
+    code_gen_cur_region = 0;
 
     for(env = first_cpu; env != NULL; env = env->next_cpu) {
         memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
@@ -741,7 +821,6 @@ void tb_flush(CPUState *env1)
     memset (tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof (void *));
     page_flush_tb();
 
-    code_gen_ptr = code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tb_flush_count++;
@@ -964,33 +1043,136 @@ static void build_page_bitmap(PageDesc *p)
     }
 }
 
+/* Tell perf which guest code the host range of a new TB belongs to.  The
+   format is one "start size name" line per range, see perf's
+   tools/perf/Documentation/jit-interface.txt.  */
+static void tb_perf_map_add(TranslationBlock *tb, int code_size)
+{
+    const char *symbol = lookup_symbol(tb->pc);
+
+    fprintf(perf_map_file, "%lx %x %s%sTB@0x" TARGET_FMT_lx "%s\n",
+            (unsigned long)tb->tc_ptr, code_size,
+            symbol, symbol[0] ? " " : "", tb->pc,
+            (tb->cflags & CF_HOT) ? " (hot)" : "");
+}
+
+/* Open /tmp/perf-<pid>.map and describe all TBs generated from now on.  */
+int tb_perf_map_open(void)
+{
+    char path[64];
+
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+    perf_map_file = fopen(path, "w");
+    if (!perf_map_file) {
+        return -errno;
+    }
+    /* perf may read the map while we are still running */
+    setvbuf(perf_map_file, NULL, _IOLBF, 0);
+    return 0;
+}
+
+/* Start or stop counting TB executions.  Existing TBs are flushed so that
+   all the code is retranslated with (or without) the counters.  */
+void tb_set_profiling(int enable)
+{
+    CPUState *env;
+
+    enable = !!enable;
+    if (tb_profiling == enable) {
+        return;
+    }
+    tb_profiling = enable;
+    if (first_cpu) {
+        tb_flush(first_cpu);
+    }
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        cpu_exit(env);
+    }
+}
+
+/* Return true if 'tb' was not invalidated since it was generated. */
+static int tb_is_linked(TranslationBlock *tb)
+{
+    TranslationBlock *tb1;
+    tb_page_addr_t phys_pc;
+
+    phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
+    for (tb1 = tb_phys_hash[tb_phys_hash_func(phys_pc)]; tb1 != NULL;
+         tb1 = tb1->phys_hash_next) {
+        if (tb1 == tb) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Empty a region: its TBs are invalidated, which also unlinks the
+   chained jumps from other regions into them. */
+static void tb_region_evict(CodeGenRegion *r)
+{
+    int i;
+
+    for (i = 0; i < r->nb_tbs; i++) {
+        if (tb_is_linked(&r->tbs[i])) {
+            tb_phys_invalidate(&r->tbs[i], -1);
+        }
+    }
+    r->nb_tbs = 0;
+    r->ptr = r->buffer;
+    tb_region_evict_count++;
+}
+
+/* Make room in the full region 'r'.  The normal regions are used as a
+   ring, so the region evicted is the one with the oldest code. */
+static void tb_region_full(CPUState *env, CodeGenRegion *r)
+{
+    int nb_ring = nb_code_gen_regions - code_gen_survivor;
+
+    if (nb_code_gen_regions == 1) {
+        tb_flush(env);
+    } else if (code_gen_survivor && r == &code_gen_regions[nb_ring]) {
+        tb_region_evict(r);
+    } else {
+        code_gen_cur_region = (code_gen_cur_region + 1) % nb_ring;
+        tb_region_evict(&code_gen_regions[code_gen_cur_region]);
+    }
+}
+
 TranslationBlock *tb_gen_code(CPUState *env,
                               target_ulong pc, target_ulong cs_base,
                               int flags, int cflags)
 {
     TranslationBlock *tb;
+    CodeGenRegion *r;
     uint8_t *tc_ptr;
     tb_page_addr_t phys_pc, phys_page2;
     target_ulong virt_page2;
     int code_gen_size;
 
     phys_pc = get_page_addr_code(env, pc);
-    tb = tb_alloc(pc);
+    r = tb_region(cflags);
+    tb = tb_alloc(r, pc);
     if (!tb) {
-        /* flush must be done */
-        tb_flush(env);
+        tb_region_full(env, r);
         /* cannot fail at this point */
-        tb = tb_alloc(pc);
+        r = tb_region(cflags);
+        tb = tb_alloc(r, pc);
         /* Don't forget to invalidate previous TB info.  */
         tb_invalidated_flag = 1;
     }
-    tc_ptr = code_gen_ptr;
+    tc_ptr = r->ptr;
     tb->tc_ptr = tc_ptr;
     tb->cs_base = cs_base;
     tb->flags = flags;
+    if (tb_profiling && !(cflags & (CF_COUNT_MASK | CF_LAST_IO))) {
+        cflags |= CF_PROFILE;
+    }
     tb->cflags = cflags;
     cpu_gen_code(env, tb, &code_gen_size);
-    code_gen_ptr = (void *)(((unsigned long)code_gen_ptr + code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+    r->ptr = (void *)(((unsigned long)r->ptr + code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+    if (perf_map_file) {
+        tb_perf_map_add(tb, code_gen_size);
+    }
 
     /* check next page if needed */
     virt_page2 = (pc + tb->size - 1) & TARGET_PAGE_MASK;
@@ -1002,6 +1184,25 @@ TranslationBlock *tb_gen_code(CPUState *env,
     return tb;
 }
 
+/* Replace a TB that reached tb_hot_threshold executions by a superblock.
+   The new translation follows direct branches within the page, so that
+   the hot path is register allocated as a single block.  Jumps into the
+   old TB are unlinked by the invalidation and will chain to the new one
+   on their next exit.  */
+void tb_gen_hot(CPUState *env, TranslationBlock *tb)
+{
+    target_ulong pc = tb->pc;
+    target_ulong cs_base = tb->cs_base;
+    int flags = tb->flags;
+    uint32_t exec_count = tb->exec_count;
+
+    tb_phys_invalidate(tb, -1);
+    tb = tb_gen_code(env, pc, cs_base, flags, CF_HOT);
+    tb->exec_count = exec_count;
+    env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)] = tb;
+    tb_hot_count++;
+}
+
 /* invalidate all TBs which intersect with the target physical page
    starting in range [start;end[. NOTE: start and end must refer to
    the same physical page. 'is_cpu_write_access' should be true if called
@@ -1302,18 +1503,22 @@ TranslationBlock *tb_find_pc(unsigned long tc_ptr)
     int m_min, m_max, m;
     unsigned long v;
     TranslationBlock *tb;
+    CodeGenRegion *r;
 
-    if (nb_tbs <= 0)
+    if (tc_ptr < (unsigned long)code_gen_buffer)
+        return NULL;
+    m = (tc_ptr - (unsigned long)code_gen_buffer) / code_gen_region_size;
+    if (m >= nb_code_gen_regions)
         return NULL;
-    if (tc_ptr < (unsigned long)code_gen_buffer ||
-        tc_ptr >= (unsigned long)code_gen_ptr)
+    r = &code_gen_regions[m];
+    if (r->nb_tbs <= 0 || tc_ptr >= (unsigned long)r->ptr)
         return NULL;
     /* binary search (cf Knuth) */
     m_min = 0;
-    m_max = nb_tbs - 1;
+    m_max = r->nb_tbs - 1;
     while (m_min <= m_max) {
         m = (m_min + m_max) >> 1;
-        tb = &tbs[m];
+        tb = &r->tbs[m];
         v = (unsigned long)tb->tc_ptr;
         if (v == tc_ptr)
             return tb;
@@ -1323,7 +1528,7 @@ TranslationBlock *tb_find_pc(unsigned long tc_ptr)
             m_min = m + 1;
         }
     }
-    return &tbs[m_max];
+    return &r->tbs[m_max];
 }
 
 static void tb_reset_jump_recursive(TranslationBlock *tb);
@@ -1925,6 +2130,9 @@ static CPUTLBEntry s_cputlb_empty_entry = {
     .addend     = -1,
 };
 
+/* Number of slow path lookups between two victim TLB size decisions.  */
+#define TLB_RESIZE_WINDOW 4096
+
 /* NOTE: if flush_global is true, also flush global entries (not
    implemented yet) */
 void tlb_flush(CPUState *env, int flush_global)
@@ -1944,26 +2152,139 @@ void tlb_flush(CPUState *env, int flush_global)
             env->tlb_table[mmu_idx][i] = s_cputlb_empty_entry;
         }
     }
+    for(i = 0; i < CPU_VTLB_SIZE; i++) {
+        int mmu_idx;
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            env->tlb_v_table[mmu_idx][i] = s_cputlb_empty_entry;
+        }
+    }
+    env->vtlb_index = 0;
+    if (env->vtlb_size == 0) {
+        env->vtlb_size = CPU_VTLB_MIN_SIZE;
+    }
 
     memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
 
     env->tlb_flush_addr = -1;
     env->tlb_flush_mask = 0;
+    env->tlb_stats.flushes++;
     tlb_flush_count++;
 }
 
+/* return true if the entry maps the page 'addr' for any kind of access */
+static inline int tlb_entry_match(CPUTLBEntry *tlb_entry, target_ulong addr)
+{
+    return addr == (tlb_entry->addr_read &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           addr == (tlb_entry->addr_write &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
+           addr == (tlb_entry->addr_code &
+                    (TARGET_PAGE_MASK | TLB_INVALID_MASK));
+}
+
+static inline int tlb_entry_is_valid(CPUTLBEntry *tlb_entry)
+{
+    return !(tlb_entry->addr_read & TLB_INVALID_MASK) ||
+           !(tlb_entry->addr_write & TLB_INVALID_MASK) ||
+           !(tlb_entry->addr_code & TLB_INVALID_MASK);
+}
+
 static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
-    if (addr == (tlb_entry->addr_read &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_write &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK)) ||
-        addr == (tlb_entry->addr_code &
-                 (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+    if (tlb_entry_match(tlb_entry, addr)) {
         *tlb_entry = s_cputlb_empty_entry;
     }
 }
 
+/* Grow the victim TLB when most slow path lookups still end up walking
+   the page tables, shrink it when its upper half did not produce a
+   single hit during the last window.  */
+static void tlb_victim_resize(CPUState *env)
+{
+    CPUTLBStats *stats = &env->tlb_stats;
+    unsigned int size = env->vtlb_size;
+    unsigned int i;
+    int mmu_idx;
+
+    if (stats->window_fills * 2 > stats->window_lookups) {
+        if (size < CPU_VTLB_SIZE) {
+            size *= 2;
+        }
+    } else if (stats->window_upper_hits == 0) {
+        if (size > CPU_VTLB_MIN_SIZE) {
+            size /= 2;
+        }
+    }
+    if (size != env->vtlb_size) {
+        /* entries beyond the new size are no longer searched, and must
+           not come back to life stale if the TLB grows again */
+        for (i = size; i < env->vtlb_size; i++) {
+            for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+                env->tlb_v_table[mmu_idx][i] = s_cputlb_empty_entry;
+            }
+        }
+        env->vtlb_size = size;
+        if (env->vtlb_index >= size) {
+            env->vtlb_index = 0;
+        }
+        stats->resizes++;
+    }
+    stats->window_lookups = 0;
+    stats->window_fills = 0;
+    stats->window_upper_hits = 0;
+}
+
+/* Called on a direct mapped TLB miss.  Search the victim TLB for the page
+   containing 'addr' and, on a hit, swap the entry back into the direct
+   mapped TLB.  Returns nonzero on a hit; otherwise the caller must call
+   tlb_fill().  */
+int tlb_victim_lookup(CPUState *env, target_ulong addr, int access_type,
+                      int mmu_idx)
+{
+    CPUTLBStats *stats = &env->tlb_stats;
+    unsigned int index, vidx;
+    target_ulong page, cmp;
+
+    stats->lookups++;
+    stats->window_lookups++;
+    page = addr & TARGET_PAGE_MASK;
+    index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    for (vidx = 0; vidx < env->vtlb_size; vidx++) {
+        CPUTLBEntry *vte = &env->tlb_v_table[mmu_idx][vidx];
+
+        if (access_type == 1) {
+            cmp = vte->addr_write;
+        } else if (access_type == 2) {
+            cmp = vte->addr_code;
+        } else {
+            cmp = vte->addr_read;
+        }
+        if (page == (cmp & (TARGET_PAGE_MASK | TLB_INVALID_MASK))) {
+            CPUTLBEntry tmp;
+            target_phys_addr_t iotmp;
+
+            tmp = env->tlb_table[mmu_idx][index];
+            env->tlb_table[mmu_idx][index] = *vte;
+            *vte = tmp;
+            iotmp = env->iotlb[mmu_idx][index];
+            env->iotlb[mmu_idx][index] = env->iotlb_v[mmu_idx][vidx];
+            env->iotlb_v[mmu_idx][vidx] = iotmp;
+
+            stats->victim_hits++;
+            if (vidx >= env->vtlb_size / 2) {
+                stats->window_upper_hits++;
+            }
+            return 1;
+        }
+    }
+    stats->fills++;
+    stats->window_fills++;
+    if (stats->window_lookups >= TLB_RESIZE_WINDOW) {
+        tlb_victim_resize(env);
+    }
+    return 0;
+}
+
 void tlb_flush_page(CPUState *env, target_ulong addr)
 {
     int i;
@@ -1991,7 +2312,15 @@ void tlb_flush_page(CPUState *env, target_ulong addr)
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++)
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
 
+    /* check whether there are entries that need to be flushed in the vtlb */
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        for (i = 0; i < env->vtlb_size; i++) {
+            tlb_flush_entry(&env->tlb_v_table[mmu_idx][i], addr);
+        }
+    }
+
     tlb_flush_jmp_cache(env, addr);
+    env->tlb_stats.page_flushes++;
 }
 
 /* update the TLBs so that writes to code in the virtual page 'addr'
@@ -2055,6 +2384,9 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
             for(i = 0; i < CPU_TLB_SIZE; i++)
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
+            for (i = 0; i < env->vtlb_size; i++)
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
         }
     }
 }
@@ -2134,7 +2466,50 @@ void cpu_tlb_update_dirty(CPUState *env)
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         for(i = 0; i < CPU_TLB_SIZE; i++)
             tlb_update_dirty(&env->tlb_table[mmu_idx][i]);
+        for (i = 0; i < env->vtlb_size; i++)
+            tlb_update_dirty(&env->tlb_v_table[mmu_idx][i]);
+    }
+}
+
+static int tlb_get_ram_page(CPUTLBEntry *tlb_entry, ram_addr_t *ram_addr)
+{
+    target_ulong addr = tlb_entry->addr_read;
+
+    if (addr & TLB_INVALID_MASK) {
+        addr = tlb_entry->addr_code;
+    }
+    if (addr & (TLB_INVALID_MASK | TLB_MMIO)) {
+        return -1;
+    }
+    return qemu_ram_addr_from_host((void *)((addr & TARGET_PAGE_MASK) +
+                                            tlb_entry->addend), ram_addr);
+}
+
+/* Store in 'addrs' the RAM pages currently mapped by the TLBs of all CPUs,
+   an approximation of the guest working set.  Returns the number of
+   entries stored, which may contain duplicates.  */
+int tlb_get_ram_pages(ram_addr_t *addrs, int max)
+{
+    CPUState *env;
+    int mmu_idx, i, n = 0;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+            for (i = 0; i < CPU_TLB_SIZE && n < max; i++) {
+                if (tlb_get_ram_page(&env->tlb_table[mmu_idx][i],
+                                     &addrs[n]) == 0) {
+                    n++;
+                }
+            }
+            for (i = 0; i < env->vtlb_size && n < max; i++) {
+                if (tlb_get_ram_page(&env->tlb_v_table[mmu_idx][i],
+                                     &addrs[n]) == 0) {
+                    n++;
+                }
+            }
+        }
     }
+    return n;
 }
 
 static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
@@ -2154,6 +2529,12 @@ static inline void tlb_set_dirty(CPUState *env, target_ulong vaddr)
     i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++)
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
+
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        for (i = 0; i < env->vtlb_size; i++) {
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][i], vaddr);
+        }
+    }
 }
 
 /* Our TLB does not support large pages, so remember the area covered by
@@ -2261,8 +2642,19 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
     }
 
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te = &env->tlb_table[mmu_idx][index];
+
+    /* Keep the entry we are replacing in the victim TLB, unless it maps
+       the same page (e.g. a permission upgrade after a write fault).  */
+    if (env->vtlb_size && tlb_entry_is_valid(te) &&
+        !tlb_entry_match(te, vaddr & TARGET_PAGE_MASK)) {
+        unsigned int vidx = env->vtlb_index++ % env->vtlb_size;
+
+        env->tlb_v_table[mmu_idx][vidx] = *te;
+        env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+    }
+
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -2291,6 +2683,28 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
     }
 }
 
+void dump_tlb_stats(FILE *f, fprintf_function cpu_fprintf)
+{
+    CPUState *env;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        CPUTLBStats *stats = &env->tlb_stats;
+
+        cpu_fprintf(f, "CPU #%d:\n", env->cpu_index);
+        cpu_fprintf(f, "  TLB misses          %" PRIu64 "\n", stats->lookups);
+        cpu_fprintf(f, "  victim TLB hits     %" PRIu64 " (%" PRIu64 "%%)\n",
+                    stats->victim_hits,
+                    stats->lookups ?
+                    (stats->victim_hits * 100) / stats->lookups : 0);
+        cpu_fprintf(f, "  TLB fills           %" PRIu64 "\n", stats->fills);
+        cpu_fprintf(f, "  TLB flushes         %" PRIu64 " (%" PRIu64
+                    " single page)\n",
+                    stats->flushes, stats->page_flushes);
+        cpu_fprintf(f, "  victim TLB size     %u/%d (%" PRIu64 " resizes)\n",
+                    env->vtlb_size, CPU_VTLB_SIZE, stats->resizes);
+    }
+}
+
 #else
 
 void tlb_flush(CPUState *env, int flush_global)
@@ -2810,8 +3224,57 @@ static void *file_ram_alloc(RAMBlock *block,
     block->fd = fd;
     return area;
 }
+
+/* Map a RAM block from a template written by savevm_template.  The mapping
+   is private, so pages stay shared with the page cache, and with the other
+   VMs started from the same template, until the guest writes to them.  */
+static void *template_ram_alloc(RAMBlock *block,
+                                ram_addr_t memory,
+                                const char *dir)
+{
+    char *filename;
+    struct stat st;
+    void *area;
+    int fd;
+
+    filename = qemu_ram_template_file(dir, block->idstr);
+    fd = qemu_open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "qemu: could not open RAM template %s: %s\n",
+                filename, strerror(errno));
+        exit(1);
+    }
+    if (fstat(fd, &st) < 0 || st.st_size != memory) {
+        fprintf(stderr, "qemu: RAM template %s does not match the size of "
+                "RAM block %s\n", filename, block->idstr);
+        exit(1);
+    }
+    area = mmap(0, memory, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (area == MAP_FAILED) {
+        perror("template_ram_alloc: can't mmap RAM pages");
+        exit(1);
+    }
+    qemu_free(filename);
+    block->fd = fd;
+    return area;
+}
 #endif
 
+/* Name of the file holding RAM block 'idstr' in a RAM template directory */
+char *qemu_ram_template_file(const char *dir, const char *idstr)
+{
+    char *filename, *p;
+
+    filename = qemu_malloc(strlen(dir) + strlen(idstr) + 6);
+    sprintf(filename, "%s/%s.ram", dir, idstr);
+    for (p = filename + strlen(dir) + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '_';
+        }
+    }
+    return filename;
+}
+
 static ram_addr_t find_ram_offset(ram_addr_t size)
 {
     RAMBlock *block, *next_block;
@@ -2877,6 +3340,13 @@ ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
     if (host) {
         new_block->host = host;
         new_block->flags |= RAM_PREALLOC_MASK;
+    } else if (mem_template) {
+#if defined (__linux__) && !defined(TARGET_S390X)
+        new_block->host = template_ram_alloc(new_block, size, mem_template);
+#else
+        fprintf(stderr, "-mem-template option unsupported\n");
+        exit(1);
+#endif
     } else {
         if (mem_path) {
 #if defined (__linux__) && !defined(TARGET_S390X)
@@ -2932,7 +3402,7 @@ void qemu_ram_free(ram_addr_t addr)
             QLIST_REMOVE(block, next);
             if (block->flags & RAM_PREALLOC_MASK) {
                 ;
-            } else if (mem_path) {
+            } else if (mem_path || mem_template) {
 #if defined (__linux__) && !defined(TARGET_S390X)
                 if (block->fd) {
                     munmap(block->host, block->length);
@@ -2974,7 +3444,15 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
             } else {
                 flags = MAP_FIXED;
                 munmap(vaddr, length);
-                if (mem_path) {
+                if (mem_template) {
+#if defined(__linux__) && !defined(TARGET_S390X)
+                    flags |= MAP_PRIVATE;
+                    area = mmap(vaddr, length, PROT_READ | PROT_WRITE,
+                                flags, block->fd, offset);
+#else
+                    abort();
+#endif
+                } else if (mem_path) {
 #if defined(__linux__) && !defined(TARGET_S390X)
                     if (block->fd) {
 #ifdef MAP_POPULATE
@@ -4354,19 +4832,38 @@ CPUState *get_current_cpu(void)
 	return cpu_single_env;
 }
 
+/* Return true if tbs[] entry 'tb' holds a generated TB. */
+static inline int tb_is_allocated(TranslationBlock *tb)
+{
+    int i = (tb - tbs) / code_gen_region_max_blocks;
+
+    return i < nb_code_gen_regions &&
+        tb - code_gen_regions[i].tbs < code_gen_regions[i].nb_tbs;
+}
+
 void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 {
     int i, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
+    int nb_tbs;
+    long code_size;
     TranslationBlock *tb;
 
+    nb_tbs = 0;
+    code_size = 0;
+    for (i = 0; i < nb_code_gen_regions; i++) {
+        nb_tbs += code_gen_regions[i].nb_tbs;
+        code_size += code_gen_regions[i].ptr - code_gen_regions[i].buffer;
+    }
     target_code_size = 0;
     max_target_code_size = 0;
     cross_page = 0;
     direct_jmp_count = 0;
     direct_jmp2_count = 0;
-    for(i = 0; i < nb_tbs; i++) {
+    for(i = 0; i < code_gen_max_blocks; i++) {
         tb = &tbs[i];
+        if (!tb_is_allocated(tb))
+            continue;
         target_code_size += tb->size;
         if (tb->size > max_target_code_size)
             max_target_code_size = tb->size;
@@ -4381,16 +4878,18 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     }
     /* XXX: avoid using doubles ? */
     cpu_fprintf(f, "Translation buffer state:\n");
-    cpu_fprintf(f, "gen code size       %td/%ld\n",
-                code_gen_ptr - code_gen_buffer, code_gen_buffer_max_size);
+    cpu_fprintf(f, "gen code size       %ld/%ld\n",
+                code_size, code_gen_region_max_size * nb_code_gen_regions);
+    cpu_fprintf(f, "code regions        %d (current %d)\n",
+                nb_code_gen_regions, code_gen_cur_region);
     cpu_fprintf(f, "TB count            %d/%d\n", 
                 nb_tbs, code_gen_max_blocks);
     cpu_fprintf(f, "TB avg target size  %d max=%d bytes\n",
                 nb_tbs ? target_code_size / nb_tbs : 0,
                 max_target_code_size);
-    cpu_fprintf(f, "TB avg host size    %td bytes (expansion ratio: %0.1f)\n",
-                nb_tbs ? (code_gen_ptr - code_gen_buffer) / nb_tbs : 0,
-                target_code_size ? (double) (code_gen_ptr - code_gen_buffer) / target_code_size : 0);
+    cpu_fprintf(f, "TB avg host size    %ld bytes (expansion ratio: %0.1f)\n",
+                nb_tbs ? code_size / nb_tbs : 0,
+                target_code_size ? (double) code_size / target_code_size : 0);
     cpu_fprintf(f, "cross page TB count %d (%d%%)\n",
             cross_page,
             nb_tbs ? (cross_page * 100) / nb_tbs : 0);
@@ -4401,11 +4900,61 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
                 nb_tbs ? (direct_jmp2_count * 100) / nb_tbs : 0);
     cpu_fprintf(f, "\nStatistics:\n");
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
+    cpu_fprintf(f, "region evict count  %d\n", tb_region_evict_count);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
+    cpu_fprintf(f, "hot TB count        %d\n", tb_hot_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
     tcg_dump_info(f, cpu_fprintf);
 }
 
+#define TB_PROFILE_TOP 32
+
+/* Print the most executed TBs still in the code buffer.  */
+void dump_tb_profile(FILE *f, fprintf_function cpu_fprintf)
+{
+    TranslationBlock *top[TB_PROFILE_TOP];
+    TranslationBlock *tb;
+    uint64_t total = 0;
+    int i, j, n = 0;
+
+    if (!tb_profiling) {
+        cpu_fprintf(f, "TB profiling is off, use 'tb_profile on' or "
+                    "-tb-profile\n");
+        return;
+    }
+    for (i = 0; i < code_gen_max_blocks; i++) {
+        tb = &tbs[i];
+        if (!tb_is_allocated(tb) || !(tb->cflags & CF_PROFILE) ||
+            tb->exec_count == 0 || !tb_is_linked(tb)) {
+            continue;
+        }
+        total += tb->exec_count;
+        /* insertion into the sorted top list */
+        for (j = n; j > 0 && top[j - 1]->exec_count < tb->exec_count; j--) {
+            if (j < TB_PROFILE_TOP) {
+                top[j] = top[j - 1];
+            }
+        }
+        if (j < TB_PROFILE_TOP) {
+            top[j] = tb;
+            if (n < TB_PROFILE_TOP) {
+                n++;
+            }
+        }
+    }
+    cpu_fprintf(f, "%-12s %4s %-10s %-18s %5s %s\n",
+                "count", "%", "guest pc", "host code", "size", "symbol");
+    for (i = 0; i < n; i++) {
+        tb = top[i];
+        cpu_fprintf(f, "%-12u %3d%% 0x" TARGET_FMT_lx " %-18p %5d %s%s\n",
+                    tb->exec_count,
+                    (int)(((uint64_t)tb->exec_count * 100) / total),
+                    tb->pc, tb->tc_ptr, tb->size, lookup_symbol(tb->pc),
+                    (tb->cflags & CF_HOT) ? " (hot)" : "");
+    }
+    cpu_fprintf(f, "%" PRIu64 " TB executions counted\n", total);
+}
+
 #define MMUSUFFIX _cmmu
 #define GETPC() NULL
 #define env cpu_single_env
@@ -35,7 +35,8 @@
 #include "gdbstub.h"
 #endif
 
-#define MAX_PACKET_LENGTH 4096
+/* gdb itself never sends or asks for more than 16k per packet */
+#define MAX_PACKET_LENGTH 16384
 
 #include "exec-all.h"
 #include "qemu_socket.h"
@@ -288,12 +289,17 @@ typedef struct GDBState {
     uint8_t last_packet[MAX_PACKET_LENGTH + 4];
     int last_packet_len;
     int signal;
+    char *xfer_buf; /* qXfer object being read, built at offset 0 */
+    int xfer_len;
+    int xfer_size;
 #ifdef CONFIG_USER_ONLY
     int fd;
     int running_state;
 #else
     CharDriverState *chr;
     CharDriverState *mon_chr;
+    int non_stop; /* QNonStop:1, CPUs stop and resume on their own */
+    int notify_pending; /* a %Stop notification waits for vStopped */
 #endif
 } GDBState;
 
@@ -1559,7 +1565,6 @@ static int cpu_gdb_write_register(CPUState *env, uint8_t *mem_buf, int n)
 
 static int num_g_regs = NUM_CORE_REGS;
 
-#ifdef GDB_CORE_XML
 /* Encode data using the encoding for 'x' packets.  */
 static int memtox(char *buf, const char *mem, int len)
 {
@@ -1581,6 +1586,55 @@ static int memtox(char *buf, const char *mem, int len)
     return p - buf;
 }
 
+/* Like memtox, but stop before the output grows beyond buf_size bytes.
+   Returns the encoded length, *len is set to the number of bytes of mem
+   that went in.  */
+static int memtox_max(char *buf, int buf_size, const uint8_t *mem, int *len)
+{
+    char *p = buf;
+    int i;
+
+    for (i = 0; i < *len; i++) {
+        switch (mem[i]) {
+        case '#': case '$': case '*': case '}':
+            if (p + 2 > buf + buf_size) {
+                goto out;
+            }
+            *(p++) = '}';
+            *(p++) = mem[i] ^ 0x20;
+            break;
+        default:
+            if (p + 1 > buf + buf_size) {
+                goto out;
+            }
+            *(p++) = mem[i];
+            break;
+        }
+    }
+out:
+    *len = i;
+    return p - buf;
+}
+
+/* Decode the escaped binary data of an 'X' packet.  Returns the number of
+   bytes stored in mem, at most len.  */
+static int xtomem(uint8_t *mem, const char *buf, int buf_len, int len)
+{
+    const char *end = buf + buf_len;
+    int i;
+
+    for (i = 0; i < len && buf < end; i++) {
+        if (*buf == '}' && buf + 1 < end) {
+            mem[i] = buf[1] ^ 0x20;
+            buf += 2;
+        } else {
+            mem[i] = *(buf++);
+        }
+    }
+    return i;
+}
+
+#ifdef GDB_CORE_XML
 static const char *get_feature_xml(const char *p, const char **newp)
 {
     size_t len;
@@ -1843,7 +1897,360 @@ static CPUState *find_cpu(uint32_t thread_id)
     return NULL;
 }
 
-static int gdb_handle_packet(GDBState *s, const char *line_buf)
+/* Format the stop reply for env.  The core registers go along with it,
+   so that gdb does not need a 'g' packet to find out where env stopped.  */
+static void gdb_stop_reply(CPUState *env, int sig, char *buf, int buf_size)
+{
+    uint8_t reg_buf[64];
+    char hex[2 * sizeof(reg_buf) + 1];
+    const char *type;
+    int len, reg, reg_size;
+
+    len = snprintf(buf, buf_size, "T%02xthread:%02x;", sig, gdb_id(env));
+    if (sig == GDB_SIGNAL_TRAP && env->watchpoint_hit) {
+        switch (env->watchpoint_hit->flags & BP_MEM_ACCESS) {
+        case BP_MEM_READ:
+            type = "r";
+            break;
+        case BP_MEM_ACCESS:
+            type = "a";
+            break;
+        default:
+            type = "";
+            break;
+        }
+        len += snprintf(buf + len, buf_size - len,
+                        "%swatch:" TARGET_FMT_lx ";", type,
+                        env->watchpoint_hit->vaddr);
+        env->watchpoint_hit = NULL;
+    }
+
+    cpu_synchronize_state(env);
+    for (reg = 0; reg < NUM_CORE_REGS; reg++) {
+        reg_size = gdb_read_register(env, reg_buf, reg);
+        if (reg_size == 0 || len + 2 * reg_size + 6 >= buf_size) {
+            continue;
+        }
+        memtohex(hex, reg_buf, reg_size);
+        len += snprintf(buf + len, buf_size - len, "%02x:%s;", reg, hex);
+    }
+}
+
+/* Answer a qXfer read of len bytes at offset addr in data.  */
+static void put_xfer_reply(GDBState *s, const char *data,
+                           target_ulong total_len,
+                           target_ulong addr, target_ulong len)
+{
+    char buf[MAX_PACKET_LENGTH];
+
+    if (addr > total_len) {
+        put_packet(s, "E00");
+        return;
+    }
+    if (len > (MAX_PACKET_LENGTH - 5) / 2)
+        len = (MAX_PACKET_LENGTH - 5) / 2;
+    if (len < total_len - addr) {
+        buf[0] = 'm';
+        len = memtox(buf + 1, data + addr, len);
+    } else {
+        buf[0] = 'l';
+        len = memtox(buf + 1, data + addr, total_len - addr);
+    }
+    put_packet_binary(s, buf, len + 1);
+}
+
+static void GCC_FMT_ATTR(2, 3) xfer_printf(GDBState *s, const char *fmt, ...)
+{
+    va_list va;
+    int len;
+
+    for (;;) {
+        va_start(va, fmt);
+        len = vsnprintf(s->xfer_buf + s->xfer_len, s->xfer_size - s->xfer_len,
+                        fmt, va);
+        va_end(va);
+        if (len < s->xfer_size - s->xfer_len) {
+            break;
+        }
+        s->xfer_size = s->xfer_size * 2 + len + 1;
+        s->xfer_buf = qemu_realloc(s->xfer_buf, s->xfer_size);
+    }
+    s->xfer_len += len;
+}
+
+static void gdb_build_threads(GDBState *s)
+{
+    CPUState *env;
+
+    s->xfer_len = 0;
+    xfer_printf(s, "<?xml version=\"1.0\"?><threads>");
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        cpu_synchronize_state(env);
+        xfer_printf(s, "<thread id=\"%x\" core=\"%d\" name=\"CPU#%d\">"
+                    "%s [%s]</thread>", gdb_id(env), env->cpu_index,
+                    env->cpu_index,
+                    env->cpu_model_str ? env->cpu_model_str : "cpu",
+                    env->halted ? "halted" : "running");
+    }
+    xfer_printf(s, "</threads>");
+}
+
+#if !defined(CONFIG_USER_ONLY) && TARGET_VIRT_ADDR_SPACE_BITS <= 32
+#define GDB_MEMORY_MAP
+
+static const char *gdb_page_type(CPUState *env, target_ulong addr)
+{
+    target_phys_addr_t phys;
+    ram_addr_t pd;
+
+    phys = cpu_get_phys_page_debug(env, addr);
+    if (phys == -1) {
+        return NULL;
+    }
+    pd = cpu_get_physical_page_desc(phys);
+    if ((pd & ~TARGET_PAGE_MASK) == IO_MEM_RAM) {
+        return "ram";
+    }
+    if ((pd & ~TARGET_PAGE_MASK) == IO_MEM_ROM || (pd & IO_MEM_ROMD)) {
+        return "rom";
+    }
+    return NULL;
+}
+
+/* Describe the RAM and ROM that env sees through its MMU right now.
+   gdb then leaves device registers alone and knows to use hardware
+   breakpoints in ROM.  gdb only asks once per connection, so this is
+   best done after the guest has set up its page tables.  */
+static void gdb_build_memory_map(GDBState *s, CPUState *env)
+{
+    const uint64_t end = 1ULL << TARGET_VIRT_ADDR_SPACE_BITS;
+    const char *type, *cur = NULL;
+    uint64_t addr, start = 0;
+
+    s->xfer_len = 0;
+    xfer_printf(s, "<?xml version=\"1.0\"?>"
+                "<!DOCTYPE memory-map PUBLIC "
+                "\"+//IDN gnu.org//DTD GDB Memory Map V1.0//EN\" "
+                "\"http://sourceware.org/gdb/gdb-memory-map.dtd\">"
+                "<memory-map>");
+    for (addr = 0; addr <= end; addr += TARGET_PAGE_SIZE) {
+        type = addr < end ? gdb_page_type(env, addr) : NULL;
+        if (type == cur) {
+            continue;
+        }
+        if (cur) {
+            xfer_printf(s, "<memory type=\"%s\" start=\"0x%" PRIx64 "\" "
+                        "length=\"0x%" PRIx64 "\"/>", cur, start,
+                        addr - start);
+        }
+        cur = type;
+        start = addr;
+    }
+    xfer_printf(s, "</memory-map>");
+}
+#endif
+
+#ifndef CONFIG_USER_ONLY
+/* Notifications are not acknowledged, so they do not go through
+   last_packet.  */
+static void put_notification(GDBState *s, const char *buf)
+{
+    uint8_t pkt[MAX_PACKET_LENGTH + 4];
+    int len = strlen(buf);
+    int csum, i;
+
+    pkt[0] = '%';
+    memcpy(pkt + 1, buf, len);
+    csum = 0;
+    for (i = 0; i < len; i++) {
+        csum += buf[i];
+    }
+    pkt[len + 1] = '#';
+    pkt[len + 2] = tohex((csum >> 4) & 0xf);
+    pkt[len + 3] = tohex(csum & 0xf);
+    put_buffer(s, pkt, len + 4);
+}
+
+static CPUState *gdb_next_stop(void)
+{
+    CPUState *env;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (env->gdb_stop_pending) {
+            return env;
+        }
+    }
+    return NULL;
+}
+
+static void gdb_cpu_stopped(CPUState *env, int sig)
+{
+    cpu_single_step(env, 0);
+    env->gdb_stopped = 1;
+    env->gdb_stop_request = 0;
+    env->gdb_stop_pending = 1;
+    env->gdb_stop_signal = sig;
+}
+
+/* Send the next stop gdb has not heard about, unless a notification is
+   still waiting for vStopped: gdb then collects the rest itself.  */
+static void gdb_notify_stop(GDBState *s)
+{
+    char buf[MAX_PACKET_LENGTH];
+    CPUState *env;
+
+    if (s->notify_pending || (env = gdb_next_stop()) == NULL) {
+        return;
+    }
+    pstrcpy(buf, sizeof(buf), "Stop:");
+    gdb_stop_reply(env, env->gdb_stop_signal, buf + 5, sizeof(buf) - 5);
+    env->gdb_stop_pending = 0;
+    s->notify_pending = 1;
+    put_notification(s, buf);
+}
+
+/* Answer '?' or vStopped in non-stop mode.  */
+static void gdb_put_next_stop(GDBState *s)
+{
+    char buf[MAX_PACKET_LENGTH];
+    CPUState *env;
+
+    env = gdb_next_stop();
+    if (env == NULL) {
+        s->notify_pending = 0;
+        put_packet(s, "OK");
+        return;
+    }
+    gdb_stop_reply(env, env->gdb_stop_signal, buf, sizeof(buf));
+    env->gdb_stop_pending = 0;
+    s->notify_pending = 1;
+    put_packet(s, buf);
+}
+
+static void gdb_set_non_stop(GDBState *s, int on)
+{
+    CPUState *env;
+
+    /* While the VM is stopped, every CPU counts as stopped by gdb; they
+       get going again one by one with vCont.  */
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        env->gdb_stopped = on && !vm_running;
+        env->gdb_stop_pending = 0;
+        env->gdb_stop_request = 0;
+        env->gdb_stop_signal = GDB_SIGNAL_0;
+    }
+    s->non_stop = on;
+    s->notify_pending = 0;
+}
+
+/* In non-stop mode a CPU that hits a breakpoint or finishes a step stops
+   on its own, and the others keep running.  Returns 0 in all-stop mode,
+   where the whole VM has to stop instead.  */
+int gdb_stop_cpu(CPUState *env)
+{
+    GDBState *s = gdbserver_state;
+
+    if (!s || !s->non_stop || s->state == RS_INACTIVE) {
+        return 0;
+    }
+    if (!env->watchpoint_hit) {
+        tb_flush(env);
+    }
+    gdb_cpu_stopped(env, GDB_SIGNAL_TRAP);
+    gdb_notify_stop(s);
+    return 1;
+}
+
+/* A CPU that vCont;t asked to stop has come out of cpu_exec, only now is
+   it safe to tell gdb and let it read the registers.  */
+void gdb_stop_request_done(CPUState *env)
+{
+    GDBState *s = gdbserver_state;
+
+    env->gdb_stop_request = 0;
+    if (!s || !s->non_stop || s->state == RS_INACTIVE) {
+        return;
+    }
+    gdb_cpu_stopped(env, GDB_SIGNAL_0);
+    gdb_notify_stop(s);
+}
+
+/* Find the leftmost vCont action that applies to thread id.  Returns the
+   action, 0 if none applies or -1 if the packet is malformed.  */
+static int gdb_vcont_action(const char *p, uint32_t id)
+{
+    uint32_t thread;
+    int action;
+
+    while (*p) {
+        if (*p++ != ';') {
+            return -1;
+        }
+        action = *p++;
+        if (action == 'C' || action == 'S') {
+            /* signals mean nothing to a system emulator */
+            strtoul(p, (char **)&p, 16);
+        } else if (action != 'c' && action != 's' && action != 't') {
+            return -1;
+        }
+        thread = -1;
+        if (*p == ':') {
+            thread = strtoull(p + 1, (char **)&p, 16);
+        }
+        if (thread == -1 || thread == 0 || thread == id) {
+            return tolower(action);
+        }
+    }
+    return 0;
+}
+
+static int gdb_vcont_non_stop(GDBState *s, const char *p)
+{
+    CPUState *env;
+    int resume = 0;
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        if (gdb_vcont_action(p, gdb_id(env)) < 0) {
+            return -1;
+        }
+    }
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        switch (gdb_vcont_action(p, gdb_id(env))) {
+        case 's':
+            cpu_single_step(env, sstep_flags);
+            /* fall through */
+        case 'c':
+            if (env->gdb_stopped) {
+                env->gdb_stopped = 0;
+                env->gdb_stop_pending = 0;
+                resume = 1;
+            }
+            break;
+        case 't':
+            if (env->gdb_stopped || env->gdb_stop_request) {
+                break;
+            }
+            if (!vm_running) {
+                gdb_cpu_stopped(env, GDB_SIGNAL_0);
+                break;
+            }
+            /* The CPU may be in the middle of a TB chain: get it out, the
+               stop is reported once it is back in the CPU loop.  */
+            env->gdb_stop_request = 1;
+            cpu_exit(env);
+            qemu_cpu_kick(env);
+            break;
+        }
+    }
+    if (resume && !vm_running) {
+        vm_start();
+    }
+    gdb_notify_stop(s);
+    return 0;
+}
+#endif
+
+static int gdb_handle_packet(GDBState *s, const char *line_buf, int line_len)
 {
     CPUState *env;
     const char *p;
@@ -1861,9 +2268,20 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
     ch = *p++;
     switch(ch) {
     case '?':
+#ifndef CONFIG_USER_ONLY
+        if (s->non_stop) {
+            /* Report every stopped CPU, gdb asks for the others with
+               vStopped.  */
+            for (env = first_cpu; env != NULL; env = env->next_cpu) {
+                env->gdb_stop_pending = env->gdb_stopped;
+            }
+            gdb_put_next_stop(s);
+            gdb_breakpoint_remove_all();
+            break;
+        }
+#endif
         /* TODO: Make this return the correct value for user-mode.  */
-        snprintf(buf, sizeof(buf), "T%02xthread:%02x;", GDB_SIGNAL_TRAP,
-                 gdb_id(s->c_cpu));
+        gdb_stop_reply(s->c_cpu, GDB_SIGNAL_TRAP, buf, sizeof(buf));
         put_packet(s, buf);
         /* Remove all the breakpoints when this query is issued,
          * because gdb is doing and initial connect and the state
@@ -1891,9 +2309,25 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
 
             p += 4;
             if (*p == '?') {
+#ifndef CONFIG_USER_ONLY
+                if (s->non_stop) {
+                    put_packet(s, "vCont;c;C;s;S;t");
+                    break;
+                }
+#endif
                 put_packet(s, "vCont;c;C;s;S");
                 break;
             }
+#ifndef CONFIG_USER_ONLY
+            if (s->non_stop) {
+                if (gdb_vcont_non_stop(s, p) < 0) {
+                    put_packet(s, "E22");
+                } else {
+                    put_packet(s, "OK");
+                }
+                break;
+            }
+#endif
             res = 0;
             res_signal = 0;
             res_thread = 0;
@@ -1940,6 +2374,11 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
                 return RS_IDLE;
             }
             break;
+#ifndef CONFIG_USER_ONLY
+        } else if (s->non_stop && strcmp(p, "Stopped") == 0) {
+            gdb_put_next_stop(s);
+            break;
+#endif
         } else {
             goto unknown_command;
         }
@@ -1951,6 +2390,9 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         /* Detach packet */
         gdb_breakpoint_remove_all();
         gdb_syscall_mode = GDB_SYS_DISABLED;
+#ifndef CONFIG_USER_ONLY
+        gdb_set_non_stop(s, 0);
+#endif
         gdb_continue(s);
         put_packet(s, "OK");
         break;
@@ -2013,6 +2455,8 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         if (*p == ',')
             p++;
         len = strtoull(p, NULL, 16);
+        if (len > (MAX_PACKET_LENGTH - 1) / 2)
+            len = (MAX_PACKET_LENGTH - 1) / 2;
         if (cpu_memory_rw_debug(s->g_cpu, addr, mem_buf, len, 0) != 0) {
             put_packet (s, "E14");
         } else {
@@ -2020,6 +2464,41 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
             put_packet(s, buf);
         }
         break;
+    case 'x':
+        /* Binary read, the reply may be shorter than asked for */
+        addr = strtoull(p, (char **)&p, 16);
+        if (*p == ',')
+            p++;
+        len = strtoull(p, NULL, 16);
+        if (len > MAX_PACKET_LENGTH - 1)
+            len = MAX_PACKET_LENGTH - 1;
+        if (cpu_memory_rw_debug(s->g_cpu, addr, mem_buf, len, 0) != 0) {
+            put_packet(s, "E14");
+        } else {
+            int n = len;
+
+            buf[0] = 'b';
+            res = memtox_max(buf + 1, MAX_PACKET_LENGTH - 1, mem_buf, &n);
+            put_packet_binary(s, buf, res + 1);
+        }
+        break;
+    case 'X':
+        /* Binary write, also used by gdb to probe for it with len 0 */
+        addr = strtoull(p, (char **)&p, 16);
+        if (*p == ',')
+            p++;
+        len = strtoull(p, (char **)&p, 16);
+        if (*p == ':')
+            p++;
+        if (len > sizeof(mem_buf) ||
+            xtomem(mem_buf, p, line_len - (p - line_buf), len) != len) {
+            put_packet(s, "E22");
+        } else if (cpu_memory_rw_debug(s->g_cpu, addr, mem_buf, len, 1) != 0) {
+            put_packet(s, "E14");
+        } else {
+            put_packet(s, "OK");
+        }
+        break;
     case 'M':
         addr = strtoull(p, (char **)&p, 16);
         if (*p == ',')
@@ -2027,6 +2506,10 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
         len = strtoull(p, (char **)&p, 16);
         if (*p == ':')
             p++;
+        if (len > strlen(p) / 2) {
+            put_packet(s, "E22");
+            break;
+        }
         hextomem(mem_buf, p, len);
         if (cpu_memory_rw_debug(s->g_cpu, addr, mem_buf, len, 1) != 0)
             put_packet(s, "E14");
@@ -2191,26 +2674,61 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
                 put_packet(s, "E01");
                 break;
             }
-            hextomem(mem_buf, p + 5, len);
             len = len / 2;
+            hextomem(mem_buf, p + 5, len);
             mem_buf[len++] = 0;
             qemu_chr_read(s->mon_chr, mem_buf, len);
             put_packet(s, "OK");
             break;
         }
+        else if (strncmp(p, "NonStop:", 8) == 0) {
+            gdb_set_non_stop(s, p[8] == '1');
+            put_packet(s, "OK");
+            break;
+        }
 #endif /* !CONFIG_USER_ONLY */
         if (strncmp(p, "Supported", 9) == 0) {
             snprintf(buf, sizeof(buf), "PacketSize=%x", MAX_PACKET_LENGTH);
 #ifdef GDB_CORE_XML
             pstrcat(buf, sizeof(buf), ";qXfer:features:read+");
+#endif
+#ifdef GDB_MEMORY_MAP
+            pstrcat(buf, sizeof(buf), ";qXfer:memory-map:read+");
+#endif
+            pstrcat(buf, sizeof(buf), ";qXfer:threads:read+;binary-upload+");
+#ifndef CONFIG_USER_ONLY
+            pstrcat(buf, sizeof(buf), ";QNonStop+");
 #endif
             put_packet(s, buf);
             break;
         }
+        if (strncmp(p, "Xfer:threads:read::", 19) == 0) {
+            p += 19;
+            addr = strtoul(p, (char **)&p, 16);
+            if (*p == ',')
+                p++;
+            len = strtoul(p, (char **)&p, 16);
+            if (addr == 0)
+                gdb_build_threads(s);
+            put_xfer_reply(s, s->xfer_buf, s->xfer_len, addr, len);
+            break;
+        }
+#ifdef GDB_MEMORY_MAP
+        if (strncmp(p, "Xfer:memory-map:read::", 22) == 0) {
+            p += 22;
+            addr = strtoul(p, (char **)&p, 16);
+            if (*p == ',')
+                p++;
+            len = strtoul(p, (char **)&p, 16);
+            if (addr == 0)
+                gdb_build_memory_map(s, s->g_cpu);
+            put_xfer_reply(s, s->xfer_buf, s->xfer_len, addr, len);
+            break;
+        }
+#endif
 #ifdef GDB_CORE_XML
         if (strncmp(p, "Xfer:features:read:", 19) == 0) {
             const char *xml;
-            target_ulong total_len;
 
             gdb_has_xml = 1;
             p += 19;
@@ -2228,22 +2746,7 @@ static int gdb_handle_packet(GDBState *s, const char *line_buf)
                 p++;
             len = strtoul(p, (char **)&p, 16);
 
-            total_len = strlen(xml);
-            if (addr > total_len) {
-                snprintf(buf, sizeof(buf), "E00");
-                put_packet(s, buf);
-                break;
-            }
-            if (len > (MAX_PACKET_LENGTH - 5) / 2)
-                len = (MAX_PACKET_LENGTH - 5) / 2;
-            if (len < total_len - addr) {
-                buf[0] = 'm';
-                len = memtox(buf + 1, xml + addr, len);
-            } else {
-                buf[0] = 'l';
-                len = memtox(buf + 1, xml + addr, total_len - addr);
-            }
-            put_packet_binary(s, buf, len + 1);
+            put_xfer_reply(s, xml, strlen(xml), addr, len);
             break;
         }
 #endif
@@ -2271,8 +2774,7 @@ static void gdb_vm_state_change(void *opaque, int running, int reason)
 {
     GDBState *s = gdbserver_state;
     CPUState *env = s->c_cpu;
-    char buf[256];
-    const char *type;
+    char buf[MAX_PACKET_LENGTH];
     int ret;
 
     if (running || s->state == RS_INACTIVE || s->state == RS_SYSCALL) {
@@ -2280,26 +2782,9 @@ static void gdb_vm_state_change(void *opaque, int running, int reason)
     }
     switch (reason) {
     case VMSTOP_DEBUG:
-        if (env->watchpoint_hit) {
-            switch (env->watchpoint_hit->flags & BP_MEM_ACCESS) {
-            case BP_MEM_READ:
-                type = "r";
-                break;
-            case BP_MEM_ACCESS:
-                type = "a";
-                break;
-            default:
-                type = "";
-                break;
-            }
-            snprintf(buf, sizeof(buf),
-                     "T%02xthread:%02x;%swatch:" TARGET_FMT_lx ";",
-                     GDB_SIGNAL_TRAP, gdb_id(env), type,
-                     env->watchpoint_hit->vaddr);
-            env->watchpoint_hit = NULL;
-            goto send_packet;
+        if (!env->watchpoint_hit) {
+            tb_flush(env);
         }
-        tb_flush(env);
         ret = GDB_SIGNAL_TRAP;
         break;
     case VMSTOP_USER:
@@ -2327,9 +2812,19 @@ static void gdb_vm_state_change(void *opaque, int running, int reason)
         ret = GDB_SIGNAL_UNKNOWN;
         break;
     }
-    snprintf(buf, sizeof(buf), "T%02xthread:%02x;", ret, gdb_id(env));
 
-send_packet:
+    if (s->non_stop) {
+        /* Everything stopped, gdb hears about each CPU in turn */
+        for (env = first_cpu; env != NULL; env = env->next_cpu) {
+            if (!env->gdb_stopped) {
+                gdb_cpu_stopped(env, ret);
+            }
+        }
+        gdb_notify_stop(s);
+        return;
+    }
+
+    gdb_stop_reply(env, ret, buf, sizeof(buf));
     put_packet(s, buf);
 
     /* disable single step if it was enabled */
@@ -2428,7 +2923,7 @@ static void gdb_read_byte(GDBState *s, int ch)
         if (ch != '$')
             return;
     }
-    if (vm_running) {
+    if (vm_running && !s->non_stop) {
         /* when the CPU is running, we cannot do anything except stop
            it when receiving a char */
         vm_stop(VMSTOP_USER);
@@ -2469,7 +2964,8 @@ static void gdb_read_byte(GDBState *s, int ch)
             } else {
                 reply = '+';
                 put_buffer(s, &reply, 1);
-                s->state = gdb_handle_packet(s, s->line_buf);
+                s->state = gdb_handle_packet(s, s->line_buf,
+                                             s->line_buf_index);
             }
             break;
         default:
@@ -2693,9 +3189,14 @@ static void gdb_chr_event(void *opaque, int event)
 {
     switch (event) {
     case CHR_EVENT_OPENED:
+        gdb_set_non_stop(gdbserver_state, 0);
         vm_stop(VMSTOP_USER);
         gdb_has_xml = 0;
         break;
+    case CHR_EVENT_CLOSED:
+        /* do not leave CPUs stopped behind the back of the VM */
+        gdb_set_non_stop(gdbserver_state, 0);
+        break;
     default:
         break;
     }
@@ -2787,6 +3288,7 @@ int gdbserver_start(const char *device)
         if (s->chr)
             qemu_chr_close(s->chr);
         mon_chr = s->mon_chr;
+        qemu_free(s->xfer_buf);
         memset(s, 0, sizeof(GDBState));
     }
     s->c_cpu = first_cpu;
@@ -23,6 +23,9 @@ int gdb_queuesig (void);
 int gdb_handlesig (CPUState *, int);
 void gdb_signalled(CPUState *, int);
 void gdbserver_fork(CPUState *);
+#else
+int gdb_stop_cpu(CPUState *env);
+void gdb_stop_request_done(CPUState *env);
 #endif
 /* Get or set a register.  Returns the size of the register.  */
 typedef int (*gdb_reg_cb)(CPUState *env, uint8_t *buf, int reg);
@@ -33,6 +33,49 @@ static void gen_icount_end(TranslationBlock *tb, int num_insns)
     }
 }
 
+/* Helpers for TB execution counting.  TBs translated with CF_PROFILE
+   count their executions for the TB profile.  Normal TBs also count them
+   when hot TB detection is on, and leave with exit code 3 when the count
+   reaches tb_hot_threshold so that the main loop can retranslate the TB
+   as a superblock.  The count goes before gen_icount_start, so a TB that
+   leaves as hot has not taken its instructions off icount_decr yet.  */
+
+static int hot_label;
+
+static inline int gen_tb_hot_check(TranslationBlock *tb)
+{
+    return tb_hot_threshold && (tb->cflags & ~CF_PROFILE) == 0;
+}
+
+static inline void gen_tb_count_start(TranslationBlock *tb)
+{
+    TCGv_ptr ptr;
+    TCGv_i32 count;
+
+    if (!(tb->cflags & CF_PROFILE) && !gen_tb_hot_check(tb))
+        return;
+
+    ptr = tcg_const_ptr((tcg_target_long)&tb->exec_count);
+    count = tcg_temp_new_i32();
+    tcg_gen_ld_i32(count, ptr, 0);
+    tcg_gen_addi_i32(count, count, 1);
+    tcg_gen_st_i32(count, ptr, 0);
+    if (gen_tb_hot_check(tb)) {
+        hot_label = gen_new_label();
+        tcg_gen_brcondi_i32(TCG_COND_EQ, count, tb_hot_threshold, hot_label);
+    }
+    tcg_temp_free_i32(count);
+    tcg_temp_free_ptr(ptr);
+}
+
+static inline void gen_tb_count_end(TranslationBlock *tb)
+{
+    if (gen_tb_hot_check(tb)) {
+        gen_set_label(hot_label);
+        tcg_gen_exit_tb((long)tb + 3);
+    }
+}
+
 static inline void gen_io_start(void)
 {
     TCGv_i32 tmp = tcg_const_i32(1);
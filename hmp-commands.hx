@@ -164,6 +164,41 @@ STEXI
 @item screendump @var{filename}
 @findex screendump
 Save screen into PPM image @var{filename}.
+ETEXI
+
+    {
+        .name       = "record_start",
+        .args_type  = "filename:F,fps:i?,format:s?",
+        .params     = "filename [fps [format]]",
+        .help       = "record the screen into 'filename' (mjpeg, png or ppm)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_record_start,
+    },
+
+STEXI
+@item record_start @var{filename} [@var{fps} [@var{format}]]
+@findex record_start
+Record the screen, at most @var{fps} frames per second (10 by default).
+Frames that did not change are skipped, and each frame carries the host and
+guest time it was captured at.  @var{format} is @code{mjpeg} (one file of
+concatenated JPEG images, the default when built with libjpeg), @code{png}
+or @code{ppm} (one file per frame, named @var{filename}-@var{n}.png).  Encoding and writing happen
+in a separate thread; when it cannot keep up, frames are dropped.
+ETEXI
+
+    {
+        .name       = "record_stop",
+        .args_type  = "",
+        .params     = "",
+        .help       = "stop recording the screen",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_record_stop,
+    },
+
+STEXI
+@item record_stop
+@findex record_stop
+Stop recording the screen.  The last frame is still written.
 ETEXI
 
     {
@@ -226,19 +261,43 @@ ETEXI
 
     {
         .name       = "savevm",
-        .args_type  = "name:s?",
-        .params     = "[tag|id]",
-        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created",
+        .args_type  = "incremental:-i,name:s?",
+        .params     = "[-i] [tag|id]",
+        .help       = "save a VM snapshot. If no tag or id are provided, a new snapshot is created"
+                      "\n\t\t\t -i to only save the RAM changed since the last snapshot saved or loaded",
         .mhandler.cmd = do_savevm,
     },
 
 STEXI
-@item savevm [@var{tag}|@var{id}]
+@item savevm [-i] [@var{tag}|@var{id}]
 @findex savevm
 Create a snapshot of the whole virtual machine. If @var{tag} is
 provided, it is used as human readable identifier. If there is already
 a snapshot with the same tag or ID, it is replaced. More info at
 @ref{vm_snapshots}.
+
+With @option{-i}, the snapshot is incremental: it only holds the guest RAM
+pages written since the last snapshot that was saved or loaded, its parent.
+@code{loadvm} restores the parents first.  An incremental snapshot can no
+longer be loaded once one of its parents is deleted or replaced.
+Incremental snapshots must be enabled with @code{savevm_set_incremental}
+before the parent is saved or loaded.
+ETEXI
+
+    {
+        .name       = "savevm_set_incremental",
+        .args_type  = "enable:b",
+        .params     = "on|off",
+        .help       = "track the RAM written since the last snapshot, for savevm -i",
+        .mhandler.cmd = do_savevm_set_incremental,
+    },
+
+STEXI
+@item savevm_set_incremental on|off
+@findex savevm_set_incremental
+Enable or disable incremental snapshots.  While enabled, every snapshot
+that is saved or loaded becomes the parent of the next @code{savevm -i},
+and guest RAM writes are tracked to that end, which costs some speed.
 ETEXI
 
     {
@@ -268,6 +327,23 @@ STEXI
 @item delvm @var{tag}|@var{id}
 @findex delvm
 Delete the snapshot identified by @var{tag} or @var{id}.
+ETEXI
+
+    {
+        .name       = "savevm_template",
+        .args_type  = "dir:s",
+        .params     = "dir",
+        .help       = "save the VM as a template for -mem-template",
+        .mhandler.cmd = do_savevm_template,
+    },
+
+STEXI
+@item savevm_template @var{dir}
+@findex savevm_template
+Save the virtual machine as a template in directory @var{dir}, which is
+created if needed.  Guest RAM is written to one file per RAM block and the
+rest of the state to @file{@var{dir}/vmstate}.  Start new instances from it
+with @option{-mem-template}.
 ETEXI
 
     {
@@ -283,6 +359,21 @@ STEXI
 @findex singlestep
 Run the emulation in single step mode.
 If called with option off, the emulation returns to normal mode.
+ETEXI
+
+    {
+        .name       = "tb_profile",
+        .args_type  = "option:s?",
+        .params     = "[on|off]",
+        .help       = "start or stop counting translated block executions",
+        .mhandler.cmd = do_tb_profile,
+    },
+
+STEXI
+@item tb_profile [off]
+@findex tb_profile
+Count how often each translated block runs, see @code{info tb-profile}.
+Switching the counting on or off flushes the translated code.
 ETEXI
 
     {
@@ -818,6 +909,27 @@ STEXI
 @item migrate_set_downtime @var{second}
 @findex migrate_set_downtime
 Set maximum tolerated downtime (in seconds) for migration.
+ETEXI
+
+    {
+        .name       = "migrate_set_compress",
+        .args_type  = "threads:i,cache:o?",
+        .params     = "threads [cache]",
+        .help       = "compress RAM with 'threads' threads in migrations and "
+                      "snapshots (0 to disable), 'cache' is the size of the "
+                      "cache for delta compression of pages sent again",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_compress,
+    },
+
+STEXI
+@item migrate_set_compress @var{threads} [@var{cache}]
+@findex migrate_set_compress
+Compress guest RAM with zlib in @var{threads} worker threads when migrating
+or saving a snapshot; 0, the default, sends RAM uncompressed.  Pages that
+are sent again during a live migration, and still are in a cache of
+@var{cache} bytes, are sent as a compressed delta against the previous
+version.  The receiving side always decompresses in parallel.
 ETEXI
 
     {
@@ -1292,6 +1404,8 @@ show the character devices
 show the block devices
 @item info blockstats
 show block device statistics
+@item info block-latency
+show the read, write and flush latency histograms of the block devices
 @item info registers
 show the cpu registers
 @item info cpus
@@ -1310,6 +1424,10 @@ show virtual to physical memory mappings (i386, SH4 and SPARC only)
 show the active virtual memory mappings (i386 only)
 @item info jit
 show dynamic compiler info
+@item info tlb-stats
+show per-CPU softmmu TLB statistics (misses, victim TLB hits, fills, flushes)
+@item info tb-profile
+show the most executed translated blocks with their guest symbols
 @item info kvm
 show KVM information
 @item info numa
@@ -1334,6 +1452,8 @@ show guest PCMCIA status
 show which guest mouse is receiving events
 @item info vnc
 show the vnc server status
+@item info record
+show the display recorder status
 @item info name
 show the current VM name
 @item info uuid
@@ -264,6 +264,7 @@ int register_savevm_live(DeviceState *dev,
                          void *opaque);
 
 void unregister_savevm(DeviceState *dev, const char *idstr, void *opaque);
+void savevm_set_save_version(const char *idstr, void *opaque, int version_id);
 void register_device_unmigratable(DeviceState *dev, const char *idstr,
                                                                 void *opaque);
 
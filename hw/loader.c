@@ -53,6 +53,7 @@
 #include <zlib.h>
 
 static int roms_loaded;
+static int roms_skip_reset;
 
 /* return the size or -1 if error */
 int get_image_size(const char *filename)
@@ -653,7 +654,9 @@ int rom_add_option(const char *file, int32_t bootindex)
 static void rom_reset(void *unused)
 {
     Rom *rom;
+    int skip = roms_skip_reset;
 
+    roms_skip_reset = 0;
     QTAILQ_FOREACH(rom, &roms, next) {
         if (rom->fw_file) {
             continue;
@@ -661,7 +664,9 @@ static void rom_reset(void *unused)
         if (rom->data == NULL) {
             continue;
         }
-        cpu_physical_memory_write_rom(rom->addr, rom->data, rom->romsize);
+        if (!skip) {
+            cpu_physical_memory_write_rom(rom->addr, rom->data, rom->romsize);
+        }
         if (rom->isrom) {
             /* rom needs to be written only once */
             qemu_free(rom->data);
@@ -698,6 +703,16 @@ int rom_load_all(void)
     return 0;
 }
 
+/*
+ * Leave guest memory alone on the next reset.  A VM started from a memory
+ * template already has the guest's version of the ROM areas mapped, and
+ * writing them would both lose it and unshare the template pages.
+ */
+void rom_skip_first_reset(void)
+{
+    roms_skip_reset = 1;
+}
+
 void rom_set_fw(void *f)
 {
     fw_cfg = f;
@@ -177,7 +177,7 @@ typedef struct
 {
     SysBusDevice busdev;
     qemu_irq irq;
-	BlockDriverState ce[H2FMI_MAX_CHIPS];
+	BlockDriverState *ce[H2FMI_MAX_CHIPS];
 	int bitmap;
 
 	char *ce_paths;
@@ -272,7 +272,7 @@ static inline int64_t h2fmi_page_offset(h2fmi_state_t *_state, int _addr)
 static int h2fmi_add_chip(h2fmi_state_t *_h2fmi, int _ce, const char *_file)
 {
 	int ret;
-	if(_ce > H2FMI_MAX_CHIPS)
+	if(_ce >= H2FMI_MAX_CHIPS)
 	{
 		//fprintf(stderr, "invalid CE %d.\n", _ce);
 		return -EINVAL;
@@ -280,12 +280,21 @@ static int h2fmi_add_chip(h2fmi_state_t *_h2fmi, int _ce, const char *_file)
 
 	if(_h2fmi->bitmap & (1 << _ce))
 	{
-		bdrv_close(&_h2fmi->ce[_ce]);
+		bdrv_close(_h2fmi->ce[_ce]);
 		_h2fmi->bitmap &=~ (1 << _ce);
 	}
 
+	// Named so that the chips show up in info blockstats.
+	if(!_h2fmi->ce[_ce])
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "fmi%u-ce%d", _h2fmi->fmtn, _ce);
+		_h2fmi->ce[_ce] = bdrv_new(name);
+		bdrv_attach(_h2fmi->ce[_ce], &_h2fmi->busdev.qdev);
+	}
+
 	//fprintf(stderr, "FILE: %s\n", _file);
-	ret = bdrv_open(&_h2fmi->ce[_ce], _file, BDRV_O_RDWR, NULL);
+	ret = bdrv_open(_h2fmi->ce[_ce], _file, BDRV_O_RDWR, NULL);
 	if(ret)
 		return ret;
 
@@ -353,7 +362,7 @@ void enableIOPH2fmi(void) {
 static int h2fmi_do_readid(h2fmi_state_t *_h2fmi, int _ce)
 {
 	void *data = h2fmi_buffer_map(&_h2fmi->buf0, H2FMI_CHIPID_LENGTH);
-	int ret = bdrv_pread(&_h2fmi->ce[_ce], 0, // h2fmi_id_offset(_h2fmi, _h2fmi->addr),
+	int ret = bdrv_pread(_h2fmi->ce[_ce], 0, // h2fmi_id_offset(_h2fmi, _h2fmi->addr),
 			data, H2FMI_CHIPID_LENGTH);
 	//fprintf(stderr, "%s: data 0x%08x ret: %d ptr %p fmt %d offset 0x%08x\n", __FUNCTION__, *(uint32_t *)data, ret, _h2fmi, _h2fmi->fmtn,  h2fmi_id_offset(_h2fmi, _h2fmi->addr));
 	if(ret <= 0)
@@ -382,7 +391,7 @@ static int h2fmi_do_read(h2fmi_state_t *_h2fmi, int _ce)
 	int i;
 	uint8_t marker;
 	void *data, *meta;
-	int ret = bdrv_pread(&_h2fmi->ce[_ce], h2fmi_page_offset(_h2fmi, _h2fmi->addr),
+	int ret = bdrv_pread(_h2fmi->ce[_ce], h2fmi_page_offset(_h2fmi, _h2fmi->addr),
 			&marker, 1);
 
 	fprintf(stderr, "%s: returned %d for address 0x%08x and page offset %llx on ce %d fmt %d\n", __FUNCTION__, ret, _h2fmi->addr, h2fmi_page_offset(_h2fmi, _h2fmi->addr), _ce, _h2fmi->fmtn);
@@ -408,7 +417,7 @@ static int h2fmi_do_read(h2fmi_state_t *_h2fmi, int _ce)
 		goto done;
 	}
 
-	ret = bdrv_pread(&_h2fmi->ce[_ce], h2fmi_page_offset(_h2fmi, _h2fmi->addr) + 1,
+	ret = bdrv_pread(_h2fmi->ce[_ce], h2fmi_page_offset(_h2fmi, _h2fmi->addr) + 1,
 			data, _h2fmi->page_size);
 	if(ret <= 0)
 	{
@@ -416,7 +425,7 @@ static int h2fmi_do_read(h2fmi_state_t *_h2fmi, int _ce)
 		goto done;
 	}
 
-	ret = bdrv_pread(&_h2fmi->ce[_ce], h2fmi_page_offset(_h2fmi, _h2fmi->addr)
+	ret = bdrv_pread(_h2fmi->ce[_ce], h2fmi_page_offset(_h2fmi, _h2fmi->addr)
 			+ 1 + _h2fmi->page_size, meta, _h2fmi->meta_size-2);
 	if(ret <= 0)
 	{
@@ -32,6 +32,8 @@
 #include "hw.h"
 #include "block.h"
 #include "block_int.h"
+#include "qemu-aio.h"
+#include "sysemu.h"
 #include "sd.h"
 
 //#define DEBUG_SD 1
@@ -43,6 +45,8 @@ do { fprintf(stderr, "SD: " fmt , ## __VA_ARGS__); } while (0)
 #define DPRINTF(fmt, ...) do {} while(0)
 #endif
 
+#define SD_MB_SECTORS	64	/* 32 kilobytes */
+
 typedef enum {
     sd_r0 = 0,    /* no response */
     sd_r1,        /* normal response command */
@@ -101,6 +105,20 @@ struct SDState {
     BlockDriverState *bdrv;
     uint8_t *buf;
 
+    /* Multiple block transfers through sd_read_data and sd_write_data are
+       read ahead and gathered here, SD_MB_SECTORS blocks at a time.  */
+    uint8_t *mb_buf;
+    uint64_t mb_start;
+    uint32_t mb_len;
+    int mb_dirty;
+    Notifier exit_notifier;
+
+    /* Transfer started by sd_read_blocks or sd_write_blocks */
+    BlockDriverAIOCB *aiocb;
+    uint32_t aio_len;
+    BlockDriverCompletionFunc *aio_cb;
+    void *aio_opaque;
+
     int enable;
 };
 
@@ -420,6 +438,46 @@ static void sd_reset(SDState *sd, BlockDriverState *bdrv)
     sd->size = size;
     sd->blk_len = 0x200;
     sd->pwd_len = 0;
+    sd->mb_len = 0;
+    sd->mb_dirty = 0;
+}
+
+static void sd_mb_flush(SDState *sd)
+{
+    if (sd->mb_dirty &&
+        bdrv_write(sd->bdrv, sd->mb_start >> 9, sd->mb_buf,
+                   sd->mb_len >> 9) < 0) {
+        fprintf(stderr, "sd_mb_flush: write error on host side\n");
+    }
+    sd->mb_len = 0;
+    sd->mb_dirty = 0;
+}
+
+static void sd_blocks_cancel(SDState *sd)
+{
+    if (sd->aiocb) {
+        bdrv_aio_cancel(sd->aiocb);
+        sd->aiocb = NULL;
+        sd->aio_cb(sd->aio_opaque, -ENOMEDIUM);
+    }
+}
+
+/* Blocks gathered for a write must reach the image before a snapshot or
+   migration reads it, and before we exit */
+static void sd_vm_state_change(void *opaque, int running, int reason)
+{
+    SDState *sd = opaque;
+
+    if (!running) {
+        sd_mb_flush(sd);
+    }
+}
+
+static void sd_exit_notify(Notifier *notifier)
+{
+    SDState *sd = container_of(notifier, SDState, exit_notifier);
+
+    sd_mb_flush(sd);
 }
 
 static void sd_cardchange(void *opaque, int reason)
@@ -430,6 +488,11 @@ static void sd_cardchange(void *opaque, int reason)
         return;
     }
 
+    /* Whatever was on its way to the old medium is lost */
+    sd_blocks_cancel(sd);
+    sd->mb_len = 0;
+    sd->mb_dirty = 0;
+
     qemu_set_irq(sd->inserted_cb, bdrv_is_inserted(sd->bdrv));
     if (bdrv_is_inserted(sd->bdrv)) {
         sd_reset(sd, sd->bdrv);
@@ -447,12 +510,16 @@ SDState *sd_init(BlockDriverState *bs, int is_spi)
 
     sd = (SDState *) qemu_mallocz(sizeof(SDState));
     sd->buf = qemu_blockalign(bs, 512);
+    sd->mb_buf = qemu_blockalign(bs, SD_MB_SECTORS << 9);
     sd->spi = is_spi;
     sd->enable = 1;
     sd_reset(sd, bs);
     if (sd->bdrv) {
         bdrv_set_change_cb(sd->bdrv, sd_cardchange, sd);
     }
+    qemu_add_vm_change_state_handler(sd_vm_state_change, sd);
+    sd->exit_notifier.notify = sd_exit_notify;
+    qemu_add_exit_notifier(&sd->exit_notifier);
     return sd;
 }
 
@@ -804,6 +871,7 @@ static sd_rsp_type_t sd_normal_command(SDState *sd,
             sd->state = sd_sendingdata_state;
             sd->data_start = req.arg;
             sd->data_offset = 0;
+            sd->mb_len = 0;
 
             if (sd->data_start + sd->blk_len > sd->size)
                 sd->card_status |= ADDRESS_ERROR;
@@ -898,6 +966,7 @@ static sd_rsp_type_t sd_normal_command(SDState *sd,
             sd->state = sd_sendingdata_state;
             sd->data_start = addr;
             sd->data_offset = 0;
+            sd->mb_len = 0;
 
             if (sd->data_start + sd->blk_len > sd->size)
                 sd->card_status |= ADDRESS_ERROR;
@@ -1266,6 +1335,11 @@ int sd_do_command(SDState *sd, SDRequest *req,
         return 0;
     }
 
+    /* The card is busy until a block transfer completes */
+    if (sd->aiocb) {
+        qemu_aio_flush();
+    }
+
     if (sd_req_crc_validate(req)) {
         sd->card_status &= ~COM_CRC_ERROR;
         return 0;
@@ -1294,6 +1368,11 @@ int sd_do_command(SDState *sd, SDRequest *req,
 
     sd->current_cmd = req->cmd;
 
+    /* The host is done sending blocks, commit what is still gathered */
+    if (sd->mb_dirty && sd->state != sd_receivingdata_state) {
+        sd_mb_flush(sd);
+    }
+
     switch (rtype) {
     case sd_r1:
     case sd_r1b:
@@ -1404,8 +1483,59 @@ static void sd_blk_write(SDState *sd, uint64_t addr, uint32_t len)
     }
 }
 
+/* Read a block of a multiple block transfer, reading ahead a few */
+static void sd_mb_read(SDState *sd, uint64_t addr, uint32_t len)
+{
+    uint64_t sectors;
+    int n;
+
+    bdrv_get_geometry(sd->bdrv, &sectors);
+
+    if (len != 512 || (addr & 511) || (addr >> 9) >= sectors) {
+        sd_blk_read(sd, addr, len);
+        return;
+    }
+
+    if (addr < sd->mb_start || addr + 512 > sd->mb_start + sd->mb_len) {
+        sd_mb_flush(sd);
+        n = MIN(SD_MB_SECTORS, sectors - (addr >> 9));
+        if (bdrv_read(sd->bdrv, addr >> 9, sd->mb_buf, n) < 0) {
+            fprintf(stderr, "sd_mb_read: read error on host side\n");
+            return;
+        }
+        sd->mb_start = addr;
+        sd->mb_len = n << 9;
+    }
+    memcpy(sd->data, sd->mb_buf + (addr - sd->mb_start), 512);
+}
+
+/* Write a block of a multiple block transfer, gathering a few first */
+static void sd_mb_write(SDState *sd, uint64_t addr, uint32_t len)
+{
+    if (len != 512 || (addr & 511)) {
+        sd_mb_flush(sd);
+        sd_blk_write(sd, addr, len);
+        return;
+    }
+
+    if (sd->mb_len && (!sd->mb_dirty || addr != sd->mb_start + sd->mb_len)) {
+        sd_mb_flush(sd);
+    }
+    if (!sd->mb_len) {
+        sd->mb_start = addr;
+    }
+    memcpy(sd->mb_buf + sd->mb_len, sd->data, 512);
+    sd->mb_len += 512;
+    sd->mb_dirty = 1;
+    if (sd->mb_len == SD_MB_SECTORS << 9) {
+        sd_mb_flush(sd);
+    }
+}
+
 #define BLK_READ_BLOCK(a, len)	sd_blk_read(sd, a, len)
 #define BLK_WRITE_BLOCK(a, len)	sd_blk_write(sd, a, len)
+#define MB_READ_BLOCK(a, len)	sd_mb_read(sd, a, len)
+#define MB_WRITE_BLOCK(a, len)	sd_mb_write(sd, a, len)
 #define APP_READ_BLOCK(a, len)	memset(sd->data, 0xec, len)
 #define APP_WRITE_BLOCK(a, len)
 
@@ -1443,7 +1573,7 @@ void sd_write_data(SDState *sd, uint8_t value)
         if (sd->data_offset >= sd->blk_len) {
             /* TODO: Check CRC before committing */
             sd->state = sd_programming_state;
-            BLK_WRITE_BLOCK(sd->data_start, sd->data_offset);
+            MB_WRITE_BLOCK(sd->data_start, sd->data_offset);
             sd->blk_written ++;
             sd->data_start += sd->blk_len;
             sd->data_offset = 0;
@@ -1544,6 +1674,11 @@ uint8_t sd_read_data(SDState *sd)
         return 0x00;
     }
 
+    if (sd->aiocb) {
+        DPRINTF("sd_read_data: block transfer in progress\n");
+        return 0x00;
+    }
+
     if (sd->card_status & (ADDRESS_ERROR | WP_VIOLATION))
         return 0x00;
 
@@ -1567,7 +1702,7 @@ uint8_t sd_read_data(SDState *sd)
 
     case 11:	/* CMD11:  READ_DAT_UNTIL_STOP */
         if (sd->data_offset == 0)
-            BLK_READ_BLOCK(sd->data_start, io_len);
+            MB_READ_BLOCK(sd->data_start, io_len);
         ret = sd->data[sd->data_offset ++];
 
         if (sd->data_offset >= io_len) {
@@ -1598,7 +1733,7 @@ uint8_t sd_read_data(SDState *sd)
 
     case 18:	/* CMD18:  READ_MULTIPLE_BLOCK */
         if (sd->data_offset == 0)
-            BLK_READ_BLOCK(sd->data_start, io_len);
+            MB_READ_BLOCK(sd->data_start, io_len);
         ret = sd->data[sd->data_offset ++];
 
         if (sd->data_offset >= io_len) {
@@ -1651,7 +1786,139 @@ uint8_t sd_read_data(SDState *sd)
 
 int sd_data_ready(SDState *sd)
 {
-    return sd->state == sd_sendingdata_state;
+    return sd->state == sd_sendingdata_state && !sd->aiocb;
+}
+
+static void sd_blocks_done(void *opaque, int ret)
+{
+    SDState *sd = opaque;
+    uint32_t len = sd->aio_len;
+
+    sd->aiocb = NULL;
+    if (ret < 0) {
+        fprintf(stderr, "sd_blocks_done: I/O error on host side\n");
+        if (sd->state == sd_programming_state) {
+            sd->state = sd->current_cmd == 24 ? sd_transfer_state
+                                              : sd_receivingdata_state;
+        }
+        sd->aio_cb(sd->aio_opaque, ret);
+        return;
+    }
+
+    /* Leave the card where the byte interface would have after len bytes */
+    switch (sd->current_cmd) {
+    case 17:	/* CMD17:  READ_SINGLE_BLOCK */
+        sd->state = sd_transfer_state;
+        break;
+
+    case 11:	/* CMD11:  READ_DAT_UNTIL_STOP */
+    case 18:	/* CMD18:  READ_MULTIPLE_BLOCK */
+        sd->data_start += len;
+        if (sd->data_start + 512 > sd->size)
+            sd->card_status |= ADDRESS_ERROR;
+        break;
+
+    case 24:	/* CMD24:  WRITE_SINGLE_BLOCK */
+        sd->blk_written ++;
+        sd->csd[14] |= 0x40;
+        sd->state = sd_transfer_state;
+        break;
+
+    case 25:	/* CMD25:  WRITE_MULTIPLE_BLOCK */
+        sd->blk_written += len >> 9;
+        sd->csd[14] |= 0x40;
+        sd->data_start += len;
+        sd->state = sd_receivingdata_state;
+        if (sd->data_start + 512 > sd->size)
+            sd->card_status |= ADDRESS_ERROR;
+        else if (sd_wp_addr(sd, sd->data_start))
+            sd->card_status |= WP_VIOLATION;
+        break;
+    }
+    sd->aio_cb(sd->aio_opaque, ret);
+}
+
+/* Whether the blocks of sg can go in one request from where the card is */
+static int sd_blocks_check(SDState *sd, QEMUSGList *sg, int state)
+{
+    return sd->bdrv && bdrv_is_inserted(sd->bdrv) && sd->enable &&
+           !sd->aiocb && sd->state == state && sd->data_offset == 0 &&
+           !(sd->card_status & (ADDRESS_ERROR | WP_VIOLATION)) &&
+           sd->blk_len == 512 && !(sd->data_start & 511) &&
+           sg->size > 0 && !(sg->size & 511) &&
+           sd->data_start + sg->size <= sd->size;
+}
+
+int sd_read_blocks(SDState *sd, QEMUSGList *sg,
+                   BlockDriverCompletionFunc *cb, void *opaque)
+{
+    if (!sd_blocks_check(sd, sg, sd_sendingdata_state)) {
+        return -1;
+    }
+    switch (sd->current_cmd) {
+    case 17:	/* CMD17:  READ_SINGLE_BLOCK */
+        if (sg->size != 512) {
+            return -1;
+        }
+        break;
+
+    case 11:	/* CMD11:  READ_DAT_UNTIL_STOP */
+    case 18:	/* CMD18:  READ_MULTIPLE_BLOCK */
+        break;
+
+    default:
+        return -1;
+    }
+
+    DPRINTF("sd_read_blocks: addr = 0x%08llx, len = %lld\n",
+            (unsigned long long) sd->data_start, (long long) sg->size);
+    sd->aio_len = sg->size;
+    sd->aio_cb = cb;
+    sd->aio_opaque = opaque;
+    sd->aiocb = dma_bdrv_read(sd->bdrv, sg, sd->data_start >> 9,
+                              sd_blocks_done, sd);
+    return 0;
+}
+
+int sd_write_blocks(SDState *sd, QEMUSGList *sg,
+                    BlockDriverCompletionFunc *cb, void *opaque)
+{
+    uint64_t addr;
+
+    if (!sd_blocks_check(sd, sg, sd_receivingdata_state)) {
+        return -1;
+    }
+    switch (sd->current_cmd) {
+    case 24:	/* CMD24:  WRITE_SINGLE_BLOCK */
+        if (sg->size != 512) {
+            return -1;
+        }
+        break;
+
+    case 25:	/* CMD25:  WRITE_MULTIPLE_BLOCK */
+        break;
+
+    default:
+        return -1;
+    }
+    for (addr = sd->data_start; addr < sd->data_start + sg->size;
+         addr += 512) {
+        if (sd_wp_addr(sd, addr)) {
+            return -1;
+        }
+    }
+
+    DPRINTF("sd_write_blocks: addr = 0x%08llx, len = %lld\n",
+            (unsigned long long) sd->data_start, (long long) sg->size);
+    /* Blocks gathered from the byte interface go first */
+    sd_mb_flush(sd);
+    sd->state = sd_programming_state;
+    sd->aio_len = sg->size;
+    sd->aio_cb = cb;
+    sd->aio_opaque = opaque;
+    sd->aiocb = dma_bdrv_write(sd->bdrv, sg, sd->data_start >> 9,
+                               sd_blocks_done, sd);
+    return 0;
 }
 
 void sd_enable(SDState *sd, int enable)
@@ -29,6 +29,8 @@
 #ifndef __hw_sd_h
 #define __hw_sd_h		1
 
+#include "dma.h"
+
 #define OUT_OF_RANGE		(1 << 31)
 #define ADDRESS_ERROR		(1 << 30)
 #define BLOCK_LEN_ERROR		(1 << 29)
@@ -76,4 +78,18 @@ void sd_set_cb(SDState *sd, qemu_irq readonly, qemu_irq insert);
 int sd_data_ready(SDState *sd);
 void sd_enable(SDState *sd, int enable);
 
+/* Move all the blocks of the current data transfer command in one go,
+   between the card and the guest memory in sg.  These return -1 without
+   doing anything if the transfer does not start on a block boundary,
+   is not a whole number of 512 byte blocks, or runs into an error the
+   card would report; the controller then falls back to sd_read_data and
+   sd_write_data.  Otherwise cb is called once the blocks are done, with
+   the card in the state it would be in after the same bytes went through
+   sd_read_data or sd_write_data.  The card is busy until then: a
+   command sent in the meantime waits for the transfer to finish.  */
+int sd_read_blocks(SDState *sd, QEMUSGList *sg,
+                   BlockDriverCompletionFunc *cb, void *opaque);
+int sd_write_blocks(SDState *sd, QEMUSGList *sg,
+                    BlockDriverCompletionFunc *cb, void *opaque);
+
 #endif	/* __hw_sd_h */
@@ -31,6 +31,10 @@
 #include <sys/wait.h>
 #endif
 
+#ifdef CONFIG_EPOLL
+#include <sys/epoll.h>
+#endif
+
 typedef struct IOHandlerRecord {
     int fd;
     IOCanReadHandler *fd_read_poll;
@@ -38,12 +42,139 @@ typedef struct IOHandlerRecord {
     IOHandler *fd_write;
     int deleted;
     void *opaque;
+#ifdef CONFIG_EPOLL
+    uint32_t events;            /* events registered with the epoll fd */
+    int no_epoll;               /* fd not supported by epoll, use select */
+#endif
     QLIST_ENTRY(IOHandlerRecord) next;
 } IOHandlerRecord;
 
 static QLIST_HEAD(, IOHandlerRecord) io_handlers =
     QLIST_HEAD_INITIALIZER(io_handlers);
 
+#ifdef CONFIG_EPOLL
+/* On Linux the handlers stay registered with an epoll fd, which is only
+   updated when a handler changes.  The main loop waits with epoll_wait()
+   alone, unless some fds (slirp sockets, fds epoll refuses such as
+   regular files) still need select(); then the epoll fd is part of the
+   select() sets.  */
+#define IOHANDLER_MAX_EVENTS 64
+
+static int iohandler_epfd = -1;
+/* live handlers whose fd has to go through select() */
+static int iohandler_nb_no_epoll;
+static struct epoll_event iohandler_events[IOHANDLER_MAX_EVENTS];
+static int iohandler_nb_events;
+/* Events carry the fd rather than the record: an fd closed without
+   removing its handler first can stay registered if it was duplicated,
+   and must not lead to a freed record.  */
+static IOHandlerRecord **iohandler_fd_table;
+static int iohandler_fd_table_size;
+
+static void iohandler_fd_table_set(int fd, IOHandlerRecord *ioh)
+{
+    int size;
+
+    if (fd >= iohandler_fd_table_size) {
+        if (!ioh) {
+            return;
+        }
+        size = iohandler_fd_table_size ? iohandler_fd_table_size : 64;
+        while (size <= fd) {
+            size *= 2;
+        }
+        iohandler_fd_table = qemu_realloc(iohandler_fd_table,
+                                          size * sizeof(*iohandler_fd_table));
+        memset(iohandler_fd_table + iohandler_fd_table_size, 0,
+               (size - iohandler_fd_table_size) * sizeof(*iohandler_fd_table));
+        iohandler_fd_table_size = size;
+    }
+    iohandler_fd_table[fd] = ioh;
+}
+
+static IOHandlerRecord *iohandler_fd_table_get(int fd)
+{
+    if (fd < 0 || fd >= iohandler_fd_table_size) {
+        return NULL;
+    }
+    return iohandler_fd_table[fd];
+}
+
+static uint32_t iohandler_wanted_events(IOHandlerRecord *ioh)
+{
+    uint32_t events = 0;
+
+    if (ioh->deleted) {
+        return 0;
+    }
+    if (ioh->fd_read &&
+        (!ioh->fd_read_poll || ioh->fd_read_poll(ioh->opaque) != 0)) {
+        events |= EPOLLIN;
+    }
+    if (ioh->fd_write) {
+        events |= EPOLLOUT;
+    }
+    return events;
+}
+
+static void iohandler_epoll_update(IOHandlerRecord *ioh)
+{
+    struct epoll_event ev;
+    uint32_t events;
+    int op;
+
+    if (ioh->no_epoll) {
+        return;
+    }
+    events = iohandler_wanted_events(ioh);
+    if (events == ioh->events) {
+        return;
+    }
+    if (iohandler_epfd < 0) {
+#ifdef CONFIG_EPOLL_CREATE1
+        iohandler_epfd = epoll_create1(EPOLL_CLOEXEC);
+#else
+        iohandler_epfd = epoll_create(IOHANDLER_MAX_EVENTS);
+        if (iohandler_epfd >= 0) {
+            qemu_set_cloexec(iohandler_epfd);
+        }
+#endif
+        if (iohandler_epfd < 0) {
+            perror("epoll_create");
+            exit(1);
+        }
+    }
+
+    /* an fd without events is removed: epoll would still report
+       errors and hangups for it, unlike select */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = ioh->fd;
+    iohandler_fd_table_set(ioh->fd, events ? ioh : NULL);
+    if (!events) {
+        op = EPOLL_CTL_DEL;
+    } else if (!ioh->events) {
+        op = EPOLL_CTL_ADD;
+    } else {
+        op = EPOLL_CTL_MOD;
+    }
+    if (epoll_ctl(iohandler_epfd, op, ioh->fd, &ev) < 0) {
+        if (op == EPOLL_CTL_ADD && errno == EPERM) {
+            /* e.g. a regular file */
+            ioh->no_epoll = 1;
+            iohandler_fd_table_set(ioh->fd, NULL);
+            events = 0;
+        } else if (op != EPOLL_CTL_DEL) {
+            /* the fd was closed and reopened since it was registered,
+               which drops or leaves behind a stale registration */
+            epoll_ctl(iohandler_epfd, EPOLL_CTL_DEL, ioh->fd, &ev);
+            epoll_ctl(iohandler_epfd, EPOLL_CTL_ADD, ioh->fd, &ev);
+        }
+    }
+    ioh->events = events;
+}
+#endif
+
 
 /* XXX: fd_read_poll should be suppressed, but an API change is
    necessary in the character devices to suppress fd_can_read(). */
@@ -58,7 +189,15 @@ int qemu_set_fd_handler2(int fd,
     if (!fd_read && !fd_write) {
         QLIST_FOREACH(ioh, &io_handlers, next) {
             if (ioh->fd == fd) {
+#ifdef CONFIG_EPOLL
+                if (ioh->no_epoll && !ioh->deleted) {
+                    iohandler_nb_no_epoll--;
+                }
+#endif
                 ioh->deleted = 1;
+#ifdef CONFIG_EPOLL
+                iohandler_epoll_update(ioh);
+#endif
                 break;
             }
         }
@@ -70,12 +209,23 @@ int qemu_set_fd_handler2(int fd,
         ioh = qemu_mallocz(sizeof(IOHandlerRecord));
         QLIST_INSERT_HEAD(&io_handlers, ioh, next);
     found:
+#ifdef CONFIG_EPOLL
+        if (ioh->no_epoll && !ioh->deleted) {
+            iohandler_nb_no_epoll--;
+        }
+#endif
         ioh->fd = fd;
         ioh->fd_read_poll = fd_read_poll;
         ioh->fd_read = fd_read;
         ioh->fd_write = fd_write;
         ioh->opaque = opaque;
         ioh->deleted = 0;
+#ifdef CONFIG_EPOLL
+        iohandler_epoll_update(ioh);
+        if (ioh->no_epoll) {
+            iohandler_nb_no_epoll++;
+        }
+#endif
     }
     return 0;
 }
@@ -92,9 +242,21 @@ void qemu_iohandler_fill(int *pnfds, fd_set *readfds, fd_set *writefds, fd_set *
 {
     IOHandlerRecord *ioh;
 
+#ifdef CONFIG_EPOLL
+    iohandler_nb_events = 0;
+#endif
     QLIST_FOREACH(ioh, &io_handlers, next) {
         if (ioh->deleted)
             continue;
+#ifdef CONFIG_EPOLL
+        if (!ioh->no_epoll) {
+            /* only can-read callbacks change the events between calls */
+            if (ioh->fd_read_poll) {
+                iohandler_epoll_update(ioh);
+            }
+            continue;
+        }
+#endif
         if (ioh->fd_read &&
             (!ioh->fd_read_poll ||
              ioh->fd_read_poll(ioh->opaque) != 0)) {
@@ -108,6 +270,45 @@ void qemu_iohandler_fill(int *pnfds, fd_set *readfds, fd_set *writefds, fd_set *
                 *pnfds = ioh->fd;
         }
     }
+
+#ifdef CONFIG_EPOLL
+    if (iohandler_epfd >= 0) {
+        FD_SET(iohandler_epfd, readfds);
+        if (iohandler_epfd > *pnfds)
+            *pnfds = iohandler_epfd;
+    }
+#endif
+}
+
+/* Wait for the fds of qemu_iohandler_fill() and of the other users of
+   the sets, like select() would.  other_fds tells whether anybody else
+   put fds in the sets.  */
+int qemu_iohandler_select(int nfds, fd_set *readfds, fd_set *writefds,
+                          fd_set *xfds, struct timeval *tv, int other_fds)
+{
+#ifdef CONFIG_EPOLL
+    int ret, timeout;
+
+    if (iohandler_epfd >= 0 && !iohandler_nb_no_epoll && !other_fds) {
+        timeout = tv->tv_sec * 1000 + (tv->tv_usec + 999) / 1000;
+        ret = epoll_wait(iohandler_epfd, iohandler_events,
+                         IOHANDLER_MAX_EVENTS, timeout);
+        iohandler_nb_events = ret > 0 ? ret : 0;
+        return ret;
+    }
+    ret = select(nfds + 1, readfds, writefds, xfds, tv);
+    if (ret > 0 && iohandler_epfd >= 0 &&
+        FD_ISSET(iohandler_epfd, readfds)) {
+        iohandler_nb_events = epoll_wait(iohandler_epfd, iohandler_events,
+                                         IOHANDLER_MAX_EVENTS, 0);
+        if (iohandler_nb_events < 0) {
+            iohandler_nb_events = 0;
+        }
+    }
+    return ret;
+#else
+    return select(nfds + 1, readfds, writefds, xfds, tv);
+#endif
 }
 
 void qemu_iohandler_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds, int ret)
@@ -115,7 +316,37 @@ void qemu_iohandler_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds, int re
     if (ret > 0) {
         IOHandlerRecord *pioh, *ioh;
 
+#ifdef CONFIG_EPOLL
+        int i;
+        uint32_t events;
+
+        for (i = 0; i < iohandler_nb_events; i++) {
+            ioh = iohandler_fd_table_get(iohandler_events[i].data.fd);
+            events = iohandler_events[i].events;
+            if (!ioh) {
+                continue;
+            }
+            if (!ioh->deleted && ioh->fd_read &&
+                (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+                ioh->fd_read(ioh->opaque);
+            }
+            if (!ioh->deleted && ioh->fd_write &&
+                (events & (EPOLLOUT | EPOLLHUP | EPOLLERR))) {
+                ioh->fd_write(ioh->opaque);
+            }
+        }
+        iohandler_nb_events = 0;
+#endif
         QLIST_FOREACH_SAFE(ioh, &io_handlers, next, pioh) {
+#ifdef CONFIG_EPOLL
+            if (!ioh->no_epoll) {
+                if (ioh->deleted) {
+                    QLIST_REMOVE(ioh, next);
+                    qemu_free(ioh);
+                }
+                continue;
+            }
+#endif
             if (!ioh->deleted && ioh->fd_read && FD_ISSET(ioh->fd, readfds)) {
                 ioh->fd_read(ioh->opaque);
             }
@@ -40,6 +40,13 @@ struct qemu_laio_state {
     int efd;
     int count;
     QLIST_HEAD(, qemu_laiocb) completed_reqs;
+
+    /* iocbs queued while plugged, submitted with a single io_submit */
+    int plugged;
+    int npending;
+    struct iocb *pending[MAX_EVENTS];
+    QLIST_HEAD(, qemu_laiocb) failed_reqs;
+    QEMUBH *failed_bh;
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -146,13 +153,79 @@ static void qemu_laio_completion_cb(void *opaque)
     }
 }
 
+/*
+ * Requests that io_submit refused are completed from a bottom half so that
+ * their callbacks never run from within laio_submit() or laio_io_unplug().
+ */
+static void qemu_laio_failed_bh(void *opaque)
+{
+    struct qemu_laio_state *s = opaque;
+    struct qemu_laiocb *laiocb;
+
+    while ((laiocb = QLIST_FIRST(&s->failed_reqs)) != NULL) {
+        QLIST_REMOVE(laiocb, node);
+        qemu_laio_enqueue_completed(s, laiocb);
+    }
+}
+
+static void qemu_laio_submit_pending(struct qemu_laio_state *s)
+{
+    int done = 0;
+    int ret = 0;
+
+    while (done < s->npending) {
+        ret = io_submit(s->ctx, s->npending - done, &s->pending[done]);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            break;
+        }
+        done += ret;
+    }
+
+    /* fail whatever the kernel did not take */
+    if (done < s->npending) {
+        for (; done < s->npending; done++) {
+            struct qemu_laiocb *laiocb =
+                    container_of(s->pending[done], struct qemu_laiocb, iocb);
+
+            laiocb->ret = ret < 0 ? ret : -EIO;
+            QLIST_INSERT_HEAD(&s->failed_reqs, laiocb, node);
+        }
+        qemu_bh_schedule(s->failed_bh);
+    }
+    s->npending = 0;
+}
+
 static int qemu_laio_flush_cb(void *opaque)
 {
     struct qemu_laio_state *s = opaque;
 
+    /* someone is about to wait for requests, they must not stay queued */
+    if (s->npending > 0) {
+        qemu_laio_submit_pending(s);
+    }
     return (s->count > 0) ? 1 : 0;
 }
 
+void laio_io_plug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->plugged++;
+}
+
+void laio_io_unplug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->plugged > 0);
+    if (--s->plugged == 0 && s->npending > 0) {
+        qemu_laio_submit_pending(s);
+    }
+}
+
 static void laio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
@@ -162,6 +235,16 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    /* make sure the kernel knows about the request before cancelling it */
+    if (laiocb->ctx->npending > 0) {
+        qemu_laio_submit_pending(laiocb->ctx);
+        if (laiocb->ret != -EINPROGRESS) {
+            /* still on failed_reqs, complete it without a callback */
+            laiocb->ret = -ECANCELED;
+            return;
+        }
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -221,6 +304,19 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         goto out_free_aiocb;
     }
     io_set_eventfd(&laiocb->iocb, s->efd);
+
+    if (s->plugged) {
+        if (s->count >= MAX_EVENTS) {
+            goto out_free_aiocb_only;
+        }
+        s->count++;
+        s->pending[s->npending++] = iocbs;
+        if (s->npending == MAX_EVENTS) {
+            qemu_laio_submit_pending(s);
+        }
+        return &laiocb->common;
+    }
+
     s->count++;
 
     if (io_submit(s->ctx, 1, &iocbs) < 0)
@@ -232,6 +328,9 @@ out_free_aiocb:
 out_dec_count:
     s->count--;
     return NULL;
+out_free_aiocb_only:
+    qemu_aio_release(laiocb);
+    return NULL;
 }
 
 void *laio_init(void)
@@ -240,6 +339,7 @@ void *laio_init(void)
 
     s = qemu_mallocz(sizeof(*s));
     QLIST_INIT(&s->completed_reqs);
+    QLIST_INIT(&s->failed_reqs);
     s->efd = eventfd(0, 0);
     if (s->efd == -1)
         goto out_free_state;
@@ -250,6 +350,7 @@ void *laio_init(void)
 
     qemu_aio_set_fd_handler(s->efd, qemu_laio_completion_cb, NULL,
         qemu_laio_flush_cb, qemu_laio_process_requests, s);
+    s->failed_bh = qemu_bh_new(qemu_laio_failed_bh, s);
 
     return s;
 
@@ -0,0 +1,179 @@
+/*
+ * QEMU compression threads, used by migration and qemu-img convert
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include <zlib.h>
+#include "qemu-common.h"
+#include "qemu-thread.h"
+#include "migration-compress.h"
+
+#define COMPRESS_MAX_THREADS 64
+
+static QemuMutex compress_lock;
+static QemuCond compress_request_cond;
+static QemuCond compress_done_cond;
+static QTAILQ_HEAD(, CompressJob) compress_queue;
+static int compress_threads;
+
+static int buffer_is_zero(const uint8_t *buf, unsigned long len)
+{
+    const unsigned long *p = (const unsigned long *)buf;
+    unsigned long i;
+
+    for (i = 0; i < len / sizeof(unsigned long); i++) {
+        if (p[i]) {
+            return 0;
+        }
+    }
+    for (i *= sizeof(unsigned long); i < len; i++) {
+        if (buf[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Same parameters as the serial code in block/qcow2.c, so that the output
+   does not depend on whether it was compressed here or there */
+static int deflate_raw(CompressJob *job, uLongf *len)
+{
+    z_stream strm;
+    int ret;
+
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != Z_OK) {
+        return -EIO;
+    }
+    strm.next_in = (uint8_t *)job->in;
+    strm.avail_in = job->in_len;
+    strm.next_out = job->out;
+    strm.avail_out = *len;
+
+    ret = deflate(&strm, Z_FINISH);
+    *len = strm.next_out - job->out;
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END || *len >= job->in_len) {
+        return -ENOSPC;
+    }
+    return 0;
+}
+
+static int compress_job_run(CompressJob *job, uLongf *len)
+{
+    if (job->skip_zero && buffer_is_zero(job->in, job->in_len)) {
+        *len = 0;
+        return 0;
+    }
+    if (job->raw) {
+        return deflate_raw(job, len);
+    }
+    if (job->decompress) {
+        return uncompress(job->out, len, job->in, job->in_len) == Z_OK ?
+               0 : -EIO;
+    }
+    return compress2(job->out, len, job->in, job->in_len, Z_BEST_SPEED) ==
+           Z_OK ? 0 : -EIO;
+}
+
+static void *compress_thread(void *opaque)
+{
+    CompressJob *job;
+    uLongf len;
+    int ret;
+
+    for (;;) {
+        qemu_mutex_lock(&compress_lock);
+        while (QTAILQ_EMPTY(&compress_queue)) {
+            qemu_cond_wait(&compress_request_cond, &compress_lock);
+        }
+        job = QTAILQ_FIRST(&compress_queue);
+        QTAILQ_REMOVE(&compress_queue, job, next);
+        qemu_mutex_unlock(&compress_lock);
+
+        len = job->out_len;
+        ret = compress_job_run(job, &len);
+
+        qemu_mutex_lock(&compress_lock);
+        job->out_len = len;
+        job->ret = ret;
+        job->done = 1;
+        qemu_cond_broadcast(&compress_done_cond);
+        qemu_mutex_unlock(&compress_lock);
+    }
+    return NULL;
+}
+
+/* Make sure that at least 'threads' workers run, or a default number
+   based on the host CPUs if 'threads' is 0.  Workers are never stopped.
+   Returns the number of workers.  */
+int compress_pool_start(int threads)
+{
+    QemuThread thread;
+
+    if (!compress_threads) {
+        qemu_mutex_init(&compress_lock);
+        qemu_cond_init(&compress_request_cond);
+        qemu_cond_init(&compress_done_cond);
+        QTAILQ_INIT(&compress_queue);
+    }
+    if (threads <= 0) {
+        if (compress_threads) {
+            return compress_threads;
+        }
+#ifdef _WIN32
+        threads = 2;
+#else
+        threads = MIN(MAX(sysconf(_SC_NPROCESSORS_ONLN), 1), 8);
+#endif
+    }
+    threads = MIN(threads, COMPRESS_MAX_THREADS);
+    while (compress_threads < threads) {
+        qemu_thread_create(&thread, compress_thread, NULL);
+        compress_threads++;
+    }
+    return compress_threads;
+}
+
+unsigned long compress_bound(unsigned long len)
+{
+    return compressBound(len);
+}
+
+void compress_job_submit(CompressJob *job)
+{
+    compress_pool_start(0);
+    job->done = 0;
+    qemu_mutex_lock(&compress_lock);
+    QTAILQ_INSERT_TAIL(&compress_queue, job, next);
+    qemu_cond_signal(&compress_request_cond);
+    qemu_mutex_unlock(&compress_lock);
+}
+
+/* Wait for a submitted job, returns 0 or a negative errno value */
+int compress_job_wait(CompressJob *job)
+{
+    qemu_mutex_lock(&compress_lock);
+    while (!job->done) {
+        qemu_cond_wait(&compress_done_cond, &compress_lock);
+    }
+    qemu_mutex_unlock(&compress_lock);
+    return job->ret;
+}
+
+/* Returns whether a submitted job has completed, without blocking */
+int compress_job_done(CompressJob *job)
+{
+    int done;
+
+    qemu_mutex_lock(&compress_lock);
+    done = job->done;
+    qemu_mutex_unlock(&compress_lock);
+    return done;
+}
@@ -0,0 +1,40 @@
+/*
+ * QEMU compression threads, used by migration and qemu-img convert
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_MIGRATION_COMPRESS_H
+#define QEMU_MIGRATION_COMPRESS_H
+
+#include "qemu-common.h"
+#include "qemu-queue.h"
+
+/* A buffer to deflate or inflate in a worker thread.  On submission
+   out_len is the size of 'out', on completion the length of the result.
+   'raw' selects the headerless deflate stream with a 4k window that qcow
+   and qcow2 use for compressed clusters; if it does not fit into 'out' the
+   job fails with -ENOSPC.  With 'skip_zero' an all-zero input is not
+   compressed at all and out_len is set to 0.  */
+typedef struct CompressJob {
+    int decompress;
+    int raw;
+    int skip_zero;
+    const uint8_t *in;
+    unsigned long in_len;
+    uint8_t *out;
+    unsigned long out_len;
+    int ret;
+    int done;
+    QTAILQ_ENTRY(CompressJob) next;
+} CompressJob;
+
+int compress_pool_start(int threads);
+unsigned long compress_bound(unsigned long len);
+void compress_job_submit(CompressJob *job);
+int compress_job_wait(CompressJob *job);
+int compress_job_done(CompressJob *job);
+
+#endif
@@ -180,6 +180,33 @@ int do_migrate_set_downtime(Monitor *mon, const QDict *qdict,
     return 0;
 }
 
+/* RAM compression threads, 0 to send pages uncompressed, and size of the
+   cache of previously sent pages used for delta compression */
+static int compress_threads;
+static int64_t compress_cache_size;
+
+int migrate_compress_threads(void)
+{
+    return compress_threads;
+}
+
+int64_t migrate_compress_cache_size(void)
+{
+    return compress_cache_size;
+}
+
+int do_migrate_set_compress(Monitor *mon, const QDict *qdict,
+                            QObject **ret_data)
+{
+    int64_t threads;
+
+    threads = qdict_get_int(qdict, "threads");
+    compress_threads = MAX(0, MIN(threads, 64));
+    compress_cache_size = MAX(0, qdict_get_try_int(qdict, "cache", 0));
+
+    return 0;
+}
+
 static void migrate_print_status(Monitor *mon, const char *name,
                                  const QDict *status_dict)
 {
@@ -66,6 +66,13 @@ uint64_t migrate_max_downtime(void);
 int do_migrate_set_downtime(Monitor *mon, const QDict *qdict,
                             QObject **ret_data);
 
+int migrate_compress_threads(void);
+
+int64_t migrate_compress_cache_size(void);
+
+int do_migrate_set_compress(Monitor *mon, const QDict *qdict,
+                            QObject **ret_data);
+
 void do_info_migrate_print(Monitor *mon, const QObject *data);
 
 void do_info_migrate(Monitor *mon, QObject **ret_data);
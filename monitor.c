@@ -43,6 +43,7 @@
 #include "audio/audio.h"
 #include "disas.h"
 #include "balloon.h"
+#include "stats.h"
 #include "qemu-timer.h"
 #include "migration.h"
 #include "kvm.h"
@@ -412,12 +413,9 @@ static void timestamp_put(QDict *qdict)
     qdict_put_obj(qdict, "timestamp", obj);
 }
 
-/**
- * monitor_protocol_event(): Generate a Monitor event
- *
- * Event-specific data can be emitted through the (optional) 'data' parameter.
- */
-void monitor_protocol_event(MonitorEvent event, QObject *data)
+/* Emit an event to target, or to all QMP monitors if target is NULL */
+static void monitor_protocol_event_emit(Monitor *target, MonitorEvent event,
+                                        QObject *data)
 {
     QDict *qmp;
     const char *event_name;
@@ -468,6 +466,9 @@ void monitor_protocol_event(MonitorEvent event, QObject *data)
         case QEVENT_SPICE_DISCONNECTED:
             event_name = "SPICE_DISCONNECTED";
             break;
+        case QEVENT_STATS:
+            event_name = "STATS";
+            break;
         default:
             abort();
             break;
@@ -482,6 +483,9 @@ void monitor_protocol_event(MonitorEvent event, QObject *data)
     }
 
     QLIST_FOREACH(mon, &mon_list, entry) {
+        if (target && mon != target) {
+            continue;
+        }
         if (monitor_ctrl_mode(mon) && qmp_cmd_mode(mon)) {
             monitor_json_emitter(mon, QOBJECT(qmp));
         }
@@ -489,6 +493,23 @@ void monitor_protocol_event(MonitorEvent event, QObject *data)
     QDECREF(qmp);
 }
 
+/**
+ * monitor_protocol_event(): Generate a Monitor event
+ *
+ * Event-specific data can be emitted through the (optional) 'data' parameter.
+ */
+void monitor_protocol_event(MonitorEvent event, QObject *data)
+{
+    monitor_protocol_event_emit(NULL, event, data);
+}
+
+/* Emit an event to one QMP monitor only */
+void monitor_protocol_event_mon(Monitor *mon, MonitorEvent event,
+                                QObject *data)
+{
+    monitor_protocol_event_emit(mon, event, data);
+}
+
 static int do_qmp_capabilities(Monitor *mon, const QDict *params,
                                QObject **ret_data)
 {
@@ -968,6 +989,16 @@ static void do_info_jit(Monitor *mon)
     dump_exec_info((FILE *)mon, monitor_fprintf);
 }
 
+static void do_info_tlb_stats(Monitor *mon)
+{
+    dump_tlb_stats((FILE *)mon, monitor_fprintf);
+}
+
+static void do_info_tb_profile(Monitor *mon)
+{
+    dump_tb_profile((FILE *)mon, monitor_fprintf);
+}
+
 static void do_info_history(Monitor *mon)
 {
     int i;
@@ -1218,6 +1249,37 @@ static int do_screen_dump(Monitor *mon, const QDict *qdict, QObject **ret_data)
     return 0;
 }
 
+static int do_record_start(Monitor *mon, const QDict *qdict,
+                           QObject **ret_data)
+{
+    const char *filename = qdict_get_str(qdict, "filename");
+    const char *format = qdict_get_try_str(qdict, "format");
+    int fps = qdict_get_try_int(qdict, "fps", 10);
+    int ret;
+
+    ret = record_start(get_displaystate(), filename, format, fps);
+    if (ret == -ENOTSUP) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "format",
+                      "mjpeg, png or ppm");
+        return -1;
+    } else if (ret == -EINVAL) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "fps",
+                      "a rate between 1 and 1000");
+        return -1;
+    } else if (ret < 0) {
+        qerror_report(QERR_OPEN_FILE_FAILED, filename);
+        return -1;
+    }
+    return 0;
+}
+
+static int do_record_stop(Monitor *mon, const QDict *qdict,
+                          QObject **ret_data)
+{
+    record_stop();
+    return 0;
+}
+
 static void do_logfile(Monitor *mon, const QDict *qdict)
 {
     cpu_set_log_filename(qdict_get_str(qdict, "filename"));
@@ -1252,6 +1314,18 @@ static void do_singlestep(Monitor *mon, const QDict *qdict)
     }
 }
 
+static void do_tb_profile(Monitor *mon, const QDict *qdict)
+{
+    const char *option = qdict_get_try_str(qdict, "option");
+    if (!option || !strcmp(option, "on")) {
+        tb_set_profiling(1);
+    } else if (!strcmp(option, "off")) {
+        tb_set_profiling(0);
+    } else {
+        monitor_printf(mon, "unexpected option %s\n", option);
+    }
+}
+
 /**
  * do_stop(): Stop VM execution
  */
@@ -2865,6 +2939,14 @@ static const mon_cmd_t info_cmds[] = {
         .user_print = bdrv_stats_print,
         .mhandler.info_new = bdrv_info_stats,
     },
+    {
+        .name       = "block-latency",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show block device latency histograms",
+        .user_print = bdrv_latency_print,
+        .mhandler.info_new = bdrv_info_stats,
+    },
     {
         .name       = "registers",
         .args_type  = "",
@@ -2934,6 +3016,20 @@ static const mon_cmd_t info_cmds[] = {
         .help       = "show dynamic compiler info",
         .mhandler.info = do_info_jit,
     },
+    {
+        .name       = "tlb-stats",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show per-CPU softmmu TLB statistics",
+        .mhandler.info = do_info_tlb_stats,
+    },
+    {
+        .name       = "tb-profile",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the most executed translated blocks",
+        .mhandler.info = do_info_tb_profile,
+    },
     {
         .name       = "kvm",
         .args_type  = "",
@@ -3015,6 +3111,14 @@ static const mon_cmd_t info_cmds[] = {
         .user_print = do_info_vnc_print,
         .mhandler.info_new = do_info_vnc,
     },
+    {
+        .name       = "record",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the display recorder status",
+        .user_print = do_info_record_print,
+        .mhandler.info_new = do_info_record,
+    },
 #if defined(CONFIG_SPICE)
     {
         .name       = "spice",
@@ -3212,6 +3316,14 @@ static const mon_cmd_t qmp_query_cmds[] = {
         .user_print = do_info_vnc_print,
         .mhandler.info_new = do_info_vnc,
     },
+    {
+        .name       = "record",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show the display recorder status",
+        .user_print = do_info_record_print,
+        .mhandler.info_new = do_info_record,
+    },
 #if defined(CONFIG_SPICE)
     {
         .name       = "spice",
@@ -5103,6 +5215,7 @@ static void monitor_control_event(void *opaque, int event)
         break;
     case CHR_EVENT_CLOSED:
         json_message_parser_destroy(&mon->mc->parser);
+        stats_monitor_closed(mon);
         break;
     }
 }
@@ -403,7 +403,10 @@ static ssize_t qemu_deliver_packet(VLANClientState *sender,
 
     if (ret == 0) {
         vc->receive_disabled = 1;
-    };
+    } else if (ret > 0) {
+        vc->rx_packets++;
+        vc->rx_bytes += ret;
+    }
 
     return ret;
 }
@@ -443,6 +446,9 @@ static ssize_t qemu_vlan_deliver_packet(VLANClientState *sender,
 
         if (len == 0) {
             vc->receive_disabled = 1;
+        } else if (len > 0) {
+            vc->rx_packets++;
+            vc->rx_bytes += len;
         }
 
         ret = (ret >= 0) ? ret : len;
@@ -500,6 +506,8 @@ static ssize_t qemu_send_packet_async_with_flags(VLANClientState *sender,
         return size;
     }
 
+    sender->tx_packets++;
+    sender->tx_bytes += size;
     if (sender->peer) {
         queue = sender->peer->send_queue;
     } else {
@@ -546,16 +554,23 @@ static ssize_t qemu_deliver_packet_iov(VLANClientState *sender,
                                        void *opaque)
 {
     VLANClientState *vc = opaque;
+    ssize_t ret;
 
     if (vc->link_down) {
         return iov_size(iov, iovcnt);
     }
 
     if (vc->info->receive_iov) {
-        return vc->info->receive_iov(vc, iov, iovcnt);
+        ret = vc->info->receive_iov(vc, iov, iovcnt);
     } else {
-        return vc_sendv_compat(vc, iov, iovcnt);
+        ret = vc_sendv_compat(vc, iov, iovcnt);
+    }
+
+    if (ret > 0) {
+        vc->rx_packets++;
+        vc->rx_bytes += ret;
     }
+    return ret;
 }
 
 static ssize_t qemu_vlan_deliver_packet_iov(VLANClientState *sender,
@@ -588,6 +603,11 @@ static ssize_t qemu_vlan_deliver_packet_iov(VLANClientState *sender,
             len = vc_sendv_compat(vc, iov, iovcnt);
         }
 
+        if (len > 0) {
+            vc->rx_packets++;
+            vc->rx_bytes += len;
+        }
+
         ret = (ret >= 0) ? ret : len;
     }
 
@@ -604,6 +624,8 @@ ssize_t qemu_sendv_packet_async(VLANClientState *sender,
         return iov_size(iov, iovcnt);
     }
 
+    sender->tx_packets++;
+    sender->tx_bytes += iov_size(iov, iovcnt);
     if (sender->peer) {
         queue = sender->peer->send_queue;
     } else {
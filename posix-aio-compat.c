@@ -69,6 +69,16 @@ static int cur_threads = 0;
 static int idle_threads = 0;
 static QTAILQ_HEAD(, qemu_paiocb) request_list;
 
+/* Requests queued by the main thread while plugged, see paio_io_plug() */
+static int plugged;
+static int nb_plugged;
+static QTAILQ_HEAD(, qemu_paiocb) plugged_list =
+    QTAILQ_HEAD_INITIALIZER(plugged_list);
+
+/* Set when a worker has signalled a completion that the main thread has
+   not looked at yet; later completions don't need another signal */
+static int completion_pending;
+
 #ifdef CONFIG_PREADV
 static int preadv_present = 1;
 #else
@@ -354,6 +364,11 @@ static void *aio_thread(void *unused)
         mutex_lock(&lock);
         aiocb->ret = ret;
         idle_threads++;
+        if (completion_pending) {
+            mutex_unlock(&lock);
+            continue;
+        }
+        completion_pending = 1;
         mutex_unlock(&lock);
 
         if (kill(pid, aiocb->ev_signo)) die("kill failed");
@@ -382,10 +397,47 @@ static void spawn_thread(void)
     if (sigprocmask(SIG_SETMASK, &oldset, NULL)) die("sigprocmask restore");
 }
 
+static void cond_broadcast(pthread_cond_t *cond)
+{
+    int ret = pthread_cond_broadcast(cond);
+    if (ret) die2(ret, "pthread_cond_broadcast");
+}
+
+/* Hand all plugged requests to the workers at once */
+static void paio_submit_plugged(void)
+{
+    struct qemu_paiocb *aiocb;
+    int n = nb_plugged;
+
+    if (n == 0) {
+        return;
+    }
+    nb_plugged = 0;
+
+    mutex_lock(&lock);
+    while (idle_threads < n && cur_threads < max_threads)
+        spawn_thread();
+    while ((aiocb = QTAILQ_FIRST(&plugged_list)) != NULL) {
+        QTAILQ_REMOVE(&plugged_list, aiocb, node);
+        QTAILQ_INSERT_TAIL(&request_list, aiocb, node);
+    }
+    mutex_unlock(&lock);
+    if (n == 1) {
+        cond_signal(&cond);
+    } else {
+        cond_broadcast(&cond);
+    }
+}
+
 static void qemu_paio_submit(struct qemu_paiocb *aiocb)
 {
     aiocb->ret = -EINPROGRESS;
     aiocb->active = 0;
+    if (plugged) {
+        QTAILQ_INSERT_TAIL(&plugged_list, aiocb, node);
+        nb_plugged++;
+        return;
+    }
     mutex_lock(&lock);
     if (idle_threads == 0 && cur_threads < max_threads)
         spawn_thread();
@@ -394,6 +446,19 @@ static void qemu_paio_submit(struct qemu_paiocb *aiocb)
     cond_signal(&cond);
 }
 
+void paio_io_plug(void)
+{
+    plugged++;
+}
+
+void paio_io_unplug(void)
+{
+    assert(plugged > 0);
+    if (--plugged == 0) {
+        paio_submit_plugged();
+    }
+}
+
 static ssize_t qemu_paio_return(struct qemu_paiocb *aiocb)
 {
     ssize_t ret;
@@ -491,12 +556,20 @@ static void posix_aio_read(void *opaque)
         break;
     }
 
+    /* from now on completions must be signalled again */
+    mutex_lock(&lock);
+    completion_pending = 0;
+    mutex_unlock(&lock);
+
     posix_aio_process_queue(s);
 }
 
 static int posix_aio_flush(void *opaque)
 {
     PosixAioState *s = opaque;
+
+    /* someone is about to wait for requests, they must not stay queued */
+    paio_submit_plugged();
     return !!s->first_aio;
 }
 
@@ -542,6 +615,9 @@ static void paio_cancel(BlockDriverAIOCB *blockacb)
 
     trace_paio_cancel(acb, acb->common.opaque);
 
+    /* the request may still be waiting for unplug */
+    paio_submit_plugged();
+
     mutex_lock(&lock);
     if (!acb->active) {
         QTAILQ_REMOVE(&request_list, acb, node);
@@ -35,6 +35,9 @@ void qemu_aio_flush(void);
  * result of executing I/O completion or bh callbacks. */
 void qemu_aio_wait(void);
 
+/* Returns 1 if there are outstanding AIO requests; 0 otherwise */
+int qemu_aio_pending(void);
+
 /*
  * Runs all currently allowed AIO callbacks of completed requests. Returns 0
  * if no requests were handled, non-zero if at least one request was
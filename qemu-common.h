@@ -229,6 +229,8 @@ typedef int IOCanReadHandler(void *opaque);
 typedef void IOHandler(void *opaque);
 
 void qemu_iohandler_fill(int *pnfds, fd_set *readfds, fd_set *writefds, fd_set *xfds);
+int qemu_iohandler_select(int nfds, fd_set *readfds, fd_set *writefds,
+                          fd_set *xfds, struct timeval *tv, int other_fds);
 void qemu_iohandler_poll(fd_set *readfds, fd_set *writefds, fd_set *xfds, int rc);
 
 struct ParallelIOArg {
@@ -283,6 +285,10 @@ typedef struct VirtIODevice VirtIODevice;
 typedef uint64_t pcibus_t;
 
 void cpu_exec_init_all(unsigned long tb_size);
+extern int tb_hot_threshold;
+extern int tb_profiling;
+void tb_set_profiling(int enable);
+int tb_perf_map_open(void);
 
 /* CPU save/load.  */
 void cpu_save(QEMUFile *f, void *opaque);
@@ -59,6 +59,10 @@ static QemuOptsList qemu_drive_opts = {
             .name = "aio",
             .type = QEMU_OPT_STRING,
             .help = "host AIO implementation (threads, native)",
+        },{
+            .name = "metadata-cache-size",
+            .type = QEMU_OPT_SIZE,
+            .help = "memory for image metadata caches (qcow2)",
         },{
             .name = "format",
             .type = QEMU_OPT_STRING,
@@ -27,6 +27,7 @@
 #include "osdep.h"
 #include "sysemu.h"
 #include "block_int.h"
+#include "migration-compress.h"
 #include <stdio.h>
 
 #ifdef _WIN32
@@ -73,6 +74,7 @@ static void help(void)
            "    name=value format. Use -o ? for an overview of the options supported by the\n"
            "    used format\n"
            "  '-c' indicates that target image must be compressed (qcow format only)\n"
+           "  '-m' is the number of parallel read and write requests of convert\n"
            "  '-u' enables unsafe rebasing. It is assumed that old and new backing file\n"
            "       match exactly. The image doesn't need a working backing file before\n"
            "       rebasing in this case (useful for renaming the backing file)\n"
@@ -564,16 +566,417 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
 
+/*
+ * Pipelined conversion: up to 'nb_requests' chunks of the input are read
+ * with AIO at the same time.  Plain output is written as soon as a chunk
+ * has been read, in whatever order the reads complete.  For compressed
+ * output worker threads check clusters for zeroes and deflate them, and the
+ * clusters are written in order because qcow and qcow2 append compressed
+ * data to the end of the image file.
+ */
+
+#define CONVERT_DEFAULT_REQUESTS 8
+#define CONVERT_MAX_REQUESTS 64
+
+enum {
+    CONVERT_FREE,
+    CONVERT_READING,
+    CONVERT_READ_DONE,
+    CONVERT_COMPRESSING,
+    CONVERT_WRITING,
+};
+
+typedef struct ConvertState ConvertState;
+
+typedef struct ConvertRequest {
+    ConvertState *s;
+    int state;
+    int64_t sector_num;
+    int nb_sectors;
+    int in_flight;
+    uint8_t *buf;
+    uint8_t *zbuf;
+    CompressJob job;
+} ConvertRequest;
+
+typedef struct ConvertIO {
+    ConvertRequest *req;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} ConvertIO;
+
+struct ConvertState {
+    BlockDriverState **bs;
+    int bs_n;
+    int bs_i;                   /* input image containing sector_num */
+    int64_t bs_offset;          /* first sector of bs[bs_i] */
+    uint64_t bs_sectors;        /* size of bs[bs_i] */
+    int64_t sector_num;         /* next sector to read */
+    int64_t total_sectors;
+    BlockDriverState *out_bs;
+    const char *out_baseimg;
+    int has_zero_init;
+    int cluster_sectors;        /* non-zero for compressed output */
+    int deflate;                /* compress in worker threads */
+    int nb_requests;
+    ConvertRequest *reqs;
+    int next;                   /* where to look for a free request */
+    int head;                   /* oldest request for ordered output */
+    int aio_in_flight;
+    int ret;
+};
+
+static void convert_error(ConvertState *s, int ret, const char *msg)
+{
+    if (!s->ret) {
+        error_report("%s", msg);
+        s->ret = ret;
+    }
+}
+
+/* Drop a reference to req.  While AIO is submitted a reference is held
+   for the submitter too, because some drivers complete requests before
+   bdrv_aio_readv/writev returns.  */
+static void convert_request_put(ConvertRequest *req)
+{
+    if (--req->in_flight == 0) {
+        req->state = (req->state == CONVERT_READING) ?
+                     CONVERT_READ_DONE : CONVERT_FREE;
+    }
+}
+
+static void convert_aio_cb(void *opaque, int ret)
+{
+    ConvertIO *io = opaque;
+    ConvertRequest *req = io->req;
+    ConvertState *s = req->s;
+
+    if (ret < 0) {
+        convert_error(s, ret, req->state == CONVERT_READING ?
+                      "error while reading" : "error while writing");
+    }
+    qemu_free(io);
+    s->aio_in_flight--;
+    convert_request_put(req);
+}
+
+static int convert_submit(ConvertRequest *req, BlockDriverState *bs,
+                          int64_t sector_num, uint8_t *buf, int nb_sectors,
+                          int is_write)
+{
+    ConvertState *s = req->s;
+    ConvertIO *io;
+    BlockDriverAIOCB *acb;
+
+    io = qemu_malloc(sizeof(*io));
+    io->req = req;
+    io->iov.iov_base = buf;
+    io->iov.iov_len = nb_sectors * 512;
+    qemu_iovec_init_external(&io->qiov, &io->iov, 1);
+
+    req->in_flight++;
+    s->aio_in_flight++;
+    if (is_write) {
+        acb = bdrv_aio_writev(bs, sector_num, &io->qiov, nb_sectors,
+                              convert_aio_cb, io);
+    } else {
+        acb = bdrv_aio_readv(bs, sector_num, &io->qiov, nb_sectors,
+                             convert_aio_cb, io);
+    }
+    if (!acb) {
+        req->in_flight--;
+        s->aio_in_flight--;
+        qemu_free(io);
+        convert_error(s, -EIO, is_write ? "error while writing" :
+                      "error while reading");
+        return -EIO;
+    }
+    return 0;
+}
+
+/* Move to the input image that contains s->sector_num */
+static void convert_find_input(ConvertState *s)
+{
+    while (s->sector_num - s->bs_offset >= s->bs_sectors) {
+        s->bs_i++;
+        assert(s->bs_i < s->bs_n);
+        s->bs_offset += s->bs_sectors;
+        bdrv_get_geometry(s->bs[s->bs_i], &s->bs_sectors);
+    }
+}
+
+/* Start reading the next chunk of input into req, returns 0 if there is
+   nothing left to read */
+static int convert_read(ConvertState *s, ConvertRequest *req)
+{
+    uint8_t *buf;
+    int n, n1;
+
+    for (;;) {
+        if (s->sector_num >= s->total_sectors) {
+            return 0;
+        }
+        convert_find_input(s);
+
+        if (s->cluster_sectors) {
+            /* a cluster may span several input images */
+            n = MIN(s->cluster_sectors, s->total_sectors - s->sector_num);
+            break;
+        }
+        n = MIN(IO_BUF_SIZE / 512, s->bs_offset + s->bs_sectors -
+                s->sector_num);
+
+        /* If the output image is being created as a copy on write image,
+           assume that sectors which are unallocated in the input image
+           are present in both the output's and input's base images (no
+           need to copy them). */
+        if (!s->has_zero_init || !s->out_baseimg) {
+            break;
+        }
+        if (bdrv_is_allocated(s->bs[s->bs_i], s->sector_num - s->bs_offset,
+                              n, &n1)) {
+            /* The next 'n1' sectors are allocated in the input image. Copy
+               only those as they may be followed by unallocated sectors. */
+            n = n1;
+            break;
+        }
+        s->sector_num += n1;
+    }
+
+    req->state = CONVERT_READING;
+    req->sector_num = s->sector_num;
+    req->nb_sectors = n;
+    req->in_flight++;
+    buf = req->buf;
+    while (n > 0) {
+        convert_find_input(s);
+        n1 = MIN(n, s->bs_offset + s->bs_sectors - s->sector_num);
+        if (convert_submit(req, s->bs[s->bs_i], s->sector_num - s->bs_offset,
+                           buf, n1, 0) < 0) {
+            break;
+        }
+        s->sector_num += n1;
+        buf += n1 * 512;
+        n -= n1;
+    }
+    convert_request_put(req);
+    s->next = (req - s->reqs + 1) % s->nb_requests;
+    return 1;
+}
+
+static void convert_write(ConvertState *s, ConvertRequest *req)
+{
+    int64_t sector_num = req->sector_num;
+    uint8_t *buf = req->buf;
+    int n = req->nb_sectors, n1;
+
+    req->state = CONVERT_WRITING;
+    req->in_flight++;
+    while (n > 0 && !s->ret) {
+        /* If the output image is being created as a copy on write image,
+           copy all sectors even the ones containing only NUL bytes,
+           because they may differ from the sectors in the base image.
+
+           If the output is to a host device, we also write out
+           sectors that are entirely 0, since whatever data was
+           already there is garbage, not 0s. */
+        n1 = n;
+        if (!s->has_zero_init || s->out_baseimg ||
+            is_allocated_sectors(buf, n, &n1)) {
+            if (convert_submit(req, s->out_bs, sector_num, buf, n1, 1) < 0) {
+                break;
+            }
+        }
+        sector_num += n1;
+        buf += n1 * 512;
+        n -= n1;
+    }
+    convert_request_put(req);
+}
+
+static void convert_compress(ConvertState *s, ConvertRequest *req)
+{
+    int cluster_size = s->cluster_sectors * 512;
+
+    if (req->nb_sectors < s->cluster_sectors) {
+        memset(req->buf + req->nb_sectors * 512, 0,
+               cluster_size - req->nb_sectors * 512);
+    }
+    req->state = CONVERT_COMPRESSING;
+    if (s->deflate) {
+        req->job.raw = 1;
+        req->job.skip_zero = 1;
+        req->job.in = req->buf;
+        req->job.in_len = cluster_size;
+        req->job.out = req->zbuf;
+        req->job.out_len = cluster_size;
+        compress_job_submit(&req->job);
+    }
+}
+
+/* Write the oldest compressed cluster if it is ready, returns 1 if it
+   was retired */
+static int convert_retire(ConvertState *s)
+{
+    ConvertRequest *req = &s->reqs[s->head];
+    int ret = 0;
+
+    if (req->state != CONVERT_COMPRESSING) {
+        return 0;
+    }
+    if (s->deflate) {
+        if (!compress_job_done(&req->job)) {
+            return 0;
+        }
+        if (req->job.ret < 0 || req->job.out_len > 0) {
+            ret = bdrv_write_deflated(s->out_bs, req->sector_num, req->buf,
+                                      s->cluster_sectors, req->zbuf,
+                                      req->job.ret < 0 ? 0 :
+                                      req->job.out_len);
+        }
+    } else if (is_not_zero(req->buf, s->cluster_sectors * 512)) {
+        ret = bdrv_write_compressed(s->out_bs, req->sector_num, req->buf,
+                                    s->cluster_sectors);
+    }
+    if (ret < 0 && !s->ret) {
+        error_report("error while compressing sector %" PRId64,
+                     req->sector_num);
+        s->ret = ret;
+    }
+    req->state = CONVERT_FREE;
+    s->head = (s->head + 1) % s->nb_requests;
+    return 1;
+}
+
+/* Batch the requests issued by one pass over the pipeline */
+static void convert_plug(ConvertState *s, int plug)
+{
+    int i;
+
+    for (i = 0; i < s->bs_n; i++) {
+        if (plug) {
+            bdrv_io_plug(s->bs[i]);
+        } else {
+            bdrv_io_unplug(s->bs[i]);
+        }
+    }
+    if (plug) {
+        bdrv_io_plug(s->out_bs);
+    } else {
+        bdrv_io_unplug(s->out_bs);
+    }
+}
+
+static int convert_run(BlockDriverState **bs, int bs_n, int64_t total_sectors,
+                       BlockDriverState *out_bs, const char *out_baseimg,
+                       int cluster_sectors, int nb_requests)
+{
+    ConvertState state, *s = &state;
+    ConvertRequest *req;
+    int i, progress;
+
+    memset(s, 0, sizeof(*s));
+    s->bs = bs;
+    s->bs_n = bs_n;
+    bdrv_get_geometry(bs[0], &s->bs_sectors);
+    s->total_sectors = total_sectors;
+    s->out_bs = out_bs;
+    s->out_baseimg = out_baseimg;
+    s->has_zero_init = bdrv_has_zero_init(out_bs);
+    s->cluster_sectors = cluster_sectors;
+    s->deflate = cluster_sectors && out_bs->drv->bdrv_write_deflated;
+    if (s->deflate) {
+        /* keep all workers busy while the oldest cluster is written */
+        nb_requests = MAX(nb_requests, 2 * compress_pool_start(0));
+        nb_requests = MIN(nb_requests, CONVERT_MAX_REQUESTS);
+    }
+    s->nb_requests = nb_requests;
+    s->reqs = qemu_mallocz(nb_requests * sizeof(ConvertRequest));
+    for (i = 0; i < nb_requests; i++) {
+        s->reqs[i].s = s;
+        if (cluster_sectors) {
+            s->reqs[i].buf = qemu_malloc(cluster_sectors * 512);
+            s->reqs[i].zbuf = qemu_malloc(cluster_sectors * 512);
+        } else {
+            s->reqs[i].buf = qemu_malloc(IO_BUF_SIZE);
+        }
+    }
+
+    for (;;) {
+        progress = 0;
+        convert_plug(s, 1);
+        while (!s->ret) {
+            req = &s->reqs[s->next];
+            if (!cluster_sectors) {
+                for (i = 0; i < nb_requests; i++) {
+                    if (s->reqs[i].state == CONVERT_FREE) {
+                        req = &s->reqs[i];
+                        break;
+                    }
+                }
+            }
+            if (req->state != CONVERT_FREE || !convert_read(s, req)) {
+                break;
+            }
+            progress = 1;
+        }
+
+        for (i = 0; i < nb_requests; i++) {
+            req = &s->reqs[i];
+            if (req->state != CONVERT_READ_DONE) {
+                continue;
+            }
+            if (s->ret) {
+                req->state = CONVERT_FREE;
+            } else if (cluster_sectors) {
+                convert_compress(s, req);
+            } else {
+                convert_write(s, req);
+            }
+            progress = 1;
+        }
+
+        while (cluster_sectors && convert_retire(s)) {
+            progress = 1;
+        }
+        convert_plug(s, 0);
+
+        if (progress) {
+            continue;
+        }
+        if (s->aio_in_flight) {
+            qemu_aio_wait();
+            continue;
+        }
+        req = &s->reqs[s->head];
+        if (s->deflate && req->state == CONVERT_COMPRESSING) {
+            compress_job_wait(&req->job);
+            continue;
+        }
+        break;
+    }
+
+    for (i = 0; i < nb_requests; i++) {
+        req = &s->reqs[i];
+        if (s->deflate && req->state == CONVERT_COMPRESSING) {
+            compress_job_wait(&req->job);
+        }
+        qemu_free(req->buf);
+        qemu_free(req->zbuf);
+    }
+    qemu_free(s->reqs);
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int c, ret = 0, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int nb_requests;
     const char *fmt, *out_fmt, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
+    int64_t total_sectors;
     uint64_t bs_sectors;
-    uint8_t * buf = NULL;
-    const uint8_t *buf1;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
@@ -584,8 +987,9 @@ static int img_convert(int argc, char **argv)
     out_fmt = "raw";
     out_baseimg = NULL;
     compress = 0;
+    nb_requests = CONVERT_DEFAULT_REQUESTS;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:m:");
         if (c == -1) {
             break;
         }
@@ -620,6 +1024,14 @@ static int img_convert(int argc, char **argv)
         case 's':
             snapshot_name = optarg;
             break;
+        case 'm':
+            nb_requests = strtol(optarg, NULL, 0);
+            if (nb_requests < 1 || nb_requests > CONVERT_MAX_REQUESTS) {
+                error_report("Invalid number of parallel requests '%s'",
+                             optarg);
+                return 1;
+            }
+            break;
         }
     }
 
@@ -754,11 +1166,6 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    bs_i = 0;
-    bs_offset = 0;
-    bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = qemu_malloc(IO_BUF_SIZE);
-
     if (compress) {
         ret = bdrv_get_info(out_bs, &bdi);
         if (ret < 0) {
@@ -772,152 +1179,19 @@ static int img_convert(int argc, char **argv)
             goto out;
         }
         cluster_sectors = cluster_size >> 9;
-        sector_num = 0;
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors) {
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_offset += bs_sectors;
-                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%" PRId64 ", "
-                       "bs_i=%d, bs_offset=%" PRId64 ", bs_sectors=%" PRId64
-                       "\n", sector_num, bs_i, bs_offset, bs_sectors); */
-                }
-                assert (bs_num < bs_sectors);
-
-                nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
-
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
-                if (ret < 0) {
-                    error_report("error while reading");
-                    goto out;
-                }
-
-                buf2 += nlow * 512;
-                bs_num += nlow;
-
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
+    } else {
+        cluster_sectors = 0;
+    }
 
-            if (n < cluster_sectors) {
-                memset(buf + n * 512, 0, cluster_size - n * 512);
-            }
-            if (is_not_zero(buf, cluster_size)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf,
-                                            cluster_sectors);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64,
-                          sector_num);
-                    goto out;
-                }
-            }
-            sector_num += n;
-        }
+    ret = convert_run(bs, bs_n, total_sectors, out_bs, out_baseimg,
+                      cluster_sectors, nb_requests);
+    if (ret == 0 && compress) {
         /* signal EOF to align */
         bdrv_write_compressed(out_bs, 0, NULL, 0);
-    } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
-
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
-
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading");
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors(buf1, n, &n1)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing");
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-        }
     }
 out:
     free_option_parameters(create_options);
     free_option_parameters(param);
-    qemu_free(buf);
     if (out_bs) {
         bdrv_delete(out_bs);
     }
@@ -120,7 +120,7 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
-    "       [,readonly=on|off]\n"
+    "       [,readonly=on|off][,metadata-cache-size=size]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -160,6 +160,11 @@ an untrusted format header.
 This option specifies the serial number to assign to the device.
 @item addr=@var{addr}
 Specify the controller's PCI address (if=virtio only).
+@item metadata-cache-size=@var{size}
+Memory to use at most for caching image metadata, such as the L2 tables
+and refcount blocks of qcow2 images (8M by default).  The cache starts
+small and grows up to this size as the guest touches more of the image.
+Hits and misses are shown by @code{info blockstats}.
 @end table
 
 By default, writethrough caching is used for all block device.  This means that
@@ -317,6 +322,34 @@ the raw disk image you use is not written back. You can however force
 the write back by pressing @key{C-a s} (@pxref{disk_images}).
 ETEXI
 
+DEF("blockstats-log", HAS_ARG, QEMU_OPTION_blockstats_log, \
+    "-blockstats-log file[,interval=ms]\n"
+    "                append the block device statistics to file periodically\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -blockstats-log @var{file}[,interval=@var{ms}]
+@findex -blockstats-log
+Every @var{ms} milliseconds of host time (1000 by default), append one line
+to @var{file} with the host and guest time and the output of the QMP command
+@code{query-blockstats}, including the latency histograms of all block
+devices.  Comparing it with the guest progress shows how much of the boot
+time is spent waiting for storage.
+ETEXI
+
+DEF("record", HAS_ARG, QEMU_OPTION_record, \
+    "-record file[,fps=n][,format=mjpeg|png|ppm]\n"
+    "                record the screen into file\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -record @var{file}[,fps=@var{n}][,format=@var{format}]
+@findex -record
+Record the screen from startup, like the @code{record_start} monitor command:
+at most @var{n} frames per second (10 by default), skipping frames that did
+not change.  @var{format} is @code{mjpeg} (the default when built with
+libjpeg), @code{png} or @code{ppm}.  Works with @option{-nographic} and
+@option{-display none}, so test runs can be recorded without a window.
+ETEXI
+
 DEF("m", HAS_ARG, QEMU_OPTION_m,
     "-m megs         set virtual RAM size to megs MB [default="
     stringify(DEFAULT_RAM_SIZE) "]\n", QEMU_ARCH_ALL)
@@ -335,6 +368,22 @@ STEXI
 Allocate guest RAM from a temporarily created file in @var{path}.
 ETEXI
 
+DEF("mem-template", HAS_ARG, QEMU_OPTION_mem_template,
+    "-mem-template dir\n"
+    "                start from a template saved with savevm_template,\n"
+    "                mapping its RAM copy-on-write\n", QEMU_ARCH_ALL)
+STEXI
+@item -mem-template @var{dir}
+@findex -mem-template
+Start the virtual machine from the template saved in @var{dir} by the
+@code{savevm_template} monitor command.  Guest RAM is mapped privately from
+the template files, so that pages the guest does not modify are shared, in
+the host page cache, by all the instances started from the same template;
+the device state is then loaded from @file{@var{dir}/vmstate}.  The machine
+options must match the ones the template was saved with.  Cannot be used
+with @option{-mem-path}, @option{-loadvm} or @option{-incoming}.
+ETEXI
+
 #ifdef MAP_POPULATE
 DEF("mem-prealloc", 0, QEMU_OPTION_mem_prealloc,
     "-mem-prealloc   preallocate guest memory (use with -mem-path)\n",
@@ -969,6 +1018,14 @@ option is set, VNC client may receive lossy framebuffer updates
 depending on its encoding settings. Enabling this option can save
 a lot of bandwidth at the expense of quality.
 
+@item threads=@var{n}
+
+Encode the framebuffer updates with @var{n} threads (at most 16) instead
+of one.  Updates of different clients are encoded in parallel; with the
+raw and hextile encodings, large updates are also split in tiles that
+several threads encode for the same client.  Only available if QEMU was
+built with the VNC encoding thread.
+
 @item non-adaptive
 
 Disable adaptive encodings. Adaptive encodings are enabled by default.
@@ -2201,6 +2258,37 @@ order cores with complex cache hierarchies.  The number of instructions
 executed often has little or no correlation with actual performance.
 ETEXI
 
+DEF("idle-fast-forward", 0, QEMU_OPTION_idle_fast_forward, \
+    "-idle-fast-forward\n" \
+    "                skip idle time: advance the virtual clock to the next\n" \
+    "                timer when all CPUs are halted and no I/O is pending\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -idle-fast-forward
+@findex -idle-fast-forward
+When all virtual CPUs are halted (for instance in WFI), no file descriptor is
+ready and no AIO request is in flight, advance the virtual clock straight to
+the next virtual clock timer instead of waiting for it in real time.  Guest
+timeouts and sleeps then take no wall clock time, which speeds up automated
+test runs.  The guest sees less real time pass than it expects, so this is
+not meant for interactive use.  It cannot be combined with @option{-icount}.
+ETEXI
+
+DEF("lazy-loadvm", 0, QEMU_OPTION_lazy_loadvm, \
+    "-lazy-loadvm    restore the RAM of snapshots on demand\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -lazy-loadvm
+@findex -lazy-loadvm
+When a snapshot is restored with @option{-loadvm} or the @code{loadvm}
+monitor command, start the guest before its RAM is read back.  Guest RAM is
+filled in on demand as the guest touches it, starting with the pages it was
+using when the snapshot was taken, while a background thread reads the
+rest.  This needs userfaultfd support in the host kernel and a qcow2 image
+on a local file; snapshots taken before this option existed, or that cannot
+be restored lazily, are loaded as usual.  Not available with KVM.
+ETEXI
+
 DEF("watchdog", HAS_ARG, QEMU_OPTION_watchdog, \
     "-watchdog i6300esb|ib700\n" \
     "                enable virtual hardware watchdog [default=none]\n",
@@ -2302,6 +2390,54 @@ STEXI
 Set TB size.
 ETEXI
 
+DEF("tb-hot-threshold", HAS_ARG, QEMU_OPTION_tb_hot_threshold, \
+    "-tb-hot-threshold n\n"
+    "                retranslate a TB as a superblock after n executions\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tb-hot-threshold @var{n}
+@findex -tb-hot-threshold
+Count how often each translated block runs, and retranslate a block as a
+superblock once it has run @var{n} times.  The superblock continues
+through direct forward branches within the same page.  The default
+is 0, which disables this.
+ETEXI
+
+DEF("tb-profile", 0, QEMU_OPTION_tb_profile, \
+    "-tb-profile     count translated block executions (see 'info tb-profile')\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tb-profile
+@findex -tb-profile
+Count how often each translated block runs from the start.  The hottest
+blocks are listed by the monitor command @code{info tb-profile}.  Counting
+can also be switched on and off later with @code{tb_profile}.
+ETEXI
+
+DEF("perf-map", 0, QEMU_OPTION_perf_map, \
+    "-perf-map       describe the generated code in /tmp/perf-<pid>.map\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -perf-map
+@findex -perf-map
+Write one line per translated block to @file{/tmp/perf-<pid>.map}, so that
+@command{perf report} can attribute samples in the code buffer to the guest
+code (and guest symbol, see @option{-guest-symbols}) they were generated
+from.
+ETEXI
+
+DEF("guest-symbols", HAS_ARG, QEMU_OPTION_guest_symbols, \
+    "-guest-symbols file\n"
+    "                read guest symbols from an nm style file\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -guest-symbols @var{file}
+@findex -guest-symbols
+Read guest symbols from @var{file}, with one @code{address [type] name} line
+per symbol as printed by @command{nm}.  The symbols are used by
+@option{-perf-map}, @code{info tb-profile} and the disassembly in logs.
+ETEXI
+
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming p     prepare for incoming migration, listen on port p\n",
     QEMU_ARCH_ALL)
@@ -15,6 +15,7 @@ struct QemuCond {
 
 struct QemuThread {
     HANDLE thread;
+    HANDLE handle;      /* the creator's, for qemu_thread_join */
     void *ret;
 };
 
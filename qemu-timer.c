@@ -46,6 +46,9 @@
    we use a local copy of hpet.h. */
 /* #include <linux/hpet.h> */
 #include "hpet.h"
+#ifdef CONFIG_TIMERFD
+#include <sys/timerfd.h>
+#endif
 #endif
 
 #ifdef _WIN32
@@ -211,6 +214,12 @@ static void unix_stop_timer(struct qemu_alarm_timer *t);
 
 #ifdef __linux__
 
+#ifdef CONFIG_TIMERFD
+static int timerfd_start_timer(struct qemu_alarm_timer *t);
+static void timerfd_stop_timer(struct qemu_alarm_timer *t);
+static void timerfd_rearm_timer(struct qemu_alarm_timer *t);
+#endif
+
 static int dynticks_start_timer(struct qemu_alarm_timer *t);
 static void dynticks_stop_timer(struct qemu_alarm_timer *t);
 static void dynticks_rearm_timer(struct qemu_alarm_timer *t);
@@ -283,6 +292,10 @@ int64_t qemu_icount_round(int64_t count)
 static struct qemu_alarm_timer alarm_timers[] = {
 #ifndef _WIN32
 #ifdef __linux__
+#ifdef CONFIG_TIMERFD
+    {"timerfd", timerfd_start_timer,
+     timerfd_stop_timer, timerfd_rearm_timer, NULL},
+#endif
     {"dynticks", dynticks_start_timer,
      dynticks_stop_timer, dynticks_rearm_timer, NULL},
     /* HPET - if available - is preferred */
@@ -386,6 +399,29 @@ void qemu_clock_enable(QEMUClock *clock, int enabled)
     clock->enabled = enabled;
 }
 
+int qemu_clock_has_timers(QEMUClock *clock)
+{
+    return active_timers[clock->type] != NULL;
+}
+
+/* Advance vm_clock to the expiry time of its first timer, as if the
+   guest had idled until then.  Only used without icount, which has its
+   own way to skip idle time.  */
+void qemu_clock_warp(QEMUClock *clock)
+{
+    int64_t delta;
+
+    if (clock != vm_clock || use_icount || !vm_running ||
+        !active_timers[QEMU_CLOCK_VIRTUAL]) {
+        return;
+    }
+    delta = active_timers[QEMU_CLOCK_VIRTUAL]->expire_time -
+        qemu_get_clock_ns(vm_clock);
+    if (delta > 0) {
+        timers_state.cpu_clock_offset += delta;
+    }
+}
+
 QEMUTimer *qemu_new_timer(QEMUClock *clock, int scale,
                           QEMUTimerCB *cb, void *opaque)
 {
@@ -901,6 +937,115 @@ static void dynticks_rearm_timer(struct qemu_alarm_timer *t)
     }
 }
 
+#ifdef CONFIG_TIMERFD
+
+/* The timerfd timer is a one-shot timer like dynticks, but it expires
+   through an fd handler of the main loop rather than through a signal:
+   the main loop wakes up from epoll_wait() and runs the timers without
+   any EINTR.  Without the I/O thread the CPUs run in the main loop thread
+   too, and only a signal gets them out of a chain of TBs, so there a
+   dynticks timer with the same deadline kicks them.  */
+
+typedef struct TimerfdState {
+    int fd;
+#ifndef CONFIG_IOTHREAD
+    struct qemu_alarm_timer kick;
+#endif
+} TimerfdState;
+
+static void timerfd_read(void *opaque)
+{
+    struct qemu_alarm_timer *t = opaque;
+    TimerfdState *s = t->priv;
+    uint64_t expirations;
+
+    if (read(s->fd, &expirations, sizeof(expirations)) !=
+        sizeof(expirations)) {
+        return;
+    }
+    t->expired = 1;
+    t->pending = 1;
+}
+
+static int timerfd_start_timer(struct qemu_alarm_timer *t)
+{
+    TimerfdState *s;
+
+    s = qemu_mallocz(sizeof(*s));
+    s->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (s->fd < 0) {
+        qemu_free(s);
+        return -1;
+    }
+#ifndef CONFIG_IOTHREAD
+    s->kick.rearm = dynticks_rearm_timer;
+    if (dynticks_start_timer(&s->kick)) {
+        close(s->fd);
+        qemu_free(s);
+        return -1;
+    }
+#endif
+
+    t->priv = s;
+    qemu_set_fd_handler(s->fd, timerfd_read, NULL, t);
+    return 0;
+}
+
+static void timerfd_stop_timer(struct qemu_alarm_timer *t)
+{
+    TimerfdState *s = t->priv;
+
+    qemu_set_fd_handler(s->fd, NULL, NULL, NULL);
+    close(s->fd);
+#ifndef CONFIG_IOTHREAD
+    dynticks_stop_timer(&s->kick);
+#endif
+    qemu_free(s);
+}
+
+static void timerfd_rearm_timer(struct qemu_alarm_timer *t)
+{
+    TimerfdState *s = t->priv;
+    struct itimerspec timeout;
+    int64_t nearest_delta_ns = INT64_MAX;
+    int64_t current_ns;
+
+    assert(alarm_has_dynticks(t));
+    if (!active_timers[QEMU_CLOCK_REALTIME] &&
+        !active_timers[QEMU_CLOCK_VIRTUAL] &&
+        !active_timers[QEMU_CLOCK_HOST])
+        return;
+
+    nearest_delta_ns = qemu_next_alarm_deadline();
+    if (nearest_delta_ns < MIN_TIMER_REARM_NS)
+        nearest_delta_ns = MIN_TIMER_REARM_NS;
+
+    /* check whether a timer is already running */
+    if (timerfd_gettime(s->fd, &timeout)) {
+        perror("timerfd_gettime");
+        fprintf(stderr, "Internal timer error: aborting\n");
+        exit(1);
+    }
+    current_ns = timeout.it_value.tv_sec * 1000000000LL + timeout.it_value.tv_nsec;
+    if (current_ns && current_ns <= nearest_delta_ns)
+        return;
+
+    timeout.it_interval.tv_sec = 0;
+    timeout.it_interval.tv_nsec = 0; /* 0 for one-shot timer */
+    timeout.it_value.tv_sec =  nearest_delta_ns / 1000000000;
+    timeout.it_value.tv_nsec = nearest_delta_ns % 1000000000;
+    if (timerfd_settime(s->fd, 0 /* RELATIVE */, &timeout, NULL)) {
+        perror("timerfd_settime");
+        fprintf(stderr, "Internal timer error: aborting\n");
+        exit(1);
+    }
+#ifndef CONFIG_IOTHREAD
+    dynticks_rearm_timer(&s->kick);
+#endif
+}
+
+#endif /* CONFIG_TIMERFD */
+
 #endif /* defined(__linux__) */
 
 #if !defined(_WIN32)
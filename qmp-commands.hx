@@ -176,6 +176,125 @@ Example:
 -> { "execute": "screendump", "arguments": { "filename": "/tmp/image" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "record_start",
+        .args_type  = "filename:F,fps:i?,format:s?",
+        .params     = "filename [fps [format]]",
+        .help       = "record the screen into 'filename' (mjpeg, png or ppm)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_record_start,
+    },
+
+SQMP
+record_start
+------------
+
+Record the screen.  Unchanged frames are skipped, and every frame is tagged
+with the host and guest time it was captured at.
+
+Arguments:
+
+- "filename": file path, or file name prefix for png and ppm (json-string)
+- "fps": maximum frames per second, 10 by default (json-int, optional)
+- "format": "mjpeg" (default), "png" or "ppm" (json-string, optional)
+
+Example:
+
+-> { "execute": "record_start",
+     "arguments": { "filename": "/tmp/run.mjpeg", "fps": 30 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "record_stop",
+        .args_type  = "",
+        .params     = "",
+        .help       = "stop recording the screen",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_record_stop,
+    },
+
+SQMP
+record_stop
+-----------
+
+Stop recording the screen.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "record_stop" }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "stats-subscribe",
+        .args_type  = "interval:i,counters:s?",
+        .params     = "interval [counters]",
+        .help       = "send STATS events every 'interval' ms",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_stats_subscribe,
+    },
+
+SQMP
+stats-subscribe
+---------------
+
+Send a STATS event with the selected counters to this client every
+interval.  A new subscription replaces the previous one.
+
+The counters are sent as a plain list of numbers; their names come with
+the first event and whenever the list changes.  The counters are:
+
+- "cpu": per CPU "tbs" (translation blocks entered from the execution
+  loop, chained blocks not counted), "tlb-misses" and "tlb-fills", and
+  "cpu.insns" with -icount
+- "block": per drive "rd-bytes", "wr-bytes", "rd-ops", "wr-ops" and
+  "flush-ops"
+- "net": per NIC "rx-packets", "rx-bytes", "tx-packets" and "tx-bytes"
+- "display": "display.frames", screen refreshes that found changes
+
+Arguments:
+
+- "interval": milliseconds between events, 10 to 3600000 (json-int)
+- "counters": comma separated list of counter groups, all of them by
+  default (json-string, optional)
+
+Example:
+
+-> { "execute": "stats-subscribe",
+     "arguments": { "interval": 100, "counters": "cpu,display" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "stats-unsubscribe",
+        .args_type  = "",
+        .params     = "",
+        .help       = "stop sending STATS events",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_stats_unsubscribe,
+    },
+
+SQMP
+stats-unsubscribe
+-----------------
+
+Stop sending STATS events to this client.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "stats-unsubscribe" }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -543,6 +662,34 @@ Example:
 -> { "execute": "migrate_set_downtime", "arguments": { "value": 0.1 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "migrate_set_compress",
+        .args_type  = "threads:i,cache:o?",
+        .params     = "threads [cache]",
+        .help       = "set RAM compression for migrations and snapshots",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_compress,
+    },
+
+SQMP
+migrate_set_compress
+--------------------
+
+Compress guest RAM in migrations and snapshots.
+
+Arguments:
+
+- "threads": number of compression threads, 0 to disable (json-int)
+- "cache": size in bytes of the cache of sent pages used for delta
+  compression, optional (json-int)
+
+Example:
+
+-> { "execute": "migrate_set_compress", "arguments": { "threads": 4 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1112,8 +1259,28 @@ Each json-object contain the following:
     - "wr_bytes": bytes written (json-int)
     - "rd_operations": read operations (json-int)
     - "wr_operations": write operations (json-int)
+    - "flush_operations": cache flush operations (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "rd_total_time_ns": total time spent on reads in nanoseconds (json-int)
+    - "wr_total_time_ns": total time spent on writes in nanoseconds
+                          (json-int)
+    - "flush_total_time_ns": total time spent on cache flushes in
+                             nanoseconds (json-int)
+    - "rd_latency", "wr_latency", "flush_latency": latency histograms
+      (json-array of json-int).  Element 0 counts the requests that took
+      less than 1 microsecond, element i those that took at least 2^(i-1)
+      and less than 2^i microseconds.  The last possible element (31) also
+      counts anything slower.  Empty elements at the end are omitted
+    - "metadata_cache_hits": lookups of image metadata served from the
+                             cache (json-int, only for formats with a
+                             metadata cache such as qcow2)
+    - "metadata_cache_misses": metadata reads from the image file (json-int,
+                               optional)
+    - "metadata_cache_readahead": metadata tables read ahead (json-int,
+                                  optional)
+    - "metadata_cache_bytes": memory currently used by the metadata cache
+                              (json-int, optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -1140,7 +1307,14 @@ Example:
                "wr_bytes":9786368,
                "wr_operations":692,
                "rd_bytes":122739200,
-               "rd_operations":36604
+               "rd_operations":36604,
+               "flush_operations":51,
+               "rd_total_time_ns":3465673657,
+               "wr_total_time_ns":1056780234,
+               "flush_total_time_ns":207354812,
+               "rd_latency":[0,0,0,0,2,31210,3890,1042,310,98,41,11],
+               "wr_latency":[0,0,0,0,0,12,488,133,42,13,4],
+               "flush_latency":[0,0,0,0,0,0,0,0,0,0,0,0,22,27,2]
             }
          },
          {
@@ -1561,6 +1735,44 @@ Example:
 
 EQMP
 
+SQMP
+query-record
+------------
+
+Show the display recorder status.
+
+Return a json-object with the following information:
+
+- "active": true if recording (json-bool)
+- "filename": file name or prefix (json-string, only when active)
+- "format": "mjpeg", "png" or "ppm" (json-string, only when active)
+- "fps": maximum frame rate (json-int, only when active)
+- "captured": frames handed to the writer thread (json-int, only when active)
+- "written": frames written (json-int, only when active)
+- "duplicates": updates that did not change the screen (json-int, only when
+  active)
+- "dropped": frames replaced before the writer got to them (json-int, only
+  when active)
+- "error": last write error (json-string, optional)
+
+Example:
+
+-> { "execute": "query-record" }
+<- {
+      "return":{
+         "active":true,
+         "filename":"/tmp/run.mjpeg",
+         "format":"mjpeg",
+         "fps":30,
+         "captured":412,
+         "written":409,
+         "duplicates":1570,
+         "dropped":3
+      }
+   }
+
+EQMP
+
 SQMP
 query-spice
 -----------
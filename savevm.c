@@ -1051,6 +1051,7 @@ typedef struct SaveStateEntry {
     int instance_id;
     int alias_id;
     int version_id;
+    int save_version_id;
     int section_id;
     SaveSetParamsHandler *set_params;
     SaveLiveStateHandler *save_live_state;
@@ -1116,6 +1117,7 @@ int register_savevm_live(DeviceState *dev,
 
     se = qemu_mallocz(sizeof(SaveStateEntry));
     se->version_id = version_id;
+    se->save_version_id = version_id;
     se->section_id = global_section_id++;
     se->set_params = set_params;
     se->save_live_state = save_live_state;
@@ -1190,6 +1192,21 @@ void unregister_savevm(DeviceState *dev, const char *idstr, void *opaque)
     }
 }
 
+/* Write the sections of a handler registered without a device with an
+   older version, for a stream that older builds can still load.  Streams
+   up to the registered version keep loading.  */
+void savevm_set_save_version(const char *idstr, void *opaque, int version_id)
+{
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        if (strcmp(se->idstr, idstr) == 0 && se->opaque == opaque) {
+            assert(version_id <= se->version_id);
+            se->save_version_id = version_id;
+        }
+    }
+}
+
 /* mark a device as not to be migrated, that is the device should be
    unplugged before migration */
 void register_device_unmigratable(DeviceState *dev, const char *idstr,
@@ -1227,6 +1244,7 @@ int vmstate_register_with_alias_id(DeviceState *dev, int instance_id,
 
     se = qemu_mallocz(sizeof(SaveStateEntry));
     se->version_id = vmsd->version_id;
+    se->save_version_id = vmsd->version_id;
     se->section_id = global_section_id++;
     se->save_live_state = NULL;
     se->save_state = NULL;
@@ -1492,7 +1510,7 @@ int qemu_savevm_state_begin(Monitor *mon, QEMUFile *f, int blk_enable,
         qemu_put_buffer(f, (uint8_t *)se->idstr, len);
 
         qemu_put_be32(f, se->instance_id);
-        qemu_put_be32(f, se->version_id);
+        qemu_put_be32(f, se->save_version_id);
 
         se->save_live_state(mon, f, QEMU_VM_SECTION_START, se->opaque);
     }
@@ -1572,7 +1590,7 @@ int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
         qemu_put_buffer(f, (uint8_t *)se->idstr, len);
 
         qemu_put_be32(f, se->instance_id);
-        qemu_put_be32(f, se->version_id);
+        qemu_put_be32(f, se->save_version_id);
 
         vmstate_save(f, se);
     }
@@ -1892,6 +1910,10 @@ static int del_existing_snapshots(Monitor *mon, const char *name)
     return 0;
 }
 
+/* ID of the snapshot that RAM matched last, the parent of the next
+   incremental snapshot */
+static char snapshot_parent[128];
+
 void do_savevm(Monitor *mon, const QDict *qdict)
 {
     BlockDriverState *bs, *bs1;
@@ -1908,6 +1930,13 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     struct tm tm;
 #endif
     const char *name = qdict_get_try_str(qdict, "name");
+    int incremental = qdict_get_try_bool(qdict, "incremental", 0);
+
+    if (incremental && (!snapshot_parent[0] || !ram_snapshot_has_baseline())) {
+        monitor_printf(mon, "No parent snapshot, enable incremental snapshots "
+                       "and take a full one first\n");
+        return;
+    }
 
     /* Verify if there is a device that doesn't support snapshots and is writable */
     bs = NULL;
@@ -1933,6 +1962,9 @@ void do_savevm(Monitor *mon, const QDict *qdict)
     saved_vm_running = vm_running;
     vm_stop(VMSTOP_SAVEVM);
 
+    /* an older snapshot may be replaced below */
+    ram_lazy_wait();
+
     memset(sn, 0, sizeof(*sn));
 
     /* fill auxiliary fields */
@@ -1966,6 +1998,13 @@ void do_savevm(Monitor *mon, const QDict *qdict)
 #endif
     }
 
+    if (incremental && name && bdrv_snapshot_find(bs, old_sn, name) >= 0 &&
+        !strcmp(old_sn->id_str, snapshot_parent)) {
+        monitor_printf(mon, "Cannot replace the parent snapshot '%s' with "
+                       "an incremental one\n", name);
+        goto the_end;
+    }
+
     /* Delete old snapshots of the same name */
     if (name && del_existing_snapshots(mon, name) < 0) {
         goto the_end;
@@ -1977,9 +2016,14 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "Could not open VM state file\n");
         goto the_end;
     }
+    ram_save_set_delta(incremental);
+    ram_index_start();
     ret = qemu_savevm_state(mon, f);
+    ram_index_save(f, incremental ? snapshot_parent : "");
+    ram_save_set_delta(0);
     vm_state_size = qemu_ftell(f);
     qemu_fclose(f);
+    snapshot_parent[0] = 0;
     if (ret < 0) {
         monitor_printf(mon, "Error %d while writing VM\n", ret);
         goto the_end;
@@ -2000,16 +2044,77 @@ void do_savevm(Monitor *mon, const QDict *qdict)
         }
     }
 
+    if (bdrv_snapshot_find(bs, old_sn, sn->name) >= 0) {
+        pstrcpy(snapshot_parent, sizeof(snapshot_parent), old_sn->id_str);
+        ram_snapshot_baseline();
+    }
+
  the_end:
     if (saved_vm_running)
         vm_start();
 }
 
+#define MAX_SNAPSHOT_CHAIN 256
+
+/* Load the VM state of snapshot 'id' and of its ancestors from 'bs',
+   oldest first, to restore an incremental snapshot.  Only the RAM of
+   these snapshots matters, the child state that is loaded last replaces
+   the device state.  */
+static int load_vmstate_parent(BlockDriverState *bs, const char *id,
+                               int depth)
+{
+    QEMUSnapshotInfo sn;
+    char parent[256];
+    QEMUFile *f;
+    int ret;
+
+    if (depth > MAX_SNAPSHOT_CHAIN) {
+        error_report("Snapshot chain too long");
+        return -ELOOP;
+    }
+    if (bdrv_snapshot_find(bs, &sn, id) < 0 || sn.vm_state_size == 0) {
+        error_report("Parent snapshot '%s' not found", id);
+        return -ENOENT;
+    }
+    ret = bdrv_snapshot_goto(bs, id);
+    if (ret < 0) {
+        return ret;
+    }
+
+    f = qemu_fopen_bdrv(bs, 0);
+    ret = ram_index_get_parent(f, sn.vm_state_size, parent);
+    qemu_fclose(f);
+    if (ret < 0) {
+        return ret;
+    }
+    if (parent[0]) {
+        ret = load_vmstate_parent(bs, parent, depth + 1);
+        if (ret < 0) {
+            return ret;
+        }
+        ret = bdrv_snapshot_goto(bs, id);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    f = qemu_fopen_bdrv(bs, 0);
+    ret = qemu_loadvm_state(f);
+    qemu_fclose(f);
+    if (ret < 0) {
+        error_report("Error %d while loading VM state of snapshot '%s'",
+                     ret, id);
+    }
+    return ret;
+}
+
 int load_vmstate(const char *name)
 {
     BlockDriverState *bs, *bs_vm_state;
     QEMUSnapshotInfo sn;
     QEMUFile *f;
+    char parent[256];
+    int64_t vm_state_size;
     int ret;
 
     bs_vm_state = bdrv_snapshots();
@@ -2027,6 +2132,7 @@ int load_vmstate(const char *name)
             "using qemu-img.");
         return -EINVAL;
     }
+    vm_state_size = sn.vm_state_size;
 
     /* Verify if there is any device that doesn't support snapshots and is
     writable and check if the requested snapshot is available too. */
@@ -2073,20 +2179,136 @@ int load_vmstate(const char *name)
         return -EINVAL;
     }
 
+    /* an incremental snapshot is applied on top of its parents */
+    ret = ram_index_get_parent(f, vm_state_size, parent);
+    if (ret == 0 && parent[0]) {
+        ret = load_vmstate_parent(bs_vm_state, parent, 1);
+        if (ret == 0) {
+            ret = bdrv_snapshot_goto(bs_vm_state, name);
+        }
+        qemu_fseek(f, 0, SEEK_SET);
+    }
+    if (ret < 0) {
+        qemu_fclose(f);
+        snapshot_parent[0] = 0;
+        return ret;
+    }
+
+    if (lazy_loadvm && !parent[0] &&
+        (ret = ram_lazy_start(f, bs_vm_state, vm_state_size)) < 0) {
+        error_report("Cannot restore RAM lazily (%s), loading it now",
+                     strerror(-ret));
+    }
     ret = qemu_loadvm_state(f);
+    ram_lazy_stream_end();
 
     qemu_fclose(f);
     if (ret < 0) {
+        snapshot_parent[0] = 0;
         error_report("Error %d while loading VM state", ret);
         return ret;
     }
 
+    /* the next incremental snapshot is relative to this one */
+    if (bdrv_snapshot_find(bs_vm_state, &sn, name) >= 0) {
+        pstrcpy(snapshot_parent, sizeof(snapshot_parent), sn.id_str);
+        ram_snapshot_baseline();
+    }
+
     return 0;
 }
 
+static char *vmstate_template_file(const char *dir)
+{
+    char *filename = qemu_malloc(strlen(dir) + 9);
+
+    sprintf(filename, "%s/vmstate", dir);
+    return filename;
+}
+
+/* Save the VM as a template: guest RAM goes to one file per RAM block,
+   that new VMs map copy-on-write with -mem-template, and the rest of the
+   state to the vmstate file they load at startup.  */
+void do_savevm_set_incremental(Monitor *mon, const QDict *qdict)
+{
+    int enable = qdict_get_bool(qdict, "enable");
+
+    ram_set_incremental(enable);
+    if (!enable) {
+        snapshot_parent[0] = 0;
+    }
+}
+
+void do_savevm_template(Monitor *mon, const QDict *qdict)
+{
+    const char *dir = qdict_get_str(qdict, "dir");
+    char *filename;
+    QEMUFile *f;
+    int saved_vm_running;
+    int ret;
+
+    if (qemu_savevm_state_blocked(mon)) {
+        return;
+    }
+
+    saved_vm_running = vm_running;
+    vm_stop(VMSTOP_SAVEVM);
+
+    ret = ram_template_save(dir);
+    if (ret < 0) {
+        monitor_printf(mon, "Could not write RAM template to '%s': %s\n",
+                       dir, strerror(-ret));
+        goto the_end;
+    }
+
+    filename = vmstate_template_file(dir);
+    f = qemu_fopen(filename, "wb");
+    if (!f) {
+        monitor_printf(mon, "Could not open VM state file '%s'\n", filename);
+    } else {
+        ret = qemu_savevm_state(mon, f);
+        qemu_fclose(f);
+        if (ret < 0) {
+            monitor_printf(mon, "Error %d while writing VM\n", ret);
+        }
+    }
+    qemu_free(filename);
+    ram_template_done();
+
+ the_end:
+    if (saved_vm_running)
+        vm_start();
+}
+
+/* Load the device state of a template whose RAM was mapped with
+   -mem-template */
+int load_vmstate_template(const char *dir)
+{
+    char *filename;
+    QEMUFile *f;
+    int ret;
+
+    filename = vmstate_template_file(dir);
+    f = qemu_fopen(filename, "rb");
+    if (!f) {
+        error_report("Could not open VM state file '%s'", filename);
+        qemu_free(filename);
+        return -EINVAL;
+    }
+    qemu_free(filename);
+
+    ret = qemu_loadvm_state(f);
+    qemu_fclose(f);
+    if (ret < 0) {
+        error_report("Error %d while loading VM state", ret);
+    }
+    return ret;
+}
+
 void do_delvm(Monitor *mon, const QDict *qdict)
 {
     BlockDriverState *bs, *bs1;
+    QEMUSnapshotInfo sn;
     int ret;
     const char *name = qdict_get_str(qdict, "name");
 
@@ -2096,6 +2318,14 @@ void do_delvm(Monitor *mon, const QDict *qdict)
         return;
     }
 
+    /* the clusters of a snapshot being restored must stay around */
+    ram_lazy_wait();
+
+    if (bdrv_snapshot_find(bs, &sn, name) >= 0 &&
+        !strcmp(sn.id_str, snapshot_parent)) {
+        snapshot_parent[0] = 0;
+    }
+
     bs1 = NULL;
     while ((bs1 = bdrv_next(bs1))) {
         if (bdrv_can_snapshot(bs1)) {
@@ -17,7 +17,12 @@
 
 #include <slirp.h>
 
-#define MBUF_THRESH 30
+/*
+ * Number of mbufs kept on the free list.  A full TCP window to the guest
+ * is about 45 segments per connection, which sit on the interface queues
+ * until the NIC takes them; below this many, m_get() never mallocs.
+ */
+#define MBUF_THRESH 512
 
 /*
  * Find a nice value for msize
@@ -688,14 +688,14 @@ void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
 }
 
 /* output the IP packet to the ethernet device */
-void if_encap(Slirp *slirp, const uint8_t *ip_data, int ip_data_len)
+void if_encap(Slirp *slirp, struct mbuf *ifm)
 {
     uint8_t buf[1600];
     struct ethhdr *eh = (struct ethhdr *)buf;
+    const uint8_t *ip_data = (const uint8_t *)ifm->m_data;
+    int ip_data_len = ifm->m_len;
+    int headroom;
 
-    if (ip_data_len + ETH_HLEN > sizeof(buf))
-        return;
-    
     if (!memcmp(slirp->client_ethaddr, zero_ethaddr, ETH_ALEN)) {
         uint8_t arp_req[ETH_HLEN + sizeof(struct arphdr)];
         struct ethhdr *reh = (struct ethhdr *)arp_req;
@@ -728,13 +728,27 @@ void if_encap(Slirp *slirp, const uint8_t *ip_data, int ip_data_len)
         slirp->client_ipaddr = iph->ip_dst;
         slirp_output(slirp->opaque, arp_req, sizeof(arp_req));
     } else {
+        /*
+         * The output paths leave IF_MAXLINKHDR bytes in front of the IP
+         * header: build the ethernet header there instead of copying the
+         * whole packet.
+         */
+        headroom = ifm->m_data - ((ifm->m_flags & M_EXT) ? ifm->m_ext
+                                                         : ifm->m_dat);
+        if (headroom >= ETH_HLEN) {
+            eh = (struct ethhdr *)(ifm->m_data - ETH_HLEN);
+        } else if (ip_data_len + ETH_HLEN > sizeof(buf)) {
+            return;
+        }
         memcpy(eh->h_dest, slirp->client_ethaddr, ETH_ALEN);
         memcpy(eh->h_source, special_ethaddr, ETH_ALEN - 4);
         /* XXX: not correct */
         memcpy(&eh->h_source[2], &slirp->vhost_addr, 4);
         eh->h_proto = htons(ETH_P_IP);
-        memcpy(buf + sizeof(struct ethhdr), ip_data, ip_data_len);
-        slirp_output(slirp->opaque, buf, ip_data_len + ETH_HLEN);
+        if (headroom < ETH_HLEN) {
+            memcpy(buf + sizeof(struct ethhdr), ip_data, ip_data_len);
+        }
+        slirp_output(slirp->opaque, (uint8_t *)eh, ip_data_len + ETH_HLEN);
     }
 }
 
@@ -0,0 +1,345 @@
+/*
+ * QEMU statistics subscriptions
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "sysemu.h"
+#include "monitor.h"
+#include "qemu-timer.h"
+#include "qemu-objects.h"
+#include "qerror.h"
+#include "exec-all.h"
+#include "block_int.h"
+#include "net.h"
+#include "console.h"
+#include "stats.h"
+
+/*
+ * A QMP client subscribes to groups of counters and gets a STATS event
+ * with their values every interval milliseconds, instead of polling a
+ * handful of query commands:
+ *
+ *   { "seq": 12, "interval": 100, "values": [ 1234, 56, ... ] }
+ *
+ * The values are the raw counters in a fixed order.  Their names only go
+ * along with the first event, and again whenever the order changes
+ * because a device came or went, so the events stay small.
+ *
+ * The event data is built once and the counters are written into it in
+ * place on every tick; a tick only walks the CPUs and devices and reads
+ * their counters.
+ */
+
+#define STATS_CPU       (1 << 0)
+#define STATS_BLOCK     (1 << 1)
+#define STATS_NET       (1 << 2)
+#define STATS_DISPLAY   (1 << 3)
+#define STATS_ALL       (STATS_CPU | STATS_BLOCK | STATS_NET | STATS_DISPLAY)
+
+#define STATS_MIN_INTERVAL 10
+#define STATS_MAX_INTERVAL (60 * 60 * 1000)
+
+typedef struct StatsSubscription StatsSubscription;
+
+struct StatsSubscription {
+    Monitor *mon;
+    QEMUTimer *timer;
+    int64_t interval;
+    int64_t deadline;
+    unsigned int groups;
+
+    /* counters read on this tick */
+    uint64_t *cur;
+    int nb_cur;
+    int max_cur;
+
+    /* layout of the values in the event data */
+    uint64_t layout;
+    int nb_values;
+
+    QDict *data;
+    QInt *seq;
+    QInt **values;
+
+    QLIST_ENTRY(StatsSubscription) next;
+};
+
+typedef struct StatsCollector {
+    StatsSubscription *sub;
+    uint64_t layout;        /* hash of the object names */
+    QList *names;           /* only when the layout is rebuilt */
+    const char *object;
+} StatsCollector;
+
+static QLIST_HEAD(, StatsSubscription) subscriptions =
+    QLIST_HEAD_INITIALIZER(subscriptions);
+
+static void stats_object(StatsCollector *c, const char *object)
+{
+    const char *p;
+
+    for (p = object; *p; p++) {
+        c->layout = (c->layout ^ (uint8_t)*p) * 0x100000001b3ULL;
+    }
+    c->layout = (c->layout ^ '/') * 0x100000001b3ULL;
+    c->object = object;
+}
+
+static void stats_value(StatsCollector *c, const char *counter,
+                        uint64_t value)
+{
+    StatsSubscription *sub = c->sub;
+    char name[128];
+
+    if (sub->nb_cur == sub->max_cur) {
+        sub->max_cur = sub->max_cur * 2 + 16;
+        sub->cur = qemu_realloc(sub->cur, sub->max_cur * sizeof(uint64_t));
+    }
+    sub->cur[sub->nb_cur++] = value;
+
+    if (c->names) {
+        snprintf(name, sizeof(name), "%s.%s", c->object, counter);
+        qlist_append(c->names, qstring_from_str(name));
+    }
+}
+
+static void stats_collect_cpu(StatsCollector *c)
+{
+    CPUState *env;
+    char object[16];
+
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        snprintf(object, sizeof(object), "cpu%d", env->cpu_index);
+        stats_object(c, object);
+        stats_value(c, "tbs", env->tb_dispatches);
+        stats_value(c, "tlb-misses", env->tlb_stats.lookups);
+        stats_value(c, "tlb-fills", env->tlb_stats.fills);
+    }
+    if (use_icount) {
+        stats_object(c, "cpu");
+        stats_value(c, "insns", qemu_icount);
+    }
+}
+
+static void stats_collect_block(void *opaque, BlockDriverState *bs)
+{
+    StatsCollector *c = opaque;
+    char object[64];
+
+    snprintf(object, sizeof(object), "block.%s", bdrv_get_device_name(bs));
+    stats_object(c, object);
+    stats_value(c, "rd-bytes", bs->rd_bytes);
+    stats_value(c, "wr-bytes", bs->wr_bytes);
+    stats_value(c, "rd-ops", bs->rd_ops);
+    stats_value(c, "wr-ops", bs->wr_ops);
+    stats_value(c, "flush-ops", bs->flush_ops);
+}
+
+static void stats_collect_nic(NICState *nic, void *opaque)
+{
+    StatsCollector *c = opaque;
+    char object[64];
+
+    snprintf(object, sizeof(object), "net.%s", nic->nc.name);
+    stats_object(c, object);
+    stats_value(c, "rx-packets", nic->nc.rx_packets);
+    stats_value(c, "rx-bytes", nic->nc.rx_bytes);
+    stats_value(c, "tx-packets", nic->nc.tx_packets);
+    stats_value(c, "tx-bytes", nic->nc.tx_bytes);
+}
+
+static void stats_collect(StatsSubscription *sub, StatsCollector *c,
+                          QList *names)
+{
+    c->sub = sub;
+    c->layout = 0xcbf29ce484222325ULL;
+    c->names = names;
+    sub->nb_cur = 0;
+
+    if (sub->groups & STATS_CPU) {
+        stats_collect_cpu(c);
+    }
+    if (sub->groups & STATS_BLOCK) {
+        bdrv_iterate(stats_collect_block, c);
+    }
+    if (sub->groups & STATS_NET) {
+        qemu_foreach_nic(stats_collect_nic, c);
+    }
+    if (sub->groups & STATS_DISPLAY) {
+        stats_object(c, "display");
+        stats_value(c, "frames", get_displaystate()->frames);
+    }
+}
+
+/* Collect again with the names, and rebuild the list of values */
+static void stats_rebuild(StatsSubscription *sub)
+{
+    StatsCollector c;
+    QList *values;
+    QList *names;
+    int i;
+
+    names = qlist_new();
+    stats_collect(sub, &c, names);
+
+    values = qlist_new();
+    sub->values = qemu_realloc(sub->values,
+                               (sub->nb_cur + 1) * sizeof(QInt *));
+    for (i = 0; i < sub->nb_cur; i++) {
+        sub->values[i] = qint_from_int(0);
+        qlist_append(values, sub->values[i]);
+    }
+    qdict_put(sub->data, "values", values);
+    qdict_put(sub->data, "names", names);
+    sub->layout = c.layout;
+    sub->nb_values = sub->nb_cur;
+}
+
+static void stats_tick(void *opaque)
+{
+    StatsSubscription *sub = opaque;
+    int64_t now = qemu_get_clock_ms(rt_clock);
+    StatsCollector c;
+    int i;
+
+    stats_collect(sub, &c, NULL);
+    if (c.layout != sub->layout || sub->nb_cur != sub->nb_values) {
+        stats_rebuild(sub);
+    }
+    /* Nobody else holds a reference to these, so they can be updated
+       in place instead of being replaced.  */
+    for (i = 0; i < sub->nb_values; i++) {
+        sub->values[i]->value = sub->cur[i];
+    }
+    monitor_protocol_event_mon(sub->mon, QEVENT_STATS, QOBJECT(sub->data));
+    if (qdict_haskey(sub->data, "names")) {
+        qdict_del(sub->data, "names");
+    }
+    sub->seq->value++;
+
+    /* stay on the interval grid, skipping ticks that were missed */
+    sub->deadline += sub->interval;
+    if (sub->deadline <= now) {
+        sub->deadline += ((now - sub->deadline) / sub->interval + 1) *
+                         sub->interval;
+    }
+    qemu_mod_timer(sub->timer, sub->deadline);
+}
+
+static StatsSubscription *stats_find(Monitor *mon)
+{
+    StatsSubscription *sub;
+
+    QLIST_FOREACH(sub, &subscriptions, next) {
+        if (sub->mon == mon) {
+            return sub;
+        }
+    }
+    return NULL;
+}
+
+static void stats_unsubscribe(StatsSubscription *sub)
+{
+    if (!sub) {
+        return;
+    }
+    QLIST_REMOVE(sub, next);
+    qemu_del_timer(sub->timer);
+    qemu_free_timer(sub->timer);
+    QDECREF(sub->data);
+    qemu_free(sub->values);
+    qemu_free(sub->cur);
+    qemu_free(sub);
+}
+
+static int stats_parse_groups(const char *p, unsigned int *groups)
+{
+    static const struct {
+        const char *name;
+        unsigned int group;
+    } names[] = {
+        { "cpu", STATS_CPU },
+        { "block", STATS_BLOCK },
+        { "net", STATS_NET },
+        { "display", STATS_DISPLAY },
+    };
+    size_t len;
+    int i;
+
+    if (!p) {
+        *groups = STATS_ALL;
+        return 0;
+    }
+
+    *groups = 0;
+    for (;;) {
+        len = strcspn(p, ",");
+        for (i = 0; i < ARRAY_SIZE(names); i++) {
+            if (strlen(names[i].name) == len &&
+                !strncmp(p, names[i].name, len)) {
+                *groups |= names[i].group;
+                break;
+            }
+        }
+        if (i == ARRAY_SIZE(names)) {
+            return -1;
+        }
+        if (p[len] == '\0') {
+            return 0;
+        }
+        p += len + 1;
+    }
+}
+
+int do_stats_subscribe(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    int64_t interval = qdict_get_int(qdict, "interval");
+    const char *counters = qdict_get_try_str(qdict, "counters");
+    StatsSubscription *sub;
+    unsigned int groups;
+
+    if (interval < STATS_MIN_INTERVAL || interval > STATS_MAX_INTERVAL) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "interval",
+                      "a number of milliseconds from 10 to 3600000");
+        return -1;
+    }
+    if (stats_parse_groups(counters, &groups) < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "counters",
+                      "a list of cpu, block, net and display");
+        return -1;
+    }
+
+    /* a new subscription replaces the old one */
+    stats_unsubscribe(stats_find(mon));
+
+    sub = qemu_mallocz(sizeof(*sub));
+    sub->mon = mon;
+    sub->interval = interval;
+    sub->groups = groups;
+    sub->nb_values = -1;
+    sub->data = qdict_new();
+    sub->seq = qint_from_int(0);
+    qdict_put(sub->data, "seq", sub->seq);
+    qdict_put(sub->data, "interval", qint_from_int(interval));
+
+    sub->timer = qemu_new_timer_ms(rt_clock, stats_tick, sub);
+    sub->deadline = qemu_get_clock_ms(rt_clock);
+    qemu_mod_timer(sub->timer, sub->deadline);
+    QLIST_INSERT_HEAD(&subscriptions, sub, next);
+    return 0;
+}
+
+int do_stats_unsubscribe(Monitor *mon, const QDict *qdict,
+                         QObject **ret_data)
+{
+    stats_unsubscribe(stats_find(mon));
+    return 0;
+}
+
+void stats_monitor_closed(Monitor *mon)
+{
+    stats_unsubscribe(stats_find(mon));
+}
@@ -0,0 +1,19 @@
+/*
+ * QEMU statistics subscriptions
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_STATS_H
+#define QEMU_STATS_H
+
+#include "monitor.h"
+
+int do_stats_subscribe(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_stats_unsubscribe(Monitor *mon, const QDict *qdict,
+                         QObject **ret_data);
+void stats_monitor_closed(Monitor *mon);
+
+#endif
@@ -79,6 +79,9 @@ void qemu_add_machine_init_done_notifier(Notifier *notify);
 void do_savevm(Monitor *mon, const QDict *qdict);
 int load_vmstate(const char *name);
 void do_delvm(Monitor *mon, const QDict *qdict);
+void do_savevm_template(Monitor *mon, const QDict *qdict);
+void do_savevm_set_incremental(Monitor *mon, const QDict *qdict);
+int load_vmstate_template(const char *dir);
 void do_info_snapshots(Monitor *mon);
 
 void cpu_synchronize_all_states(void);
@@ -97,6 +100,22 @@ int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f);
 void qemu_savevm_state_cancel(Monitor *mon, QEMUFile *f);
 int qemu_loadvm_state(QEMUFile *f);
 
+/* RAM templates (arch_init.c) */
+int ram_template_save(const char *dir);
+void ram_template_done(void);
+
+/* snapshots (arch_init.c) */
+void ram_index_start(void);
+void ram_index_save(QEMUFile *f, const char *parent);
+int ram_index_get_parent(QEMUFile *f, int64_t vm_state_size, char *parent);
+void ram_set_incremental(int enable);
+void ram_save_set_delta(int enable);
+void ram_snapshot_baseline(void);
+int ram_snapshot_has_baseline(void);
+int ram_lazy_start(QEMUFile *f, BlockDriverState *bs, int64_t vm_state_size);
+void ram_lazy_stream_end(void);
+void ram_lazy_wait(void);
+
 /* SLIRP */
 void do_info_slirp(Monitor *mon);
 
@@ -147,6 +166,8 @@ extern int cursor_hide;
 extern int graphic_rotate;
 extern int no_quit;
 extern int no_shutdown;
+extern int idle_fast_forward;
+extern int lazy_loadvm;
 extern int semihosting_enabled;
 extern int old_param;
 extern int boot_menu;
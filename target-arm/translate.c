@@ -718,7 +718,7 @@ static inline void gen_bx_im(DisasContext *s, uint32_t addr)
 {
     TCGv tmp;
 
-    s->is_jmp = DISAS_UPDATE;
+    s->is_jmp = DISAS_JUMP;
     if (s->thumb != (addr & 1)) {
         tmp = tcg_temp_new_i32();
         tcg_gen_movi_i32(tmp, addr & 1);
@@ -731,7 +731,7 @@ static inline void gen_bx_im(DisasContext *s, uint32_t addr)
 /* Set PC and Thumb state from var.  var is marked as dead.  */
 static inline void gen_bx(DisasContext *s, TCGv var)
 {
-    s->is_jmp = DISAS_UPDATE;
+    s->is_jmp = DISAS_JUMP;
     tcg_gen_andi_i32(cpu_R[15], var, ~1);
     tcg_gen_andi_i32(var, var, 1);
     store_cpu_field(var, thumb);
@@ -3394,6 +3394,29 @@ static inline void gen_goto_tb(DisasContext *s, int n, uint32_t dest)
     }
 }
 
+/* End the TB after a branch to a run time address: continue directly with
+   the next TB if it is already in the jump cache, otherwise go back to the
+   main loop.  Only the PC and Thumb bit may have changed.  */
+static inline void gen_goto_ptr(void)
+{
+    TCGv_ptr ptr = tcg_temp_local_new_ptr();
+
+    gen_helper_lookup_tb_ptr(ptr);
+    tcg_gen_goto_ptr(ptr);
+    tcg_temp_free_ptr(ptr);
+}
+
+/* In a superblock, unconditional direct branches forward within the page
+   are followed instead of ending the TB.  Keeping to forward branches
+   means [pc, pc + size) still covers all the code of the TB, so self
+   modifying code is detected as usual.  */
+static inline int gen_can_follow_jmp(DisasContext *s, uint32_t dest)
+{
+    return (s->tb->cflags & CF_HOT) && !s->condjmp && !s->condexec_mask &&
+           dest >= s->pc &&
+           (dest & TARGET_PAGE_MASK) == (s->tb->pc & TARGET_PAGE_MASK);
+}
+
 static inline void gen_jmp (DisasContext *s, uint32_t dest)
 {
     if (unlikely(s->singlestep_enabled)) {
@@ -3401,6 +3424,8 @@ static inline void gen_jmp (DisasContext *s, uint32_t dest)
         if (s->thumb)
             dest |= 1;
         gen_bx_im(s, dest);
+    } else if (gen_can_follow_jmp(s, dest)) {
+        s->pc = dest;
     } else {
         gen_goto_tb(s, 0, dest);
         s->is_jmp = DISAS_TB_JUMP;
@@ -9218,6 +9243,7 @@ static inline void gen_intermediate_code_internal(CPUState *env,
     if (max_insns == 0)
         max_insns = CF_COUNT_MASK;
 
+    gen_tb_count_start(tb);
     gen_icount_start();
 
     tcg_clear_temp_count();
@@ -9396,8 +9422,11 @@ static inline void gen_intermediate_code_internal(CPUState *env,
         case DISAS_NEXT:
             gen_goto_tb(dc, 1, dc->pc);
             break;
-        default:
         case DISAS_JUMP:
+            /* look the next TB up without leaving generated code */
+            gen_goto_ptr();
+            break;
+        default:
         case DISAS_UPDATE:
             /* indicate that the hash table must be used to find the next TB */
             tcg_gen_exit_tb(0);
@@ -9422,6 +9451,7 @@ static inline void gen_intermediate_code_internal(CPUState *env,
 
 done_generating:
     gen_icount_end(tb, num_insns);
+    gen_tb_count_end(tb);
     *gen_opc_ptr = INDEX_op_end;
 
 #ifdef DEBUG_DISAS
@@ -2186,6 +2186,24 @@ static inline void tcg_gen_goto_tb(int idx)
     tcg_gen_op1i(INDEX_op_goto_tb, idx);
 }
 
+/* Jump to the host code of a TB found at run time, or return to the main
+   loop (as tcg_gen_exit_tb(0)) if 'ptr' is NULL.  'ptr' must be a local
+   temporary since it is used after a branch.  */
+static inline void tcg_gen_goto_ptr(TCGv_ptr ptr)
+{
+    int l1 = gen_new_label();
+
+#if TCG_TARGET_REG_BITS == 32
+    tcg_gen_brcondi_i32(TCG_COND_EQ, ptr, 0, l1);
+    tcg_gen_op1_i32(INDEX_op_jmp, ptr);
+#else
+    tcg_gen_brcondi_i64(TCG_COND_EQ, ptr, 0, l1);
+    tcg_gen_op1_i64(INDEX_op_jmp, ptr);
+#endif
+    gen_set_label(l1);
+    tcg_gen_exit_tb(0);
+}
+
 #if TCG_TARGET_REG_BITS == 32
 static inline void tcg_gen_qemu_ld8u(TCGv ret, TCGv addr, int mem_index)
 {
@@ -0,0 +1,295 @@
+/*
+ * Benchmark of the audio mixing engine
+ *
+ * Compares the sample at a time conversion, clipping, mixing and
+ * resampling loops with the kernels of audio/mixeng_simd.h and the
+ * resampler of audio/rate_template.h, and checks that they give the same
+ * samples.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <sys/time.h>
+#include "config-host.h"
+#include "audio/mixeng_simd.h"
+
+#define xglue(x, y) x ## y
+#define glue(x, y) xglue(x, y)
+
+#define FRAMES  65536
+#define ITERS   100
+
+/* The generic code, built the way audio/mixeng.c builds it */
+#define ENDIAN_CONVERSION natural
+#define ENDIAN_CONVERT(v) (v)
+#define SIGNED
+
+#define IN_T int16_t
+#define IN_MIN SHRT_MIN
+#define IN_MAX SHRT_MAX
+#define SHIFT 16
+#include "audio/mixeng_template.h"
+#undef IN_MAX
+#undef IN_MIN
+#undef IN_T
+#undef SHIFT
+
+#define IN_T int32_t
+#define IN_MIN INT32_MIN
+#define IN_MAX INT32_MAX
+#define SHIFT 32
+#include "audio/mixeng_template.h"
+#undef IN_MAX
+#undef IN_MIN
+#undef IN_T
+#undef SHIFT
+
+struct rate {
+    uint64_t opos;
+    uint64_t opos_inc;
+    uint32_t ipos;
+    struct st_sample ilast;
+};
+
+#define NAME rate_flow_mix
+#define OP(a, b) a += b
+#define BLOCK_OP(dst, src, n) mixeng_mix (dst, src, n)
+#include "audio/rate_template.h"
+
+/* The resampler before it kept its state in locals */
+static void rate_flow_mix_ref(struct rate *rate, struct st_sample *ibuf,
+                              struct st_sample *obuf, int *isamp, int *osamp)
+{
+    struct st_sample *istart = ibuf, *iend = ibuf + *isamp;
+    struct st_sample *ostart = obuf, *oend = obuf + *osamp;
+    struct st_sample ilast = rate->ilast, icur, out;
+    int64_t t;
+
+    if (rate->opos_inc == (1ULL + UINT_MAX)) {
+        int i, n = *isamp > *osamp ? *osamp : *isamp;
+        for (i = 0; i < n; i++) {
+            obuf[i].l += ibuf[i].l;
+            obuf[i].r += ibuf[i].r;
+        }
+        *isamp = n;
+        *osamp = n;
+        return;
+    }
+
+    while (obuf < oend) {
+        if (ibuf >= iend) {
+            break;
+        }
+        while (rate->ipos <= (rate->opos >> 32)) {
+            ilast = *ibuf++;
+            rate->ipos++;
+            if (ibuf >= iend) {
+                goto the_end;
+            }
+        }
+        icur = *ibuf;
+        t = rate->opos & 0xffffffff;
+        out.l = (ilast.l * ((int64_t) UINT_MAX - t) + icur.l * t) >> 32;
+        out.r = (ilast.r * ((int64_t) UINT_MAX - t) + icur.r * t) >> 32;
+        obuf->l += out.l;
+        obuf->r += out.r;
+        obuf += 1;
+        rate->opos += rate->opos_inc;
+    }
+
+the_end:
+    *isamp = ibuf - istart;
+    *osamp = obuf - ostart;
+    rate->ilast = ilast;
+}
+
+static int16_t in16[FRAMES * 2], out16[FRAMES * 2], ref16[FRAMES * 2];
+static int32_t in32[FRAMES * 2], out32[FRAMES * 2], ref32[FRAMES * 2];
+static struct st_sample mix[FRAMES], out[FRAMES], ref[FRAMES];
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int64_t random_sample(void)
+{
+    static const int64_t edges[] = {
+        0x7f000000, 0x7effffff, 0x7fffffff, 0x80000000LL,
+        -2147483648LL, -2147483649LL, 0, -1,
+    };
+    int64_t v = ((int64_t) rand() << 31) ^ rand();
+
+    if (rand() % 16 == 0) {
+        return edges[rand() % 8];
+    }
+    /* mostly in range, some needing clipping */
+    return (v % (1LL << 33)) - (1LL << 32) / (1 + rand() % 4);
+}
+
+static void setup(void)
+{
+    int i;
+
+    srand(1);
+    for (i = 0; i < FRAMES * 2; i++) {
+        in16[i] = rand();
+        in32[i] = rand() ^ ((uint32_t) rand() << 16);
+    }
+    for (i = 0; i < FRAMES; i++) {
+        mix[i].l = random_sample();
+        mix[i].r = random_sample();
+    }
+}
+
+static void report(const char *name, double generic, double vector,
+                   int differ)
+{
+    if (differ) {
+        fprintf(stderr, "mixeng-bench: %s: results differ\n", name);
+        exit(1);
+    }
+    printf("%-16s generic %7.3f ms, vector %7.3f ms, speedup %.2fx\n",
+           name, generic * 1000 / ITERS, vector * 1000 / ITERS,
+           generic / vector);
+}
+
+/* Time the generic loop against the kernel plus the generic tail */
+#define BENCH_CONV(name, generic, kernel, in, in_t, channels)             \
+    do {                                                                \
+        double t, g = 0, v = 0;                                         \
+        int i, n;                                                       \
+                                                                        \
+        for (i = 0; i < ITERS; i++) {                                   \
+            t = now();                                                  \
+            generic(ref, in, FRAMES - i);                               \
+            g += now() - t;                                             \
+            t = now();                                                  \
+            n = kernel(out, in, FRAMES - i);                            \
+            generic(out + n, (const in_t *) in + n * channels,          \
+                    FRAMES - i - n);                                    \
+            v += now() - t;                                             \
+        }                                                               \
+        report(name, g, v, memcmp(ref, out, sizeof(out)));              \
+    } while (0)
+
+#define BENCH_CLIP(name, generic, kernel, ref, out, channels)             \
+    do {                                                                \
+        double t, g = 0, v = 0;                                         \
+        int i, n;                                                       \
+                                                                        \
+        for (i = 0; i < ITERS; i++) {                                   \
+            t = now();                                                  \
+            generic(ref, mix, FRAMES - i);                              \
+            g += now() - t;                                             \
+            t = now();                                                  \
+            n = kernel(out, mix, FRAMES - i);                           \
+            generic(out + n * channels, mix + n, FRAMES - i - n);       \
+            v += now() - t;                                             \
+        }                                                               \
+        report(name, g, v, memcmp(ref, out, sizeof(out)));              \
+    } while (0)
+
+static void bench_mix(void)
+{
+    double t, g = 0, v = 0;
+    int i, j;
+
+    memset(ref, 0, sizeof(ref));
+    memset(out, 0, sizeof(out));
+    for (i = 0; i < ITERS; i++) {
+        t = now();
+        for (j = 0; j < FRAMES - i; j++) {
+            ref[j].l += mix[j].l;
+            ref[j].r += mix[j].r;
+        }
+        g += now() - t;
+        t = now();
+        mixeng_mix(out, mix, FRAMES - i);
+        v += now() - t;
+    }
+    report("mix", g, v, memcmp(ref, out, sizeof(out)));
+}
+
+/* Feed a period's worth of input at a time, the way audio.c does */
+static void rate_run(struct rate *rate, struct st_sample *obuf, int *isamps,
+                     int *osamps, int ref)
+{
+    int pos, i, isamp, osamp;
+
+    memset(obuf, 0, FRAMES * sizeof(struct st_sample));
+    for (pos = 0, i = 0; pos + 1024 <= FRAMES; pos += 1024, i++) {
+        isamp = 1024;
+        osamp = FRAMES - pos;
+        if (ref) {
+            rate_flow_mix_ref(rate, mix + pos, obuf + pos, &isamp, &osamp);
+        } else {
+            rate_flow_mix(rate, mix + pos, obuf + pos, &isamp, &osamp);
+        }
+        isamps[i] = isamp;
+        osamps[i] = osamp;
+    }
+}
+
+static void bench_rate(const char *name, int inrate, int outrate)
+{
+    struct rate a = { 0 }, b = { 0 };
+    int ia[FRAMES / 1024], oa[FRAMES / 1024];
+    int ib[FRAMES / 1024], ob[FRAMES / 1024];
+    double t, g = 0, v = 0;
+    int differ = 0;
+    int i;
+
+    a.opos_inc = b.opos_inc = ((uint64_t) inrate << 32) / outrate;
+    for (i = 0; i < ITERS; i++) {
+        t = now();
+        rate_run(&a, ref, ia, oa, 1);
+        g += now() - t;
+        t = now();
+        rate_run(&b, out, ib, ob, 0);
+        v += now() - t;
+        differ |= memcmp(ia, ib, sizeof(ia)) || memcmp(oa, ob, sizeof(oa));
+        differ |= a.opos != b.opos || a.ipos != b.ipos ||
+                  a.ilast.l != b.ilast.l || a.ilast.r != b.ilast.r;
+    }
+    report(name, g, v, differ || memcmp(ref, out, sizeof(out)));
+}
+
+int main(int argc, char **argv)
+{
+    setup();
+
+#if defined(__SSE2__)
+    printf("kernel: SSE2\n");
+#else
+    printf("kernel: generic\n");
+#endif
+    BENCH_CONV("s16 to stereo", conv_natural_int16_t_to_stereo,
+               mixeng_conv_s16_to_stereo, in16, int16_t, 2);
+    BENCH_CONV("s16 to mono", conv_natural_int16_t_to_mono,
+               mixeng_conv_s16_to_mono, in16, int16_t, 1);
+    BENCH_CONV("s32 to stereo", conv_natural_int32_t_to_stereo,
+               mixeng_conv_s32_to_stereo, in32, int32_t, 2);
+    BENCH_CONV("s32 to mono", conv_natural_int32_t_to_mono,
+               mixeng_conv_s32_to_mono, in32, int32_t, 1);
+    BENCH_CLIP("s16 from stereo", clip_natural_int16_t_from_stereo,
+               mixeng_clip_s16_from_stereo, ref16, out16, 2);
+    BENCH_CLIP("s16 from mono", clip_natural_int16_t_from_mono,
+               mixeng_clip_s16_from_mono, ref16, out16, 1);
+    BENCH_CLIP("s32 from stereo", clip_natural_int32_t_from_stereo,
+               mixeng_clip_s32_from_stereo, ref32, out32, 2);
+    BENCH_CLIP("s32 from mono", clip_natural_int32_t_from_mono,
+               mixeng_clip_s32_from_mono, ref32, out32, 1);
+    bench_mix();
+    bench_rate("rate 44100>48000", 44100, 48000);
+    bench_rate("rate 48000>44100", 48000, 44100);
+    bench_rate("rate 48000>48000", 48000, 48000);
+    return 0;
+}
@@ -0,0 +1,151 @@
+/*
+ * Benchmark of the VNC server surface update loop
+ *
+ * Compares the chunk at a time memcmp/memcpy loop with the word at a time
+ * kernels of ui/vnc-dirty.h on a 1920x1080x32 surface, for a few ratios of
+ * dirty and really changed chunks.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "config-host.h"
+#include "ui/vnc-dirty.h"
+
+#define WIDTH   1920
+#define HEIGHT  1080
+#define BPP     4
+#define CHUNKS  (WIDTH / 16)
+#define BITS    (sizeof(unsigned long) * 8)
+#define WORDS   ((CHUNKS + BITS - 1) / BITS)
+#define ITERS   50
+
+static uint8_t *guest, *server, *ref;
+static unsigned long guest_dirty[HEIGHT][WORDS];
+static unsigned long saved_dirty[HEIGHT][WORDS];
+static unsigned long client_dirty[HEIGHT][WORDS];
+static unsigned long ref_dirty[HEIGHT][WORDS];
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Mark a fraction of the chunks dirty, and change some of those. */
+static void setup(int dirty_pct, int changed_pct, unsigned int seed)
+{
+    int x, y;
+
+    srand(seed);
+    memset(guest_dirty, 0, sizeof(guest_dirty));
+    for (y = 0; y < HEIGHT; y++) {
+        for (x = 0; x < CHUNKS; x++) {
+            uint8_t *p = guest + (y * WIDTH + x * 16) * BPP;
+
+            if (rand() % 100 >= dirty_pct) {
+                continue;
+            }
+            guest_dirty[y][x / BITS] |= 1UL << (x % BITS);
+            if (rand() % 100 < changed_pct) {
+                p[rand() % (16 * BPP)] ^= 0x5a;
+            }
+        }
+    }
+}
+
+static void update_bytewise(uint8_t *dst)
+{
+    int x, y;
+
+    for (y = 0; y < HEIGHT; y++) {
+        for (x = 0; x < CHUNKS; x++) {
+            int off = (y * WIDTH + x * 16) * BPP;
+            unsigned long *w = &guest_dirty[y][x / BITS];
+
+            if (!(*w & (1UL << (x % BITS)))) {
+                continue;
+            }
+            *w &= ~(1UL << (x % BITS));
+            if (memcmp(dst + off, guest + off, 16 * BPP) == 0) {
+                continue;
+            }
+            memcpy(dst + off, guest + off, 16 * BPP);
+            ref_dirty[y][x / BITS] |= 1UL << (x % BITS);
+        }
+    }
+}
+
+static void update_wordwise(uint8_t *dst)
+{
+    int y, i;
+
+    for (y = 0; y < HEIGHT; y++) {
+        int row = y * WIDTH * BPP;
+
+        for (i = 0; i < WORDS; i++) {
+            unsigned long bits = guest_dirty[y][i];
+            int off = row + i * BITS * 16 * BPP;
+
+            if (!bits) {
+                continue;
+            }
+            guest_dirty[y][i] = 0;
+            client_dirty[y][i] |= vnc_chunks_update(dst + off, guest + off,
+                                                    bits, 16 * BPP);
+        }
+    }
+}
+
+static void run(int dirty_pct, int changed_pct)
+{
+    double t, bytewise = 0, wordwise = 0;
+    int i;
+
+    for (i = 0; i < ITERS; i++) {
+        setup(dirty_pct, changed_pct, i);
+        memcpy(saved_dirty, guest_dirty, sizeof(guest_dirty));
+        t = now();
+        update_bytewise(ref);
+        bytewise += now() - t;
+
+        memcpy(guest_dirty, saved_dirty, sizeof(guest_dirty));
+        t = now();
+        update_wordwise(server);
+        wordwise += now() - t;
+    }
+
+    if (memcmp(ref, server, WIDTH * HEIGHT * BPP) ||
+        memcmp(ref_dirty, client_dirty, sizeof(ref_dirty))) {
+        fprintf(stderr, "vnc-dirty-bench: results differ\n");
+        exit(1);
+    }
+    printf("dirty %3d%% changed %3d%%: chunk loop %7.3f ms, "
+           "word loop %7.3f ms, speedup %.2fx\n",
+           dirty_pct, changed_pct, bytewise * 1000 / ITERS,
+           wordwise * 1000 / ITERS, bytewise / wordwise);
+}
+
+int main(int argc, char **argv)
+{
+    guest = calloc(WIDTH * HEIGHT, BPP);
+    server = calloc(WIDTH * HEIGHT, BPP);
+    ref = calloc(WIDTH * HEIGHT, BPP);
+
+#if defined(__AVX2__)
+    printf("kernel: AVX2\n");
+#elif defined(__SSE2__)
+    printf("kernel: SSE2\n");
+#else
+    printf("kernel: generic\n");
+#endif
+    run(5, 50);
+    run(50, 10);
+    run(100, 1);
+    run(100, 100);
+    return 0;
+}
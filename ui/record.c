@@ -0,0 +1,592 @@
+/*
+ * QEMU display recorder
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "config-host.h"
+
+#include <setjmp.h>
+#ifdef CONFIG_VNC_PNG
+#include <png.h>
+#endif
+#ifdef CONFIG_VNC_JPEG
+#include <stdio.h>
+#include <jpeglib.h>
+#endif
+
+#include "qemu-common.h"
+#include "console.h"
+#include "monitor.h"
+#include "qemu-timer.h"
+#include "qemu-thread.h"
+#include "qjson.h"
+#include "qdict.h"
+
+/*
+ * The recorder is a display change listener.  Every 1/fps seconds it
+ * looks at what the guest updated since the last tick; if anything really
+ * changed, the frame is copied to a pending slot and a background thread
+ * converts and writes it.  When the thread is still busy with the previous
+ * frame, the pending one is replaced, so a slow disk or encoder drops
+ * frames instead of holding up the guest.
+ *
+ * Frames carry the host and guest time at which they were captured:
+ * - mjpeg: one file, concatenated JPEG images with a COM marker each
+ * - png:   one file per frame, FILE-000000.png, with a tEXt chunk
+ * - ppm:   one file per frame, FILE-000000.ppm, with a comment line
+ *
+ * Once a frame fails to be written, the recorder keeps the error for
+ * "info record" and writes nothing more.
+ */
+
+enum {
+    RECORD_MJPEG,
+    RECORD_PNG,
+    RECORD_PPM,
+};
+
+#define RECORD_JPEG_QUALITY 85
+
+typedef struct RecordFrame {
+    uint8_t *data;
+    int width;
+    int height;
+    int linesize;
+    size_t size;
+    PixelFormat pf;
+    int64_t host_ms;
+    int64_t vm_ns;
+} RecordFrame;
+
+typedef struct RecordState {
+    DisplayChangeListener dcl;
+    DisplayState *ds;
+    QEMUTimer *timer;
+    int fps;
+    int interval;
+    int format;
+    char *filename;
+    FILE *file;                 /* mjpeg only */
+
+    /* iothread side */
+    RecordFrame last;           /* last captured frame */
+    bool dirty;
+    int x1, y1, x2, y2;         /* updated area since the last tick */
+
+    /* shared with the writer thread */
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    RecordFrame pending;
+    bool has_pending;
+    bool stopping;
+    uint64_t captured;
+    uint64_t duplicates;
+    uint64_t dropped;
+    uint64_t written;
+    int error;
+} RecordState;
+
+static RecordState *recorder;
+
+static void record_frame_resize(RecordFrame *f, DisplaySurface *s)
+{
+    size_t size = s->linesize * s->height;
+
+    if (f->size != size) {
+        qemu_free(f->data);
+        f->data = qemu_mallocz(size);
+        f->size = size;
+    }
+    f->width = s->width;
+    f->height = s->height;
+    f->linesize = s->linesize;
+    f->pf = s->pf;
+}
+
+/* Writer thread */
+
+static void record_rgb_row(RecordFrame *f, int y, uint8_t *rgb)
+{
+    PixelFormat *pf = &f->pf;
+    uint8_t *p = f->data + y * f->linesize;
+    uint32_t v;
+    int x;
+
+    for (x = 0; x < f->width; x++, p += pf->bytes_per_pixel) {
+        switch (pf->bytes_per_pixel) {
+        case 4:
+            v = *(uint32_t *)p;
+            break;
+        case 2:
+            v = *(uint16_t *)p;
+            break;
+        default:
+            v = *p;
+            break;
+        }
+        *rgb++ = ((v >> pf->rshift) & pf->rmax) * 255 / (pf->rmax ? : 1);
+        *rgb++ = ((v >> pf->gshift) & pf->gmax) * 255 / (pf->gmax ? : 1);
+        *rgb++ = ((v >> pf->bshift) & pf->bmax) * 255 / (pf->bmax ? : 1);
+    }
+}
+
+#ifdef CONFIG_VNC_JPEG
+typedef struct RecordJpegError {
+    struct jpeg_error_mgr pub;
+    jmp_buf jmp;
+} RecordJpegError;
+
+/* The default handler exits, which would take the VM down with us */
+static void record_jpeg_error_exit(j_common_ptr cinfo)
+{
+    RecordJpegError *err = (RecordJpegError *)cinfo->err;
+
+    longjmp(err->jmp, 1);
+}
+
+static int record_write_jpeg(RecordState *r, RecordFrame *f, const char *stamp)
+{
+    struct jpeg_compress_struct cinfo;
+    RecordJpegError jerr;
+    uint8_t *row = qemu_malloc(f->width * 3);
+    int y;
+
+    cinfo.err = jpeg_std_error(&jerr.pub);
+    jerr.pub.error_exit = record_jpeg_error_exit;
+    if (setjmp(jerr.jmp)) {
+        /* most likely the file could not be written */
+        jpeg_destroy_compress(&cinfo);
+        qemu_free(row);
+        return -EIO;
+    }
+    jpeg_create_compress(&cinfo);
+    jpeg_stdio_dest(&cinfo, r->file);
+    cinfo.image_width = f->width;
+    cinfo.image_height = f->height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, RECORD_JPEG_QUALITY, true);
+    jpeg_start_compress(&cinfo, true);
+    jpeg_write_marker(&cinfo, JPEG_COM, (const JOCTET *)stamp, strlen(stamp));
+    for (y = 0; y < f->height; y++) {
+        record_rgb_row(f, y, row);
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    qemu_free(row);
+    return fflush(r->file) ? -errno : 0;
+}
+#endif
+
+#ifdef CONFIG_VNC_PNG
+static int record_write_png(FILE *file, RecordFrame *f, const char *stamp)
+{
+    png_structp png_ptr;
+    png_infop info_ptr;
+    png_text text;
+    uint8_t *row;
+    int y;
+
+    png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    if (png_ptr == NULL) {
+        return -ENOMEM;
+    }
+    info_ptr = png_create_info_struct(png_ptr);
+    if (info_ptr == NULL) {
+        png_destroy_write_struct(&png_ptr, NULL);
+        return -ENOMEM;
+    }
+
+    row = qemu_malloc(f->width * 3);
+    if (setjmp(png_jmpbuf(png_ptr))) {
+        png_destroy_write_struct(&png_ptr, &info_ptr);
+        qemu_free(row);
+        return -EIO;
+    }
+
+    png_init_io(png_ptr, file);
+    /* keep up with the guest rather than produce small files */
+    png_set_compression_level(png_ptr, 1);
+    png_set_IHDR(png_ptr, info_ptr, f->width, f->height,
+                 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
+                 PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    memset(&text, 0, sizeof(text));
+    text.compression = PNG_TEXT_COMPRESSION_NONE;
+    text.key = (char *)"qemu-timestamp";
+    text.text = (char *)stamp;
+    png_set_text(png_ptr, info_ptr, &text, 1);
+    png_write_info(png_ptr, info_ptr);
+
+    for (y = 0; y < f->height; y++) {
+        record_rgb_row(f, y, row);
+        png_write_row(png_ptr, row);
+    }
+    qemu_free(row);
+
+    png_write_end(png_ptr, NULL);
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    return 0;
+}
+#endif
+
+static int record_write_ppm(FILE *file, RecordFrame *f, const char *stamp)
+{
+    uint8_t *row = qemu_malloc(f->width * 3);
+    int y, ret = 0;
+
+    fprintf(file, "P6\n# %s\n%d %d\n255\n", stamp, f->width, f->height);
+    for (y = 0; y < f->height; y++) {
+        record_rgb_row(f, y, row);
+        if (fwrite(row, 3, f->width, file) != f->width) {
+            ret = -EIO;
+            break;
+        }
+    }
+    qemu_free(row);
+    return ret;
+}
+
+static int record_write_frame(RecordState *r, RecordFrame *f)
+{
+    char stamp[64];
+    char *name;
+    FILE *file;
+    int ret;
+
+    snprintf(stamp, sizeof(stamp), "host_ms=%" PRId64 " vm_ns=%" PRId64,
+             f->host_ms, f->vm_ns);
+
+#ifdef CONFIG_VNC_JPEG
+    if (r->format == RECORD_MJPEG) {
+        return record_write_jpeg(r, f, stamp);
+    }
+#endif
+
+    name = qemu_malloc(strlen(r->filename) + 32);
+    sprintf(name, "%s-%06" PRIu64 ".%s", r->filename, r->written,
+            r->format == RECORD_PNG ? "png" : "ppm");
+    file = fopen(name, "wb");
+    qemu_free(name);
+    if (!file) {
+        return -errno;
+    }
+#ifdef CONFIG_VNC_PNG
+    if (r->format == RECORD_PNG) {
+        ret = record_write_png(file, f, stamp);
+    } else
+#endif
+    {
+        ret = record_write_ppm(file, f, stamp);
+    }
+    if (fclose(file) && !ret) {
+        ret = -errno;
+    }
+    return ret;
+}
+
+static void record_free(RecordState *r)
+{
+    if (r->file) {
+        fclose(r->file);
+    }
+    qemu_cond_destroy(&r->cond);
+    qemu_mutex_destroy(&r->mutex);
+    qemu_free(r->pending.data);
+    qemu_free(r->filename);
+    qemu_free(r);
+}
+
+static void *record_thread(void *opaque)
+{
+    RecordState *r = opaque;
+    RecordFrame work = { NULL };
+    RecordFrame tmp;
+    int ret;
+
+    qemu_mutex_lock(&r->mutex);
+    for (;;) {
+        while (!r->has_pending && !r->stopping) {
+            qemu_cond_wait(&r->cond, &r->mutex);
+        }
+        if (!r->has_pending) {
+            break;
+        }
+        /* take the pending frame, leave our old buffer for the next one */
+        tmp = work;
+        work = r->pending;
+        r->pending = tmp;
+        r->has_pending = false;
+        if (r->error) {
+            r->dropped++;
+            continue;
+        }
+        qemu_mutex_unlock(&r->mutex);
+
+        ret = record_write_frame(r, &work);
+
+        qemu_mutex_lock(&r->mutex);
+        if (ret < 0) {
+            r->error = ret;
+        } else {
+            r->written++;
+        }
+    }
+    qemu_mutex_unlock(&r->mutex);
+
+    qemu_free(work.data);
+    return NULL;
+}
+
+/* Display change listener */
+
+static void record_update(DisplayState *ds, int x, int y, int w, int h)
+{
+    RecordState *r = recorder;
+
+    if (!r->dirty) {
+        r->x1 = x;
+        r->y1 = y;
+        r->x2 = x + w;
+        r->y2 = y + h;
+        r->dirty = true;
+        return;
+    }
+    r->x1 = MIN(r->x1, x);
+    r->y1 = MIN(r->y1, y);
+    r->x2 = MAX(r->x2, x + w);
+    r->y2 = MAX(r->y2, y + h);
+}
+
+static void record_resize(DisplayState *ds)
+{
+    record_update(ds, 0, 0, ds_get_width(ds), ds_get_height(ds));
+}
+
+static bool record_same_pf(PixelFormat *a, PixelFormat *b)
+{
+    return a->bits_per_pixel == b->bits_per_pixel &&
+           a->rmask == b->rmask && a->gmask == b->gmask &&
+           a->bmask == b->bmask && a->amask == b->amask &&
+           a->rshift == b->rshift && a->gshift == b->gshift &&
+           a->bshift == b->bshift && a->ashift == b->ashift &&
+           a->rmax == b->rmax && a->gmax == b->gmax &&
+           a->bmax == b->bmax && a->amax == b->amax;
+}
+
+/* Copy the updated area, return false if nothing changed */
+static bool record_capture(RecordState *r)
+{
+    DisplaySurface *s = r->ds->surface;
+    RecordFrame *f = &r->last;
+    int bpp = s->pf.bytes_per_pixel;
+    bool changed = false;
+    int x1, x2, y;
+
+    if (f->width != s->width || f->height != s->height ||
+        f->linesize != s->linesize || !record_same_pf(&f->pf, &s->pf)) {
+        record_frame_resize(f, s);
+        memcpy(f->data, s->data, f->size);
+        return true;
+    }
+
+    x1 = MAX(r->x1, 0);
+    x2 = MIN(r->x2, s->width);
+    for (y = MAX(r->y1, 0); y < MIN(r->y2, s->height); y++) {
+        size_t off = y * s->linesize + x1 * bpp;
+        size_t len = (x2 - x1) * bpp;
+
+        if (x2 > x1 && memcmp(f->data + off, s->data + off, len)) {
+            memcpy(f->data + off, s->data + off, len);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+static void record_tick(void *opaque)
+{
+    RecordState *r = opaque;
+
+    qemu_mod_timer(r->timer, qemu_get_clock_ms(rt_clock) + r->interval);
+
+    /* headless machines have nobody else refreshing the display */
+    vga_hw_update();
+    if (!r->dirty) {
+        return;
+    }
+    r->dirty = false;
+
+    if (!record_capture(r)) {
+        r->duplicates++;
+        return;
+    }
+
+    qemu_mutex_lock(&r->mutex);
+    r->captured++;
+    if (r->has_pending) {
+        r->dropped++;
+    }
+    if (r->pending.size != r->last.size) {
+        qemu_free(r->pending.data);
+        r->pending.data = qemu_malloc(r->last.size);
+        r->pending.size = r->last.size;
+    }
+    memcpy(r->pending.data, r->last.data, r->last.size);
+    r->pending.width = r->last.width;
+    r->pending.height = r->last.height;
+    r->pending.linesize = r->last.linesize;
+    r->pending.pf = r->last.pf;
+    r->pending.host_ms = qemu_get_clock_ms(host_clock);
+    r->pending.vm_ns = qemu_get_clock_ns(vm_clock);
+    r->has_pending = true;
+    qemu_cond_signal(&r->cond);
+    qemu_mutex_unlock(&r->mutex);
+}
+
+int record_start(DisplayState *ds, const char *filename, const char *format,
+                 int fps)
+{
+    RecordState *r;
+    int fmt;
+
+    if (!format) {
+#ifdef CONFIG_VNC_JPEG
+        fmt = RECORD_MJPEG;
+#else
+        fmt = RECORD_PPM;
+#endif
+#ifdef CONFIG_VNC_JPEG
+    } else if (!strcmp(format, "mjpeg")) {
+        fmt = RECORD_MJPEG;
+#endif
+#ifdef CONFIG_VNC_PNG
+    } else if (!strcmp(format, "png")) {
+        fmt = RECORD_PNG;
+#endif
+    } else if (!strcmp(format, "ppm")) {
+        fmt = RECORD_PPM;
+    } else {
+        return -ENOTSUP;
+    }
+    if (fps <= 0 || fps > 1000) {
+        return -EINVAL;
+    }
+
+    record_stop();
+
+    r = qemu_mallocz(sizeof(*r));
+    r->ds = ds;
+    r->format = fmt;
+    r->fps = fps;
+    r->interval = 1000 / fps;
+    r->filename = qemu_strdup(filename);
+    if (fmt == RECORD_MJPEG) {
+        r->file = fopen(filename, "wb");
+        if (!r->file) {
+            int ret = -errno;
+
+            qemu_free(r->filename);
+            qemu_free(r);
+            return ret;
+        }
+    }
+    qemu_mutex_init(&r->mutex);
+    qemu_cond_init(&r->cond);
+    qemu_thread_create(&r->thread, record_thread, r);
+
+    r->dcl.dpy_update = record_update;
+    r->dcl.dpy_resize = record_resize;
+    r->dcl.dpy_setdata = record_resize;
+    register_displaychangelistener(ds, &r->dcl);
+    recorder = r;
+
+    /* the first frame is the whole screen */
+    record_resize(ds);
+    r->timer = qemu_new_timer_ms(rt_clock, record_tick, r);
+    qemu_mod_timer(r->timer, qemu_get_clock_ms(rt_clock));
+    return 0;
+}
+
+void record_stop(void)
+{
+    RecordState *r = recorder;
+
+    if (!r) {
+        return;
+    }
+    recorder = NULL;
+    unregister_displaychangelistener(r->ds, &r->dcl);
+    qemu_del_timer(r->timer);
+    qemu_free_timer(r->timer);
+    qemu_free(r->last.data);
+
+    /* the thread writes what is pending, then exits */
+    qemu_mutex_lock(&r->mutex);
+    r->stopping = true;
+    qemu_cond_signal(&r->cond);
+    qemu_mutex_unlock(&r->mutex);
+    qemu_thread_join(&r->thread);
+    record_free(r);
+}
+
+void do_info_record_print(Monitor *mon, const QObject *data)
+{
+    QDict *qdict = qobject_to_qdict(data);
+
+    if (!qdict_get_bool(qdict, "active")) {
+        monitor_printf(mon, "Recorder: inactive\n");
+        return;
+    }
+    monitor_printf(mon, "Recorder: %s (%s, %" PRId64 " fps)\n",
+                   qdict_get_str(qdict, "filename"),
+                   qdict_get_str(qdict, "format"),
+                   qdict_get_int(qdict, "fps"));
+    monitor_printf(mon, "  captured=%" PRId64 " written=%" PRId64
+                   " duplicates=%" PRId64 " dropped=%" PRId64 "\n",
+                   qdict_get_int(qdict, "captured"),
+                   qdict_get_int(qdict, "written"),
+                   qdict_get_int(qdict, "duplicates"),
+                   qdict_get_int(qdict, "dropped"));
+    if (qdict_haskey(qdict, "error")) {
+        monitor_printf(mon, "  last error: %s\n",
+                       qdict_get_str(qdict, "error"));
+    }
+}
+
+void do_info_record(Monitor *mon, QObject **ret_data)
+{
+    static const char *formats[] = {
+        [RECORD_MJPEG] = "mjpeg",
+        [RECORD_PNG] = "png",
+        [RECORD_PPM] = "ppm",
+    };
+    RecordState *r = recorder;
+    QDict *qdict;
+
+    if (!r) {
+        *ret_data = qobject_from_jsonf("{ 'active': false }");
+        return;
+    }
+
+    qemu_mutex_lock(&r->mutex);
+    *ret_data = qobject_from_jsonf("{ 'active': true, 'filename': %s, "
+                                   "'format': %s, 'fps': %d, "
+                                   "'captured': %" PRId64 ", "
+                                   "'written': %" PRId64 ", "
+                                   "'duplicates': %" PRId64 ", "
+                                   "'dropped': %" PRId64 " }",
+                                   r->filename, formats[r->format],
+                                   r->fps, r->captured,
+                                   r->written, r->duplicates, r->dropped);
+    if (r->error) {
+        qdict = qobject_to_qdict(*ret_data);
+        qdict_put(qdict, "error", qstring_from_str(strerror(-r->error)));
+    }
+    qemu_mutex_unlock(&r->mutex);
+}
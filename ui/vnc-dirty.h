@@ -0,0 +1,109 @@
+/*
+ * QEMU VNC display driver: server surface update kernels
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef VNC_DIRTY_H
+#define VNC_DIRTY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "host-utils.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * Copy len bytes from src to dst if they differ, return true if they did.
+ * len is a multiple of 16: the chunks are always 16 pixels wide.
+ */
+static inline bool vnc_chunk_update(uint8_t *dst, const uint8_t *src, int len)
+{
+    int i = 0;
+
+#if defined(__AVX2__)
+    for (; i + 32 <= len; i += 32) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(s, d)) != -1) {
+            goto changed;
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(s, d)) != 0xffff) {
+            goto changed;
+        }
+    }
+#endif
+    if (i == len || memcmp(dst + i, src + i, len - i) == 0) {
+        return false;
+    }
+
+changed:
+    /* everything before i is already equal */
+#if defined(__SSE2__)
+    for (; i < len; i += 16) {
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_loadu_si128((const __m128i *)(src + i)));
+    }
+#else
+    memcpy(dst + i, src + i, len - i);
+#endif
+    return true;
+}
+
+/*
+ * Update the chunks of one dirty bitmap word.  Bit n of dirty stands for
+ * the chunk at dst/src + n * chunk_bytes.  Returns the chunks that
+ * actually changed, in the same format.
+ */
+static inline unsigned long vnc_chunks_update(uint8_t *dst, const uint8_t *src,
+                                              unsigned long dirty,
+                                              int chunk_bytes)
+{
+    unsigned long changed = 0;
+
+    while (dirty) {
+        int n = ctz64(dirty);
+        int off = n * chunk_bytes;
+
+        dirty &= dirty - 1;
+        if (vnc_chunk_update(dst + off, src + off, chunk_bytes)) {
+            changed |= 1UL << n;
+        }
+    }
+    return changed;
+}
+
+/* Hash of len bytes of a row, used to find rows that moved */
+static inline uint64_t vnc_row_hash(const uint8_t *p, int len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint64_t v;
+    int i;
+
+    for (i = 0; i + 8 <= len; i += 8) {
+        memcpy(&v, p + i, 8);
+        h = (h ^ v) * 0x100000001b3ULL;
+        h ^= h >> 29;
+    }
+    for (; i < len; i++) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+#endif /* VNC_DIRTY_H */
@@ -0,0 +1,235 @@
+/*
+ * QEMU VNC display driver: cache of encoded rectangles
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ */
+
+#include "vnc.h"
+
+/*
+ * When several clients watch the same display, they usually get the same
+ * dirty rectangles from the same refresh of the server surface.  The
+ * encoded bytes of a rectangle are kept here, so that the other clients
+ * with the same encoding settings and pixel format can send them instead
+ * of encoding the pixels again.
+ *
+ * Only rectangles whose encoding does not depend on what was sent to the
+ * client before can be shared: raw, hextile, and the tight rectangles that
+ * did not go through one of the client's zlib streams (solid fills, JPEG,
+ * PNG).  Entries are only valid for the generation of the server surface
+ * they were encoded from; vd->generation is bumped whenever it changes.
+ */
+
+#define VNC_ENC_CACHE_BUCKETS   256
+#define VNC_ENC_CACHE_MAX_BYTES (16 * 1024 * 1024)
+
+typedef struct VncEncKey {
+    int x, y, w, h;
+    uint32_t encoding;
+    uint32_t features;
+    int quality;
+    int compression;
+    VncWritePixels *write_pixels;
+    int big_endian;
+    uint8_t bits_per_pixel;
+    uint8_t depth;
+    uint8_t rshift, gshift, bshift;
+    uint16_t rmax, gmax, bmax;
+} VncEncKey;
+
+struct VncEncCacheEntry {
+    VncEncKey key;
+    int n;
+    bool lossy;
+    uint8_t *data;
+    size_t len;
+    QLIST_ENTRY(VncEncCacheEntry) next;
+};
+
+struct VncEncCache {
+#ifdef CONFIG_VNC_THREAD
+    QemuMutex mutex;
+#endif
+    uint64_t generation;
+    size_t bytes;
+    QLIST_HEAD(, VncEncCacheEntry) buckets[VNC_ENC_CACHE_BUCKETS];
+};
+
+static void vnc_enc_cache_lock(VncEncCache *c)
+{
+#ifdef CONFIG_VNC_THREAD
+    qemu_mutex_lock(&c->mutex);
+#endif
+}
+
+static void vnc_enc_cache_unlock(VncEncCache *c)
+{
+#ifdef CONFIG_VNC_THREAD
+    qemu_mutex_unlock(&c->mutex);
+#endif
+}
+
+void vnc_enc_cache_init(VncDisplay *vd)
+{
+    VncEncCache *c = qemu_mallocz(sizeof(VncEncCache));
+    int i;
+
+#ifdef CONFIG_VNC_THREAD
+    qemu_mutex_init(&c->mutex);
+#endif
+    for (i = 0; i < VNC_ENC_CACHE_BUCKETS; i++) {
+        QLIST_INIT(&c->buckets[i]);
+    }
+    vd->enc_cache = c;
+}
+
+static void vnc_enc_cache_clear_locked(VncEncCache *c)
+{
+    VncEncCacheEntry *e;
+    int i;
+
+    for (i = 0; i < VNC_ENC_CACHE_BUCKETS; i++) {
+        while ((e = QLIST_FIRST(&c->buckets[i])) != NULL) {
+            QLIST_REMOVE(e, next);
+            qemu_free(e->data);
+            qemu_free(e);
+        }
+    }
+    c->bytes = 0;
+}
+
+/* Can the rectangle be shared at all?  Fills in its key if so. */
+static bool vnc_enc_cache_key(VncState *vs, int x, int y, int w, int h,
+                              VncEncKey *key)
+{
+    PixelFormat *pf = &vs->clientds.pf;
+
+    if (!vs->vd->enc_cache || vs->vd->nb_clients < 2) {
+        return false;
+    }
+
+    memset(key, 0, sizeof(*key));
+    switch (vs->vnc_encoding) {
+    case VNC_ENCODING_ZLIB:
+    case VNC_ENCODING_ZRLE:
+    case VNC_ENCODING_ZYWRLE:
+        /* everything goes through the client's zlib stream */
+        return false;
+    case VNC_ENCODING_TIGHT:
+    case VNC_ENCODING_TIGHT_PNG:
+        key->quality = vs->tight.quality;
+        key->compression = vs->tight.compression;
+        break;
+    default:
+        break;
+    }
+
+    key->x = x;
+    key->y = y;
+    key->w = w;
+    key->h = h;
+    key->encoding = vs->vnc_encoding;
+    key->features = vs->features;
+    key->write_pixels = vs->write_pixels;
+    key->big_endian = !!(vs->clientds.flags & QEMU_BIG_ENDIAN_FLAG);
+    key->bits_per_pixel = pf->bits_per_pixel;
+    key->depth = pf->depth;
+    key->rshift = pf->rshift;
+    key->gshift = pf->gshift;
+    key->bshift = pf->bshift;
+    key->rmax = pf->rmax;
+    key->gmax = pf->gmax;
+    key->bmax = pf->bmax;
+    return true;
+}
+
+static unsigned int vnc_enc_cache_hash(const VncEncKey *key)
+{
+    unsigned int h = key->x * 31 + key->y;
+
+    h = h * 31 + key->w;
+    h = h * 31 + key->h;
+    return (h ^ (h >> 8)) % VNC_ENC_CACHE_BUCKETS;
+}
+
+static VncEncCacheEntry *vnc_enc_cache_find_locked(VncEncCache *c,
+                                                   const VncEncKey *key)
+{
+    VncEncCacheEntry *e;
+
+    QLIST_FOREACH(e, &c->buckets[vnc_enc_cache_hash(key)], next) {
+        if (!memcmp(&e->key, key, sizeof(*key))) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Send the rectangle from the cache.  Returns true and the number of
+ * rectangles written in *n on a hit.
+ */
+bool vnc_enc_cache_send(VncState *vs, int x, int y, int w, int h, int *n)
+{
+    VncEncCache *c = vs->vd->enc_cache;
+    VncEncCacheEntry *e;
+    VncEncKey key;
+
+    if (!vnc_enc_cache_key(vs, x, y, w, h, &key)) {
+        return false;
+    }
+
+    vnc_enc_cache_lock(c);
+    if (c->generation != vs->vd->generation) {
+        vnc_enc_cache_clear_locked(c);
+        c->generation = vs->vd->generation;
+    }
+    e = vnc_enc_cache_find_locked(c, &key);
+    if (e) {
+        vnc_write(vs, e->data, e->len);
+        *n = e->n;
+        if (e->lossy) {
+            vnc_sent_lossy_rect(vs, x, y, w, h);
+        }
+    }
+    vnc_enc_cache_unlock(c);
+    return e != NULL;
+}
+
+/*
+ * Remember what the encoder wrote to vs->output from offset on.  The
+ * caller makes sure that the encoding did not use any per-client state.
+ */
+void vnc_enc_cache_store(VncState *vs, int x, int y, int w, int h,
+                         size_t offset, int n, bool lossy)
+{
+    VncEncCache *c = vs->vd->enc_cache;
+    VncEncCacheEntry *e;
+    VncEncKey key;
+    size_t len = vs->output.offset - offset;
+
+    if (!vnc_enc_cache_key(vs, x, y, w, h, &key)) {
+        return;
+    }
+
+    vnc_enc_cache_lock(c);
+    if (c->generation != vs->vd->generation) {
+        vnc_enc_cache_clear_locked(c);
+        c->generation = vs->vd->generation;
+    }
+    if (c->bytes + len <= VNC_ENC_CACHE_MAX_BYTES &&
+        !vnc_enc_cache_find_locked(c, &key)) {
+        e = qemu_malloc(sizeof(*e));
+        e->key = key;
+        e->n = n;
+        e->lossy = lossy;
+        e->len = len;
+        e->data = qemu_malloc(len);
+        memcpy(e->data, vs->output.buffer + offset, len);
+        QLIST_INSERT_HEAD(&c->buckets[vnc_enc_cache_hash(&key)], e, next);
+        c->bytes += len;
+    }
+    vnc_enc_cache_unlock(c);
+}
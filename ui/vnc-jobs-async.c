@@ -40,28 +40,60 @@
  * - VncState::output lock: used to make sure the output buffer is not corrupted
  * 		   	 if two threads try to write on it at the same time
  *
- * While the VNC worker thread is working, the VncDisplay global lock is hold
- * to avoid screen corruptions (this does not block vnc_refresh() because it
- * uses trylock()) but the output lock is not hold because the thread work on
- * its own output buffer.
+ * While a VNC worker thread is working, it holds a shared reference on the
+ * VncDisplay lock to avoid screen corruptions (this does not block
+ * vnc_refresh() because it uses trylock()) but the output lock is not hold
+ * because the thread work on its own output buffer.
  * When the encoding job is done, the worker thread will hold the output lock
  * and copy its output buffer in vs->output.
-*/
+ *
+ * Several worker threads share the queue.  The jobs of one client are
+ * encoded one after the other, in the order they were pushed, because the
+ * encoders keep per-client state (zlib streams...).  Jobs of different
+ * clients are encoded in parallel.  Encodings without such state are also
+ * split in tiles that idle workers encode for the thread owning the job.
+ */
+
+#define VNC_MAX_WORKERS 16
+
+/* Height of the tiles large updates are split in */
+#define VNC_TILE_ROWS 64
+
+typedef struct VncTile {
+    VncRect rect;
+    Buffer output;
+    int n;
+} VncTile;
+
+/* The tiles of a job, shared with the other workers */
+typedef struct VncTileSet {
+    VncState *vs;
+    VncTile *tiles;
+    int nb_tiles;
+    int next;    /* first tile not taken by a worker */
+    int pending; /* tiles not encoded yet */
+    QTAILQ_ENTRY(VncTileSet) next_set;
+} VncTileSet;
 
 struct VncJobQueue {
     QemuCond cond;
     QemuMutex mutex;
-    QemuThread thread;
-    Buffer buffer;
+    int nb_workers;
     bool exit;
     QTAILQ_HEAD(, VncJob) jobs;
+    QTAILQ_HEAD(, VncTileSet) tile_sets;
 };
 
 typedef struct VncJobQueue VncJobQueue;
 
+typedef struct VncWorker {
+    QemuThread thread;
+    VncJobQueue *queue;
+    Buffer buffer;
+} VncWorker;
+
 /*
- * We use a single global queue, but most of the functions are
- * already reetrant, so we can easilly add more than one encoding thread
+ * We use a single global queue for all worker threads
  */
 static VncJobQueue *queue;
 
@@ -141,7 +173,8 @@ void vnc_jobs_clear(VncState *vs)
 
     vnc_lock_queue(queue);
     QTAILQ_FOREACH_SAFE(job, &queue->jobs, next, tmp) {
-        if (job->vs == vs || !vs) {
+        /* busy jobs are removed by their worker */
+        if ((job->vs == vs || !vs) && !job->busy) {
             QTAILQ_REMOVE(&queue->jobs, job, next);
         }
     }
@@ -157,10 +190,36 @@ void vnc_jobs_join(VncState *vs)
     vnc_unlock_queue(queue);
 }
 
+/*
+ * First job that no worker is encoding and that has no older job of the
+ * same client in front of it
+ */
+static VncJob *vnc_next_job_locked(VncJobQueue *queue)
+{
+    VncJob *job, *prev;
+
+    QTAILQ_FOREACH(job, &queue->jobs, next) {
+        if (job->busy) {
+            continue;
+        }
+        for (prev = QTAILQ_FIRST(&queue->jobs); prev != job;
+             prev = QTAILQ_NEXT(prev, next)) {
+            if (prev->vs == job->vs) {
+                break;
+            }
+        }
+        if (prev == job) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
 /*
  * Copy data for local use
  */
-static void vnc_async_encoding_start(VncState *orig, VncState *local)
+static void vnc_async_encoding_start(VncState *orig, VncState *local,
+                                     Buffer *output)
 {
     local->vnc_encoding = orig->vnc_encoding;
     local->features = orig->features;
@@ -173,13 +232,14 @@ static void vnc_async_encoding_start(VncState *orig, VncState *local)
     local->zlib = orig->zlib;
     local->hextile = orig->hextile;
     local->zrle = orig->zrle;
-    local->output =  queue->buffer;
+    local->output = *output;
     local->csock = -1; /* Don't do any network work on this thread */
 
     buffer_reset(&local->output);
 }
 
-static void vnc_async_encoding_end(VncState *orig, VncState *local)
+static void vnc_async_encoding_end(VncState *orig, VncState *local,
+                                   Buffer *output)
 {
     orig->tight = local->tight;
     orig->zlib = local->zlib;
@@ -187,11 +247,129 @@ static void vnc_async_encoding_end(VncState *orig, VncState *local)
     orig->zrle = local->zrle;
     orig->lossy_rect = local->lossy_rect;
 
-    queue->buffer = local->output;
+    *output = local->output;
+}
+
+/* Raw and hextile rectangles don't depend on what was sent before */
+static bool vnc_encoding_has_state(int encoding)
+{
+    switch (encoding) {
+    case VNC_ENCODING_ZLIB:
+    case VNC_ENCODING_TIGHT:
+    case VNC_ENCODING_TIGHT_PNG:
+    case VNC_ENCODING_ZRLE:
+    case VNC_ENCODING_ZYWRLE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void vnc_tile_encode(VncTileSet *set, VncTile *tile)
+{
+    VncState *vs = set->vs;
+    VncState local;
+
+    local.vnc_encoding = vs->vnc_encoding;
+    local.features = vs->features;
+    local.ds = vs->ds;
+    local.vd = vs->vd;
+    local.write_pixels = vs->write_pixels;
+    local.clientds = vs->clientds;
+    local.hextile = vs->hextile;
+    local.output = tile->output;
+    local.csock = -1;
+
+    tile->n = vnc_send_framebuffer_update(&local, tile->rect.x, tile->rect.y,
+                                          tile->rect.w, tile->rect.h);
+    tile->output = local.output;
+}
+
+/* Take a tile of any job, returns false if there is none */
+static bool vnc_tile_work_locked(VncJobQueue *queue)
+{
+    VncTileSet *set;
+    VncTile *tile;
+
+    QTAILQ_FOREACH(set, &queue->tile_sets, next_set) {
+        if (set->next < set->nb_tiles) {
+            break;
+        }
+    }
+    if (!set) {
+        return false;
+    }
+
+    tile = &set->tiles[set->next++];
+    vnc_unlock_queue(queue);
+    vnc_tile_encode(set, tile);
+    vnc_lock_queue(queue);
+    if (--set->pending == 0) {
+        qemu_cond_broadcast(&queue->cond);
+    }
+    return true;
+}
+
+/*
+ * Encode the rectangles of job in tiles, with the help of the idle
+ * workers, and append them to the output of vs in order.  Returns the
+ * number of rectangles written.
+ */
+static int vnc_job_encode_tiles(VncJobQueue *queue, VncJob *job,
+                                VncState *vs)
+{
+    VncRectEntry *entry, *tmp;
+    VncTileSet set;
+    int i, y, n = 0;
+
+    set.nb_tiles = 0;
+    QLIST_FOREACH(entry, &job->rectangles, next) {
+        set.nb_tiles += DIV_ROUND_UP(entry->rect.h, VNC_TILE_ROWS);
+    }
+    set.tiles = qemu_mallocz(set.nb_tiles * sizeof(VncTile));
+    i = 0;
+    QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
+        for (y = 0; y < entry->rect.h; y += VNC_TILE_ROWS) {
+            set.tiles[i].rect.x = entry->rect.x;
+            set.tiles[i].rect.y = entry->rect.y + y;
+            set.tiles[i].rect.w = entry->rect.w;
+            set.tiles[i].rect.h = MIN(VNC_TILE_ROWS, entry->rect.h - y);
+            i++;
+        }
+        qemu_free(entry);
+    }
+    set.vs = vs;
+    set.next = 0;
+    set.pending = set.nb_tiles;
+
+    vnc_lock_queue(queue);
+    QTAILQ_INSERT_TAIL(&queue->tile_sets, &set, next_set);
+    qemu_cond_broadcast(&queue->cond);
+    while (set.next < set.nb_tiles) {
+        vnc_tile_work_locked(queue);
+    }
+    while (set.pending) {
+        qemu_cond_wait(&queue->cond, &queue->mutex);
+    }
+    QTAILQ_REMOVE(&queue->tile_sets, &set, next_set);
+    vnc_unlock_queue(queue);
+
+    for (i = 0; i < set.nb_tiles; i++) {
+        VncTile *tile = &set.tiles[i];
+
+        if (tile->n > 0) {
+            vnc_write(vs, tile->output.buffer, tile->output.offset);
+            n += tile->n;
+        }
+        buffer_free(&tile->output);
+    }
+    qemu_free(set.tiles);
+    return n;
 }
 
-static int vnc_worker_thread_loop(VncJobQueue *queue)
+static int vnc_worker_thread_loop(VncWorker *worker)
 {
+    VncJobQueue *queue = worker->queue;
     VncJob *job;
     VncRectEntry *entry, *tmp;
     VncState vs;
@@ -200,17 +378,24 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     bool flush;
 
     vnc_lock_queue(queue);
-    while (QTAILQ_EMPTY(&queue->jobs) && !queue->exit) {
+    for (;;) {
+        if (queue->exit) {
+            vnc_unlock_queue(queue);
+            return -1;
+        }
+        /* help with the tiles of running jobs first, they are late */
+        if (vnc_tile_work_locked(queue)) {
+            continue;
+        }
+        job = vnc_next_job_locked(queue);
+        if (job) {
+            break;
+        }
         qemu_cond_wait(&queue->cond, &queue->mutex);
     }
-    /* Here job can only be NULL if queue->exit is true */
-    job = QTAILQ_FIRST(&queue->jobs);
+    job->busy = true;
     vnc_unlock_queue(queue);
 
-    if (queue->exit) {
-        return -1;
-    }
-
     vnc_lock_output(job->vs);
     if (job->vs->csock == -1 || job->vs->abort == true) {
         goto disconnected;
@@ -218,7 +403,7 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     vnc_unlock_output(job->vs);
 
     /* Make a local copy of vs and switch output buffers */
-    vnc_async_encoding_start(job->vs, &vs);
+    vnc_async_encoding_start(job->vs, &vs, &worker->buffer);
 
     /* Start sending rectangles */
     n_rectangles = 0;
@@ -227,28 +412,32 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     saved_offset = vs.output.offset;
     vnc_write_u16(&vs, 0);
 
-    vnc_lock_display(job->vs->vd);
-    QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
-        int n;
-
-        if (job->vs->csock == -1) {
-            vnc_unlock_display(job->vs->vd);
-            /* output mutex must be locked before going to
-             * disconnected:
-             */
-            vnc_lock_output(job->vs);
-            goto disconnected;
-        }
-
-        n = vnc_send_framebuffer_update(&vs, entry->rect.x, entry->rect.y,
-                                        entry->rect.w, entry->rect.h);
-
-        if (n >= 0) {
-            n_rectangles += n;
+    vnc_lock_display_shared(job->vs->vd);
+    if (queue->nb_workers > 1 && !vnc_encoding_has_state(vs.vnc_encoding)) {
+        n_rectangles = vnc_job_encode_tiles(queue, job, &vs);
+    } else {
+        QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
+            int n;
+
+            if (job->vs->csock == -1) {
+                vnc_unlock_display_shared(job->vs->vd);
+                /* output mutex must be locked before going to
+                 * disconnected:
+                 */
+                vnc_lock_output(job->vs);
+                goto disconnected;
+            }
+
+            n = vnc_send_framebuffer_update(&vs, entry->rect.x, entry->rect.y,
+                                            entry->rect.w, entry->rect.h);
+
+            if (n >= 0) {
+                n_rectangles += n;
+            }
+            qemu_free(entry);
         }
-        qemu_free(entry);
     }
-    vnc_unlock_display(job->vs->vd);
+    vnc_unlock_display_shared(job->vs->vd);
 
     /* Put n_rectangles at the beginning of the message */
     vs.output.buffer[saved_offset] = (n_rectangles >> 8) & 0xFF;
@@ -264,7 +453,7 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
 
 disconnected:
     /* Copy persistent encoding data */
-    vnc_async_encoding_end(job->vs, &vs);
+    vnc_async_encoding_end(job->vs, &vs, &worker->buffer);
     flush = (job->vs->csock != -1 && job->vs->abort != true);
     vnc_unlock_output(job->vs);
 
@@ -287,6 +476,7 @@ static VncJobQueue *vnc_queue_init(void)
     qemu_cond_init(&queue->cond);
     qemu_mutex_init(&queue->mutex);
     QTAILQ_INIT(&queue->jobs);
+    QTAILQ_INIT(&queue->tile_sets);
     return queue;
 }
 
@@ -294,22 +484,43 @@ static void vnc_queue_clear(VncJobQueue *q)
 {
     qemu_cond_destroy(&queue->cond);
     qemu_mutex_destroy(&queue->mutex);
-    buffer_free(&queue->buffer);
     qemu_free(q);
     queue = NULL; /* Unset global queue */
 }
 
 static void *vnc_worker_thread(void *arg)
 {
-    VncJobQueue *queue = arg;
+    VncWorker *worker = arg;
+    VncJobQueue *queue = worker->queue;
+    bool last;
+
+    qemu_thread_get_self(&worker->thread);
 
-    qemu_thread_get_self(&queue->thread);
+    while (!vnc_worker_thread_loop(worker)) ;
 
-    while (!vnc_worker_thread_loop(queue)) ;
-    vnc_queue_clear(queue);
+    buffer_free(&worker->buffer);
+    qemu_free(worker);
+
+    vnc_lock_queue(queue);
+    last = --queue->nb_workers == 0;
+    vnc_unlock_queue(queue);
+    if (last) {
+        vnc_queue_clear(queue);
+    }
     return NULL;
 }
 
+static void vnc_add_worker(VncJobQueue *q)
+{
+    VncWorker *worker = qemu_mallocz(sizeof(VncWorker));
+
+    worker->queue = q;
+    vnc_lock_queue(q);
+    q->nb_workers++;
+    vnc_unlock_queue(q);
+    qemu_thread_create(&worker->thread, vnc_worker_thread, worker);
+}
+
 void vnc_start_worker_thread(void)
 {
     VncJobQueue *q;
@@ -318,10 +529,27 @@ void vnc_start_worker_thread(void)
         return ;
 
     q = vnc_queue_init();
-    qemu_thread_create(&q->thread, vnc_worker_thread, q);
+    vnc_add_worker(q);
     queue = q; /* Set global queue */
 }
 
+/* Grow the pool of encoding threads to threads workers */
+void vnc_set_worker_threads(int threads)
+{
+    int n;
+
+    if (!vnc_worker_thread_running())
+        return ;
+
+    threads = MIN(threads, VNC_MAX_WORKERS);
+    vnc_lock_queue(queue);
+    n = threads - queue->nb_workers;
+    vnc_unlock_queue(queue);
+    while (n-- > 0) {
+        vnc_add_worker(queue);
+    }
+}
+
 bool vnc_worker_thread_running(void)
 {
     return queue; /* Check global queue */
@@ -332,7 +560,7 @@ void vnc_stop_worker_thread(void)
     if (!vnc_worker_thread_running())
         return ;
 
-    /* Remove all jobs and wake up the thread */
+    /* Remove all jobs and wake up the threads */
     vnc_lock_queue(queue);
     queue->exit = true;
     vnc_unlock_queue(queue);
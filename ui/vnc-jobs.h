@@ -41,18 +41,49 @@ void vnc_jobs_join(VncState *vs);
 #ifdef CONFIG_VNC_THREAD
 
 void vnc_start_worker_thread(void);
+void vnc_set_worker_threads(int threads);
 bool vnc_worker_thread_running(void);
 void vnc_stop_worker_thread(void);
 
 #endif /* CONFIG_VNC_THREAD */
 
 /* Locks */
+
+/*
+ * The worker threads only read the server surface, so any number of them
+ * may encode at the same time (vnc_lock_display_shared).  vnc_refresh()
+ * updates it and must be alone: vnc_trylock_display() fails while an
+ * encoder is running.
+ */
 static inline int vnc_trylock_display(VncDisplay *vd)
 {
 #ifdef CONFIG_VNC_THREAD
-    return qemu_mutex_trylock(&vd->mutex);
-#else
+    if (qemu_mutex_trylock(&vd->mutex)) {
+        return -1;
+    }
+    if (vd->encoders) {
+        qemu_mutex_unlock(&vd->mutex);
+        return -1;
+    }
+#endif
     return 0;
+}
+
+static inline void vnc_lock_display_shared(VncDisplay *vd)
+{
+#ifdef CONFIG_VNC_THREAD
+    qemu_mutex_lock(&vd->mutex);
+    vd->encoders++;
+    qemu_mutex_unlock(&vd->mutex);
+#endif
+}
+
+static inline void vnc_unlock_display_shared(VncDisplay *vd)
+{
+#ifdef CONFIG_VNC_THREAD
+    qemu_mutex_lock(&vd->mutex);
+    vd->encoders--;
+    qemu_mutex_unlock(&vd->mutex);
 #endif
 }
 
@@ -26,6 +26,7 @@
 
 #include "vnc.h"
 #include "vnc-jobs.h"
+#include "vnc-dirty.h"
 #include "sysemu.h"
 #include "qemu_socket.h"
 #include "qemu-timer.h"
@@ -511,6 +512,7 @@ static void vnc_dpy_resize(DisplayState *ds)
     *(vd->server) = *(ds->surface);
     vd->server->data = qemu_mallocz(vd->server->linesize *
                                     vd->server->height);
+    vd->generation++;
 
     /* guest surface */
     if (!vd->guest.ds)
@@ -630,7 +632,8 @@ int vnc_raw_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
     return 1;
 }
 
-int vnc_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
+static int vnc_encode_framebuffer_update(VncState *vs, int x, int y,
+                                         int w, int h)
 {
     int n = 0;
 
@@ -662,6 +665,63 @@ int vnc_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
     return n;
 }
 
+/*
+ * Tight only depends on the client's history when data goes through one
+ * of its zlib streams; solid, JPEG and PNG rectangles don't.  Any use of
+ * a stream makes its total_in grow.
+ */
+static uint64_t vnc_tight_stream_state(VncState *vs)
+{
+    uint64_t sum = 0;
+    int i;
+
+    for (i = 0; i < ARRAY_SIZE(vs->tight.stream); i++) {
+        sum += vs->tight.stream[i].total_in;
+    }
+    return sum;
+}
+
+int vnc_send_framebuffer_update(VncState *vs, int x, int y, int w, int h)
+{
+    size_t offset = vs->output.offset;
+    uint64_t tight_state = 0;
+    bool cacheable;
+    int n = 0;
+
+    if (vnc_enc_cache_send(vs, x, y, w, h, &n)) {
+        return n;
+    }
+
+    vs->sent_lossy = false;
+    switch (vs->vnc_encoding) {
+    case VNC_ENCODING_TIGHT:
+    case VNC_ENCODING_TIGHT_PNG:
+        tight_state = vnc_tight_stream_state(vs);
+        break;
+    }
+
+    n = vnc_encode_framebuffer_update(vs, x, y, w, h);
+
+    switch (vs->vnc_encoding) {
+    case VNC_ENCODING_ZLIB:
+    case VNC_ENCODING_ZRLE:
+    case VNC_ENCODING_ZYWRLE:
+        cacheable = false;
+        break;
+    case VNC_ENCODING_TIGHT:
+    case VNC_ENCODING_TIGHT_PNG:
+        cacheable = tight_state == vnc_tight_stream_state(vs);
+        break;
+    default:
+        cacheable = true;
+        break;
+    }
+    if (cacheable) {
+        vnc_enc_cache_store(vs, x, y, w, h, offset, n, vs->sent_lossy);
+    }
+    return n;
+}
+
 static void vnc_copy(VncState *vs, int src_x, int src_y, int dst_x, int dst_y, int w, int h)
 {
     /* send bitblit op to the vnc client */
@@ -676,16 +736,35 @@ static void vnc_copy(VncState *vs, int src_x, int src_y, int dst_x, int dst_y, i
     vnc_flush(vs);
 }
 
-static void vnc_dpy_copy(DisplayState *ds, int src_x, int src_y, int dst_x, int dst_y, int w, int h)
+/*
+ * Pixels the client has not been sent yet (it did not ask for an update)
+ * move along with the rest: carry their dirty state to the destination.
+ */
+static void vnc_copy_dirty(VncState *vs, int src_x, int src_y,
+                           int dst_x, int dst_y, int w, int h)
+{
+    int i, r;
+
+    for (i = 0; i < h; i++) {
+        r = dst_y > src_y ? h - 1 - i : i;
+        if (find_next_bit(vs->dirty[src_y + r], (src_x + w + 15) / 16,
+                          src_x / 16) < (src_x + w + 15) / 16) {
+            bitmap_set(vs->dirty[dst_y + r], dst_x / 16,
+                       (dst_x + w + 15) / 16 - dst_x / 16);
+        }
+    }
+}
+
+/* Move a rectangle of the server surface, and tell the clients about it */
+static void vnc_copy_server_surface(VncDisplay *vd, int src_x, int src_y,
+                                    int dst_x, int dst_y, int w, int h)
 {
-    VncDisplay *vd = ds->opaque;
     VncState *vs, *vn;
     uint8_t *src_row;
     uint8_t *dst_row;
     int i,x,y,pitch,depth,inc,w_lim,s;
     int cmp_bytes;
 
-    vnc_refresh_server_surface(vd);
     QTAILQ_FOREACH_SAFE(vs, &vd->clients, next, vn) {
         if (vnc_has_feature(vs, VNC_FEATURE_COPYRECT)) {
             vs->force_update = 1;
@@ -693,6 +772,11 @@ static void vnc_dpy_copy(DisplayState *ds, int src_x, int src_y, int dst_x, int
             /* vs might be free()ed here */
         }
     }
+    QTAILQ_FOREACH(vs, &vd->clients, next) {
+        if (vnc_has_feature(vs, VNC_FEATURE_COPYRECT)) {
+            vnc_copy_dirty(vs, src_x, src_y, dst_x, dst_y, w, h);
+        }
+    }
 
     /* do bitblit op on the local surface too */
     pitch = ds_get_linesize(vd->ds);
@@ -730,6 +814,7 @@ static void vnc_dpy_copy(DisplayState *ds, int src_x, int src_y, int dst_x, int
             if (memcmp(src_row, dst_row, cmp_bytes) == 0)
                 continue;
             memmove(dst_row, src_row, cmp_bytes);
+            vd->generation++;
             QTAILQ_FOREACH(vs, &vd->clients, next) {
                 if (!vnc_has_feature(vs, VNC_FEATURE_COPYRECT)) {
                     set_bit(((x + dst_x) / 16), vs->dirty[y]);
@@ -748,6 +833,180 @@ static void vnc_dpy_copy(DisplayState *ds, int src_x, int src_y, int dst_x, int
     }
 }
 
+static void vnc_dpy_copy(DisplayState *ds, int src_x, int src_y, int dst_x, int dst_y, int w, int h)
+{
+    VncDisplay *vd = ds->opaque;
+
+    vnc_refresh_server_surface(vd);
+    vnc_copy_server_surface(vd, src_x, src_y, dst_x, dst_y, w, h);
+}
+
+/*
+ * Scroll detection.
+ *
+ * Guests almost never use the hardware blitter any more, so scrolling
+ * shows up as a large dirty area.  Before the server surface is updated,
+ * compare hashes of the new (guest) rows with the old (server) rows over
+ * the dirty columns.  If a run of rows simply moved up or down, move it in
+ * the server surface and send a CopyRect; the normal refresh then only
+ * finds the newly exposed strip.
+ */
+static bool vnc_scroll_run(const uint64_t *ghash, const uint64_t *shash,
+                           int y0, int y1, int dy, int *start, int *end)
+{
+    int y, run = 0, moved = 0, best = 0, best_moved = 0;
+
+    *end = 0;
+    for (y = MAX(y0, y0 + dy); y < MIN(y1, y1 + dy); y++) {
+        if (ghash[y - y0] != shash[y - dy - y0]) {
+            run = moved = 0;
+            continue;
+        }
+        run++;
+        /* rows that were already the same don't need a copy */
+        if (ghash[y - y0] != shash[y - y0]) {
+            moved++;
+        }
+        if (run > best) {
+            best = run;
+            best_moved = moved;
+            *end = y + 1;
+        }
+    }
+    *start = *end - best;
+    return best >= VNC_SCROLL_MIN_ROWS && best_moved * 2 >= best;
+}
+
+static void vnc_detect_scroll(VncDisplay *vd)
+{
+    VncState *vs;
+    unsigned long cols[BITS_TO_LONGS(VNC_DIRTY_BITS)] = { 0 };
+    int width = vd->guest.ds->width;
+    int height = vd->guest.ds->height;
+    int bpp = ds_get_bytes_per_pixel(vd->ds);
+    int pitch = ds_get_linesize(vd->ds);
+    int y, y0 = -1, y1 = 0, x0, x1, len, i, n;
+    int best_dy = 0, start = 0, end = 0;
+    int candidates[VNC_SCROLL_SAMPLES];
+    uint64_t *ghash, *shash;
+
+    if (vd->scroll_skip > 0) {
+        vd->scroll_skip--;
+        return;
+    }
+    QTAILQ_FOREACH(vs, &vd->clients, next) {
+        if (vnc_has_feature(vs, VNC_FEATURE_COPYRECT)) {
+            break;
+        }
+    }
+    if (!vs) {
+        return;
+    }
+
+    /* bounding box of the dirty area */
+    for (y = 0; y < height; y++) {
+        if (bitmap_empty(vd->guest.dirty[y], VNC_DIRTY_BITS)) {
+            continue;
+        }
+        bitmap_or(cols, cols, vd->guest.dirty[y], VNC_DIRTY_BITS);
+        if (y0 < 0) {
+            y0 = y;
+        }
+        y1 = y + 1;
+    }
+    if (y0 < 0 || y1 - y0 < VNC_SCROLL_MIN_ROWS) {
+        return;
+    }
+    x0 = find_first_bit(cols, VNC_DIRTY_BITS) * 16;
+    x1 = 0;
+    for (i = x0 / 16; i < VNC_DIRTY_BITS; i++) {
+        if (test_bit(i, cols)) {
+            x1 = (i + 1) * 16;
+        }
+    }
+    x1 = MIN(x1, width);
+    if (x0 >= x1) {
+        return;
+    }
+    len = (x1 - x0) * bpp;
+
+    ghash = qemu_malloc(sizeof(uint64_t) * (y1 - y0) * 2);
+    shash = ghash + (y1 - y0);
+    for (y = y0; y < y1; y++) {
+        ghash[y - y0] = vnc_row_hash(vd->guest.ds->data + y * pitch + x0 * bpp,
+                                     len);
+        shash[y - y0] = vnc_row_hash(vd->server->data + y * pitch + x0 * bpp,
+                                     len);
+    }
+
+    /*
+     * Find candidate shifts: for a few sample rows that changed, look for
+     * the nearest old row with the same content.
+     */
+    n = 0;
+    for (i = 0; i < VNC_SCROLL_SAMPLES; i++) {
+        int gy = (y1 - y0) * (2 * i + 1) / (2 * VNC_SCROLL_SAMPLES);
+        int d, j, dy = 0;
+
+        if (ghash[gy] == shash[gy] || (gy > 0 && ghash[gy] == ghash[gy - 1])) {
+            continue;
+        }
+        for (d = 1; d < y1 - y0; d++) {
+            if (gy - d >= 0 && shash[gy - d] == ghash[gy]) {
+                dy = d;
+                break;
+            }
+            if (gy + d < y1 - y0 && shash[gy + d] == ghash[gy]) {
+                dy = -d;
+                break;
+            }
+        }
+        if (d == y1 - y0) {
+            continue;
+        }
+        for (j = 0; j < n && candidates[j] != dy; j++) {
+        }
+        if (j == n) {
+            candidates[n++] = dy;
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        int s, e;
+
+        if (vnc_scroll_run(ghash, shash, y0, y1, candidates[i], &s, &e) &&
+            e - s > end - start) {
+            best_dy = candidates[i];
+            start = s;
+            end = e;
+        }
+    }
+    qemu_free(ghash);
+
+    if (!best_dy) {
+        vd->scroll_backoff = MIN(vd->scroll_backoff * 2 + 1,
+                                 VNC_SCROLL_MAX_BACKOFF);
+        vd->scroll_skip = vd->scroll_backoff;
+        return;
+    }
+    vd->scroll_backoff = 0;
+
+    /* rule out hash collisions */
+    for (y = start; y < end; y++) {
+        if (memcmp(vd->guest.ds->data + y * pitch + x0 * bpp,
+                   vd->server->data + (y - best_dy) * pitch + x0 * bpp, len)) {
+            return;
+        }
+    }
+
+    /* no worker may be reading the rows we are about to move */
+    QTAILQ_FOREACH(vs, &vd->clients, next) {
+        vnc_jobs_join(vs);
+    }
+    vnc_copy_server_surface(vd, x0, start - best_dy, x0, start,
+                            x1 - x0, end - start);
+}
+
 static void vnc_mouse_set(int x, int y, int visible)
 {
     /* can we ask the client(s) to move the pointer ??? */
@@ -998,6 +1257,7 @@ static void vnc_disconnect_finish(VncState *vs)
     audio_del(vs);
 
     QTAILQ_REMOVE(&vs->vd->clients, vs, next);
+    vs->vd->nb_clients--;
 
     if (QTAILQ_EMPTY(&vs->vd->clients)) {
         dcl->idle = 1;
@@ -2258,6 +2518,7 @@ void vnc_sent_lossy_rect(VncState *vs, int x, int y, int w, int h)
             vs->lossy_rect[j][i] = 1;
         }
     }
+    vs->sent_lossy = true;
 }
 
 static int vnc_refresh_lossy_rect(VncDisplay *vd, int x, int y)
@@ -2386,7 +2647,7 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     int y;
     uint8_t *guest_row;
     uint8_t *server_row;
-    int cmp_bytes;
+    int cmp_bytes, chunks;
     VncState *vs;
     int has_dirty = 0;
 
@@ -2398,35 +2659,48 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     }
 
     /*
-     * Walk through the guest dirty map.
-     * Check and copy modified bits from guest to server surface.
-     * Update server dirty map.
+     * Walk through the guest dirty map, one bitmap word at a time.
+     * Check and copy modified chunks from guest to server surface.
+     * Merge the chunks that changed into the client dirty maps.
      */
     cmp_bytes = 16 * ds_get_bytes_per_pixel(vd->ds);
+    chunks = DIV_ROUND_UP(vd->guest.ds->width, 16);
     guest_row  = vd->guest.ds->data;
     server_row = vd->server->data;
     for (y = 0; y < vd->guest.ds->height; y++) {
-        if (!bitmap_empty(vd->guest.dirty[y], VNC_DIRTY_BITS)) {
-            int x;
-            uint8_t *guest_ptr;
-            uint8_t *server_ptr;
-
-            guest_ptr  = guest_row;
-            server_ptr = server_row;
-
-            for (x = 0; x < vd->guest.ds->width;
-                    x += 16, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
-                if (!test_and_clear_bit((x / 16), vd->guest.dirty[y]))
-                    continue;
-                if (memcmp(server_ptr, guest_ptr, cmp_bytes) == 0)
-                    continue;
-                memcpy(server_ptr, guest_ptr, cmp_bytes);
-                if (!vd->non_adaptive)
-                    vnc_rect_updated(vd, x, y, &tv);
-                QTAILQ_FOREACH(vs, &vd->clients, next) {
-                    set_bit((x / 16), vs->dirty[y]);
+        unsigned long *dirty = vd->guest.dirty[y];
+        int i;
+
+        for (i = 0; i * BITS_PER_LONG < chunks; i++) {
+            unsigned long bits = dirty[i], changed;
+            int first = i * BITS_PER_LONG;
+            int off = first * cmp_bytes;
+
+            if (chunks - first < BITS_PER_LONG) {
+                bits &= (1UL << (chunks - first)) - 1;
+            }
+            if (!bits) {
+                continue;
+            }
+            dirty[i] &= ~bits;
+
+            changed = vnc_chunks_update(server_row + off, guest_row + off,
+                                        bits, cmp_bytes);
+            if (!changed) {
+                continue;
+            }
+            vd->generation++;
+            QTAILQ_FOREACH(vs, &vd->clients, next) {
+                vs->dirty[y][i] |= changed;
+            }
+            has_dirty += ctpop64(changed);
+            if (!vd->non_adaptive) {
+                while (changed) {
+                    int n = ctz64(changed);
+
+                    changed &= changed - 1;
+                    vnc_rect_updated(vd, (first + n) * 16, y, &tv);
                 }
-                has_dirty++;
             }
         }
         guest_row  += ds_get_linesize(vd->ds);
@@ -2443,6 +2717,11 @@ static void vnc_refresh(void *opaque)
 
     vga_hw_update();
 
+    vnc_detect_scroll(vd);
+    /* vd->timer could be NULL now if the last client disconnected */
+    if (vd->timer == NULL)
+        return;
+
     if (vnc_trylock_display(vd)) {
         vd->timer_interval = VNC_REFRESH_INTERVAL_BASE;
         qemu_mod_timer(vd->timer, qemu_get_clock_ms(rt_clock) +
@@ -2528,6 +2807,7 @@ static void vnc_connect(VncDisplay *vd, int csock)
 #endif
 
     QTAILQ_INSERT_HEAD(&vd->clients, vs, next);
+    vd->nb_clients++;
 
     vga_hw_update();
 
@@ -2576,6 +2856,7 @@ void vnc_display_init(DisplayState *ds)
     vs->ds = ds;
     QTAILQ_INIT(&vs->clients);
     vs->expires = TIME_MAX;
+    vnc_enc_cache_init(vs);
 
     if (keyboard_layout)
         vs->kbd_layout = init_keyboard_layout(name2keysym, keyboard_layout);
@@ -2761,6 +3042,18 @@ int vnc_display_open(DisplayState *ds, const char *display)
 #if defined(CONFIG_VNC_TLS) || defined(CONFIG_VNC_SASL)
         } else if (strncmp(options, "acl", 3) == 0) {
             acl = 1;
+#endif
+#ifdef CONFIG_VNC_THREAD
+        } else if (strncmp(options, "threads=", 8) == 0) {
+            int threads = strtol(options + 8, NULL, 0);
+
+            if (threads < 1) {
+                fprintf(stderr, "vnc: invalid number of threads\n");
+                qemu_free(vs->display);
+                vs->display = NULL;
+                return -1;
+            }
+            vnc_set_worker_threads(threads);
 #endif
         } else if (strncmp(options, "lossy", 5) == 0) {
             vs->lossy = true;
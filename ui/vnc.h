@@ -92,7 +92,14 @@ typedef void VncSendHextileTile(VncState *vs,
 
 #define VNC_AUTH_CHALLENGE_SIZE 16
 
+/* Scroll detection, see vnc_detect_scroll() */
+#define VNC_SCROLL_MIN_ROWS    32  /* smallest run of rows worth a CopyRect */
+#define VNC_SCROLL_SAMPLES     8   /* rows used to guess the shift */
+#define VNC_SCROLL_MAX_BACKOFF 32  /* refreshes skipped after misses */
+
 typedef struct VncDisplay VncDisplay;
+typedef struct VncEncCache VncEncCache;
+typedef struct VncEncCacheEntry VncEncCacheEntry;
 
 #ifdef CONFIG_VNC_TLS
 #include "vnc-tls.h"
@@ -125,6 +132,7 @@ struct VncSurface
 struct VncDisplay
 {
     QTAILQ_HEAD(, VncState) clients;
+    int nb_clients;
     QEMUTimer *timer;
     int timer_interval;
     int lsock;
@@ -133,6 +141,7 @@ struct VncDisplay
     int lock_key_sync;
 #ifdef CONFIG_VNC_THREAD
     QemuMutex mutex;
+    int encoders; /* worker threads reading the server surface */
 #endif
 
     QEMUCursor *cursor;
@@ -141,6 +150,8 @@ struct VncDisplay
 
     struct VncSurface guest;   /* guest visible surface (aka ds->surface) */
     DisplaySurface *server;  /* vnc server surface */
+    uint64_t generation;     /* bumped when the server surface changes */
+    VncEncCache *enc_cache;  /* rects encoded for one client, see vnc-enc-cache.c */
 
     char *display;
     char *password;
@@ -148,6 +159,8 @@ struct VncDisplay
     int auth;
     bool lossy;
     bool non_adaptive;
+    int scroll_skip;
+    int scroll_backoff;
 #ifdef CONFIG_VNC_TLS
     int subauth; /* Used by VeNCrypt */
     VncDisplayTLS tls;
@@ -219,6 +232,7 @@ struct VncRectEntry
 struct VncJob
 {
     VncState *vs;
+    bool busy; /* a worker thread is encoding it */
 
     QLIST_HEAD(, VncRectEntry) rectangles;
     QTAILQ_ENTRY(VncJob) next;
@@ -240,6 +254,7 @@ struct VncState
     DECLARE_BITMAP(dirty[VNC_MAX_HEIGHT], VNC_DIRTY_BITS);
     uint8_t **lossy_rect; /* Not an Array to avoid costly memcpy in
                            * vnc-jobs-async.c */
+    bool sent_lossy;      /* the last rect went through a lossy encoding */
 
     VncDisplay *vd;
     int need_update;
@@ -531,6 +546,11 @@ void vnc_sent_lossy_rect(VncState *vs, int x, int y, int w, int h);
 /* Encodings */
 int vnc_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
 
+void vnc_enc_cache_init(VncDisplay *vd);
+bool vnc_enc_cache_send(VncState *vs, int x, int y, int w, int h, int *n);
+void vnc_enc_cache_store(VncState *vs, int x, int y, int w, int h,
+                         size_t offset, int n, bool lossy);
+
 int vnc_raw_send_framebuffer_update(VncState *vs, int x, int y, int w, int h);
 
 int vnc_hextile_send_framebuffer_update(VncState *vs, int x,
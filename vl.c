@@ -180,6 +180,7 @@ int display_remote = 0;
 const char* keyboard_layout = NULL;
 ram_addr_t ram_size;
 const char *mem_path = NULL;
+const char *mem_template = NULL;
 #ifdef MAP_POPULATE
 int mem_prealloc = 0; /* force preallocation of physical target memory */
 #endif
@@ -216,6 +217,8 @@ int no_hpet = 0;
 int fd_bootchk = 1;
 int no_reboot = 0;
 int no_shutdown = 0;
+int idle_fast_forward = 0;
+int lazy_loadvm = 0;
 int cursor_hide = 1;
 int graphic_rotate = 1;
 uint8_t irq0override = 1;
@@ -1297,9 +1300,10 @@ void qemu_system_vmstop_request(int reason)
 void main_loop_wait(int nonblocking)
 {
     fd_set rfds, wfds, xfds;
-    int ret, nfds;
+    int ret, nfds, slirp_fds;
     struct timeval tv;
     int timeout;
+    int warp = 0;
 
     if (nonblocking)
         timeout = 0;
@@ -1308,6 +1312,16 @@ void main_loop_wait(int nonblocking)
         qemu_bh_update_timeout(&timeout);
     }
 
+    /* With -idle-fast-forward, do not wait in real time for the next
+       vm_clock timer when the CPUs are idle: poll the file descriptors
+       and, if nothing is ready, skip vm_clock forward to the timer.  */
+    if (idle_fast_forward && timeout > 0 && vm_running &&
+        qemu_clock_has_timers(vm_clock) && all_cpu_threads_idle() &&
+        !qemu_aio_pending()) {
+        warp = 1;
+        timeout = 0;
+    }
+
     os_host_main_loop_wait(&timeout);
 
     tv.tv_sec = timeout / 1000;
@@ -1319,16 +1333,21 @@ void main_loop_wait(int nonblocking)
     FD_ZERO(&rfds);
     FD_ZERO(&wfds);
     FD_ZERO(&xfds);
-    qemu_iohandler_fill(&nfds, &rfds, &wfds, &xfds);
     slirp_select_fill(&nfds, &rfds, &wfds, &xfds);
+    /* slirp sockets are not fd handlers, they can only be selected */
+    slirp_fds = nfds >= 0;
+    qemu_iohandler_fill(&nfds, &rfds, &wfds, &xfds);
 
     qemu_mutex_unlock_iothread();
-    ret = select(nfds + 1, &rfds, &wfds, &xfds, &tv);
+    ret = qemu_iohandler_select(nfds, &rfds, &wfds, &xfds, &tv, slirp_fds);
     qemu_mutex_lock_iothread();
 
     qemu_iohandler_poll(&rfds, &wfds, &xfds, ret);
     slirp_select_poll(&rfds, &wfds, &xfds, (ret < 0));
 
+    if (warp && ret == 0) {
+        qemu_clock_warp(vm_clock);
+    }
     qemu_run_all_timers();
 
     /* Check bottom-halves last in case any of the earlier events triggered
@@ -1969,6 +1988,10 @@ int main(int argc, char **argv, char **envp)
     QEMUMachine *machine;
     const char *cpu_model;
     int tb_size;
+    int perf_map = 0;
+    const char *guest_symbols = NULL;
+    const char *blockstats_log = NULL;
+    const char *record = NULL;
     const char *pid_file = NULL;
     const char *incoming = NULL;
 #ifdef CONFIG_VNC
@@ -2132,6 +2155,12 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_snapshot:
                 snapshot = 1;
                 break;
+            case QEMU_OPTION_blockstats_log:
+                blockstats_log = optarg;
+                break;
+            case QEMU_OPTION_record:
+                record = optarg;
+                break;
             case QEMU_OPTION_hdachs:
                 {
                     const char *p;
@@ -2359,6 +2388,9 @@ int main(int argc, char **argv, char **envp)
             case QEMU_OPTION_mempath:
                 mem_path = optarg;
                 break;
+            case QEMU_OPTION_mem_template:
+                mem_template = optarg;
+                break;
 #ifdef MAP_POPULATE
             case QEMU_OPTION_mem_prealloc:
                 mem_prealloc = 1;
@@ -2760,9 +2792,29 @@ int main(int argc, char **argv, char **envp)
                 if (tb_size < 0)
                     tb_size = 0;
                 break;
+            case QEMU_OPTION_tb_hot_threshold:
+                tb_hot_threshold = strtol(optarg, NULL, 0);
+                if (tb_hot_threshold < 0)
+                    tb_hot_threshold = 0;
+                break;
+            case QEMU_OPTION_tb_profile:
+                tb_profiling = 1;
+                break;
+            case QEMU_OPTION_perf_map:
+                perf_map = 1;
+                break;
+            case QEMU_OPTION_guest_symbols:
+                guest_symbols = optarg;
+                break;
             case QEMU_OPTION_icount:
                 icount_option = optarg;
                 break;
+            case QEMU_OPTION_idle_fast_forward:
+                idle_fast_forward = 1;
+                break;
+            case QEMU_OPTION_lazy_loadvm:
+                lazy_loadvm = 1;
+                break;
             case QEMU_OPTION_incoming:
                 incoming = optarg;
                 incoming_expected = true;
@@ -2992,6 +3044,15 @@ int main(int argc, char **argv, char **envp)
         fprintf(stderr, "could not initialize alarm timer\n");
         exit(1);
     }
+    if (mem_template && (mem_path || loadvm || incoming)) {
+        fprintf(stderr, "-mem-template cannot be used with -mem-path, "
+                "-loadvm or -incoming\n");
+        exit(1);
+    }
+    if (idle_fast_forward && icount_option) {
+        fprintf(stderr, "-idle-fast-forward and -icount are incompatible\n");
+        exit(1);
+    }
     configure_icount(icount_option);
 
     if (net_init_clients() < 0) {
@@ -3008,6 +3069,16 @@ int main(int argc, char **argv, char **envp)
 
     /* init the dynamic translator */
     cpu_exec_init_all(tb_size * 1024 * 1024);
+    if (guest_symbols && load_symbol_file(guest_symbols) < 0) {
+        fprintf(stderr, "qemu: could not load guest symbols from '%s'\n",
+                guest_symbols);
+        exit(1);
+    }
+    if (perf_map && tb_perf_map_open() < 0) {
+        fprintf(stderr, "qemu: could not open perf map file: %s\n",
+                strerror(errno));
+        exit(1);
+    }
 
     bdrv_init_with_whitelist();
 
@@ -3026,8 +3097,8 @@ int main(int argc, char **argv, char **envp)
     default_drive(default_sdcard, snapshot, machine->use_scsi,
                   IF_SD, 0, SD_OPTS);
 
-    register_savevm_live(NULL, "ram", 0, 4, NULL, ram_save_live, NULL,
-                         ram_load, NULL);
+    register_savevm_live(NULL, "ram", 0, 5, ram_set_params, ram_save_live,
+                         NULL, ram_load, NULL);
 
     if (nb_numa_nodes > 0) {
         int i;
@@ -3181,6 +3252,30 @@ int main(int argc, char **argv, char **envp)
     }
 #endif
 
+    if (record) {
+        char file[1024];
+        char buf[32];
+        const char *p, *format = NULL;
+        int fps = 10;
+        int ret;
+
+        p = get_opt_value(file, sizeof(file), record);
+        if (*p == ',') {
+            if (get_param_value(buf, sizeof(buf), "fps", p + 1)) {
+                fps = strtol(buf, NULL, 0);
+            }
+            if (get_param_value(buf, sizeof(buf), "format", p + 1)) {
+                format = buf;
+            }
+        }
+        ret = record_start(ds, file, format, fps);
+        if (ret < 0) {
+            fprintf(stderr, "qemu: could not record to '%s': %s\n",
+                    file, strerror(-ret));
+            exit(1);
+        }
+    }
+
     /* display setup */
     dpy_resize(ds);
     dcl = ds->listeners;
@@ -3216,12 +3311,43 @@ int main(int argc, char **argv, char **envp)
     qemu_register_reset(qbus_reset_all_fn, sysbus_get_default());
     qemu_run_machine_init_done_notifiers();
 
+    if (blockstats_log) {
+        char file[1024];
+        char buf[32];
+        const char *p;
+        int64_t interval = 1000;
+        int ret;
+
+        p = get_opt_value(file, sizeof(file), blockstats_log);
+        if (*p == ',' && get_param_value(buf, sizeof(buf), "interval", p + 1)) {
+            interval = strtoll(buf, NULL, 0);
+        }
+        if (interval <= 0) {
+            fprintf(stderr, "qemu: invalid blockstats-log interval\n");
+            exit(1);
+        }
+        ret = blockstats_log_start(file, interval);
+        if (ret < 0) {
+            fprintf(stderr, "qemu: could not open blockstats log '%s': %s\n",
+                    file, strerror(-ret));
+            exit(1);
+        }
+    }
+
+    if (mem_template) {
+        rom_skip_first_reset();
+    }
     qemu_system_reset();
     if (loadvm) {
         if (load_vmstate(loadvm) < 0) {
             autostart = 0;
         }
     }
+    if (mem_template) {
+        if (load_vmstate_template(mem_template) < 0) {
+            autostart = 0;
+        }
+    }
 
     if (incoming) {
         int ret = qemu_start_incoming_migration(incoming);